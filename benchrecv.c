@@ -0,0 +1,174 @@
+/*******************************************************************************
+*      Filename: benchrecv.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: A microbenchmark comparing the original strcat-based receive
+*                path with chatReceiveView(). Frames are pushed through a
+*                socketpair and received by each implementation in turn. For
+*                every message the benchmark reports the time taken and the
+*                number of bytes touched in user space: bytes cleared,
+*                scanned, or copied by the receive code, plus the bytes that
+*                recv() itself writes.
+*******************************************************************************/
+
+#include <time.h>
+
+#include "validate.h"
+#include "network.h"
+
+#define BENCH_ITERATIONS 200000
+
+/* Bytes touched in user space by the legacy implementation. */
+static unsigned long long legacyTouched;
+
+/*******************************************************************************
+* Function: _legacyReceiveHelper()
+* Description: The original _chatReceiveHelper(), instrumented to count the
+*              bytes it clears, scans and copies.
+* Parameters: int sockfd - The socket file descriptor.
+*             char *message - The message string buffer.
+*             int msgLen - The length of the message to be received.
+* Preconditions: As for the original function.
+* Returns: As for the original function.
+*******************************************************************************/
+
+static int _legacyReceiveHelper(int sockfd, char *message, int msgLen) {
+    char buffer[MAX_BYTES];
+    int bytesReceived = 0;
+    int status = 0;
+
+    while (bytesReceived < msgLen) {
+        memset(buffer, 0, sizeof buffer);
+        legacyTouched += sizeof buffer;
+
+        status = recv(sockfd, buffer, msgLen - bytesReceived, 0);
+        if (status <= 0) {
+            return 0;
+        }
+        legacyTouched += status;
+        /* strcat() scans the destination, then copies the source. */
+        legacyTouched += strlen(message) + status + 1;
+        strcat(message, buffer);
+        bytesReceived += status;
+    }
+    return status;
+}
+
+/*******************************************************************************
+* Function: _legacyReceive()
+* Description: The original chatReceive(), instrumented like its helper.
+* Parameters: int sockfd - The socket file descriptor.
+*             char *message - The message buffer.
+* Preconditions: As for the original function.
+* Returns: As for the original function.
+*******************************************************************************/
+
+static int _legacyReceive(int sockfd, char *message) {
+    char header[PREFIX_OFFSET+1];
+    char body[MAX_BYTES];
+    long msgLen;
+    int status;
+
+    memset(header, 0, sizeof header);
+    memset(body, 0, sizeof body);
+    legacyTouched += sizeof header + sizeof body;
+    status = _legacyReceiveHelper(sockfd, header, PREFIX_OFFSET);
+    if (status == 0) {
+        return status;
+    }
+    msgLen = strtol(header, NULL, 10);
+    legacyTouched += PREFIX_OFFSET;
+    status = _legacyReceiveHelper(sockfd, body, msgLen);
+    /* strcpy() reads the body and writes it again. */
+    legacyTouched += 2 * (strlen(body) + 1);
+    strcpy(message, body);
+    return status;
+}
+
+/*******************************************************************************
+* Function: _elapsedNs()
+* Description: Returns the nanoseconds between two timestamps.
+* Parameters: struct timespec *start - The earlier timestamp.
+*             struct timespec *end - The later timestamp.
+* Preconditions: None.
+* Returns: The elapsed time in nanoseconds.
+*******************************************************************************/
+
+static double _elapsedNs(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+/*******************************************************************************
+* Function: _benchSize()
+* Description: Runs both implementations against frames with a body of the
+*              given size and prints one result row for each.
+* Parameters: int fds[2] - A connected socketpair.
+*             int bodyLen - The number of body characters per frame.
+* Preconditions: bodyLen is at most MAX_MSG.
+* Returns: None.
+*******************************************************************************/
+
+static void _benchSize(int fds[2], int bodyLen) {
+    char frame[MAX_BYTES], message[MAX_BYTES * 2];
+    unsigned long long viewTouched = 0;
+    struct timespec start, end;
+    struct msgView view;
+    int frameLen, i;
+
+    /* Build one frame of the requested size. */
+    memset(frame + PREFIX_OFFSET, 'x', bodyLen);
+    frame[PREFIX_OFFSET + bodyLen] = '\0';
+    snprintf(message, sizeof message, "%03d", bodyLen + 1);
+    memcpy(frame, message, PREFIX_OFFSET);
+    frameLen = PREFIX_OFFSET + bodyLen + 1;
+
+    legacyTouched = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        send(fds[0], frame, frameLen, 0);
+        _legacyReceive(fds[1], message);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%8d  %-8s %10.1f %12.1f\n", bodyLen, "legacy",
+           _elapsedNs(&start, &end) / BENCH_ITERATIONS,
+           (double)legacyTouched / BENCH_ITERATIONS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        send(fds[0], frame, frameLen, 0);
+        chatReceiveView(fds[1], message, sizeof message, &view);
+        /* recv() writes the frame in place; the header is parsed once. */
+        viewTouched += frameLen + PREFIX_OFFSET;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%8d  %-8s %10.1f %12.1f\n", bodyLen, "view",
+           _elapsedNs(&start, &end) / BENCH_ITERATIONS,
+           (double)viewTouched / BENCH_ITERATIONS);
+}
+
+/*******************************************************************************
+* Function: main()
+* Description: Runs the receive path benchmark for a range of message sizes.
+* Parameters: None.
+* Preconditions: None.
+* Returns: 0 on success, 1 if the socketpair cannot be created.
+*******************************************************************************/
+
+int main(void) {
+    int sizes[] = { 16, 64, 256, MAX_MSG };
+    int fds[2];
+    unsigned i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        return 1;
+    }
+    printf("%8s  %-8s %10s %12s\n", "body", "path", "ns/msg", "bytes/msg");
+    for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        _benchSize(fds, sizes[i]);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,854 @@
+/*******************************************************************************
+*      Filename: chatbench.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: A load generator for chatserver. The benchmark starts a
+*                quiet chatserver on a loopback port and connects a number of
+*                synthetic clients to it, one thread each. The clients send
+*                and receive with the same network and framing code as
+*                chatclient. Every message carries the time at which it was
+*                sent, so each delivery yields one latency sample. At the end
+*                the benchmark reports the message rate, latency percentiles,
+*                the CPU time spent per message by the server and by the
+*                clients, the system calls made by the server per message,
+*                the memory chunks its pools took, the deepest output queue
+*                it held, and the bytes each delivery took on the wire.
+*                Optionally, some clients connect and never read, to see
+*                how the server's slow-client policy shields the rest.
+*                Message bodies are made of common words, so that
+*                compression fares as it would on chat. With TLS, the
+*                benchmark makes a throwaway certificate for the server.
+*******************************************************************************/
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <linux/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "validate.h"
+#include "network.h"
+#include "frame.h"
+#include "compress.h"
+
+#define BENCH_USAGE "usage: chatbench [-1] [-z] [-T] [-c clients] " \
+                    "[-n messages] [-s size|min-max] [-w window] [-p port] " \
+                    "[-S server] [-j threads] [-e engine] [-k stalled] " \
+                    "[-P policy]\n"
+#define BENCH_STAMP_LEN 16      /* Hex digits of the send time. */
+#define BENCH_SETTLE_NS 200000000
+#define BENCH_CERT_DAYS 1       /* Lifetime of the server's certificate. */
+#define BENCH_STALL_BUF 4096    /* Receive buffer of a stalled client, kept
+                                 * small so the server's queue fills. */
+
+/* The benchmark parameters. */
+struct benchConfig {
+    int   version;
+    int   compress;         /* Nonzero to negotiate FEAT_COMPRESS. */
+    int   tls;              /* Nonzero to connect with TLS. */
+    SSL_CTX *tlsCtx;        /* The clients' TLS context, */
+    char  certDir[32];      /* and where the server's key and certificate
+                             * are kept. */
+    int   clients;
+    int   messages;         /* Messages sent by each client. */
+    int   minSize;          /* Message bodies are uniformly distributed */
+    int   maxSize;          /* between minSize and maxSize bytes. */
+    int   window;           /* Messages a client may run ahead of the rest. */
+    char *port;
+    char *server;
+    char *threads;          /* Passed to the server's -j option. */
+    char *engine;           /* Passed to the server's -e option. */
+    char *policy;           /* Passed to the server's -P option. */
+    int   stalled;          /* Clients that connect and never read. */
+};
+
+/* What the server reported once it exited. */
+struct serverReport {
+    unsigned long syscalls;     /* System calls made by its event loops. */
+    unsigned long chunks;       /* Memory chunks its pools took. */
+    long          deepest;      /* Most output pending on one client. */
+    long          dropped;      /* Messages dropped from slow clients. */
+    long          slow;         /* Slow clients disconnected. */
+};
+
+/* The state of one synthetic client. */
+struct benchClient {
+    struct benchConfig *cfg;
+    pthread_barrier_t  *start;
+    int                 id;
+    int                 sockfd;
+    char                handle[MAX_BYTES];
+    struct frameReader  reader;
+    unsigned long long *samples;    /* Delivery latencies in nanoseconds. */
+    long                numSamples;
+    unsigned long long  wireBytes;      /* Bytes received by TCP. */
+    unsigned long long  payloadBytes;   /* Bytes of messages delivered. */
+    struct frameDecompressor unzip;
+    char                unzipped[FRAME_MAX_PAYLOAD + 1];
+    int                 tlsStatus;      /* tlsStatus() of the socket. */
+    int                 failed;
+};
+
+/* The words that message bodies are made of. */
+static const char *benchWords[] = {
+    "the", "to", "I", "you", "it", "and", "a", "is", "that", "of", "in",
+    "we", "for", "on", "this", "just", "be", "so", "have", "can", "not",
+    "was", "do", "with", "but", "what", "if", "at", "it's", "my", "are",
+    "think", "like", "now", "yeah", "lol", "ok", "will", "get", "know",
+    "the build", "deploy", "server", "tests", "again", "looks", "good",
+    "thanks", "need", "today", "tomorrow", "meeting", "fix", "broken",
+    "working", "anyone", "sure", "let's", "PR", "review", "merged",
+    "error", "log", "why", "how", "when", "see", "one", "more", "time"
+};
+
+/*******************************************************************************
+* Function: _nowNs()
+* Description: Returns the current monotonic time.
+* Parameters: None.
+* Preconditions: None.
+* Returns: The time in nanoseconds.
+*******************************************************************************/
+
+static unsigned long long _nowNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*******************************************************************************
+* Function: _cpuNs()
+* Description: Converts the user and system time of a resource usage record
+*              to nanoseconds.
+* Parameters: struct rusage *ru - The resource usage.
+* Preconditions: None.
+* Returns: The CPU time in nanoseconds.
+*******************************************************************************/
+
+static double _cpuNs(struct rusage *ru) {
+    return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1e9 +
+           (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1e3;
+}
+
+/*******************************************************************************
+* Function: _parseArgs()
+* Description: Fills in the benchmark configuration from the command line,
+*              exiting with the usage message on invalid arguments.
+* Parameters: int argc - The command line argument count.
+*             char *argv[] - The command line arguments.
+*             struct benchConfig *cfg - The configuration to fill in.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _parseArgs(int argc, char *argv[], struct benchConfig *cfg) {
+    /* validatePort() may rewrite the string, so it cannot be a literal. */
+    static char defaultPort[] = "30555";
+    int opt;
+
+    cfg->version = FRAME_V2;
+    cfg->compress = 0;
+    cfg->tls = 0;
+    cfg->tlsCtx = NULL;
+    cfg->certDir[0] = '\0';
+    cfg->clients = 4;
+    cfg->messages = 20000;
+    cfg->minSize = cfg->maxSize = 64;
+    cfg->window = 16;
+    cfg->port = defaultPort;
+    cfg->server = "./chatserver";
+    cfg->threads = "1";
+    cfg->engine = "epoll";
+    cfg->policy = "disconnect";
+    cfg->stalled = 0;
+
+    while ((opt = getopt(argc, argv, "1zTc:n:s:w:p:S:j:e:k:P:")) != -1) {
+        switch (opt) {
+        case '1':
+            cfg->version = FRAME_V1;
+            break;
+        case 'z':
+            cfg->compress = 1;
+            break;
+        case 'T':
+            cfg->tls = 1;
+            break;
+        case 'c':
+            cfg->clients = atoi(optarg);
+            break;
+        case 'n':
+            cfg->messages = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%d-%d", &cfg->minSize, &cfg->maxSize) == 1) {
+                cfg->maxSize = cfg->minSize;
+            }
+            break;
+        case 'w':
+            cfg->window = atoi(optarg);
+            break;
+        case 'p':
+            cfg->port = optarg;
+            break;
+        case 'S':
+            cfg->server = optarg;
+            break;
+        case 'j':
+            cfg->threads = optarg;
+            break;
+        case 'e':
+            cfg->engine = optarg;
+            break;
+        case 'k':
+            cfg->stalled = atoi(optarg);
+            break;
+        case 'P':
+            cfg->policy = optarg;
+            break;
+        default:
+            fprintf(stderr, BENCH_USAGE);
+            exit(1);
+        }
+    }
+    if (optind != argc || cfg->clients < 2 || cfg->messages < 1 ||
+        cfg->stalled < 0 ||
+        cfg->window < 1 || cfg->minSize < BENCH_STAMP_LEN ||
+        cfg->maxSize < cfg->minSize || cfg->maxSize > MAX_MSG) {
+        fprintf(stderr, BENCH_USAGE);
+        fprintf(stderr, "chatbench: at least 2 clients; sizes from %d to "
+                "%d bytes\n", BENCH_STAMP_LEN, MAX_MSG);
+        exit(1);
+    }
+    if (cfg->compress && cfg->version == FRAME_V1) {
+        fprintf(stderr, "chatbench: -z requires protocol version 2\n");
+        exit(1);
+    }
+    validatePort(cfg->port);
+}
+
+/*******************************************************************************
+* Function: _makeCertificate()
+* Description: Makes a key and a self-signed certificate for localhost in a
+*              new temporary directory, and the clients' TLS context, which
+*              trusts that certificate alone.
+* Parameters: struct benchConfig *cfg - The configuration. Filled in with
+*                                       the directory and the context.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _makeCertificate(struct benchConfig *cfg) {
+    char path[sizeof cfg->certDir + 16];
+    EVP_PKEY *key;
+    X509 *cert = NULL;
+    X509_NAME *name;
+    X509_EXTENSION *ext = NULL;
+    X509V3_CTX v3;
+    FILE *keyFile = NULL, *certFile = NULL;
+    int ok = 0;
+
+    strcpy(cfg->certDir, "/tmp/chatbenchXXXXXX");
+    if (mkdtemp(cfg->certDir) == NULL) {
+        perror("chatbench: mkdtemp");
+        cfg->certDir[0] = '\0';
+        return -1;
+    }
+    if ((key = EVP_EC_gen("P-256")) == NULL || (cert = X509_new()) == NULL) {
+        goto done;
+    }
+    name = X509_get_subject_name(cert);
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    if (!X509_set_version(cert, X509_VERSION_3) ||
+        !ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ||
+        !X509_gmtime_adj(X509_getm_notBefore(cert), 0) ||
+        !X509_gmtime_adj(X509_getm_notAfter(cert),
+                         BENCH_CERT_DAYS * 86400L) ||
+        !X509_set_pubkey(cert, key) ||
+        !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                    (const unsigned char *)"localhost",
+                                    -1, -1, 0) ||
+        !X509_set_issuer_name(cert, name) ||
+        (ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name,
+                                   "DNS:localhost,IP:127.0.0.1")) == NULL ||
+        !X509_add_ext(cert, ext, -1) || !X509_sign(cert, key, EVP_sha256())) {
+        goto done;
+    }
+    snprintf(path, sizeof path, "%s/key.pem", cfg->certDir);
+    if ((keyFile = fopen(path, "w")) == NULL ||
+        !PEM_write_PrivateKey(keyFile, key, NULL, NULL, 0, NULL, NULL)) {
+        goto done;
+    }
+    snprintf(path, sizeof path, "%s/cert.pem", cfg->certDir);
+    if ((certFile = fopen(path, "w")) == NULL ||
+        !PEM_write_X509(certFile, cert) || fclose(certFile) != 0) {
+        certFile = NULL;
+        goto done;
+    }
+    certFile = NULL;
+    ok = (cfg->tlsCtx = tlsClientContext(path)) != NULL;
+
+done:
+    if (!ok) {
+        fprintf(stderr, "chatbench: cannot make a certificate: %s\n",
+                tlsError());
+    }
+    if (keyFile != NULL) {
+        fclose(keyFile);
+    }
+    if (certFile != NULL) {
+        fclose(certFile);
+    }
+    X509_EXTENSION_free(ext);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok ? 0 : -1;
+}
+
+/*******************************************************************************
+* Function: _removeCertificate()
+* Description: Removes the server's key and certificate, which it has no
+*              use for once it is listening, and their directory.
+* Parameters: struct benchConfig *cfg - The configuration.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _removeCertificate(struct benchConfig *cfg) {
+    char path[sizeof cfg->certDir + 16];
+
+    if (cfg->certDir[0] == '\0') {
+        return;
+    }
+    snprintf(path, sizeof path, "%s/key.pem", cfg->certDir);
+    unlink(path);
+    snprintf(path, sizeof path, "%s/cert.pem", cfg->certDir);
+    unlink(path);
+    rmdir(cfg->certDir);
+    cfg->certDir[0] = '\0';
+}
+
+/*******************************************************************************
+* Function: _startServer()
+* Description: Starts chatserver in quiet mode with the requested number of
+*              threads, I/O engine and slow-client policy, and the
+*              benchmark's certificate if
+*              clients connect with TLS, and waits until it reports that it
+*              is listening.
+* Parameters: struct benchConfig *cfg - The configuration.
+*             int *out - Set to the read end of the server's output, which
+*                        reports its counts once it exits.
+* Preconditions: None.
+* Returns: The server's process id, or -1 on failure.
+*******************************************************************************/
+
+static pid_t _startServer(struct benchConfig *cfg, int *out) {
+    char line[128], certFile[sizeof cfg->certDir + 16];
+    char keyFile[sizeof cfg->certDir + 16];
+    char *args[] = { cfg->server, "-q", "-j", cfg->threads, "-e",
+                     cfg->engine, "-P", cfg->policy, cfg->port, NULL, NULL,
+                     NULL, NULL, NULL };
+    int fds[2], len = 0;
+    pid_t pid;
+    ssize_t n;
+
+    if (cfg->tls) {
+        snprintf(certFile, sizeof certFile, "%s/cert.pem", cfg->certDir);
+        snprintf(keyFile, sizeof keyFile, "%s/key.pem", cfg->certDir);
+        args[8] = "-C";
+        args[9] = certFile;
+        args[10] = "-K";
+        args[11] = keyFile;
+        args[12] = cfg->port;
+    }
+    if (pipe(fds) == -1) {
+        perror("chatbench: pipe");
+        return -1;
+    }
+    if ((pid = fork()) == -1) {
+        perror("chatbench: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(cfg->server, args);
+        perror("chatbench: exec");
+        _exit(127);
+    }
+    close(fds[1]);
+    /* The server prints its listening message once the socket is bound. */
+    while (len < (int)sizeof line - 1 &&
+           (n = read(fds[0], line + len, sizeof line - 1 - len)) > 0) {
+        len += n;
+        if (memchr(line, '\n', len) != NULL) {
+            break;
+        }
+    }
+    if (len == 0 || memchr(line, '\n', len) == NULL) {
+        close(fds[0]);
+        waitpid(pid, NULL, 0);
+        fprintf(stderr, "chatbench: %s did not start\n", cfg->server);
+        return -1;
+    }
+    *out = fds[0];
+    return pid;
+}
+
+/*******************************************************************************
+* Function: _serverCounts()
+* Description: Reads the rest of the output of a server that has exited for
+*              the counts that it reported: its system calls, its pool
+*              chunks and the state of its output queues.
+* Parameters: int fd - The read end of the server's output.
+*             struct serverReport *rep - Filled in with the counts, each 0
+*                                        if it was not reported.
+* Preconditions: The server has exited.
+* Returns: None.
+*******************************************************************************/
+
+static void _serverCounts(int fd, struct serverReport *rep) {
+    char buf[1024], *p;
+    int len = 0;
+    ssize_t n;
+
+    while (len < (int)sizeof buf - 1 &&
+           (n = read(fd, buf + len, sizeof buf - 1 - len)) > 0) {
+        len += n;
+    }
+    buf[len] = '\0';
+    memset(rep, 0, sizeof *rep);
+    if ((p = strstr(buf, " deepest ")) != NULL) {
+        sscanf(p, " deepest %ld bytes, %*d congested, %ld messages "
+               "dropped, %ld", &rep->deepest, &rep->dropped, &rep->slow);
+    }
+    if ((p = strstr(buf, " after ")) != NULL) {
+        sscanf(p, " after %lu system calls and %lu", &rep->syscalls,
+               &rep->chunks);
+    }
+}
+
+/*******************************************************************************
+* Function: _receive()
+* Description: Handles every message buffered in a client's frame reader,
+*              recording the latency of each benchmark message.
+* Parameters: struct benchClient *c - The client.
+*             long *received - Incremented for every benchmark message.
+* Preconditions: None.
+* Returns: 0 on success, -1 on a malformed frame.
+*******************************************************************************/
+
+static int _receive(struct benchClient *c, long *received) {
+    unsigned long long now = _nowNs(), sent;
+    struct frameView view;
+    char stamp[BENCH_STAMP_LEN + 1];
+    char *text;
+    int status;
+
+    while ((status = frameReaderNext(&c->reader, &view)) == 1) {
+        if ((view.meta.flags & FRAME_F_COMPRESSED) &&
+            frameDecompress(&c->unzip, &view, c->unzipped) == -1) {
+            return -1;
+        }
+        if (view.meta.type != FRAME_MSG) {
+            continue;
+        }
+        /* Skip the handle prefix. Warm-up messages carry no time stamp. */
+        text = memchr(view.body, '>', view.bodyLen);
+        if (text == NULL || view.body + view.bodyLen - text <
+                            2 + BENCH_STAMP_LEN) {
+            continue;
+        }
+        memcpy(stamp, text + 2, BENCH_STAMP_LEN);
+        stamp[BENCH_STAMP_LEN] = '\0';
+        sent = strtoull(stamp, NULL, 16);
+        c->samples[c->numSamples++] = now - sent;
+        c->payloadBytes += view.bodyLen;
+        (*received)++;
+    }
+    return status;
+}
+
+/*******************************************************************************
+* Function: _fillBody()
+* Description: Fills a message body with words chosen at random, after its
+*              time stamp.
+* Parameters: char *body - The body, whose first BENCH_STAMP_LEN bytes hold
+*                          the time stamp.
+*             int len - The length of the body.
+*             unsigned *seed - The client's random state.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _fillBody(char *body, int len, unsigned *seed) {
+    int i = BENCH_STAMP_LEN, n;
+    const char *word;
+
+    while (i < len) {
+        body[i++] = ' ';
+        word = benchWords[rand_r(seed) % (sizeof benchWords /
+                                          sizeof *benchWords)];
+        for (n = 0; word[n] != '\0' && i < len; n++) {
+            body[i++] = word[n];
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _runClient()
+* Description: The body of one client thread. Connects, waits for every
+*              other client, then sends its messages while receiving those of
+*              the others. A client only sends its next message while it has
+*              received enough from the others that it is at most window
+*              messages ahead of them, which bounds the data in flight.
+* Parameters: void *arg - The client.
+* Preconditions: The server is listening.
+* Returns: NULL.
+*******************************************************************************/
+
+static void *_runClient(void *arg) {
+    struct benchClient *c = arg;
+    struct benchConfig *cfg = c->cfg;
+    SSL_SESSION *ticket = NULL;
+    struct tcp_info info;
+    socklen_t infoLen = sizeof info;
+    long peers = cfg->clients - 1, expected = peers * cfg->messages;
+    long received = 0, sent = 0;
+    char body[MAX_MSG + 1];
+    unsigned accepted, seed = c->id + 1;
+    struct pollfd pfd;
+    int len, wait, pending, n;
+
+    if ((c->sockfd = formConnection("localhost", cfg->port,
+                                    CONNECT_TIMEOUT_MS)) == -1) {
+        exit(2);
+    }
+    if (cfg->tlsCtx != NULL) {
+        if (tlsConnect(cfg->tlsCtx, c->sockfd, "localhost", &ticket) == -1) {
+            fprintf(stderr, "chatbench: TLS: %s\n", tlsError());
+            exit(2);
+        }
+        c->tlsStatus = tlsStatus(c->sockfd);
+    }
+    if (frameReaderInit(&c->reader, cfg->version == FRAME_V1 ? FRAME_V1 : 0)
+        == -1 || (cfg->version == FRAME_V2 &&
+        chatHandshake(c->sockfd, &c->reader,
+                      cfg->compress ? FEAT_COMPRESS : 0, &accepted) == -1)) {
+        c->failed = 1;
+    }
+    /* The server only sends to a version 1 client once it has sent
+     * something, so every client opens with a message that is not counted.
+     */
+    if (cfg->version == FRAME_V1 && !c->failed &&
+        chatSendMsg(c->sockfd, FRAME_V1, c->handle, "", 0) == -1) {
+        c->failed = 1;
+    }
+    pfd.fd = c->sockfd;
+    pfd.events = POLLIN;
+    pthread_barrier_wait(c->start);
+
+    while (!c->failed && (sent < cfg->messages || received < expected)) {
+        wait = sent == cfg->messages ||
+               received < (sent - cfg->window) * peers;
+        if (!wait) {
+            len = cfg->minSize;
+            if (cfg->maxSize > cfg->minSize) {
+                len += rand_r(&seed) % (cfg->maxSize - cfg->minSize + 1);
+            }
+            snprintf(body, sizeof body, "%016llx", _nowNs());
+            _fillBody(body, len, &seed);
+            if (chatSendMsg(c->sockfd, cfg->version, c->handle, body,
+                            len) == -1) {
+                perror("chatbench: send");
+                c->failed = 1;
+                break;
+            }
+            sent++;
+        }
+        /* Block for input only when there is nothing to send, or to
+         * read from records already decrypted.
+         */
+        pending = tlsPending(c->sockfd);
+        if (poll(&pfd, 1, wait && !pending ? -1 : 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            c->failed = 1;
+            break;
+        }
+        if (pfd.revents == 0 && !pending) {
+            continue;
+        }
+        n = frameReaderFill(&c->reader, c->sockfd);
+        if (n == -1 && errno == EAGAIN) {
+            continue;
+        }
+        if (n <= 0 || _receive(c, &received) == -1) {
+            fprintf(stderr, "chatbench: client %d lost its connection\n",
+                    c->id);
+            c->failed = 1;
+        }
+    }
+    /* TCP counts what TLS adds to each message, as well as the frames. */
+    if (getsockopt(c->sockfd, IPPROTO_TCP, TCP_INFO, &info, &infoLen) == 0) {
+        c->wireBytes = info.tcpi_bytes_received;
+    }
+    tlsClose(c->sockfd);
+    close(c->sockfd);
+    SSL_SESSION_free(ticket);
+    frameReaderFree(&c->reader);
+    frameDecompressorFree(&c->unzip);
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: _stallClient()
+* Description: Connects a client that completes the handshake and then never
+*              reads, with a small receive buffer, so that the server's
+*              output queue for it fills.
+* Parameters: struct benchConfig *cfg - The configuration.
+* Preconditions: The server is listening.
+* Returns: The client's socket, or -1 on failure.
+*******************************************************************************/
+
+static int _stallClient(struct benchConfig *cfg) {
+    struct frameReader reader;
+    SSL_SESSION *ticket = NULL;
+    int sockfd, size = BENCH_STALL_BUF, status = 0;
+    unsigned accepted;
+
+    if ((sockfd = formConnection("localhost", cfg->port,
+                                 CONNECT_TIMEOUT_MS)) == -1) {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    if (cfg->tlsCtx != NULL &&
+        tlsConnect(cfg->tlsCtx, sockfd, "localhost", &ticket) == -1) {
+        status = -1;
+    } else if (frameReaderInit(&reader, cfg->version == FRAME_V1 ?
+                               FRAME_V1 : 0) == -1) {
+        status = -1;
+    } else {
+        if (cfg->version == FRAME_V2) {
+            status = chatHandshake(sockfd, &reader,
+                                   cfg->compress ? FEAT_COMPRESS : 0,
+                                   &accepted);
+        } else {
+            status = chatSendMsg(sockfd, FRAME_V1, "stall", "", 0);
+        }
+        frameReaderFree(&reader);
+    }
+    SSL_SESSION_free(ticket);
+    if (status == -1) {
+        tlsClose(sockfd);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*******************************************************************************
+* Function: _compareSamples()
+* Description: Orders latency samples for qsort().
+* Parameters: const void *a - The first sample.
+*             const void *b - The second sample.
+* Preconditions: None.
+* Returns: Negative, zero or positive as a is less than, equal to or greater
+*          than b.
+*******************************************************************************/
+
+static int _compareSamples(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+* Function: _report()
+* Description: Merges the latency samples of every client and prints the
+*              benchmark results.
+* Parameters: struct benchConfig *cfg - The configuration.
+*             struct benchClient *clients - The finished clients.
+*             double elapsedNs - The wall time of the run.
+*             double serverCpuNs - The CPU time used by the server.
+*             double clientCpuNs - The CPU time used by the clients.
+*             struct serverReport *rep - What the server reported. Its
+*                                        system calls include connecting
+*                                        the clients, and its chunks
+*                                        warming up.
+* Preconditions: Every client finished without failing.
+* Returns: None.
+*******************************************************************************/
+
+static void _report(struct benchConfig *cfg, struct benchClient *clients,
+                    double elapsedNs, double serverCpuNs,
+                    double clientCpuNs, struct serverReport *rep) {
+    unsigned long long *all, wire = 0, payload = 0;
+    double sentMsgs = (double)cfg->clients * cfg->messages;
+    long total = 0, i;
+    int c, kernel = 0;
+
+    for (c = 0; c < cfg->clients; c++) {
+        kernel += clients[c].tlsStatus != -1 &&
+                  (clients[c].tlsStatus & TLS_KERNEL_SEND);
+        total += clients[c].numSamples;
+        wire += clients[c].wireBytes;
+        payload += clients[c].payloadBytes;
+    }
+    if ((all = malloc(total * sizeof *all)) == NULL) {
+        fprintf(stderr, "chatbench: out of memory\n");
+        return;
+    }
+    for (c = 0, i = 0; c < cfg->clients; c++) {
+        memcpy(all + i, clients[c].samples,
+               clients[c].numSamples * sizeof *all);
+        i += clients[c].numSamples;
+    }
+    qsort(all, total, sizeof *all, _compareSamples);
+
+    printf("protocol v%d%s%s, %d clients, %d messages each, %d-%d bytes, "
+           "window %d, server threads %s on %s\n", cfg->version,
+           cfg->compress ? " compressed" : "", cfg->tls ? " over TLS" : "",
+           cfg->clients, cfg->messages, cfg->minSize, cfg->maxSize,
+           cfg->window, cfg->threads, cfg->engine);
+    if (cfg->stalled > 0) {
+        printf("%d stalled clients, slow-client policy %s\n", cfg->stalled,
+               cfg->policy);
+    }
+    if (cfg->tls) {
+        printf("%-24s %9d/%d\n", "kernel TLS clients", kernel,
+               cfg->clients);
+    }
+    printf("%-24s %12.0f\n", "messages sent/s", sentMsgs * 1e9 / elapsedNs);
+    printf("%-24s %12.0f\n", "messages delivered/s", total * 1e9 / elapsedNs);
+    printf("%-24s %12.1f\n", "latency p50 (us)", all[total / 2] / 1e3);
+    printf("%-24s %12.1f\n", "latency p99 (us)",
+           all[(long)(total * 0.99)] / 1e3);
+    printf("%-24s %12.1f\n", "latency p999 (us)",
+           all[(long)(total * 0.999)] / 1e3);
+    printf("%-24s %12.1f\n", "latency max (us)", all[total - 1] / 1e3);
+    printf("%-24s %12.2f\n", "server cpu/msg (us)",
+           serverCpuNs / sentMsgs / 1e3);
+    printf("%-24s %12.2f\n", "client cpu/msg (us)",
+           clientCpuNs / sentMsgs / 1e3);
+    printf("%-24s %12.2f\n", "server syscalls/msg",
+           rep->syscalls / sentMsgs);
+    printf("%-24s %12lu\n", "server pool chunks", rep->chunks);
+    printf("%-24s %12.1f\n", "deepest queue (KiB)", rep->deepest / 1024.0);
+    if (cfg->stalled > 0) {
+        printf("%-24s %12ld\n", "messages dropped", rep->dropped);
+        printf("%-24s %12ld\n", "slow clients cut off", rep->slow);
+    }
+    printf("%-24s %12.1f\n", "payload bytes/delivery", (double)payload / total);
+    printf("%-24s %12.1f\n", "wire bytes/delivery", (double)wire / total);
+    free(all);
+}
+
+/*******************************************************************************
+* Function: main()
+* Description: Runs the benchmark: starts the server, runs the clients to
+*              completion, stops the server and reports.
+* Parameters: int argc - The command line argument count.
+*             char *argv[] - The command line arguments.
+* Preconditions: None.
+* Returns: 0 on success, 1 on invalid arguments, 2 if the run failed.
+*******************************************************************************/
+
+int main(int argc, char *argv[]) {
+    struct benchConfig cfg;
+    struct benchClient *clients;
+    pthread_barrier_t start;
+    pthread_t *threads;
+    struct rusage serverUsage, before, after;
+    struct timespec settle = { 0, BENCH_SETTLE_NS };
+    unsigned long long begin, end;
+    struct serverReport rep;
+    int c, out, failed = 0, *stalled;
+    pid_t pid;
+
+    _parseArgs(argc, argv, &cfg);
+    signal(SIGPIPE, SIG_IGN);
+    if (cfg.tls && _makeCertificate(&cfg) == -1) {
+        _removeCertificate(&cfg);
+        exit(2);
+    }
+    pid = _startServer(&cfg, &out);
+    _removeCertificate(&cfg);
+    if (pid == -1) {
+        exit(2);
+    }
+
+    clients = calloc(cfg.clients, sizeof *clients);
+    threads = calloc(cfg.clients, sizeof *threads);
+    stalled = calloc(cfg.stalled + 1, sizeof *stalled);
+    if (clients == NULL || threads == NULL || stalled == NULL) {
+        fprintf(stderr, "chatbench: out of memory\n");
+        exit(2);
+    }
+    for (c = 0; c < cfg.stalled; c++) {
+        if ((stalled[c] = _stallClient(&cfg)) == -1) {
+            fprintf(stderr, "chatbench: cannot connect stalled client\n");
+            kill(pid, SIGTERM);
+            exit(2);
+        }
+    }
+    /* The main thread joins the barrier to start the clock. */
+    pthread_barrier_init(&start, NULL, cfg.clients + 1);
+    for (c = 0; c < cfg.clients; c++) {
+        clients[c].cfg = &cfg;
+        clients[c].start = &start;
+        clients[c].id = c;
+        snprintf(clients[c].handle, sizeof clients[c].handle, "b%d", c);
+        clients[c].samples = malloc((long)(cfg.clients - 1) * cfg.messages *
+                                    sizeof *clients[c].samples);
+        if (clients[c].samples == NULL ||
+            pthread_create(&threads[c], NULL, _runClient, &clients[c]) != 0) {
+            fprintf(stderr, "chatbench: cannot start client %d\n", c);
+            exit(2);
+        }
+    }
+    /* Give the server time to see the warm-up messages of version 1
+     * clients before the measured messages start.
+     */
+    if (cfg.version == FRAME_V1) {
+        nanosleep(&settle, NULL);
+    }
+    getrusage(RUSAGE_SELF, &before);
+    pthread_barrier_wait(&start);
+    begin = _nowNs();
+    for (c = 0; c < cfg.clients; c++) {
+        pthread_join(threads[c], NULL);
+        failed |= clients[c].failed;
+    }
+    end = _nowNs();
+    getrusage(RUSAGE_SELF, &after);
+
+    kill(pid, SIGTERM);
+    if (wait4(pid, NULL, 0, &serverUsage) == -1) {
+        memset(&serverUsage, 0, sizeof serverUsage);
+    }
+    _serverCounts(out, &rep);
+    close(out);
+    if (!failed) {
+        _report(&cfg, clients, end - begin, _cpuNs(&serverUsage),
+                _cpuNs(&after) - _cpuNs(&before), &rep);
+    }
+    for (c = 0; c < cfg.stalled; c++) {
+        tlsClose(stalled[c]);
+        close(stalled[c]);
+    }
+    free(stalled);
+    for (c = 0; c < cfg.clients; c++) {
+        free(clients[c].samples);
+    }
+    free(clients);
+    free(threads);
+    pthread_barrier_destroy(&start);
+    SSL_CTX_free(cfg.tlsCtx);
+    return failed ? 2 : 0;
+}
@@ -1,18 +1,807 @@
 /*******************************************************************************
 *      Filename: chatclient.c
 *        Author: Maxwell Goldberg
-* Last Modified: 02.12.17
+* Last Modified: 10.16.26
 *   Description: The main chatclient method file.
 *******************************************************************************/
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/random.h>
+
 #include "validate.h"
 #include "network.h"
+#include "frame.h"
+#include "compress.h"
+
+/* A room the client is in, as named by the server's JOIN frames, and the
+ * oldest of its messages received from the server's log.
+ */
+struct clientRoom {
+    uint32_t id;
+    char     name[FRAME_ROOM_NAME_MAX + 1];
+    uint64_t cursor;    /* 0 if none, or HISTORY_START if there are none
+                         * older. */
+};
+
+/* The state of one chat session with the server. */
+struct chatSession {
+    struct clientOptions *opts;
+    int                sockfd;
+    int                inputFd;         /* Where messages are read from. */
+    int                batch;           /* Set to run without prompts. */
+    char               handle[MAX_BYTES];
+    unsigned           features;        /* Features accepted by HELLO. */
+    struct lineBuffer  input;
+    struct sendQueue   queue;
+    struct replayQueue replay;          /* Messages sent while resumable. */
+    uint64_t           sessionId;
+    int                resume;          /* Set if the server keeps the
+                                         * session across reconnects. */
+    struct frameReader reader;
+    uint32_t           nextStream;      /* Last stream id used to send. */
+    uint32_t           sendStream;      /* Stream id of the line being sent
+                                         * in pieces. */
+    uint32_t           openStream;      /* Stream id of the message being
+                                         * displayed, or 0. */
+    int                deferInput;      /* Set while waiting for the socket
+                                         * to drain before reading more of
+                                         * an overlong line. */
+    int                skipLine;        /* Set while discarding the rest of
+                                         * an overlong line. */
+    struct clientRoom  rooms[FRAME_MAX_JOINED];
+    int                numRooms;
+    char               room[FRAME_ROOM_NAME_MAX + 1];  /* The room messages
+                                         * are sent to, or empty for every
+                                         * client. */
+    uint64_t           cursor;          /* As for clientRoom, for the
+                                         * messages sent to every client. */
+    struct frameDecompressor unzip;     /* The messages received, if
+                                         * compressed, */
+    char               unzipped[FRAME_MAX_PAYLOAD + 1];  /* and the last
+                                         * one decompressed. */
+    SSL_CTX           *tls;             /* NULL without TLS. */
+    SSL_SESSION       *ticket;          /* The server's latest ticket, to
+                                         * resume TLS on reconnecting. */
+    long long          heard;           /* When data last arrived, */
+    long long          pingAt;          /* and when a PING was sent that
+                                         * nothing has arrived since, or 0,
+                                         * in milliseconds. */
+};
+
+/*******************************************************************************
+* Function: _showPrompt()
+* Description: Displays the handle prompt, preceded by the room messages are
+*              sent to, if any, without a trailing newline, unless running in
+*              batch mode.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _showPrompt(struct chatSession *s) {
+    if (!s->batch) {
+        if (s->room[0] != '\0') {
+            printf("[%s] ", s->room);
+        }
+        printf("%s> ", s->handle);
+        fflush(stdout);
+    }
+}
+
+/*******************************************************************************
+* Function: _socketWritable()
+* Description: Checks without blocking whether a socket can take more data.
+* Parameters: int sockfd - The socket file descriptor.
+* Preconditions: None.
+* Returns: 1 if the socket is writable, 0 otherwise.
+*******************************************************************************/
+
+static int _socketWritable(int sockfd) {
+    struct pollfd pfd;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLOUT;
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+/*******************************************************************************
+* Function: _showStatus()
+* Description: Reports a change in the state of the connection: over the
+*              prompt in interactive mode, or on stderr in batch mode.
+* Parameters: struct chatSession *s - The session.
+*             char *status - The message, without a newline.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _showStatus(struct chatSession *s, char *status) {
+    if (s->batch) {
+        fprintf(stderr, "chatclient: %s\n", status);
+    } else {
+        printf("\r\033[K%s\n", status);
+        fflush(stdout);
+    }
+}
+
+/*******************************************************************************
+* Function: _connect()
+* Description: Connects to the server, with TLS if asked, and negotiates
+*              the protocol. If the server keeps sessions, the session is
+*              started or resumed, the messages the server already has are
+*              discarded and the rest are sent again. A TLS session is
+*              resumed from the server's latest ticket. A server that does
+*              not answer PING frames is probed with TCP keepalives.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: The session's options and handle are set.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _connect(struct chatSession *s) {
+    struct clientOptions *opts = s->opts;
+    unsigned features = FEAT_CHUNKED | FEAT_RESUME | FEAT_ROOMS |
+                        FEAT_DIRECT | FEAT_HISTORY | FEAT_KEEPALIVE |
+                        (opts->compress ? FEAT_COMPRESS : 0);
+    uint32_t lastSeq;
+
+    s->sockfd = formConnection(opts->hostname, opts->port,
+                               opts->timeout >= 0 ? opts->timeout * 1000
+                                                  : CONNECT_TIMEOUT_MS);
+    if (s->sockfd == -1) {
+        return -1;
+    }
+    /* A version 2 server announces itself with the preamble, so the reader
+     * starts out detecting the version.
+     */
+    if (frameReaderInit(&s->reader, opts->version == FRAME_V1 ? FRAME_V1 : 0)
+        == -1) {
+        fprintf(stderr, "chatclient: out of memory\n");
+        exit(2);
+    }
+    if (s->tls != NULL &&
+        tlsConnect(s->tls, s->sockfd, opts->hostname, &s->ticket) == -1) {
+        fprintf(stderr, "chatclient: TLS: %s\n", tlsError());
+        goto fail;
+    }
+    if (s->resume) {
+        /* The server is known to keep sessions, so the session is named
+         * along with the HELLO rather than after the server's answer.
+         */
+        if (chatHandshakeResume(s->sockfd, &s->reader, features,
+                                &s->features, s->sessionId, s->handle,
+                                &lastSeq) == -1) {
+            goto fail;
+        }
+    } else {
+        if (opts->version == FRAME_V2 &&
+            chatHandshake(s->sockfd, &s->reader, features,
+                          &s->features) == -1) {
+            goto fail;
+        }
+        s->resume = (s->features & FEAT_RESUME) != 0;
+        if (s->resume && chatResume(s->sockfd, &s->reader, s->sessionId,
+                                    s->handle, &lastSeq) == -1) {
+            goto fail;
+        }
+    }
+    if (s->resume) {
+        replayQueueAck(&s->replay, lastSeq);
+        replayQueueRewind(&s->replay);
+        if (replayQueueFlush(&s->replay, s->sockfd) == -1) {
+            goto fail;
+        }
+    }
+    /* A server that cannot be pinged is left to TCP keepalives. */
+    if (!(s->features & FEAT_KEEPALIVE)) {
+        socketKeepalive(s->sockfd, KEEPALIVE_IDLE_MS, KEEPALIVE_GRACE_MS);
+    }
+    s->heard = clockMs();
+    s->pingAt = 0;
+    return 0;
+
+fail:
+    frameReaderFree(&s->reader);
+    tlsClose(s->sockfd);
+    close(s->sockfd);
+    return -1;
+}
+
+/*******************************************************************************
+* Function: _reconnect()
+* Description: Replaces a lost connection, retrying with exponential backoff
+*              and random jitter so that clients cut off together do not
+*              return together.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: The session is resumable and its connection has been lost.
+* Returns: 0 on success, -1 if every attempt failed.
+*******************************************************************************/
+
+static int _reconnect(struct chatSession *s) {
+    struct timespec delay;
+    long delayMs = RECONNECT_BASE_MS, sleepMs;
+    int attempt;
+
+    frameReaderFree(&s->reader);
+    frameDecompressorFree(&s->unzip);
+    tlsClose(s->sockfd);
+    close(s->sockfd);
+    if (s->openStream != 0) {
+        putchar('\n');
+        s->openStream = 0;
+    }
+    s->deferInput = 0;
+    _showStatus(s, "Connection lost. Reconnecting...");
+
+    for (attempt = 0; attempt < RECONNECT_TRIES; attempt++) {
+        sleepMs = delayMs / 2 + rand() % (delayMs / 2 + 1);
+        delay.tv_sec = sleepMs / 1000;
+        delay.tv_nsec = sleepMs % 1000 * 1000000;
+        nanosleep(&delay, NULL);
+        if (_connect(s) == 0) {
+            _showStatus(s, "Reconnected.");
+            _showPrompt(s);
+            return 0;
+        }
+        if ((delayMs *= 2) > RECONNECT_MAX_MS) {
+            delayMs = RECONNECT_MAX_MS;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+* Function: _keepalive()
+* Description: Pings a server that has been silent for KEEPALIVE_IDLE_MS,
+*              and gives it up for dead if nothing has arrived
+*              KEEPALIVE_GRACE_MS after that.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: None.
+* Returns: 0 while the server is presumed alive, -1 once it is not.
+*******************************************************************************/
+
+static int _keepalive(struct chatSession *s) {
+    long long now;
+
+    if (!(s->features & FEAT_KEEPALIVE)) {
+        return 0;
+    }
+    now = clockMs();
+    if (s->pingAt != 0 && s->heard >= s->pingAt) {
+        s->pingAt = 0;
+    }
+    if (s->pingAt != 0) {
+        return now - s->pingAt >= KEEPALIVE_GRACE_MS ? -1 : 0;
+    }
+    if (now - s->heard >= KEEPALIVE_IDLE_MS) {
+        if (chatSendPing(s->sockfd, FRAME_PING, now) == -1) {
+            return -1;
+        }
+        s->pingAt = now;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _keepaliveWait()
+* Description: Works out how long the client may wait for input before
+*              _keepalive() has something to do.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: None.
+* Returns: The milliseconds, or -1 if the server is not pinged.
+*******************************************************************************/
+
+static int _keepaliveWait(struct chatSession *s) {
+    long long wait;
+
+    if (!(s->features & FEAT_KEEPALIVE)) {
+        return -1;
+    }
+    wait = (s->pingAt != 0 ? s->pingAt + KEEPALIVE_GRACE_MS
+                           : s->heard + KEEPALIVE_IDLE_MS) - clockMs();
+    return wait > 0 ? wait : 0;
+}
+
+/*******************************************************************************
+* Function: _queueMsg()
+* Description: Queues a chat message to be sent by _flushMsgs(). Messages of
+*              a resumable session are numbered and kept until the server
+*              acknowledges them.
+* Parameters: struct chatSession *s - The session.
+*             const struct frameMeta *meta - The header fields, or NULL for
+*                                            a plain chat message.
+*             char *handle - The handle, or NULL for a piece of a streamed
+*                            message other than the first.
+*             char *body - The message body.
+*             int len - The length of the body in bytes.
+* Preconditions: The handle and body have been validated.
+* Returns: 0 on success, -1 if the connection has failed.
+*******************************************************************************/
+
+static int _queueMsg(struct chatSession *s, const struct frameMeta *meta,
+                     char *handle, char *body, int len) {
+    if (!s->resume) {
+        return sendQueueAdd(&s->queue, s->sockfd, meta, handle, body, len);
+    }
+    if (replayQueueAdd(&s->replay, meta, handle, body, len) == -1) {
+        fprintf(stderr, "chatclient: out of memory\n");
+        exit(2);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _flushMsgs()
+* Description: Sends every message queued by _queueMsg().
+* Parameters: struct chatSession *s - The session.
+* Preconditions: None.
+* Returns: 0 on success, -1 if the connection has failed.
+*******************************************************************************/
+
+static int _flushMsgs(struct chatSession *s) {
+    if (!s->resume) {
+        return sendQueueFlush(&s->queue, s->sockfd, 0);
+    }
+    return replayQueueFlush(&s->replay, s->sockfd);
+}
+
+/*******************************************************************************
+* Function: _parseCommand()
+* Description: Recognizes the commands that are sent as frames of their own:
+*              '\join room', which joins a room and sends further messages
+*              to it, '\part [room]', which leaves a room, by default the
+*              current one, after which messages go to every client again,
+*              '\msg handle text', which sends a private message, and
+*              '\history [count]', which asks for the messages of the
+*              current room, or of every client, from before the oldest
+*              already received.
+* Parameters: struct chatSession *s - The session.
+*             char *line - The null terminated input line. A '\msg' line is
+*                          modified.
+*             struct frameMeta *meta - Its flags and room are set for the
+*                                      frame to send.
+*             char *payload - At least 2 * (MAX_HANDLE_LEN + 1) +
+*                             LINE_BUF_SIZE bytes. Set to the payload of the
+*                             frame to send.
+*             int *len - Set to the length of the payload.
+* Preconditions: None.
+* Returns: FRAME_JOIN, FRAME_PART, FRAME_DIRECT or FRAME_HISTORY if the
+*          frame should be sent, 0 if the line is not such a command, and -1
+*          if the command is invalid or there is nothing to ask for.
+*******************************************************************************/
+
+static int _parseCommand(struct chatSession *s, char *line,
+                         struct frameMeta *meta, char *payload, int *len) {
+    int type, feature = FEAT_ROOMS, count = HISTORY_PAGE, i;
+    uint64_t *cursor = &s->cursor;
+    char *arg, *text;
+
+    if (strncmp(line, "\\join", 5) == 0) {
+        type = FRAME_JOIN;
+        arg = line + 5;
+    } else if (strncmp(line, "\\part", 5) == 0) {
+        type = FRAME_PART;
+        arg = line + 5;
+    } else if (strncmp(line, "\\msg", 4) == 0) {
+        type = FRAME_DIRECT;
+        feature = FEAT_DIRECT;
+        arg = line + 4;
+    } else if (strncmp(line, "\\history", 8) == 0) {
+        type = FRAME_HISTORY;
+        feature = FEAT_HISTORY;
+        arg = line + 8;
+    } else {
+        return 0;
+    }
+    if (*arg == ' ') {
+        arg++;
+    } else if (*arg != '\0') {
+        return 0;
+    }
+    if (!(s->features & feature)) {
+        fprintf(stderr, "chatclient: the server does not support %s\n",
+                type == FRAME_DIRECT ? "private messages" :
+                type == FRAME_HISTORY ? "history" : "rooms");
+        return -1;
+    }
+    meta->flags = 0;
+    meta->room = 0;
+    if (type == FRAME_HISTORY) {
+        if (*arg != '\0' &&
+            ((count = atoi(arg)) < 1 || !isdigit((unsigned char)*arg))) {
+            fprintf(stderr, "chatclient: usage: \\history [count]\n");
+            return -1;
+        }
+        for (i = 0; i < s->numRooms && s->room[0] != '\0'; i++) {
+            if (strcmp(s->rooms[i].name, s->room) == 0) {
+                meta->flags = FRAME_F_ROOM;
+                meta->room = s->rooms[i].id;
+                cursor = &s->rooms[i].cursor;
+                break;
+            }
+        }
+        if (s->room[0] != '\0' && meta->room == 0) {
+            fprintf(stderr, "chatclient: not in room %s yet\n", s->room);
+            return -1;
+        }
+        if (*cursor == HISTORY_START) {
+            _showStatus(s, "No earlier messages.");
+            return -1;
+        }
+        *len = frameEncodeHistoryReq(payload, *cursor, count);
+        return type;
+    }
+    if (type == FRAME_DIRECT) {
+        if ((text = strchr(arg, ' ')) == NULL || text[1] == '\0') {
+            fprintf(stderr, "chatclient: usage: \\msg handle text\n");
+            return -1;
+        }
+        *text++ = '\0';
+        if (!validateHandle(arg)) {
+            return -1;
+        }
+        if ((int)strlen(text) > (s->features & FEAT_CHUNKED ? LINE_BUF_SIZE
+                                                            : MAX_MSG)) {
+            fprintf(stderr, "chatclient: Invalid message length\n");
+            return -1;
+        }
+        /* The message carries the sender's handle like any other. */
+        *len = frameEncodeDirect(payload, arg);
+        *len += sprintf(payload + *len, "%s> %s", s->handle, text);
+        return type;
+    }
+    line = *arg != '\0' ? arg : s->room;
+    if (*line == '\0') {
+        fprintf(stderr, type == FRAME_JOIN ? "chatclient: usage: \\join room\n"
+                                           : "chatclient: not in a room\n");
+        return -1;
+    }
+    if (!validateRoomName(line, FRAME_ROOM_NAME_MAX)) {
+        return -1;
+    }
+    *len = sprintf(payload, "%s", line);
+    if (type == FRAME_JOIN) {
+        strcpy(s->room, payload);
+    } else if (strcmp(s->room, payload) == 0) {
+        s->room[0] = '\0';
+    }
+    return type;
+}
+
+/*******************************************************************************
+* Function: _sendInput()
+* Description: Sends every line buffered from stdin as a chat message. The
+*              lines are queued in place and leave in a single sendmsg().
+*              Invalid lines are reported and skipped. If the server accepts
+*              streamed messages, a line too long for the input buffer is
+*              sent in pieces as it is read, each piece a continuation of the
+*              same stream; otherwise it is rejected. Commands recognized by
+*              _parseCommand() are sent as frames of their own, in order
+*              with the messages.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: The socket is connected and the handle has been validated.
+* Returns: 0 if the user entered '\quit', -1 if a resumable connection has
+*          failed, and 1 otherwise. Other send failures exit.
+*******************************************************************************/
+
+static int _sendInput(struct chatSession *s) {
+    struct frameMeta meta = { FRAME_MSG, 0, 0, 0, 0, 0 };
+    struct frameMeta cmdMeta = { FRAME_JOIN, 0, 0, 0, 0, 0 };
+    char payload[2 * (MAX_HANDLE_LEN + 1) + LINE_BUF_SIZE];
+    struct linePart part;
+    int chunked = s->features & FEAT_CHUNKED;
+    int status = 1, failed = 0, len;
+
+    while (lineBufferNextPart(&s->input, &part)) {
+        if (part.first && part.last &&
+            (cmdMeta.type = _parseCommand(s, part.data, &cmdMeta, payload,
+                                          &len)) != 0) {
+            /* The payload is sent at once, since the queue does not copy
+             * it.
+             */
+            if (cmdMeta.type != -1 && !failed &&
+                (_queueMsg(s, &cmdMeta, NULL, payload, len) == -1 ||
+                 _flushMsgs(s) == -1)) {
+                failed = 1;
+            }
+            continue;
+        }
+        if (part.first && part.last) {
+            /* A return value of 0 means the user entered '\quit'. */
+            status = validateMsgLine(part.data,
+                                     chunked ? LINE_BUF_SIZE : MAX_MSG);
+            if (status == 0) {
+                break;
+            }
+            if (status == 1 && !failed &&
+                _queueMsg(s, NULL, s->handle, part.data, part.len) == -1) {
+                failed = 1;
+            }
+            continue;
+        }
+        /* A piece of an overlong line. A private message must fit in the
+         * buffer, or the rest of it would go to everyone.
+         */
+        if (part.first) {
+            s->skipLine = !chunked || strncmp(part.data, "\\msg ", 5) == 0;
+            if (s->skipLine) {
+                fprintf(stderr, "chatclient: Invalid message length\n");
+            }
+        }
+        if (s->skipLine) {
+            continue;
+        }
+        if (part.first) {
+            s->sendStream = ++s->nextStream;
+        }
+        meta.flags = FRAME_F_STREAM | (part.last ? 0 : FRAME_F_MORE);
+        meta.stream = s->sendStream;
+        if (!failed && _queueMsg(s, &meta, part.first ? s->handle : NULL,
+                                 part.data, part.len) == -1) {
+            failed = 1;
+        }
+    }
+    if (failed || _flushMsgs(s) == -1) {
+        /* A resumable session keeps its messages for the next connection. */
+        if (s->resume) {
+            return status == 0 ? 0 : -1;
+        }
+        perror("send");
+        exit(-1);
+    }
+    if (status != 0 && !s->input.partial) {
+        _showPrompt(s);
+    }
+    return status != 0;
+}
+
+/*******************************************************************************
+* Function: _roomName()
+* Description: Looks up the name of a room the client is in.
+* Parameters: struct chatSession *s - The session.
+*             uint32_t id - The room id.
+* Preconditions: None.
+* Returns: The name, or NULL if the client is not in the room.
+*******************************************************************************/
+
+static char *_roomName(struct chatSession *s, uint32_t id) {
+    int i;
+
+    for (i = 0; i < s->numRooms; i++) {
+        if (s->rooms[i].id == id) {
+            return s->rooms[i].name;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: _historyCursor()
+* Description: Looks up where paging back through the history of a room the
+*              client is in has got to.
+* Parameters: struct chatSession *s - The session.
+*             uint32_t id - The room id, or 0 for every client.
+* Preconditions: None.
+* Returns: The cursor, or NULL if the client is not in the room.
+*******************************************************************************/
+
+static uint64_t *_historyCursor(struct chatSession *s, uint32_t id) {
+    int i;
+
+    if (id == 0) {
+        return &s->cursor;
+    }
+    for (i = 0; i < s->numRooms; i++) {
+        if (s->rooms[i].id == id) {
+            return &s->rooms[i].cursor;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: _roomReply()
+* Description: Acts on a JOIN or PART frame from the server. A JOIN frame
+*              names a room the client is in; a PART frame with a room id
+*              names one it has left. A PART frame without one means that the
+*              client is not in the room, because a join was refused, and
+*              that its messages go to every client.
+* Parameters: struct chatSession *s - The session.
+*             struct frameView *view - The JOIN or PART frame.
+* Preconditions: None.
+* Returns: 1 if a status line was displayed, 0 otherwise.
+*******************************************************************************/
+
+static int _roomReply(struct chatSession *s, struct frameView *view) {
+    char name[FRAME_ROOM_NAME_MAX + 1], status[FRAME_ROOM_NAME_MAX + 16];
+    int i;
+
+    if (frameDecodeRoom(view, name) == -1) {
+        return 0;
+    }
+    if (view->meta.flags & FRAME_F_ROOM) {
+        for (i = 0; i < s->numRooms; i++) {
+            if (s->rooms[i].id == view->meta.room) {
+                break;
+            }
+        }
+        if (view->meta.type == FRAME_JOIN && i == s->numRooms &&
+            s->numRooms < FRAME_MAX_JOINED) {
+            s->rooms[s->numRooms].id = view->meta.room;
+            s->rooms[s->numRooms].cursor = 0;
+            strcpy(s->rooms[s->numRooms++].name, name);
+        } else if (view->meta.type == FRAME_PART && i < s->numRooms) {
+            s->rooms[i] = s->rooms[--s->numRooms];
+        }
+        return 0;
+    }
+    if (view->meta.type != FRAME_PART) {
+        return 0;
+    }
+    if (strcmp(s->room, name) == 0) {
+        s->room[0] = '\0';
+    }
+    snprintf(status, sizeof status, "Not in room %s.", name);
+    _showStatus(s, status);
+    return 1;
+}
+
+/*******************************************************************************
+* Function: _showReceived()
+* Description: Displays every chat message buffered in the frame reader over
+*              the prompt, then redisplays the prompt. The pieces of a
+*              streamed message are written out as they arrive, so a long
+*              message is never held in memory as a whole; if other messages
+*              arrive in between, the stream resumes on a new line. Messages
+*              for a room are labelled with its name, and dropped if the
+*              client has left it; private messages are labelled as such.
+*              Messages from the server's log are stamped with the time at
+*              which they were sent, and the oldest received for each room
+*              is remembered for '\history'.
+*              Acknowledgements release messages from the replay queue,
+*              and PING frames are answered. Other frame types are ignored.
+* Parameters: struct chatSession *s - The session.
+* Preconditions: None.
+* Returns: 1 on success, -1 if the server sent a malformed frame.
+*******************************************************************************/
+
+static int _showReceived(struct chatSession *s) {
+    char handle[MAX_HANDLE_LEN + 1], notice[MAX_HANDLE_LEN + 32];
+    char stamp[16];
+    struct frameView view;
+    char *room;
+    uint32_t seq;
+    uint64_t id, *cursor;
+    int64_t when;
+    time_t sent;
+    uint64_t token;
+    int end;
+    int status, shown = 0;
+
+    while ((status = frameReaderNext(&s->reader, &view)) == 1) {
+        if ((view.meta.flags & FRAME_F_COMPRESSED) &&
+            frameDecompress(&s->unzip, &view, s->unzipped) == -1) {
+            fprintf(stderr, "chatclient: cannot decompress a message\n");
+            return -1;
+        }
+        /* Acknowledgements usually ride along on other frames. */
+        if (view.meta.flags & FRAME_F_ACK) {
+            replayQueueAck(&s->replay, view.meta.ack);
+        }
+        if (view.meta.type == FRAME_ACK && frameDecodeAck(&view, &seq) == 0) {
+            replayQueueAck(&s->replay, seq);
+            continue;
+        }
+        /* A failed answer shows as a broken connection soon enough. */
+        if (view.meta.type == FRAME_PING &&
+            frameDecodePing(&view, &token) == 0) {
+            chatSendPing(s->sockfd, FRAME_PONG, token);
+            continue;
+        }
+        if (view.meta.type == FRAME_JOIN || view.meta.type == FRAME_PART) {
+            shown |= _roomReply(s, &view);
+            continue;
+        }
+        room = NULL;
+        if (view.meta.type == FRAME_DIRECT) {
+            if (frameDecodeDirect(&view, handle, &view.body,
+                                  &view.bodyLen) == -1) {
+                continue;
+            }
+            /* A private message without a message could not be sent. */
+            if (view.bodyLen == 0) {
+                snprintf(notice, sizeof notice, "No client has handle %s.",
+                         handle);
+                _showStatus(s, notice);
+                shown = 1;
+                continue;
+            }
+            view.meta.type = FRAME_MSG;
+            room = "private";
+        }
+        stamp[0] = '\0';
+        if (view.meta.type == FRAME_HISTORY) {
+            cursor = _historyCursor(s, view.meta.flags & FRAME_F_ROOM ?
+                                       view.meta.room : 0);
+            if (cursor == NULL || (end = frameDecodeHistory(&view, &id, &when,
+                &view.body, &view.bodyLen)) == -1) {
+                continue;
+            }
+            /* The end of an answer tells where the next page starts. */
+            if (end) {
+                *cursor = id != 0 ? id : HISTORY_START;
+                if (id == 0) {
+                    _showStatus(s, "No earlier messages.");
+                    shown = 1;
+                }
+                continue;
+            }
+            if (*cursor == 0 || id < *cursor) {
+                *cursor = id;
+            }
+            sent = when;
+            strftime(stamp, sizeof stamp, "%H:%M ", localtime(&sent));
+            view.meta.type = FRAME_MSG;
+        }
+        if (view.meta.type != FRAME_MSG ||
+            ((view.meta.flags & FRAME_F_ROOM) &&
+             (room = _roomName(s, view.meta.room)) == NULL)) {
+            continue;
+        }
+        /* Clear the prompt unless a stream is being continued. */
+        if (!shown && s->openStream == 0 && !s->batch) {
+            printf("\r\033[K");
+        }
+        shown = 1;
+        if (view.meta.flags & FRAME_F_STREAM) {
+            if (s->openStream != 0 && s->openStream != view.meta.stream) {
+                putchar('\n');
+            }
+            if (room != NULL && s->openStream != view.meta.stream) {
+                printf("[%s] ", room);
+            }
+            fwrite(view.body, 1, view.bodyLen, stdout);
+            s->openStream = 0;
+            if (view.meta.flags & FRAME_F_MORE) {
+                s->openStream = view.meta.stream;
+            } else {
+                putchar('\n');
+            }
+            continue;
+        }
+        if (s->openStream != 0) {
+            putchar('\n');
+            s->openStream = 0;
+        }
+        if (room != NULL) {
+            printf("[%s] ", room);
+        }
+        fputs(stamp, stdout);
+        fwrite(view.body, 1, view.bodyLen, stdout);
+        putchar('\n');
+    }
+    if (status == -1) {
+        fprintf(stderr, "chatclient: malformed message header\n");
+        return -1;
+    }
+    if (shown && s->openStream == 0) {
+        _showPrompt(s);
+    }
+    fflush(stdout);
+    return 1;
+}
 
 /*******************************************************************************
 * Function: main()
 * Description: Establishes a connection with the server socket specified on the
-*              command line. Exchanges messages in a loop with the server until
-*              the connection is closed or the user enters '\quit'.
+*              command line. Waits on stdin and the socket at the same time, so
+*              that messages are sent as soon as they are typed and received
+*              messages are displayed as soon as they arrive, until the
+*              connection is closed or the user enters '\quit'. A server
+*              that goes silent is pinged, and given up for lost if it does
+*              not answer. In batch mode the handle comes from the command
+*              line, messages are read from stdin or a file as fast as the
+*              socket takes them, and received messages are written out as
+*              plain lines.
 * Parameters: int argc - The command line argument count.
 *             char *argv[] - The string array of command line arguments.
 * Preconditions: None.
@@ -20,39 +809,145 @@
 *******************************************************************************/
 
 int main(int argc, char *argv[]) {
-    int  status, sockfd;
-    char handle[MAX_BYTES];
-    char buffer[MAX_BYTES * 2];
+    static struct chatSession s;
+    struct clientOptions opts;
+    struct pollfd fds[2];
+    int readInput, status, blocked, pending, quitting = 0;
+    ssize_t n;
 
     /* Validate the command line arguments. */
-    validateArgs(argv[1], argv[2], argc);
+    parseClientArgs(argc, argv, &opts);
+    s.batch = opts.batch;
+    s.inputFd = STDIN_FILENO;
+    if (opts.file != NULL && (s.inputFd = open(opts.file, O_RDONLY)) == -1) {
+        perror(opts.file);
+        exit(1);
+    }
+    /* Leave stdin unbuffered so that input typed ahead of the handle stays
+     * in the kernel, where poll() can see it.
+     */
+    setvbuf(stdin, NULL, _IONBF, 0);
     /* Get the user handle and validate it. */
-    createValidatedHandle(handle);
+    if (opts.handle != NULL) {
+        strcpy(s.handle, opts.handle);
+    } else {
+        createValidatedHandle(s.handle);
+    }
     /* Form the socket and connect it to the server. */
-    sockfd = formConnection(argv[1], argv[2]);
-   
-    /* Loop until the user inputs '\quit'. */
-    while(1) { 
-        /* Get a validated user message. If the user input is '\quit', the
-         * return value is 0, so we break out of the loop. */
-        if (createValidatedMsg(handle, buffer, sizeof buffer) == 0) {
+    s.opts = &opts;
+    sendQueueInit(&s.queue, opts.version);
+    replayQueueInit(&s.replay);
+    if (getrandom(&s.sessionId, sizeof s.sessionId, 0) !=
+        sizeof s.sessionId) {
+        s.sessionId = (uint64_t)time(NULL) << 32 ^ getpid();
+    }
+    srand(s.sessionId);
+    if (opts.tls) {
+        if ((s.tls = tlsClientContext(opts.caFile)) == NULL) {
+            fprintf(stderr, "chatclient: TLS: %s\n", tlsError());
+            exit(2);
+        }
+        /* OpenSSL writes with write(), which cannot be told MSG_NOSIGNAL. */
+        signal(SIGPIPE, SIG_IGN);
+    }
+    if (_connect(&s) == -1) {
+        exit(2);
+    }
+    fds[0].fd = s.inputFd;
+    _showPrompt(&s);
+
+    /* Loop until the user inputs '\quit' or the connection is closed. A
+     * resumable session then waits until the server has acknowledged every
+     * message sent.
+     */
+    while (_showReceived(&s) == 1 &&
+           !(quitting && s.replay.numRecs == 0)) {
+        /* While an overlong line is being streamed, or in batch mode, input
+         * is only read once the socket can take it, so that a slow server
+         * slows the input down rather than blocking the loop in send().
+         * Nothing more is read while the window of messages awaiting
+         * acknowledgement is full.
+         */
+        blocked = quitting || s.replay.numRecs >= SEND_WINDOW ||
+                  s.replay.len - s.replay.start > REPLAY_LIMIT;
+        fds[0].events = s.deferInput || blocked ? 0 : POLLIN;
+        fds[1].fd = s.sockfd;
+        fds[1].events = POLLIN | (s.deferInput && !blocked ? POLLOUT : 0);
+        /* Received bytes that TLS holds already do not show on the socket.
+         */
+        pending = tlsPending(s.sockfd);
+        if (poll(fds, 2, pending ? 0 : _keepaliveWait(&s)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        /* Pull in whatever the server has sent; it is displayed at the top
+         * of the loop. If nothing is read, the connection has been broken,
+         * unless TLS took in something other than a message. Either way
+         * the server is alive.
+         */
+        if ((fds[1].revents & POLLIN) || pending) {
+            s.heard = clockMs();
+        }
+        if (((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) || pending) &&
+            ((n = frameReaderFill(&s.reader, s.sockfd)) == 0 ||
+             (n == -1 && errno != EAGAIN))) {
+            if (s.resume && _reconnect(&s) == 0) {
+                continue;
+            }
+            _showStatus(&s, "Server ended connection.");
             break;
         }
-        /* Send the message. */
-        chatSend(sockfd, buffer, strlen(buffer)+1);
-        /* Receive a message from the user. If the return value is 0,
-           the connection has been broken. */
-        if (chatReceive(sockfd, buffer) == 0) {
+        if (_keepalive(&s) == -1) {
+            _showStatus(&s, "Server not responding.");
+            if (s.resume && _reconnect(&s) == 0) {
+                continue;
+            }
+            _showStatus(&s, "Server ended connection.");
             break;
         }
-        /* Print the received message. */
-        printf("%s\n", buffer);
+        readInput = fds[0].revents & (POLLIN | POLLHUP | POLLERR);
+        if (s.deferInput && (fds[1].revents & POLLOUT)) {
+            s.deferInput = 0;
+            readInput = 1;
+        } else if (readInput && (s.input.partial || s.batch) &&
+                   !_socketWritable(s.sockfd)) {
+            s.deferInput = 1;
+            readInput = 0;
+        }
+        /* Send whatever the user has typed. End of input is treated like
+         * '\quit'.
+         */
+        if (readInput) {
+            status = lineBufferRead(&s.input, s.inputFd) <= 0 ? 0
+                                                               : _sendInput(&s);
+            if (status == -1 && _reconnect(&s) == -1) {
+                _showStatus(&s, "Server ended connection.");
+                break;
+            }
+            if (status == 0) {
+                if (!s.resume) {
+                    break;
+                }
+                quitting = 1;
+            }
+        }
     }
     /* Close the socket. */
-    close(sockfd); 
-    printf("Socket closed. Exiting chatclient.\n");
+    frameReaderFree(&s.reader);
+    frameDecompressorFree(&s.unzip);
+    replayQueueFree(&s.replay);
+    tlsClose(s.sockfd);
+    close(s.sockfd);
+    if (s.tls != NULL) {
+        SSL_SESSION_free(s.ticket);
+        SSL_CTX_free(s.tls);
+    }
+    if (!s.batch) {
+        printf("\nSocket closed. Exiting chatclient.\n");
+    }
 
     return 0;
 }
-
-
@@ -0,0 +1,150 @@
+/*******************************************************************************
+*      Filename: chatserver.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The main chatserver method file. chatserver is a native
+*                replacement for chatserve that serves many clients at once,
+*                optionally on several threads.
+*******************************************************************************/
+
+#include "server.h"
+
+/*******************************************************************************
+* Function: _sigintHandler()
+* Description: Upon receiving a SIGINT, asks the server loop to return so that
+*              the server can shut down cleanly.
+* Parameters: int sig - The signal number (unused).
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _sigintHandler(int sig) {
+    (void)sig;
+    serverStop();
+}
+
+/*******************************************************************************
+* Function: main()
+* Description: Validates the command line, initializes the server on the
+*              requested port with the requested number of threads, I/O
+*              engine, slow-client policy, keepalive interval, message log
+*              and TLS certificate, and runs the server until interrupted,
+*              then reports on its output queues, the system calls that its
+*              event loops made and the memory chunks its pools took.
+* Parameters: int argc - The command line argument count.
+*             char *argv[] - The string array of command line arguments.
+* Preconditions: None.
+* Returns: 0 on success. Positive integers on failure.
+*******************************************************************************/
+
+int main(int argc, char *argv[]) {
+    struct chatServer srv;
+    struct sigaction sa;
+    int opt, quiet = 0, threads = 1, engine = ENGINE_EPOLL;
+    int slowPolicy = SLOW_DISCONNECT, idle = KEEPALIVE_IDLE;
+    char *logDir = NULL, *certFile = NULL, *keyFile = NULL;
+    SSL_CTX *tls = NULL;
+
+    while ((opt = getopt(argc, argv, "qj:e:P:i:l:C:K:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = 1;
+            break;
+        case 'j':
+            /* 0 runs one thread on each CPU. */
+            if ((threads = atoi(optarg)) < 0 || !isdigit(*optarg)) {
+                fprintf(stderr, SERVER_USAGE);
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                engine = ENGINE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, SERVER_USAGE);
+                exit(1);
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "disconnect") == 0) {
+                slowPolicy = SLOW_DISCONNECT;
+            } else if (strcmp(optarg, "drop") == 0) {
+                slowPolicy = SLOW_DROP;
+            } else if (strcmp(optarg, "coalesce") == 0) {
+                slowPolicy = SLOW_COALESCE;
+            } else {
+                fprintf(stderr, SERVER_USAGE);
+                exit(1);
+            }
+            break;
+        case 'i':
+            /* 0 pings no client. */
+            if ((idle = atoi(optarg)) < 0 || !isdigit(*optarg)) {
+                fprintf(stderr, SERVER_USAGE);
+                exit(1);
+            }
+            break;
+        case 'l':
+            logDir = optarg;
+            break;
+        case 'C':
+            certFile = optarg;
+            break;
+        case 'K':
+            keyFile = optarg;
+            break;
+        default:
+            fprintf(stderr, SERVER_USAGE);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || (certFile == NULL) != (keyFile == NULL)) {
+        fprintf(stderr, SERVER_USAGE);
+        exit(1);
+    }
+    validatePort(argv[optind]);
+    /* TLS records are read and written by OpenSSL, on the socket. */
+    if (certFile != NULL && engine == ENGINE_URING) {
+        fprintf(stderr, "chatserver: TLS needs the epoll engine\n");
+        exit(1);
+    }
+    if (certFile != NULL &&
+        (tls = tlsServerContext(certFile, keyFile)) == NULL) {
+        fprintf(stderr, "chatserver: TLS: %s\n", tlsError());
+        exit(2);
+    }
+
+    /* Install the SIGINT handler without SA_RESTART so that epoll_wait()
+     * returns promptly, and never die on writes to a closed socket.
+     */
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = _sigintHandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (serverInit(&srv, argv[optind], quiet, threads, engine, slowPolicy,
+                   idle, logDir, tls) == -1) {
+        SSL_CTX_free(tls);
+        fprintf(stderr, "chatserver: failed to start\n");
+        exit(2);
+    }
+    if (srv.numShards > 1) {
+        printf("Server listening on port %s with %d threads...\n",
+               argv[optind], srv.numShards);
+    } else {
+        printf("Server listening on port %s...\n", argv[optind]);
+    }
+    fflush(stdout);
+
+    serverLoop(&srv);
+    printf("\n");
+    serverQueueReport(&srv);
+    serverShutdown(&srv);
+    printf("Exiting chatserver after %lu system calls and %lu chunks...\n",
+           srv.syscalls, slabChunks());
+
+    return 0;
+}
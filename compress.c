@@ -0,0 +1,187 @@
+/*******************************************************************************
+*      Filename: compress.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides compression of version 2 frame payloads for
+*                connections that negotiate FEAT_COMPRESS. Each direction of
+*                a connection is one zlib stream, flushed at the end of every
+*                frame, so that a message can refer back to the ones before
+*                it: a handle or phrase that recurs costs a few bits rather
+*                than its length. The empty block that ends every flush is
+*                left off the wire and put back by the receiver. Chat
+*                messages are mostly too short to compress on their own, so
+*                both ends preset the stream with a dictionary of common
+*                chat text, and even the first message has something to
+*                refer to.
+*******************************************************************************/
+
+#include "compress.h"
+
+/* The preset dictionary, built from the words and phrases most common in
+ * chat, with the most common last, where they are cheapest to refer to.
+ * Changing it changes its zlib id, so a peer with another dictionary fails
+ * on the first compressed frame rather than showing garbage.
+ */
+static const char compressDict[] =
+    "http://https://www.github.com/.com/.org/ :) :( :D ;) xD lol lmao "
+    "haha hahaha brb afk btw imo imho tbh idk np ty thx pls omg wtf gg "
+    "thanks thank you! sorry please welcome morning afternoon evening "
+    "tonight tomorrow yesterday today weekend monday friday meeting "
+    "message server client channel room email phone issue ticket error "
+    "problem question answer update release version build deploy test "
+    "commit branch merge review change fix bug code file work team "
+    "project people someone something anything everything nothing "
+    "because about after again before could would should there their "
+    "these those where which while other every never always still "
+    "maybe really actually probably already though think thought know "
+    "going doing getting looking working trying saying make take give "
+    "want need like just right well good great nice cool sure okay "
+    "yeah yes no not but and the that this with have from what when "
+    "will your they them then than into also only some more much very "
+    "back time here how why who did does done was were been being "
+    "can't don't didn't doesn't isn't won't I'm I'll I've it's that's "
+    "what's let's you're we're they're there's "
+    "Hi Hey Hello hi hey hello ok OK Ok ? ! . , "
+    "> hi > hey > ok > yes > no > I > the > it > what > is > so > lol > ";
+
+/*******************************************************************************
+* Function: frameCompress()
+* Description: Compresses a frame payload as the next part of a connection's
+*              stream.
+* Parameters: struct frameCompressor *c - The stream.
+*             const char *payload - The payload.
+*             size_t len - Its length, at most COMPRESS_MAX.
+*             char *out - At least COMPRESS_OUT_SIZE bytes. Filled in with
+*                         the compressed payload.
+* Preconditions: None.
+* Returns: The length of the compressed payload, or -1 on failure, after
+*          which the stream is unusable.
+*******************************************************************************/
+
+int frameCompress(struct frameCompressor *c, const char *payload, size_t len,
+                  char *out) {
+    z_stream *z = &c->strm;
+    size_t n;
+
+    if (!c->open) {
+        memset(z, 0, sizeof *z);
+        if (deflateInit2(z, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_WINDOW,
+                         COMPRESS_MEM_LEVEL, COMPRESS_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        c->open = 1;
+        if (deflateSetDictionary(z, (const Bytef *)compressDict,
+                                 sizeof compressDict - 1) != Z_OK) {
+            return -1;
+        }
+    }
+    z->next_in = (Bytef *)payload;
+    z->avail_in = len;
+    z->next_out = (Bytef *)out;
+    z->avail_out = COMPRESS_OUT_SIZE;
+    /* A flush that fills the output may not be complete. */
+    if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in != 0 ||
+        z->avail_out == 0) {
+        return -1;
+    }
+    n = (char *)z->next_out - out;
+    if (n < COMPRESS_TAIL_LEN ||
+        memcmp(out + n - COMPRESS_TAIL_LEN, COMPRESS_TAIL,
+               COMPRESS_TAIL_LEN) != 0 ||
+        n - COMPRESS_TAIL_LEN > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    return n - COMPRESS_TAIL_LEN;
+}
+
+/*******************************************************************************
+* Function: frameCompressorFree()
+* Description: Releases the state of a compressed stream, leaving it ready
+*              to open a new one.
+* Parameters: struct frameCompressor *c - The stream.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void frameCompressorFree(struct frameCompressor *c) {
+    if (c->open) {
+        deflateEnd(&c->strm);
+        c->open = 0;
+    }
+}
+
+/*******************************************************************************
+* Function: frameDecompress()
+* Description: Decompresses the payload of a frame received with
+*              FRAME_F_COMPRESSED as the next part of a connection's stream,
+*              and points the frame's body at the result. The flag is
+*              cleared, so the frame is then handled like any other.
+* Parameters: struct frameDecompressor *d - The stream.
+*             struct frameView *view - The frame.
+*             char *out - At least FRAME_MAX_PAYLOAD + 1 bytes. Filled in
+*                         with the payload.
+* Preconditions: None.
+* Returns: 0 on success, or -1 if the payload is corrupt, was compressed
+*          with another dictionary, or exceeds FRAME_MAX_PAYLOAD, after which
+*          the stream is unusable.
+*******************************************************************************/
+
+int frameDecompress(struct frameDecompressor *d, struct frameView *view,
+                    char *out) {
+    z_stream *z = &d->strm;
+    int status, i;
+
+    if (!d->open) {
+        memset(z, 0, sizeof *z);
+        if (inflateInit2(z, COMPRESS_WINDOW) != Z_OK) {
+            return -1;
+        }
+        d->open = 1;
+    }
+    z->next_out = (Bytef *)out;
+    /* One byte of slack tells a payload of exactly the limit from one
+     * that exceeds it.
+     */
+    z->avail_out = FRAME_MAX_PAYLOAD + 1;
+    for (i = 0; i < 2; i++) {
+        z->next_in = (Bytef *)(i == 0 ? view->body : COMPRESS_TAIL);
+        z->avail_in = i == 0 ? view->bodyLen : COMPRESS_TAIL_LEN;
+        while (z->avail_in > 0) {
+            if (z->avail_out == 0) {
+                return -1;
+            }
+            status = inflate(z, Z_SYNC_FLUSH);
+            if (status == Z_NEED_DICT) {
+                if (inflateSetDictionary(z, (const Bytef *)compressDict,
+                                         sizeof compressDict - 1) != Z_OK) {
+                    return -1;
+                }
+            } else if (status != Z_OK) {
+                return -1;
+            }
+        }
+    }
+    if ((char *)z->next_out - out > FRAME_MAX_PAYLOAD) {
+        return -1;
+    }
+    view->body = out;
+    view->bodyLen = (char *)z->next_out - out;
+    view->meta.flags &= ~FRAME_F_COMPRESSED;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameDecompressorFree()
+* Description: Releases the state of a compressed stream, leaving it ready
+*              to open a new one.
+* Parameters: struct frameDecompressor *d - The stream.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void frameDecompressorFree(struct frameDecompressor *d) {
+    if (d->open) {
+        inflateEnd(&d->strm);
+        d->open = 0;
+    }
+}
@@ -0,0 +1,58 @@
+/*******************************************************************************
+*      Filename: compress.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for compress.c. Please see compress.c for
+*                more details.
+*******************************************************************************/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "frame.h"
+
+#define COMPRESS_LEVEL      1       /* Frames are too short for a deeper
+                                     * search to find more. */
+#define COMPRESS_STRATEGY   Z_FIXED /* Building Huffman tables for every
+                                     * frame costs more time than it saves
+                                     * bytes. */
+#define COMPRESS_WINDOW     12      /* Log2 of the window, which holds the
+                                     * dictionary and then the latest 4 KiB
+                                     * of messages. */
+#define COMPRESS_MEM_LEVEL  5       /* Deflate state kept per connection:
+                                     * 16 KiB of window and 16 KiB of hash
+                                     * tables. */
+#define COMPRESS_MAX        (FRAME_MAX_PAYLOAD - 1024)  /* Longest payload
+                                     * compressed. Longer ones are sent as
+                                     * they are, so that a compressed
+                                     * payload never exceeds the limit. */
+#define COMPRESS_TAIL       "\x00\x00\xff\xff"  /* The end of every flush,
+                                     * left off the wire. */
+#define COMPRESS_TAIL_LEN   4
+#define COMPRESS_OUT_SIZE   (FRAME_MAX_PAYLOAD + COMPRESS_TAIL_LEN)  /* The
+                                     * space frameCompress() writes to. */
+
+/* One direction of a connection's compressed frames. The stream is opened
+ * by the first frame, so a zeroed structure is ready to use.
+ */
+struct frameCompressor {
+    z_stream strm;
+    int      open;
+};
+
+struct frameDecompressor {
+    z_stream strm;
+    int      open;
+};
+
+int frameCompress(struct frameCompressor *, const char *, size_t, char *);
+void frameCompressorFree(struct frameCompressor *);
+int frameDecompress(struct frameDecompressor *, struct frameView *, char *);
+void frameDecompressorFree(struct frameDecompressor *);
+
+#endif
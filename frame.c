@@ -0,0 +1,807 @@
+/*******************************************************************************
+*      Filename: frame.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides the chat frame codec and a buffered reader for it.
+*                Each fill pulls everything the socket has available in a
+*                single readv() into a per-connection ring buffer, after which
+*                any number of complete frames can be decoded without further
+*                system calls. Both the three digit text framing (version 1)
+*                and the binary framing (version 2) are understood.
+*******************************************************************************/
+
+#include "frame.h"
+
+/* The header extensions, in the order in which they follow the base header,
+ * and the frameMeta field that each one carries.
+ */
+static const struct {
+    int    flag;
+    size_t offset;
+} frameExts[FRAME_EXT_COUNT] = {
+    { FRAME_F_STREAM, offsetof(struct frameMeta, stream) },
+    { FRAME_F_SEQ,    offsetof(struct frameMeta, seq) },
+    { FRAME_F_ACK,    offsetof(struct frameMeta, ack) },
+    { FRAME_F_ROOM,   offsetof(struct frameMeta, room) }
+};
+
+/*******************************************************************************
+* Function: _put32()
+* Description: Stores a 32-bit value in big-endian byte order.
+* Parameters: char *p - The destination.
+*             uint32_t value - The value.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _put32(char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/*******************************************************************************
+* Function: _get32()
+* Description: Loads a 32-bit big-endian value.
+* Parameters: const char *p - The source.
+* Preconditions: None.
+* Returns: The value.
+*******************************************************************************/
+
+static uint32_t _get32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 |
+           (uint32_t)u[2] << 8 | u[3];
+}
+
+/*******************************************************************************
+* Function: frameReaderInit()
+* Description: Allocates the ring buffer of a frame reader.
+* Parameters: struct frameReader *fr - The reader to initialize.
+*             int version - The protocol version the peer speaks, or 0 to
+*                           detect it from the first bytes received.
+* Preconditions: None.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+int frameReaderInit(struct frameReader *fr, int version) {
+    fr->cap = FRAME_READER_SIZE;
+    fr->head = fr->tail = 0;
+    fr->version = version;
+    fr->scratch = NULL;
+    if ((fr->buf = slabAlloc(fr->cap)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameReaderFree()
+* Description: Releases the buffers of a frame reader.
+* Parameters: struct frameReader *fr - The reader.
+* Preconditions: frameReaderInit() succeeded.
+* Returns: None.
+*******************************************************************************/
+
+void frameReaderFree(struct frameReader *fr) {
+    slabFree(fr->buf);
+    slabFree(fr->scratch);
+    fr->buf = fr->scratch = NULL;
+}
+
+/*******************************************************************************
+* Function: frameReaderFill()
+* Description: Reads as many bytes as fit in the free space of the ring. When
+*              the free space wraps around the end of the buffer, both pieces
+*              are filled by the same call, which is readv() unless the
+*              descriptor is a TLS socket.
+* Parameters: struct frameReader *fr - The reader.
+*             int fd - The descriptor to read from.
+* Preconditions: The reader has been initialized.
+* Returns: The result of tlsReadv(): the byte count, 0 on end of file, or
+*          -1. If the ring is full, -1 is returned with errno set to
+*          ENOBUFS.
+*******************************************************************************/
+
+ssize_t frameReaderFill(struct frameReader *fr, int fd) {
+    struct iovec iov[2];
+    unsigned used = fr->tail - fr->head;
+    unsigned start = fr->tail & (fr->cap - 1);
+    unsigned space = fr->cap - used;
+    ssize_t status;
+    int iovcnt = 1;
+
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    iov[0].iov_base = fr->buf + start;
+    iov[0].iov_len = space;
+    if (start + space > fr->cap) {
+        iov[0].iov_len = fr->cap - start;
+        iov[1].iov_base = fr->buf;
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+    do {
+        status = tlsReadv(fd, iov, iovcnt);
+    } while (status == -1 && errno == EINTR);
+
+    if (status > 0) {
+        fr->tail += status;
+    }
+    return status;
+}
+
+/*******************************************************************************
+* Function: frameReaderFeed()
+* Description: Copies bytes received by other means, such as a completion
+*              of io_uring, into as much of the free space of the ring as
+*              they fill.
+* Parameters: struct frameReader *fr - The reader.
+*             const char *data - The bytes.
+*             size_t len - The number of bytes.
+* Preconditions: The reader has been initialized.
+* Returns: The number of bytes copied, less than len if the ring is full.
+*******************************************************************************/
+
+size_t frameReaderFeed(struct frameReader *fr, const char *data, size_t len) {
+    unsigned start = fr->tail & (fr->cap - 1);
+    unsigned space = fr->cap - (fr->tail - fr->head);
+    unsigned first;
+
+    if (len > space) {
+        len = space;
+    }
+    first = fr->cap - start;
+    if (first >= len) {
+        memcpy(fr->buf + start, data, len);
+    } else {
+        memcpy(fr->buf + start, data, first);
+        memcpy(fr->buf, data + first, len - first);
+    }
+    fr->tail += len;
+    return len;
+}
+
+/*******************************************************************************
+* Function: _ringCopy()
+* Description: Copies bytes out of the ring starting at a logical offset.
+* Parameters: struct frameReader *fr - The reader.
+*             unsigned offset - The logical offset of the first byte.
+*             char *dst - The destination.
+*             unsigned len - The number of bytes to copy.
+* Preconditions: The bytes are buffered.
+* Returns: None.
+*******************************************************************************/
+
+static void _ringCopy(struct frameReader *fr, unsigned offset, char *dst,
+                      unsigned len) {
+    unsigned start = offset & (fr->cap - 1);
+    unsigned first = fr->cap - start;
+
+    if (first >= len) {
+        memcpy(dst, fr->buf + start, len);
+    } else {
+        memcpy(dst, fr->buf + start, first);
+        memcpy(dst + first, fr->buf, len - first);
+    }
+}
+
+/*******************************************************************************
+* Function: _readerGrow()
+* Description: Enlarges the ring so that it can hold a frame of the given
+*              size. The buffered bytes are moved to the start of the new ring.
+* Parameters: struct frameReader *fr - The reader.
+*             unsigned need - The number of bytes the ring must hold.
+* Preconditions: need is at most FRAME_READER_MAX.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _readerGrow(struct frameReader *fr, unsigned need) {
+    unsigned used = fr->tail - fr->head;
+    unsigned newCap = fr->cap;
+    char *newBuf;
+
+    while (newCap < need) {
+        newCap *= 2;
+    }
+    if ((newBuf = slabAlloc(newCap)) == NULL) {
+        return -1;
+    }
+    _ringCopy(fr, fr->head, newBuf, used);
+    slabFree(fr->buf);
+    slabFree(fr->scratch);
+    fr->scratch = NULL;
+    fr->buf = newBuf;
+    fr->cap = newCap;
+    fr->head = 0;
+    fr->tail = used;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _detectVersion()
+* Description: Determines the peer's protocol version from the first bytes it
+*              sent. A leading digit means version 1; FRAME_PREAMBLE means
+*              version 2, in which case the preamble is consumed.
+* Parameters: struct frameReader *fr - The reader.
+* Preconditions: At least one byte is buffered.
+* Returns: 1 once the version is known, 0 if more bytes are needed, and -1
+*          if the bytes match neither version.
+*******************************************************************************/
+
+static int _detectVersion(struct frameReader *fr) {
+    char preamble[FRAME_PREAMBLE_LEN];
+    unsigned used = fr->tail - fr->head;
+    unsigned len = used < FRAME_PREAMBLE_LEN ? used : FRAME_PREAMBLE_LEN;
+
+    _ringCopy(fr, fr->head, preamble, len);
+    if (isdigit((unsigned char)preamble[0])) {
+        fr->version = FRAME_V1;
+        return 1;
+    }
+    if (memcmp(preamble, FRAME_PREAMBLE, len) != 0) {
+        return -1;
+    }
+    if (len < FRAME_PREAMBLE_LEN) {
+        return 0;
+    }
+    fr->head += FRAME_PREAMBLE_LEN;
+    fr->version = FRAME_V2;
+    return 1;
+}
+
+/*******************************************************************************
+* Function: _parseHeader()
+* Description: Decodes the header at the head of the ring, including any
+*              extensions that its flags announce.
+* Parameters: struct frameReader *fr - The reader.
+*             struct frameView *view - Receives the header fields.
+*             unsigned *headerLen - Set to the length of the header.
+*             unsigned *frameLen - Set to the length of the whole frame.
+* Preconditions: The version is known.
+* Returns: 1 if the header was decoded, 0 if more bytes are needed, and -1
+*          if the header is invalid.
+*******************************************************************************/
+
+static int _parseHeader(struct frameReader *fr, struct frameView *view,
+                        unsigned *headerLen, unsigned *frameLen) {
+    char header[FRAME_MAX_HEADER];
+    unsigned used = fr->tail - fr->head;
+    uint32_t payloadLen = 0;
+    char *meta = (char *)&view->meta;
+    int i;
+
+    if (fr->version == FRAME_V1) {
+        if (used < PREFIX_OFFSET) {
+            return 0;
+        }
+        _ringCopy(fr, fr->head, header, PREFIX_OFFSET);
+        for (i = 0; i < PREFIX_OFFSET; i++) {
+            if (!isdigit((unsigned char)header[i])) {
+                return -1;
+            }
+            payloadLen = payloadLen * 10 + (header[i] - '0');
+        }
+        if (payloadLen < 1 || payloadLen > MAX_BYTES - PREFIX_OFFSET) {
+            return -1;
+        }
+        view->meta.type = FRAME_MSG;
+        view->meta.flags = 0;
+        *headerLen = PREFIX_OFFSET;
+    } else {
+        if (used < FRAME_V2_HEADER) {
+            return 0;
+        }
+        _ringCopy(fr, fr->head, header, FRAME_V2_HEADER);
+        if ((payloadLen = _get32(header)) > FRAME_MAX_PAYLOAD) {
+            return -1;
+        }
+        view->meta.type = (unsigned char)header[4];
+        view->meta.flags = (unsigned char)header[5];
+        *headerLen = FRAME_V2_HEADER;
+        /* Decode the extensions announced by the flags. */
+        for (i = 0; i < FRAME_EXT_COUNT; i++) {
+            if (!(view->meta.flags & frameExts[i].flag)) {
+                continue;
+            }
+            if (used < *headerLen + 4) {
+                return 0;
+            }
+            _ringCopy(fr, fr->head + *headerLen, header, 4);
+            *(uint32_t *)(meta + frameExts[i].offset) = _get32(header);
+            *headerLen += 4;
+        }
+    }
+    *frameLen = *headerLen + payloadLen;
+    return 1;
+}
+
+/*******************************************************************************
+* Function: frameReaderNext()
+* Description: Decodes the next complete frame in the ring. The frame is
+*              returned in place when it is contiguous in the ring and is
+*              copied to the scratch buffer only when it wraps around the end.
+*              The ring grows when a frame larger than it is announced.
+* Parameters: struct frameReader *fr - The reader.
+*             struct frameView *view - Set to the frame on success.
+* Preconditions: The reader has been initialized.
+* Returns: 1 if a frame was decoded, 0 if no complete frame is buffered, and
+*          -1 if the buffered bytes are not a valid frame. The view remains
+*          valid until the next call to frameReaderNext() or
+*          frameReaderFill().
+*******************************************************************************/
+
+int frameReaderNext(struct frameReader *fr, struct frameView *view) {
+    unsigned start, headerLen, frameLen;
+    int status;
+
+    if (fr->tail == fr->head) {
+        return 0;
+    }
+    if (fr->version == 0 && (status = _detectVersion(fr)) <= 0) {
+        return status;
+    }
+    if ((status = _parseHeader(fr, view, &headerLen, &frameLen)) <= 0) {
+        return status;
+    }
+    if (frameLen > fr->cap && _readerGrow(fr, frameLen) == -1) {
+        return -1;
+    }
+    if (fr->tail - fr->head < frameLen) {
+        return 0;
+    }
+
+    start = fr->head & (fr->cap - 1);
+    if (start + frameLen <= fr->cap) {
+        view->frame = fr->buf + start;
+    } else {
+        if (fr->scratch == NULL && (fr->scratch = slabAlloc(fr->cap)) == NULL) {
+            return -1;
+        }
+        _ringCopy(fr, fr->head, fr->scratch, frameLen);
+        view->frame = fr->scratch;
+    }
+    fr->head += frameLen;
+
+    view->frameLen = frameLen;
+    view->body = view->frame + headerLen;
+    view->bodyLen = frameLen - headerLen;
+    /* Version 1 bodies include a terminator. Enforce it rather than
+     * trusting the peer.
+     */
+    if (fr->version == FRAME_V1) {
+        view->bodyLen--;
+        view->body[view->bodyLen] = '\0';
+    }
+    return 1;
+}
+
+/*******************************************************************************
+* Function: frameEncodeHeader()
+* Description: Formats the header of a frame, including any extensions that
+*              its flags announce. Version 1 frames must be followed by the
+*              payload and a null terminator; version 2 frames by the payload
+*              alone.
+* Parameters: char *header - At least FRAME_MAX_HEADER bytes.
+*             int version - The protocol version.
+*             const struct frameMeta *meta - The header fields. Ignored for
+*                                            version 1.
+*             size_t payloadLen - The payload length without any terminator.
+* Preconditions: The payload fits the version's limits.
+* Returns: The length of the header.
+*******************************************************************************/
+
+int frameEncodeHeader(char *header, int version, const struct frameMeta *meta,
+                      size_t payloadLen) {
+    const char *fields = (const char *)meta;
+    int headerLen = FRAME_V2_HEADER, i;
+
+    if (version == FRAME_V1) {
+        payloadLen++;
+        header[0] = '0' + payloadLen / 100;
+        header[1] = '0' + payloadLen / 10 % 10;
+        header[2] = '0' + payloadLen % 10;
+        return PREFIX_OFFSET;
+    }
+    _put32(header, payloadLen);
+    header[4] = meta->type;
+    header[5] = meta->flags;
+    for (i = 0; i < FRAME_EXT_COUNT; i++) {
+        if (meta->flags & frameExts[i].flag) {
+            _put32(header + headerLen,
+                   *(const uint32_t *)(fields + frameExts[i].offset));
+            headerLen += 4;
+        }
+    }
+    return headerLen;
+}
+
+/*******************************************************************************
+* Function: frameEncodeHello()
+* Description: Formats a complete HELLO frame offering or accepting version 2
+*              and a set of features.
+* Parameters: char *frame - At least FRAME_V2_HEADER + FRAME_HELLO_LEN bytes.
+*             unsigned features - The feature mask.
+* Preconditions: None.
+* Returns: The length of the frame.
+*******************************************************************************/
+
+int frameEncodeHello(char *frame, unsigned features) {
+    struct frameMeta meta = { FRAME_HELLO, 0, 0, 0, 0, 0 };
+    char *payload = frame + frameEncodeHeader(frame, FRAME_V2, &meta,
+                                              FRAME_HELLO_LEN);
+
+    payload[0] = FRAME_V2;
+    payload[1] = 0;
+    payload[2] = features >> 8;
+    payload[3] = features;
+    return FRAME_V2_HEADER + FRAME_HELLO_LEN;
+}
+
+/*******************************************************************************
+* Function: frameDecodeHello()
+* Description: Decodes a HELLO frame.
+* Parameters: struct frameView *view - The HELLO frame.
+*             unsigned *features - Set to the feature mask.
+* Preconditions: view->meta.type is FRAME_HELLO.
+* Returns: The version offered, or -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodeHello(struct frameView *view, unsigned *features) {
+    const unsigned char *p = (const unsigned char *)view->body;
+
+    if (view->bodyLen < FRAME_HELLO_LEN) {
+        return -1;
+    }
+    *features = (unsigned)p[2] << 8 | p[3];
+    return p[0];
+}
+
+/*******************************************************************************
+* Function: frameEncodeSession()
+* Description: Formats a complete SESSION frame.
+* Parameters: char *frame - At least FRAME_V2_HEADER + FRAME_SESSION_ID +
+*                           MAX_HANDLE_LEN bytes.
+*             uint64_t id - The session id.
+*             const char *handle - The validated handle.
+* Preconditions: None.
+* Returns: The length of the frame.
+*******************************************************************************/
+
+int frameEncodeSession(char *frame, uint64_t id, const char *handle) {
+    struct frameMeta meta = { FRAME_SESSION, 0, 0, 0, 0, 0 };
+    size_t handleLen = strlen(handle);
+    char *payload = frame + frameEncodeHeader(frame, FRAME_V2, &meta,
+                                              FRAME_SESSION_ID + handleLen);
+
+    _put32(payload, id >> 32);
+    _put32(payload + 4, id);
+    memcpy(payload + FRAME_SESSION_ID, handle, handleLen);
+    return FRAME_V2_HEADER + FRAME_SESSION_ID + handleLen;
+}
+
+/*******************************************************************************
+* Function: frameDecodeSession()
+* Description: Decodes a SESSION frame.
+* Parameters: struct frameView *view - The SESSION frame.
+*             uint64_t *id - Set to the session id.
+*             char *handle - At least MAX_HANDLE_LEN + 1 bytes. Set to the
+*                            null terminated handle.
+* Preconditions: view->meta.type is FRAME_SESSION.
+* Returns: 0 on success, -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodeSession(struct frameView *view, uint64_t *id, char *handle) {
+    int handleLen = view->bodyLen - FRAME_SESSION_ID;
+    int i;
+
+    if (handleLen < 1 || handleLen > MAX_HANDLE_LEN) {
+        return -1;
+    }
+    for (i = 0; i < handleLen; i++) {
+        handle[i] = view->body[FRAME_SESSION_ID + i];
+        if (!isalnum((unsigned char)handle[i]) && handle[i] != '_') {
+            return -1;
+        }
+    }
+    handle[handleLen] = '\0';
+    *id = (uint64_t)_get32(view->body) << 32 | _get32(view->body + 4);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameEncodeAck()
+* Description: Formats a complete ACK frame.
+* Parameters: char *frame - At least FRAME_V2_HEADER + FRAME_ACK_LEN bytes.
+*             uint32_t seq - The highest sequence number received.
+* Preconditions: None.
+* Returns: The length of the frame.
+*******************************************************************************/
+
+int frameEncodeAck(char *frame, uint32_t seq) {
+    struct frameMeta meta = { FRAME_ACK, 0, 0, 0, 0, 0 };
+
+    frameEncodeHeader(frame, FRAME_V2, &meta, FRAME_ACK_LEN);
+    _put32(frame + FRAME_V2_HEADER, seq);
+    return FRAME_V2_HEADER + FRAME_ACK_LEN;
+}
+
+/*******************************************************************************
+* Function: frameDecodeAck()
+* Description: Decodes an ACK frame.
+* Parameters: struct frameView *view - The ACK frame.
+*             uint32_t *seq - Set to the acknowledged sequence number.
+* Preconditions: view->meta.type is FRAME_ACK.
+* Returns: 0 on success, -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodeAck(struct frameView *view, uint32_t *seq) {
+    if (view->bodyLen < FRAME_ACK_LEN) {
+        return -1;
+    }
+    *seq = _get32(view->body);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameEncodePing()
+* Description: Formats a complete PING frame, or the PONG frame that answers
+*              one.
+* Parameters: char *frame - At least FRAME_V2_HEADER + FRAME_PING_LEN bytes.
+*             int type - FRAME_PING or FRAME_PONG.
+*             uint64_t token - The sender's token for a PING, or the token
+*                              of the PING answered for a PONG.
+* Preconditions: None.
+* Returns: The length of the frame.
+*******************************************************************************/
+
+int frameEncodePing(char *frame, int type, uint64_t token) {
+    struct frameMeta meta = { type, 0, 0, 0, 0, 0 };
+
+    frameEncodeHeader(frame, FRAME_V2, &meta, FRAME_PING_LEN);
+    _put32(frame + FRAME_V2_HEADER, token >> 32);
+    _put32(frame + FRAME_V2_HEADER + 4, token);
+    return FRAME_V2_HEADER + FRAME_PING_LEN;
+}
+
+/*******************************************************************************
+* Function: frameDecodePing()
+* Description: Decodes a PING or PONG frame.
+* Parameters: struct frameView *view - The frame.
+*             uint64_t *token - Set to its token.
+* Preconditions: view->meta.type is FRAME_PING or FRAME_PONG.
+* Returns: 0 on success, -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodePing(struct frameView *view, uint64_t *token) {
+    if (view->bodyLen < FRAME_PING_LEN) {
+        return -1;
+    }
+    *token = (uint64_t)_get32(view->body) << 32 | _get32(view->body + 4);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameEncodeRoom()
+* Description: Formats a complete JOIN or PART frame naming a room, with the
+*              room's id if it has one.
+* Parameters: char *frame - At least FRAME_MAX_HEADER + FRAME_ROOM_NAME_MAX
+*                           bytes.
+*             int type - FRAME_JOIN or FRAME_PART.
+*             uint32_t room - The room id, or 0 for none.
+*             const char *name - The validated room name.
+* Preconditions: None.
+* Returns: The length of the frame.
+*******************************************************************************/
+
+int frameEncodeRoom(char *frame, int type, uint32_t room, const char *name) {
+    struct frameMeta meta = { type, room ? FRAME_F_ROOM : 0, 0, 0, 0, room };
+    size_t nameLen = strlen(name);
+    int headerLen = frameEncodeHeader(frame, FRAME_V2, &meta, nameLen);
+
+    memcpy(frame + headerLen, name, nameLen);
+    return headerLen + nameLen;
+}
+
+/*******************************************************************************
+* Function: frameDecodeRoom()
+* Description: Decodes the room name of a JOIN or PART frame.
+* Parameters: struct frameView *view - The JOIN or PART frame.
+*             char *name - At least FRAME_ROOM_NAME_MAX + 1 bytes. Set to the
+*                          null terminated room name.
+* Preconditions: view->meta.type is FRAME_JOIN or FRAME_PART.
+* Returns: 0 on success, -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodeRoom(struct frameView *view, char *name) {
+    int i;
+
+    if (view->bodyLen < 1 || view->bodyLen > FRAME_ROOM_NAME_MAX) {
+        return -1;
+    }
+    for (i = 0; i < view->bodyLen; i++) {
+        name[i] = view->body[i];
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_' &&
+            name[i] != '-') {
+            return -1;
+        }
+    }
+    name[view->bodyLen] = '\0';
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameEncodeDirect()
+* Description: Formats the handle that starts a DIRECT payload. The message,
+*              if any, follows it.
+* Parameters: char *payload - At least 1 + MAX_HANDLE_LEN bytes.
+*             const char *handle - The validated handle.
+* Preconditions: None.
+* Returns: The length of the formatted handle.
+*******************************************************************************/
+
+int frameEncodeDirect(char *payload, const char *handle) {
+    size_t handleLen = strlen(handle);
+
+    payload[0] = handleLen;
+    memcpy(payload + 1, handle, handleLen);
+    return 1 + handleLen;
+}
+
+/*******************************************************************************
+* Function: frameDecodeDirect()
+* Description: Decodes a DIRECT frame.
+* Parameters: struct frameView *view - The DIRECT frame.
+*             char *handle - At least MAX_HANDLE_LEN + 1 bytes. Set to the
+*                            null terminated handle.
+*             char **text - Set to the message within the frame.
+*             int *textLen - Set to the length of the message, which may be
+*                            0.
+* Preconditions: view->meta.type is FRAME_DIRECT.
+* Returns: 0 on success, -1 if the payload is malformed or the message is
+*          longer than FRAME_DIRECT_MAX.
+*******************************************************************************/
+
+int frameDecodeDirect(struct frameView *view, char *handle, char **text,
+                      int *textLen) {
+    int handleLen, i;
+
+    if (view->bodyLen < 1) {
+        return -1;
+    }
+    handleLen = (unsigned char)view->body[0];
+    if (handleLen < 1 || handleLen > MAX_HANDLE_LEN ||
+        view->bodyLen - 1 - handleLen < 0 ||
+        view->bodyLen - 1 - handleLen > FRAME_DIRECT_MAX) {
+        return -1;
+    }
+    for (i = 0; i < handleLen; i++) {
+        handle[i] = view->body[1 + i];
+        if (!isalnum((unsigned char)handle[i]) && handle[i] != '_') {
+            return -1;
+        }
+    }
+    handle[handleLen] = '\0';
+    *text = view->body + 1 + handleLen;
+    *textLen = view->bodyLen - 1 - handleLen;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameEncodeHistory()
+* Description: Formats the id and time that start a HISTORY payload. The
+*              message follows them.
+* Parameters: char *payload - At least FRAME_HISTORY_LEN bytes.
+*             uint64_t id - The id of the message in the log.
+*             int64_t when - When the message was received, in seconds since
+*                            the epoch.
+* Preconditions: None.
+* Returns: FRAME_HISTORY_LEN.
+*******************************************************************************/
+
+int frameEncodeHistory(char *payload, uint64_t id, int64_t when) {
+    _put32(payload, id >> 32);
+    _put32(payload + 4, id);
+    _put32(payload + 8, (uint64_t)when >> 32);
+    _put32(payload + 12, when);
+    return FRAME_HISTORY_LEN;
+}
+
+/*******************************************************************************
+* Function: frameDecodeHistory()
+* Description: Decodes a HISTORY frame from the server, which holds either a
+*              message or the cursor that ends an answer.
+* Parameters: struct frameView *view - The HISTORY frame.
+*             uint64_t *id - Set to the id of the message in the log, or to
+*                            the cursor.
+*             int64_t *when - Set to when the message was received, in
+*                             seconds since the epoch.
+*             char **text - Set to the message within the frame.
+*             int *textLen - Set to the length of the message.
+* Preconditions: view->meta.type is FRAME_HISTORY.
+* Returns: 0 for a message, 1 for the end of an answer, in which case only
+*          id is set, or -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodeHistory(struct frameView *view, uint64_t *id, int64_t *when,
+                       char **text, int *textLen) {
+    if (view->bodyLen < FRAME_HISTORY_END ||
+        (view->bodyLen > FRAME_HISTORY_END &&
+         view->bodyLen < FRAME_HISTORY_LEN)) {
+        return -1;
+    }
+    *id = (uint64_t)_get32(view->body) << 32 | _get32(view->body + 4);
+    if (view->bodyLen == FRAME_HISTORY_END) {
+        return 1;
+    }
+    *when = (int64_t)((uint64_t)_get32(view->body + 8) << 32 |
+                      _get32(view->body + 12));
+    *text = view->body + FRAME_HISTORY_LEN;
+    *textLen = view->bodyLen - FRAME_HISTORY_LEN;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: frameEncodeHistoryEnd()
+* Description: Formats a complete HISTORY frame that ends the server's
+*              answer to a HISTORY request.
+* Parameters: char *frame - At least FRAME_MAX_HEADER + FRAME_HISTORY_END
+*                           bytes.
+*             uint32_t room - The room id, or 0 for every client.
+*             uint64_t cursor - The cursor of the page before, or 0.
+* Preconditions: None.
+* Returns: The length of the frame.
+*******************************************************************************/
+
+int frameEncodeHistoryEnd(char *frame, uint32_t room, uint64_t cursor) {
+    struct frameMeta meta = { FRAME_HISTORY, room ? FRAME_F_ROOM : 0, 0, 0,
+                              0, room };
+    int headerLen = frameEncodeHeader(frame, FRAME_V2, &meta,
+                                      FRAME_HISTORY_END);
+
+    _put32(frame + headerLen, cursor >> 32);
+    _put32(frame + headerLen + 4, cursor);
+    return headerLen + FRAME_HISTORY_END;
+}
+
+/*******************************************************************************
+* Function: frameEncodeHistoryReq()
+* Description: Formats the payload of a HISTORY request.
+* Parameters: char *payload - At least FRAME_HISTORY_REQ bytes.
+*             uint64_t cursor - 0, or the id of the message before which
+*                               messages are wanted.
+*             uint32_t count - The number of messages wanted.
+* Preconditions: None.
+* Returns: FRAME_HISTORY_REQ.
+*******************************************************************************/
+
+int frameEncodeHistoryReq(char *payload, uint64_t cursor, uint32_t count) {
+    _put32(payload, cursor >> 32);
+    _put32(payload + 4, cursor);
+    _put32(payload + 8, count);
+    return FRAME_HISTORY_REQ;
+}
+
+/*******************************************************************************
+* Function: frameDecodeHistoryReq()
+* Description: Decodes a HISTORY request from a client.
+* Parameters: struct frameView *view - The HISTORY frame.
+*             uint64_t *cursor - Set to the cursor.
+*             uint32_t *count - Set to the number of messages wanted.
+* Preconditions: view->meta.type is FRAME_HISTORY.
+* Returns: 0 on success, -1 if the payload is malformed.
+*******************************************************************************/
+
+int frameDecodeHistoryReq(struct frameView *view, uint64_t *cursor,
+                          uint32_t *count) {
+    if (view->bodyLen != FRAME_HISTORY_REQ) {
+        return -1;
+    }
+    *cursor = (uint64_t)_get32(view->body) << 32 | _get32(view->body + 4);
+    *count = _get32(view->body + 8);
+    return 0;
+}
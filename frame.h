@@ -0,0 +1,196 @@
+/*******************************************************************************
+*      Filename: frame.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for frame.c. Please see frame.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "validate.h"
+#include "tls.h"
+#include "slab.h"
+
+/* Protocol versions. Version 1 is the three digit length-prefixed text
+ * framing spoken by chatserve. Version 2 is a binary framing, announced by
+ * FRAME_PREAMBLE, in which every frame starts with a 32-bit big-endian
+ * payload length, a type byte and a flags byte.
+ */
+#define FRAME_V1            1
+#define FRAME_V2            2
+#define FRAME_PREAMBLE      "\x80" "CV2"
+#define FRAME_PREAMBLE_LEN  4
+#define FRAME_V2_HEADER     6
+#define FRAME_EXT_COUNT     4       /* Header extensions defined below. */
+#define FRAME_MAX_HEADER    (FRAME_V2_HEADER + 4 * FRAME_EXT_COUNT)
+#define FRAME_MAX_PAYLOAD   (64 * 1024)
+#define FRAME_V1_MAX_BODY   (MAX_BYTES - PREFIX_OFFSET - 1)
+#define FRAME_CHUNK_SIZE    4096    /* Largest piece of a streamed message. */
+
+/* Frame types. Version 1 frames are always FRAME_MSG. */
+#define FRAME_HELLO         1       /* Version and feature negotiation. */
+#define FRAME_MSG           2       /* A chat message. */
+#define FRAME_SESSION       3       /* Client: resume or start a session. */
+#define FRAME_ACK           4       /* Server: messages received so far. */
+#define FRAME_JOIN          5       /* Client: join a room and send to it.
+                                     * Server: a room the client is in. */
+#define FRAME_PART          6       /* Client: leave a room. Server: a room
+                                     * the client is not in. */
+#define FRAME_DIRECT        7       /* A private message. Client: to the
+                                     * handle named. Server: from it. */
+#define FRAME_HISTORY       8       /* Client: a request for the messages
+                                     * before a cursor. Server: a message
+                                     * from the log of the messages sent
+                                     * before, or the end of an answer. */
+#define FRAME_PING          9       /* Either side: is the peer alive? */
+#define FRAME_PONG          10      /* Either side: the answer to a PING. */
+
+/* Frame flags. Flags that announce a header extension are listed in the
+ * order in which their 32-bit extensions follow the base header.
+ */
+#define FRAME_F_MORE        0x01    /* More pieces of this message follow. */
+#define FRAME_F_STREAM      0x02    /* Extension: stream id of a message sent
+                                     * in pieces. */
+#define FRAME_F_SEQ         0x04    /* Extension: sequence number of a
+                                     * message within its session. */
+#define FRAME_F_ACK         0x08    /* Extension: the highest sequence
+                                     * number received from the peer. */
+#define FRAME_F_ROOM        0x10    /* Extension: the id of the room that a
+                                     * message or JOIN or PART refers to. */
+#define FRAME_F_COMPRESSED  0x20    /* The payload is the next part of the
+                                     * sender's compressed stream. */
+
+/* The HELLO payload: version, reserved byte, 16-bit feature mask. */
+#define FRAME_HELLO_LEN     4
+
+/* The SESSION payload: a 64-bit session id chosen by the client, then its
+ * handle. The ACK payload: the highest sequence number received. An ACK
+ * frame is only needed when no other frame can carry FRAME_F_ACK.
+ */
+#define FRAME_SESSION_ID    8
+#define FRAME_ACK_LEN       4
+
+/* The JOIN and PART payload: a room name of FRAME_ROOM_NAME_MAX or fewer
+ * alphanumerics, '_' or '-'. A client may be in FRAME_MAX_JOINED rooms.
+ */
+#define FRAME_ROOM_NAME_MAX 32
+#define FRAME_MAX_JOINED    64
+
+/* The DIRECT payload: a length byte and a handle, then the message. A DIRECT
+ * frame from the server without a message means that no client has the
+ * handle named.
+ */
+#define FRAME_DIRECT_MAX    (FRAME_MAX_PAYLOAD - 1 - MAX_HANDLE_LEN)
+
+/* The HISTORY payload: the 64-bit id of the message in the server's log and
+ * the 64-bit time at which the server received it, in seconds since the
+ * epoch, then the message.
+ */
+#define FRAME_HISTORY_LEN   16
+#define FRAME_HISTORY_MAX   (FRAME_MAX_PAYLOAD - FRAME_HISTORY_LEN)
+
+/* The HISTORY request payload: a 64-bit cursor, either 0 for the latest
+ * messages or the id of a message for the room named by the frame, or for
+ * every client if it names none, for the messages before it, then the
+ * 32-bit number of messages wanted. The server answers with at most that
+ * many messages, oldest first, then a HISTORY frame for the same room whose
+ * payload is only the cursor of the page before, or 0 at the start of the
+ * history.
+ */
+#define FRAME_HISTORY_REQ   12
+#define FRAME_HISTORY_END   8
+
+/* The PING payload: a 64-bit token chosen by the sender, which the PONG
+ * answering it carries back.
+ */
+#define FRAME_PING_LEN      8
+
+/* HELLO features. */
+#define FEAT_CHUNKED        0x0001  /* Messages may be streamed in pieces. */
+#define FEAT_RESUME         0x0002  /* Sessions survive reconnection. */
+#define FEAT_ROOMS          0x0004  /* Messages may be sent to rooms. */
+#define FEAT_DIRECT         0x0008  /* Private messages may be sent by
+                                     * handle. Requires FEAT_RESUME, whose
+                                     * SESSION frame registers the handle. */
+#define FEAT_HISTORY        0x0010  /* A client joining a room is sent its
+                                     * latest messages. */
+#define FEAT_COMPRESS       0x0020  /* The server may compress the messages
+                                     * it sends. */
+#define FEAT_KEEPALIVE      0x0040  /* Either side may send PING frames,
+                                     * which the other answers. */
+
+#define FRAME_READER_SIZE   4096    /* Initial ring size, a power of two. */
+#define FRAME_READER_MAX    (2 * (FRAME_MAX_HEADER + FRAME_MAX_PAYLOAD))
+
+/* The fields of a version 2 header other than the payload length. */
+struct frameMeta {
+    int      type;
+    int      flags;
+    uint32_t stream;    /* Valid if flags has FRAME_F_STREAM. */
+    uint32_t seq;       /* Valid if flags has FRAME_F_SEQ. */
+    uint32_t ack;       /* Valid if flags has FRAME_F_ACK. */
+    uint32_t room;      /* Valid if flags has FRAME_F_ROOM. */
+};
+
+/* A complete frame decoded by frameReaderNext(). */
+struct frameView {
+    char            *frame;     /* The header followed by the body. */
+    int              frameLen;
+    struct frameMeta meta;
+    char            *body;      /* The payload. Version 1 bodies are null
+                                 * terminated; version 2 bodies are not. */
+    int              bodyLen;   /* The body length without any terminator. */
+};
+
+/* A ring buffer of bytes received on one connection. head and tail count
+ * bytes consumed and received since the reader was created; their
+ * difference is the number of bytes buffered. A reader whose version is 0
+ * detects the version from the first bytes received.
+ */
+struct frameReader {
+    char     *buf;
+    unsigned  cap;
+    unsigned  head;
+    unsigned  tail;
+    int       version;
+    char     *scratch;          /* Holds frames that wrap the ring. */
+};
+
+int frameReaderInit(struct frameReader *, int);
+void frameReaderFree(struct frameReader *);
+ssize_t frameReaderFill(struct frameReader *, int);
+size_t frameReaderFeed(struct frameReader *, const char *, size_t);
+int frameReaderNext(struct frameReader *, struct frameView *);
+int frameEncodeHeader(char *, int, const struct frameMeta *, size_t);
+int frameEncodeHello(char *, unsigned);
+int frameDecodeHello(struct frameView *, unsigned *);
+int frameEncodeSession(char *, uint64_t, const char *);
+int frameDecodeSession(struct frameView *, uint64_t *, char *);
+int frameEncodeAck(char *, uint32_t);
+int frameDecodeAck(struct frameView *, uint32_t *);
+int frameEncodePing(char *, int, uint64_t);
+int frameDecodePing(struct frameView *, uint64_t *);
+int frameEncodeRoom(char *, int, uint32_t, const char *);
+int frameDecodeRoom(struct frameView *, char *);
+int frameEncodeDirect(char *, const char *);
+int frameDecodeDirect(struct frameView *, char *, char **, int *);
+int frameEncodeHistory(char *, uint64_t, int64_t);
+int frameDecodeHistory(struct frameView *, uint64_t *, int64_t *, char **,
+                       int *);
+int frameEncodeHistoryEnd(char *, uint32_t, uint64_t);
+int frameEncodeHistoryReq(char *, uint64_t, uint32_t);
+int frameDecodeHistoryReq(struct frameView *, uint64_t *, uint32_t *);
+
+#endif
@@ -0,0 +1,789 @@
+/*******************************************************************************
+*      Filename: msglog.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides chatserver's persistent message log. Messages are
+*                appended to segment files that are mapped into memory, each
+*                as the HISTORY frame that a client is sent, so that history
+*                is sent straight from the mapping without being copied or
+*                kept in memory besides. Each segment has an index file of
+*                fixed size entries, one per record, which chain the records
+*                for each room from newest to oldest, so that a page of a
+*                room's messages, the latest or those before any message, is
+*                found without scanning the log. Appenders reserve space
+*                in the last segment by updating one atomic word, so that
+*                shards do not wait on one another to log their messages.
+*******************************************************************************/
+
+#include "msglog.h"
+
+/*******************************************************************************
+* Function: _logError()
+* Description: Reports a failed operation on a file of the log.
+* Parameters: const char *path - The file.
+* Preconditions: errno describes the failure.
+* Returns: None.
+*******************************************************************************/
+
+static void _logError(const char *path) {
+    fprintf(stderr, "chatserver: %s: %s\n", path, strerror(errno));
+}
+
+/*******************************************************************************
+* Function: _mapFile()
+* Description: Opens a file of the log, creating it and allocating its full
+*              size on disk if it is new, and maps it. Allocating the space
+*              up front means that a full disk fails here rather than
+*              faulting when a record is later written into the mapping.
+* Parameters: const char *path - The file.
+*             size_t size - Its size.
+* Preconditions: None.
+* Returns: The mapping, or NULL on failure.
+*******************************************************************************/
+
+static void *_mapFile(const char *path, size_t size) {
+    struct stat st;
+    void *map;
+    int fd, err;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+        _logError(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        _logError(path);
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < size &&
+        (err = posix_fallocate(fd, 0, size)) != 0) {
+        errno = err;
+        _logError(path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        _logError(path);
+        close(fd);
+        return NULL;
+    }
+    /* The mapping keeps the file open. */
+    close(fd);
+    return map;
+}
+
+/*******************************************************************************
+* Function: _segOpen()
+* Description: Maps the files of a segment, creating them if they do not
+*              exist, and finds the end of its records. Since the entries
+*              committed are a prefix of the index, but for those that
+*              appends cut short by a crash left behind, the first unused
+*              one is found by binary search. Entries that such appends
+*              committed past the end of the last segment are cleared, so
+*              that records appended in their place are not read before
+*              they are committed.
+* Parameters: struct msgLog *log - The log.
+*             uint64_t base - The id of the segment's first record.
+*             int last - Nonzero if records will be appended to it.
+* Preconditions: None.
+* Returns: The segment, or NULL on failure.
+*******************************************************************************/
+
+static struct logSegment *_segOpen(struct msgLog *log, uint64_t base,
+                                   int last) {
+    char path[LOG_PATH_MAX];
+    struct logSegment *seg;
+    struct logEntry *e;
+    uint32_t lo = 0, hi = LOG_INDEX_SIZE, mid, used = 0;
+
+    if ((seg = calloc(1, sizeof *seg)) == NULL) {
+        return NULL;
+    }
+    seg->base = base;
+    snprintf(path, sizeof path, "%s/%020llu.log", log->dir,
+             (unsigned long long)base);
+    if ((seg->data = _mapFile(path, LOG_SEGMENT_SIZE)) == NULL) {
+        free(seg);
+        return NULL;
+    }
+    snprintf(path, sizeof path, "%s/%020llu.idx", log->dir,
+             (unsigned long long)base);
+    if ((seg->index = _mapFile(path, LOG_INDEX_SIZE *
+                               sizeof *seg->index)) == NULL) {
+        munmap(seg->data, LOG_SEGMENT_SIZE);
+        free(seg);
+        return NULL;
+    }
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (seg->index[mid].len != 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        e = &seg->index[lo - 1];
+        used = (e->offset + e->len + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1);
+        if (e->offset > LOG_SEGMENT_SIZE || used > LOG_SEGMENT_SIZE) {
+            fprintf(stderr, "chatserver: %s: corrupt index\n", path);
+            munmap(seg->data, LOG_SEGMENT_SIZE);
+            munmap(seg->index, LOG_INDEX_SIZE * sizeof *seg->index);
+            free(seg);
+            return NULL;
+        }
+    }
+    if (last) {
+        for (hi = lo; hi < LOG_INDEX_SIZE; hi++) {
+            if (seg->index[hi].len != 0) {
+                seg->index[hi].len = 0;
+            }
+        }
+    }
+    atomic_init(&seg->reserved, (uint64_t)lo << 32 | used |
+                                (last ? 0 : LOG_SEALED));
+    return seg;
+}
+
+/*******************************************************************************
+* Function: _segClose()
+* Description: Unmaps the files of a segment and frees it.
+* Parameters: struct logSegment *seg - The segment.
+* Preconditions: The segment is open.
+* Returns: None.
+*******************************************************************************/
+
+static void _segClose(struct logSegment *seg) {
+    munmap(seg->data, LOG_SEGMENT_SIZE);
+    munmap(seg->index, LOG_INDEX_SIZE * sizeof *seg->index);
+    free(seg);
+}
+
+/*******************************************************************************
+* Function: _compareBases()
+* Description: Orders segment ids for qsort().
+* Parameters: const void *a - The first id.
+*             const void *b - The second id.
+* Preconditions: None.
+* Returns: Less than, equal to or greater than 0 as a is less than, equal to
+*          or greater than b.
+*******************************************************************************/
+
+static int _compareBases(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+* Function: _openSegments()
+* Description: Opens every segment in the log's directory, oldest first, or
+*              creates the first segment of a new log.
+* Parameters: struct msgLog *log - The log.
+* Preconditions: log->dir exists.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _openSegments(struct msgLog *log) {
+    unsigned long long base;
+    struct dirent *ent;
+    uint64_t *bases = NULL, *grown;
+    struct logSegment **segs;
+    int n = 0, cap = 0, i;
+    char end;
+    DIR *dir;
+
+    if ((dir = opendir(log->dir)) == NULL) {
+        _logError(log->dir);
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (strlen(ent->d_name) != 24 ||
+            sscanf(ent->d_name, "%20llu.lo%c", &base, &end) != 2 ||
+            end != 'g' || base == 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? 2 * cap : 16;
+            if ((grown = realloc(bases, cap * sizeof *bases)) == NULL) {
+                closedir(dir);
+                free(bases);
+                return -1;
+            }
+            bases = grown;
+        }
+        bases[n++] = base;
+    }
+    closedir(dir);
+    if (n == 0) {
+        if ((bases = malloc(sizeof *bases)) == NULL) {
+            return -1;
+        }
+        bases[n++] = 1;
+    }
+    qsort(bases, n, sizeof *bases, _compareBases);
+    if ((segs = calloc(n, sizeof *segs)) == NULL) {
+        free(bases);
+        return -1;
+    }
+    atomic_store(&log->segs, segs);
+    log->segsCap = n;
+    for (i = 0; i < n; i++) {
+        if ((segs[i] = _segOpen(log, bases[i], i == n - 1)) == NULL) {
+            free(bases);
+            return -1;
+        }
+        atomic_store(&log->numSegs, i + 1);
+    }
+    free(bases);
+    return 0;
+}
+
+
+/*******************************************************************************
+* Function: _setName()
+* Description: Sets the name kept in memory for a room id, in place of any
+*              recorded for it before.
+* Parameters: struct msgLog *log - The log.
+*             uint32_t id - The room id, at least 1.
+*             const char *name - The room name.
+* Preconditions: None.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _setName(struct msgLog *log, uint32_t id, const char *name) {
+    char (*names)[FRAME_ROOM_NAME_MAX + 1];
+    uint32_t cap;
+
+    if (id > log->namesCap) {
+        cap = log->namesCap ? log->namesCap : 16;
+        while (cap < id) {
+            cap *= 2;
+        }
+        if ((names = realloc(log->roomNames, cap * sizeof *names)) == NULL) {
+            return -1;
+        }
+        memset(names + log->namesCap, 0,
+               (cap - log->namesCap) * sizeof *names);
+        log->roomNames = names;
+        log->namesCap = cap;
+    }
+    strcpy(log->roomNames[id - 1], name);
+    if (id > log->numRooms) {
+        log->numRooms = id;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _readRooms()
+* Description: Opens the file of room names, creating it if it does not
+*              exist, and reads the names it holds. Each line is a room id
+*              and its name; a line of a name alone, as older logs hold,
+*              names the id after that of the line before. A later line for
+*              an id replaces an earlier one.
+* Parameters: struct msgLog *log - The log.
+* Preconditions: log->dir exists.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _readRooms(struct msgLog *log) {
+    char path[LOG_PATH_MAX], line[LOG_ROOM_LINE_MAX], *name, *end;
+    unsigned long id = 0;
+    size_t len;
+
+    snprintf(path, sizeof path, "%s/%s", log->dir, LOG_ROOMS_FILE);
+    if ((log->roomsFile = fopen(path, "a+")) == NULL) {
+        _logError(path);
+        return -1;
+    }
+    while (fgets(line, sizeof line, log->roomsFile) != NULL) {
+        len = strlen(line);
+        if (len < 2 || line[len - 1] != '\n') {
+            fprintf(stderr, "chatserver: %s: bad room name\n", path);
+            return -1;
+        }
+        line[len - 1] = '\0';
+        if ((name = strchr(line, ' ')) != NULL) {
+            *name++ = '\0';
+            id = strtoul(line, &end, 10);
+            if (*end != '\0') {
+                id = 0;
+            }
+        } else {
+            name = line;
+            id++;
+        }
+        if (id == 0 || id > UINT32_MAX || *name == '\0' ||
+            strlen(name) > FRAME_ROOM_NAME_MAX) {
+            fprintf(stderr, "chatserver: %s: bad room name\n", path);
+            return -1;
+        }
+        if (_setName(log, id, name) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _findTails()
+* Description: Finds the last record for every room by walking the index
+*              backwards from the newest record, until each room named has
+*              been seen or the log is exhausted.
+* Parameters: struct msgLog *log - The log.
+* Preconditions: The segments and room names have been read, and the table
+*                of tails allocated.
+* Returns: None.
+*******************************************************************************/
+
+static void _findTails(struct msgLog *log) {
+    struct logSegment **segs = atomic_load(&log->segs), *seg;
+    uint32_t found = 0, named = 0, i;
+    struct logEntry *e;
+    int s;
+
+    for (i = 0; i < log->numRooms; i++) {
+        named += log->roomNames[i][0] != '\0';
+    }
+    /* Room 0 is looked for too. */
+    for (s = atomic_load(&log->numSegs) - 1; s >= 0 && found <= named; s--) {
+        seg = segs[s];
+        for (i = LOG_COUNT(atomic_load(&seg->reserved));
+             i-- > 0 && found <= named; ) {
+            e = &seg->index[i];
+            if (e->len != 0 && e->room <= LOG_ROOMS_MAX &&
+                log->tails[e->room] == 0) {
+                log->tails[e->room] = seg->base + i;
+                found++;
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _logLast()
+* Description: Finds the segment that records are appended to.
+* Parameters: struct msgLog *log - The log.
+* Preconditions: The log is open.
+* Returns: The segment.
+*******************************************************************************/
+
+static struct logSegment *_logLast(struct msgLog *log) {
+    int n = atomic_load(&log->numSegs);
+
+    return atomic_load(&log->segs)[n - 1];
+}
+
+/*******************************************************************************
+* Function: msgLogOpen()
+* Description: Opens the message log in a directory, creating both if they
+*              do not exist.
+* Parameters: struct msgLog *log - The log.
+*             const char *dir - The directory.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int msgLogOpen(struct msgLog *log, const char *dir) {
+    struct logSegment *last;
+
+    memset(log, 0, sizeof *log);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        _logError(dir);
+        return -1;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    if ((log->dir = strdup(dir)) == NULL || _readRooms(log) == -1 ||
+        _openSegments(log) == -1 ||
+        (log->tails = calloc(LOG_ROOMS_MAX + 1, sizeof *log->tails)) ==
+        NULL) {
+        msgLogClose(log);
+        return -1;
+    }
+    _findTails(log);
+    last = _logLast(log);
+    atomic_store(&log->end,
+                 last->base + LOG_COUNT(atomic_load(&last->reserved)));
+    return 0;
+}
+
+/*******************************************************************************
+* Function: msgLogClose()
+* Description: Unmaps every segment of the log and frees it.
+* Parameters: struct msgLog *log - The log.
+* Preconditions: msgLogOpen() was called, and no record read from the log is
+*                still in use.
+* Returns: None.
+*******************************************************************************/
+
+void msgLogClose(struct msgLog *log) {
+    struct logSegment **segs = atomic_load(&log->segs);
+    int i;
+
+    for (i = 0; i < atomic_load(&log->numSegs); i++) {
+        _segClose(segs[i]);
+    }
+    for (i = 0; i < log->numRetired; i++) {
+        free(log->retired[i]);
+    }
+    if (log->roomsFile != NULL) {
+        fclose(log->roomsFile);
+    }
+    free(segs);
+    free(log->retired);
+    free(log->tails);
+    free(log->roomNames);
+    free(log->dir);
+    pthread_mutex_destroy(&log->lock);
+    memset(log, 0, sizeof *log);
+}
+
+/*******************************************************************************
+* Function: msgLogAddRoom()
+* Description: Records the name of a room, which must be done before the
+*              first message for it is appended. Nothing is written if the
+*              id is recorded with that name already; a room given an id
+*              that was recorded with another name, but whose room was
+*              never logged to, replaces the name.
+* Parameters: struct msgLog *log - The log.
+*             uint32_t id - The room id, at least 1.
+*             const char *name - The room name.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int msgLogAddRoom(struct msgLog *log, uint32_t id, const char *name) {
+    int status = 0;
+
+    pthread_mutex_lock(&log->lock);
+    if (id > log->numRooms || strcmp(log->roomNames[id - 1], name) != 0) {
+        if (id > LOG_ROOMS_MAX || _setName(log, id, name) == -1 ||
+            fprintf(log->roomsFile, "%u %s\n", id, name) < 0 ||
+            fflush(log->roomsFile) == EOF) {
+            fprintf(stderr, "chatserver: cannot record room %s\n", name);
+            status = -1;
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
+
+/*******************************************************************************
+* Function: _logRoll()
+* Description: Seals a full segment and starts a new one after it, unless
+*              another appender has done so already. The segment's count is
+*              final once it is sealed, which gives the id of the next
+*              segment's first record.
+* Parameters: struct msgLog *log - The log.
+*             struct logSegment *full - The segment that a record did not
+*                                       fit in.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _logRoll(struct msgLog *log, struct logSegment *full) {
+    struct logSegment **segs, **grown = NULL, ***retired, *seg;
+    int n, status = -1;
+    uint64_t r;
+
+    pthread_mutex_lock(&log->lock);
+    n = atomic_load(&log->numSegs);
+    segs = atomic_load(&log->segs);
+    if (segs[n - 1] != full) {
+        status = 0;
+        goto out;
+    }
+    /* A new segment only lacks room if the sizes are misconfigured. */
+    if (LOG_COUNT(atomic_load(&full->reserved)) == 0) {
+        goto out;
+    }
+    r = atomic_fetch_or(&full->reserved, LOG_SEALED);
+    if ((seg = _segOpen(log, full->base + LOG_COUNT(r), 1)) == NULL) {
+        goto out;
+    }
+    /* Readers may still be using the old array, so it is kept. */
+    if (n == log->segsCap) {
+        if ((grown = malloc(2 * n * sizeof *grown)) == NULL ||
+            (retired = realloc(log->retired, (log->numRetired + 1) *
+                               sizeof *retired)) == NULL) {
+            free(grown);
+            _segClose(seg);
+            goto out;
+        }
+        memcpy(grown, segs, n * sizeof *segs);
+        log->retired = retired;
+        log->retired[log->numRetired++] = segs;
+        log->segsCap = 2 * n;
+        atomic_store(&log->segs, grown);
+        segs = grown;
+    }
+    segs[n] = seg;
+    atomic_store(&log->numSegs, n + 1);
+    status = 0;
+out:
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
+
+/*******************************************************************************
+* Function: _logEntry()
+* Description: Finds the index entry of a committed record by id, without
+*              the log's lock.
+* Parameters: struct msgLog *log - The log.
+*             uint64_t id - The id.
+*             struct logSegment **seg - Set to the segment holding it.
+* Preconditions: None.
+* Returns: The entry, or NULL if no record with the id has been committed.
+*******************************************************************************/
+
+static struct logEntry *_logEntry(struct msgLog *log, uint64_t id,
+                                  struct logSegment **seg) {
+    int lo = 0, hi = atomic_load(&log->numSegs), mid;
+    struct logSegment **segs = atomic_load(&log->segs);
+    struct logEntry *e;
+
+    /* Find the last segment whose base is at most id. */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (segs[mid]->base <= id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || id - segs[lo - 1]->base >=
+                   LOG_COUNT(atomic_load(&segs[lo - 1]->reserved))) {
+        return NULL;
+    }
+    *seg = segs[lo - 1];
+    e = &(*seg)->index[id - (*seg)->base];
+    return atomic_load_explicit(&e->len, memory_order_acquire) != 0 ? e : NULL;
+}
+
+/*******************************************************************************
+* Function: _logLink()
+* Description: Links a committed record into the chain of its room's
+*              records, which runs from the newest to the oldest. Records
+*              appended at once by several threads may be linked in any
+*              order, so a record is linked in behind any newer ones already
+*              linked, keeping the chain in order of id.
+* Parameters: struct msgLog *log - The log.
+*             uint32_t room - The room id.
+*             uint64_t id - The id of the record.
+*             struct logEntry *e - Its entry.
+* Preconditions: The record has been committed.
+* Returns: None.
+*******************************************************************************/
+
+static void _logLink(struct msgLog *log, uint32_t room, uint64_t id,
+                     struct logEntry *e) {
+    _Atomic uint64_t *link = &log->tails[room];
+    uint64_t prev = atomic_load(link);
+    struct logSegment *seg;
+    struct logEntry *newer;
+
+    for (;;) {
+        while (prev > id && (newer = _logEntry(log, prev, &seg)) != NULL) {
+            link = &newer->prev;
+            prev = atomic_load(link);
+        }
+        atomic_store(&e->prev, prev);
+        if (atomic_compare_exchange_weak(link, &prev, id)) {
+            return;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: msgLogAppend()
+* Description: Appends a chat message to the log, as a HISTORY frame stamped
+*              with its id and the current time, starting a new segment if
+*              the last one is full. Messages longer than FRAME_HISTORY_MAX
+*              are truncated. Space for the record is reserved without the
+*              log's lock, which is only taken to start a new segment.
+* Parameters: struct msgLog *log - The log.
+*             uint32_t room - The room id, or 0 for every client.
+*             const char *text - The message.
+*             size_t len - The length of the message in bytes.
+* Preconditions: None.
+* Returns: The id of the message, or 0 on failure.
+*******************************************************************************/
+
+uint64_t msgLogAppend(struct msgLog *log, uint32_t room, const char *text,
+                      size_t len) {
+    struct frameMeta meta = { FRAME_HISTORY, room ? FRAME_F_ROOM : 0, 0, 0,
+                              0, room };
+    char header[FRAME_MAX_HEADER], *frame;
+    struct logSegment *seg;
+    struct logEntry *e;
+    uint32_t total, need;
+    uint64_t r, id;
+    int hdrLen;
+
+    if (room > LOG_ROOMS_MAX) {
+        return 0;
+    }
+    if (len > FRAME_HISTORY_MAX) {
+        len = FRAME_HISTORY_MAX;
+    }
+    hdrLen = frameEncodeHeader(header, FRAME_V2, &meta,
+                               FRAME_HISTORY_LEN + len);
+    total = hdrLen + FRAME_HISTORY_LEN + len;
+    need = (total + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1);
+    for (;;) {
+        seg = _logLast(log);
+        r = atomic_load(&seg->reserved);
+        while (!(r & LOG_SEALED) && LOG_COUNT(r) < LOG_INDEX_SIZE &&
+               LOG_USED(r) + need <= LOG_SEGMENT_SIZE) {
+            if (atomic_compare_exchange_weak(&seg->reserved, &r,
+                                             r + LOG_COUNT_ONE + need)) {
+                goto reserved;
+            }
+        }
+        if (_logRoll(log, seg) == -1) {
+            return 0;
+        }
+    }
+reserved:
+    id = seg->base + LOG_COUNT(r);
+    frame = seg->data + LOG_USED(r);
+    memcpy(frame, header, hdrLen);
+    frameEncodeHistory(frame + hdrLen, id, time(NULL));
+    memcpy(frame + hdrLen + FRAME_HISTORY_LEN, text, len);
+    e = &seg->index[LOG_COUNT(r)];
+    e->offset = LOG_USED(r);
+    e->room = room;
+    e->hdrLen = hdrLen;
+    /* Storing len commits the record, so it must come last. */
+    atomic_store_explicit(&e->len, total, memory_order_release);
+    _logLink(log, room, id, e);
+    return id;
+}
+
+/*******************************************************************************
+* Function: msgLogChain()
+* Description: Lists the ids of a page of messages for a room, newest first,
+*              by following the room's chain of records back from the last
+*              one, or from the message before a cursor. Only the index is
+*              read, and without the log's lock, so a message committed
+*              while the chain is followed may be left out of the page.
+* Parameters: struct msgLog *log - The log.
+*             uint32_t room - The room id, or 0 for every client.
+*             uint64_t before - 0 for the latest messages, or the id of a
+*                               message for the room, for those before it.
+*             int max - The most ids to list.
+*             uint64_t *ids - At least max ids. Filled in with the page.
+*             uint64_t *next - Set to the cursor of the page before this
+*                              one, which is the id of its oldest message,
+*                              or 0 if there are no older messages.
+* Preconditions: None.
+* Returns: The number of ids listed, which is 0 if the cursor is not the id
+*          of a message for the room.
+*******************************************************************************/
+
+int msgLogChain(struct msgLog *log, uint32_t room, uint64_t before, int max,
+                uint64_t *ids, uint64_t *next) {
+    struct logSegment *seg;
+    struct logEntry *e;
+    uint64_t id = 0;
+    int n = 0;
+
+    if (before == 0) {
+        id = room <= LOG_ROOMS_MAX ? atomic_load(&log->tails[room]) : 0;
+    } else if ((e = _logEntry(log, before, &seg)) != NULL && e->room == room) {
+        id = e->prev;
+    }
+    /* Each link must lead to an older record, so that a damaged index
+     * cannot loop.
+     */
+    for (; n < max && id != 0 && (n == 0 || id < ids[n - 1]) &&
+         (e = _logEntry(log, id, &seg)) != NULL && e->room == room;
+         id = e->prev) {
+        ids[n++] = id;
+    }
+    *next = n > 0 && id != 0 ? ids[n - 1] : 0;
+    return n;
+}
+
+/*******************************************************************************
+* Function: msgLogRead()
+* Description: Reads a message by id, without the log's lock, so that
+*              readers never wait on appenders. The record is read in place,
+*              and stays valid until the log is closed.
+* Parameters: struct msgLog *log - The log.
+*             uint64_t id - The id.
+*             struct logRecord *rec - Filled in with the message.
+* Preconditions: None.
+* Returns: 0 on success, -1 if no message has the id.
+*******************************************************************************/
+
+int msgLogRead(struct msgLog *log, uint64_t id, struct logRecord *rec) {
+    struct logSegment *seg;
+    struct logEntry *e;
+    uint32_t len;
+
+    if ((e = _logEntry(log, id, &seg)) == NULL ||
+        e->offset + (len = atomic_load(&e->len)) > LOG_SEGMENT_SIZE) {
+        return -1;
+    }
+    rec->id = id;
+    rec->room = e->room;
+    rec->frame = seg->data + e->offset;
+    rec->len = len;
+    rec->hdrLen = e->hdrLen;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: msgLogEnd()
+* Description: Finds the id of the first record not yet committed. Every
+*              record before it can be read, but for those lost to a crash
+*              before the log was opened. Records are committed in about
+*              the order they are appended, so only those committed since
+*              the last call are stepped over. The log's lock is not taken;
+*              callers that race only ever move the end forward.
+* Parameters: struct msgLog *log - The log.
+* Preconditions: None.
+* Returns: The id.
+*******************************************************************************/
+
+uint64_t msgLogEnd(struct msgLog *log) {
+    struct logSegment *seg;
+    uint64_t end, seen = atomic_load(&log->end);
+
+    end = seen;
+    while (_logEntry(log, end, &seg) != NULL) {
+        end++;
+    }
+    while (seen < end) {
+        if (atomic_compare_exchange_weak(&log->end, &seen, end)) {
+            break;
+        }
+    }
+    return end;
+}
+
+/*******************************************************************************
+* Function: msgLogRoomName()
+* Description: Copies the name recorded for a room.
+* Parameters: struct msgLog *log - The log.
+*             uint32_t id - The room id.
+*             char *name - At least FRAME_ROOM_NAME_MAX + 1 bytes. Filled in
+*                          with the null terminated name.
+* Preconditions: None.
+* Returns: 0 on success, -1 if no room has the id.
+*******************************************************************************/
+
+int msgLogRoomName(struct msgLog *log, uint32_t id, char *name) {
+    int status = -1;
+
+    pthread_mutex_lock(&log->lock);
+    if (id >= 1 && id <= log->numRooms && log->roomNames[id - 1][0] != '\0') {
+        strcpy(name, log->roomNames[id - 1]);
+        status = 0;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
@@ -0,0 +1,132 @@
+/*******************************************************************************
+*      Filename: msglog.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for msglog.c. Please see msglog.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "frame.h"
+
+#define LOG_SEGMENT_SIZE    (16 * 1024 * 1024)  /* Bytes of records that a
+                                                 * segment holds. */
+#define LOG_INDEX_SIZE      (256 * 1024)        /* Records that a segment
+                                                 * holds. */
+#define LOG_ALIGN           8                   /* Records start at multiples
+                                                 * of this. */
+#define LOG_ROOMS_MAX       (64 * 1024)         /* Room ids the log can
+                                                 * hold, as many as the
+                                                 * server's rooms. */
+#define LOG_ROOMS_FILE      "rooms"
+#define LOG_ROOM_LINE_MAX   (FRAME_ROOM_NAME_MAX + 14)  /* A line of the
+                                                 * rooms file: an id, a
+                                                 * space, a name and a
+                                                 * newline. */
+#define LOG_PATH_MAX        4096
+
+/* The fields of a segment's reservation word. */
+#define LOG_SEALED          ((uint64_t)1 << 63) /* No more records may be
+                                                 * reserved. */
+#define LOG_COUNT_ONE       ((uint64_t)1 << 32)
+#define LOG_COUNT(r)        ((uint32_t)((r) >> 32) & 0x7fffffff)
+#define LOG_USED(r)         ((uint32_t)(r))
+
+/* The index entry of a record, in host byte order. Since len is written
+ * after the record itself, an entry whose len is 0 has not been committed,
+ * whether it is still being appended or an append was cut short.
+ */
+struct logEntry {
+    _Atomic uint64_t prev;  /* The id of the previous record for the room,
+                             * or 0. */
+    uint32_t offset;        /* Where the record starts in the segment. */
+    _Atomic uint32_t len;   /* The length of the record. */
+    uint32_t room;          /* The room id, or 0 for every client. */
+    uint32_t hdrLen;        /* The length of the record's frame header. */
+};
+
+/* A segment of the log: a file of records and a file of their index
+ * entries, both mapped in full for as long as the log is open. Appenders
+ * reserve an entry and the bytes of a record at once, by adding to the
+ * reservation word the one and the other, and then fill them in without
+ * holding the log's lock. A segment that has been sealed is full, and
+ * its count is final.
+ */
+struct logSegment {
+    uint64_t         base;      /* The id of the first record. */
+    _Atomic uint64_t reserved;  /* LOG_SEALED, the records reserved, from
+                                 * bit 32, and their bytes. */
+    char            *data;
+    struct logEntry *index;
+};
+
+/* A record read from the log. Every record is a complete version 2 HISTORY
+ * frame, read in place from the mapped segment.
+ */
+struct logRecord {
+    uint64_t  id;
+    uint32_t  room;
+    char     *frame;
+    uint32_t  len;
+    uint32_t  hdrLen;
+};
+
+/* An append-only log of chat messages. Message ids count up from 1 across
+ * segments, and each segment is named after the id of its first record.
+ * Room ids are only meaningful together with the room names, which are
+ * kept with their ids in a file of their own. The lock is taken to start
+ * a segment and to record a room, but not to append a record. The array
+ * of segments is replaced, not reallocated, when it grows, so that a
+ * reader holding the old one may still use it; old arrays are freed when
+ * the log is closed.
+ */
+struct msgLog {
+    pthread_mutex_t    lock;
+    char              *dir;
+    _Atomic(struct logSegment **) segs;  /* Oldest first. Only the last is
+                                     * appended to. */
+    atomic_int         numSegs;
+    int                segsCap;
+    struct logSegment ***retired;   /* Arrays of segments replaced, */
+    int                numRetired;  /* and how many there are. */
+    _Atomic uint64_t  *tails;       /* The id of the last record for each
+                                     * room, by room id, or 0. */
+    _Atomic uint64_t   end;         /* The id of a record not yet committed,
+                                     * with every record before it
+                                     * committed or lost. */
+    FILE              *roomsFile;
+    char             (*roomNames)[FRAME_ROOM_NAME_MAX + 1];  /* The names
+                                     * recorded, by room id less one, or
+                                     * empty for ids not recorded. */
+    uint32_t           numRooms;    /* The highest id recorded. */
+    uint32_t           namesCap;
+};
+
+int msgLogOpen(struct msgLog *, const char *);
+void msgLogClose(struct msgLog *);
+int msgLogAddRoom(struct msgLog *, uint32_t, const char *);
+uint64_t msgLogAppend(struct msgLog *, uint32_t, const char *, size_t);
+int msgLogChain(struct msgLog *, uint32_t, uint64_t, int, uint64_t *,
+                uint64_t *);
+int msgLogRead(struct msgLog *, uint64_t, struct logRecord *);
+uint64_t msgLogEnd(struct msgLog *);
+int msgLogRoomName(struct msgLog *, uint32_t, char *);
+
+#endif
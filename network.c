@@ -1,7 +1,7 @@
 /*******************************************************************************
 *      Filename: network.c
 *        Author: Maxwell Goldberg
-* Last Modified: 02.12.17
+* Last Modified: 10.16.26
 *   Description: Provides functions that allow the chatclient to form a TCP
 *                connection with the chatserver, send a chat message, and 
 *                receive a chat message.
@@ -11,26 +11,117 @@
 *                html/multipage/index.html).
 *******************************************************************************/
 
+#include <netinet/tcp.h>
+
 #include "network.h"
 #include "validate.h"
 
+/*******************************************************************************
+* Function: clockMs()
+* Description: Returns the current monotonic time.
+* Parameters: None.
+* Preconditions: None.
+* Returns: The time in milliseconds.
+*******************************************************************************/
+
+long long clockMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*******************************************************************************
+* Function: _orderAddrs()
+* Description: Orders the addresses returned by getaddrinfo() for connection
+*              attempts as RFC 8305 recommends: alternating between address
+*              families, starting with the family of the first address.
+* Parameters: struct addrinfo *res - The getaddrinfo() results.
+*             struct addrinfo **addrs - Filled in with the ordered addresses.
+*             int max - The capacity of addrs.
+* Preconditions: None.
+* Returns: The number of addresses stored in addrs.
+*******************************************************************************/
+
+static int _orderAddrs(struct addrinfo *res, struct addrinfo **addrs,
+                       int max) {
+    struct addrinfo *first = res, *other = res;
+    int n = 0;
+
+    while (n < max && (first != NULL || other != NULL)) {
+        /* Advance each cursor to its next address of the right family. */
+        while (first != NULL && first->ai_family != res->ai_family) {
+            first = first->ai_next;
+        }
+        while (other != NULL && other->ai_family == res->ai_family) {
+            other = other->ai_next;
+        }
+        if (first != NULL) {
+            addrs[n++] = first;
+            first = first->ai_next;
+        }
+        if (other != NULL && n < max) {
+            addrs[n++] = other;
+            other = other->ai_next;
+        }
+    }
+    return n;
+}
+
+/*******************************************************************************
+* Function: _startConnect()
+* Description: Creates a non-blocking socket for an address and starts
+*              connecting it.
+* Parameters: struct addrinfo *p - The address.
+* Preconditions: None.
+* Returns: The socket file descriptor, or -1 if the attempt failed at once.
+*******************************************************************************/
+
+static int _startConnect(struct addrinfo *p) {
+    int sockfd;
+
+    if ((sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                         p->ai_protocol)) == -1) {
+        perror("chatclient: socket");
+        return -1;
+    }
+    if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1 &&
+        errno != EINPROGRESS) {
+        perror("chatclient: connect");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
 /*******************************************************************************
 * Function: formConnection()
 * Description: Creates a TCP socket at a system-selected port, attempts to
 *              connect to the hostname and port passed as parameters, and
-*              returns the socket file descriptor on success and exits with an
-*              error on failure. Please note that this code is based on code
-*              from Beej's Guide available under the header "A Simple Stream
-*              Client."
+*              returns the socket file descriptor on success and prints an
+*              error on failure. Connection attempts race one another in the
+*              manner of RFC 8305 ("Happy Eyeballs"): the addresses are tried
+*              in turn, alternating between IPv6 and IPv4, and a new attempt
+*              starts whenever the previous one fails or has not succeeded
+*              within CONNECT_ATTEMPT_DELAY_MS, without abandoning the
+*              attempts already in progress. The first to connect wins.
+*              Please note that this code is based on code from Beej's Guide
+*              available under the header "A Simple Stream Client."
 * Parameters: char *host - A string containing the hostname.
 *             char *port - A string containing the port number.
+*             int timeoutMs - The time allowed for connecting, in
+*                             milliseconds, or 0 to wait indefinitely.
 * Preconditions: The hostname and port have been properly validated.
-* Returns: The socket file descriptor of the connected socket on success.
+* Returns: The socket file descriptor of the connected socket on success, -1
+*          on failure.
 *******************************************************************************/
 
-int formConnection(char *host, char *port) {
-    struct addrinfo hints, *res, *p;
-    int status, sockfd;
+int formConnection(char *host, char *port, int timeoutMs) {
+    struct addrinfo hints, *res, *addrs[CONNECT_MAX_ADDRS];
+    struct pollfd fds[CONNECT_MAX_ADDRS];
+    long long now, deadline, nextStart;
+    int status, numAddrs, next = 0, numFds = 0, sockfd = -1, wait, err, i;
+    socklen_t errLen;
 
     /* Prefill the hints addrinfo struct with the SOCK_STREAM socket type and
      * don't specify whether the address is IPv4 or IPv6.
@@ -41,55 +132,139 @@ int formConnection(char *host, char *port) {
     hints.ai_socktype = SOCK_STREAM;
 
     /* Attempt to us getaddrinfo() to fill in the res addrinfo struct. If there
-     * is an error, print it to stderr and exit with an error.
+     * is an error, print it to stderr and fail.
      */
 
     if ((status = getaddrinfo(host, port, &hints, &res)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-        exit(2);
+        return -1;
     }
+    numAddrs = _orderAddrs(res, addrs, CONNECT_MAX_ADDRS);
 
-    /* getaddrinfo() may return more than one potential address match, so we
-     * need to iterate through the res linked list in order to find the first
-     * one that allows us to connect to it.
-     */
-
-    for (p = res; p != NULL; p = p->ai_next) {
-        /* Attempt to create a socket with the correct address family, socket
-         * type (SOCK_STREAM), and protocol (TCP). If this operation fails,
-         * print an error and go to the next address candidate.
+    now = clockMs();
+    deadline = timeoutMs > 0 ? now + timeoutMs : -1;
+    nextStart = now;
+    while (sockfd == -1 && (next < numAddrs || numFds > 0)) {
+        now = clockMs();
+        if (deadline != -1 && now >= deadline) {
+            fprintf(stderr, "chatclient: connection timed out\n");
+            break;
+        }
+        /* Start the next attempt when its turn comes, or at once if no
+         * attempt is in progress.
          */
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, 
-                             p->ai_protocol)) == -1) {
-            perror("chatclient: socket");
+        if (next < numAddrs && (now >= nextStart || numFds == 0)) {
+            if ((fds[numFds].fd = _startConnect(addrs[next++])) != -1) {
+                fds[numFds].events = POLLOUT;
+                fds[numFds++].revents = 0;
+                nextStart = now + CONNECT_ATTEMPT_DELAY_MS;
+            } else {
+                nextStart = now;
+            }
             continue;
         }
-        /* Attempt to connect the created socket to the current address
-         * candidate. If an error occurs, print it and exit. Otherwise,
-         * we can break out of the loop.
+        /* Wait for an attempt to finish, the next attempt to start or the
+         * deadline, whichever comes first.
          */
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("chatclient: connect");
-            continue;
+        wait = -1;
+        if (next < numAddrs) {
+            wait = nextStart - now;
         }
-        break;
+        if (deadline != -1 && (wait == -1 || deadline - now < wait)) {
+            wait = deadline - now;
+        }
+        if (poll(fds, numFds, wait) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("chatclient: poll");
+            break;
+        }
+        for (i = 0; i < numFds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            errLen = sizeof err;
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err,
+                           &errLen) == -1) {
+                err = errno;
+            }
+            if (err == 0) {
+                sockfd = fds[i].fd;
+                fds[i] = fds[--numFds];
+                break;
+            }
+            fprintf(stderr, "chatclient: connect: %s\n", strerror(err));
+            close(fds[i].fd);
+            /* The next address need not wait for a failed attempt. */
+            fds[i--] = fds[--numFds];
+            nextStart = now;
+        }
+    }
+    /* Abandon the attempts that lost the race. */
+    for (i = 0; i < numFds; i++) {
+        close(fds[i].fd);
     }
 
     /* Free the memory allocated for the res addrinfo struct. */
     freeaddrinfo(res);
 
-    /* If we've reached the end of the linked list without finding a match,
-     * then print an error and exit. 
-     */
-    if (p == NULL) {
+    /* If every candidate failed, print an error and fail. */
+    if (sockfd == -1) {
         fprintf(stderr, "chatclient: failed to connect\n");
-        exit(2);
+        return -1;
     }
+    /* The rest of the client expects a blocking socket. */
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
 
     return sockfd;
 }
 
+/*******************************************************************************
+* Function: chatSendv()
+* Description: Sends the concatenation of several buffers with sendmsg(), or
+*              through TLS on a TLS socket, resuming after partial writes
+*              without copying the buffers into one.
+* Parameters: int sockfd - The socket file descriptor.
+*             struct iovec *iov - The buffers. Entries are modified to track
+*                                 progress through partial writes.
+*             int iovcnt - The number of buffers, at most IOV_MAX.
+*             int flags - Flags for sendmsg(), e.g. MSG_MORE.
+* Preconditions: The socket has been correctly formed.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+int chatSendv(int sockfd, struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        if ((sent = tlsSendmsg(sockfd, &msg, flags | MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        /* Skip the buffers that were sent completely, then advance into the
+         * first buffer that was sent partially.
+         */
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
 /*******************************************************************************
 * Function: chatSend()
 * Description: Attempts to send the entirety of a chat message to the server.
@@ -102,54 +277,649 @@ int formConnection(char *host, char *port) {
 *******************************************************************************/
 
 void chatSend(int sockfd, char *message, int msgLen) {
-    /* We will keep track of the total number of bytes send as well as the 
-     * bytes sent by a current instance of send().
+    struct iovec iov;
+
+    iov.iov_base = message;
+    iov.iov_len = msgLen;
+    /* If an error occurs, exit with an error message. */
+    if (chatSendv(sockfd, &iov, 1, 0) == -1) {
+        perror("send");
+        exit(-1);
+    }
+}
+
+/*******************************************************************************
+* Function: chatSendPing()
+* Description: Sends a PING frame, or the PONG frame that answers one.
+* Parameters: int sockfd - The socket file descriptor.
+*             int type - FRAME_PING or FRAME_PONG.
+*             uint64_t token - The token to send, or for a PONG, that of
+*                              the PING answered.
+* Preconditions: Both sides negotiated FEAT_KEEPALIVE.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+int chatSendPing(int sockfd, int type, uint64_t token) {
+    char frame[FRAME_V2_HEADER + FRAME_PING_LEN];
+    struct iovec iov;
+
+    iov.iov_base = frame;
+    iov.iov_len = frameEncodePing(frame, type, token);
+    return chatSendv(sockfd, &iov, 1, 0);
+}
+
+/*******************************************************************************
+* Function: socketKeepalive()
+* Description: Has the kernel probe a peer that cannot be pinged once the
+*              connection has been idle for a while, and fail the socket if
+*              the probe goes unanswered, or if data sent goes
+*              unacknowledged for as long as both.
+* Parameters: int sockfd - The socket file descriptor.
+*             int idleMs - The idle time before probing.
+*             int graceMs - The time allowed for the answer.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void socketKeepalive(int sockfd, int idleMs, int graceMs) {
+    int yes = 1, one = 1, idle = idleMs / 1000, grace = graceMs / 1000;
+    unsigned timeout = idleMs + graceMs;
+
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof yes);
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &grace, sizeof grace);
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &one, sizeof one);
+    setsockopt(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout,
+               sizeof timeout);
+}
+
+/*******************************************************************************
+* Function: _fillMsgIov()
+* Description: Describes one chat message as separate buffers: the header,
+*              the handle, the handle suffix, the body and, for version 1,
+*              the null terminator. Only the header is formatted; nothing is
+*              copied.
+* Parameters: struct iovec *iov - At least SEND_MSG_IOV entries to fill.
+*             int *iovcnt - Incremented by the number of entries filled.
+*             char *header - FRAME_MAX_HEADER bytes to format the header into.
+*             int version - The protocol version.
+*             const struct frameMeta *meta - The version 2 header fields.
+*             char *handle - The handle string, or NULL for a piece of a
+*                            streamed message other than the first.
+*             char *body - The message body.
+*             int bodyLen - The length of the body in bytes.
+* Preconditions: The handle and body have been validated.
+* Returns: The total length of the message in bytes.
+*******************************************************************************/
+
+static int _fillMsgIov(struct iovec *iov, int *iovcnt, char *header,
+                       int version, const struct frameMeta *meta,
+                       char *handle, char *body, int bodyLen) {
+    static char suffix[] = "> ";
+    int handleLen = handle ? strlen(handle) : 0;
+    int payloadLen = bodyLen + (handle ? handleLen + 2 : 0);
+    int headerLen, n = 0;
+
+    headerLen = frameEncodeHeader(header, version, meta, payloadLen);
+    iov[n].iov_base = header;
+    iov[n++].iov_len = headerLen;
+    if (handle) {
+        iov[n].iov_base = handle;
+        iov[n++].iov_len = handleLen;
+        iov[n].iov_base = suffix;
+        iov[n++].iov_len = 2;
+    }
+    iov[n].iov_base = body;
+    iov[n++].iov_len = bodyLen;
+    if (version == FRAME_V1) {
+        /* The terminator of the suffix string doubles as the message's. */
+        iov[n].iov_base = suffix + 2;
+        iov[n++].iov_len = 1;
+        payloadLen++;
+    }
+    *iovcnt += n;
+    return headerLen + payloadLen;
+}
+
+/*******************************************************************************
+* Function: chatSendMsg()
+* Description: Sends one chat message with a single sendmsg() call, gathering
+*              the header, handle and body from separate buffers.
+* Parameters: int sockfd - The socket file descriptor.
+*             int version - The protocol version.
+*             char *handle - The handle string.
+*             char *body - The message body.
+*             int bodyLen - The length of the body in bytes.
+* Preconditions: The socket has been correctly formed. The handle and body
+*                have been validated.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+int chatSendMsg(int sockfd, int version, char *handle, char *body,
+                int bodyLen) {
+    struct frameMeta meta = { FRAME_MSG, 0, 0, 0, 0, 0 };
+    struct iovec iov[SEND_MSG_IOV];
+    char header[FRAME_MAX_HEADER];
+    int iovcnt = 0;
+
+    _fillMsgIov(iov, &iovcnt, header, version, &meta, handle, body, bodyLen);
+    return chatSendv(sockfd, iov, iovcnt, 0);
+}
+
+/*******************************************************************************
+* Function: sendQueueInit()
+* Description: Prepares an empty send queue.
+* Parameters: struct sendQueue *sq - The send queue.
+*             int version - The protocol version of queued messages.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void sendQueueInit(struct sendQueue *sq, int version) {
+    sq->version = version;
+    sq->numMsgs = 0;
+    sq->iovcnt = 0;
+    sq->bytes = 0;
+}
+
+/*******************************************************************************
+* Function: sendQueueFlush()
+* Description: Sends every message in a send queue with one sendmsg() call
+*              and empties the queue.
+* Parameters: struct sendQueue *sq - The send queue.
+*             int sockfd - The socket file descriptor.
+*             int more - Nonzero if more messages will follow at once, in
+*                        which case MSG_MORE lets the kernel coalesce them.
+* Preconditions: Every queued body is still valid.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+int sendQueueFlush(struct sendQueue *sq, int sockfd, int more) {
+    int status = 0;
+
+    if (sq->iovcnt > 0) {
+        status = chatSendv(sockfd, sq->iov, sq->iovcnt, more ? MSG_MORE : 0);
+    }
+    sq->numMsgs = 0;
+    sq->iovcnt = 0;
+    sq->bytes = 0;
+    return status;
+}
+
+/*******************************************************************************
+* Function: sendQueueAdd()
+* Description: Queues a chat message. The body is referenced, not copied, so
+*              it must remain valid until the queue is flushed. A full queue
+*              is flushed with MSG_MORE first.
+* Parameters: struct sendQueue *sq - The send queue.
+*             int sockfd - The socket file descriptor.
+*             const struct frameMeta *meta - The version 2 header fields, or
+*                                            NULL for a plain chat message.
+*             char *handle - The handle string, or NULL for a piece of a
+*                            streamed message other than the first.
+*             char *body - The message body.
+*             int bodyLen - The length of the body in bytes.
+* Preconditions: The handle and body have been validated.
+* Returns: 0 on success, -1 if flushing a full queue failed.
+*******************************************************************************/
+
+int sendQueueAdd(struct sendQueue *sq, int sockfd,
+                 const struct frameMeta *meta, char *handle, char *body,
+                 int bodyLen) {
+    static const struct frameMeta plain = { FRAME_MSG, 0, 0, 0, 0, 0 };
+
+    if (sq->numMsgs == SEND_QUEUE_MSGS &&
+        sendQueueFlush(sq, sockfd, 1) == -1) {
+        return -1;
+    }
+    sq->bytes += _fillMsgIov(sq->iov + sq->iovcnt, &sq->iovcnt,
+                             sq->headers[sq->numMsgs], sq->version,
+                             meta ? meta : &plain, handle, body, bodyLen);
+    sq->numMsgs++;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _awaitFrame()
+* Description: Reads from a blocking socket until the reader holds a complete
+*              frame, waiting at most HANDSHAKE_TIMEOUT_MS for each read, so
+*              that a server that accepts the connection but never answers,
+*              or one that is not there any more, is not waited for
+*              forever.
+* Parameters: int sockfd - The socket file descriptor.
+*             struct frameReader *fr - The reader.
+*             struct frameView *view - Set to the frame.
+* Preconditions: The socket is in blocking mode.
+* Returns: 1 on success, 0 if the connection was closed, failed or timed
+*          out first, with errno ETIMEDOUT if it timed out, or -1 if what
+*          was received is not a frame.
+*******************************************************************************/
+
+static int _awaitFrame(int sockfd, struct frameReader *fr,
+                       struct frameView *view) {
+    struct pollfd pfd;
+    long long deadline;
+    ssize_t n;
+    int status, wait, ready;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    while ((status = frameReaderNext(fr, view)) == 0) {
+        if (!tlsPending(sockfd)) {
+            /* A signal must not cut the wait short, nor extend it. */
+            deadline = clockMs() + HANDSHAKE_TIMEOUT_MS;
+            wait = HANDSHAKE_TIMEOUT_MS;
+            while ((ready = poll(&pfd, 1, wait)) == -1 && errno == EINTR) {
+                wait = deadline - clockMs();
+                if (wait < 0) {
+                    wait = 0;
+                }
+            }
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            /* Reading after a failed poll might block for good. */
+            if (ready == -1) {
+                return 0;
+            }
+        }
+        /* A TLS socket may have taken in a ticket rather than data. */
+        if ((n = frameReaderFill(fr, sockfd)) == 0 ||
+            (n == -1 && errno != EAGAIN)) {
+            return 0;
+        }
+    }
+    return status;
+}
+
+/*******************************************************************************
+* Function: _encodeHello()
+* Description: Formats the preamble and a HELLO frame offering features.
+* Parameters: char *hello - FRAME_PREAMBLE_LEN + FRAME_V2_HEADER +
+*                           FRAME_HELLO_LEN bytes to format them into.
+*             unsigned features - The features to request.
+* Preconditions: None.
+* Returns: The length of what was formatted.
+*******************************************************************************/
+
+static size_t _encodeHello(char *hello, unsigned features) {
+    memcpy(hello, FRAME_PREAMBLE, FRAME_PREAMBLE_LEN);
+    return FRAME_PREAMBLE_LEN +
+           frameEncodeHello(hello + FRAME_PREAMBLE_LEN, features);
+}
+
+/*******************************************************************************
+* Function: _awaitHello()
+* Description: Awaits the server's HELLO, which must be its first frame.
+* Parameters: int sockfd - The socket file descriptor.
+*             struct frameReader *fr - A reader initialized with version 0.
+*             unsigned features - The features requested.
+*             unsigned *accepted - Set to the features the server accepted.
+* Preconditions: The HELLO has been sent. The socket is in blocking mode.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _awaitHello(int sockfd, struct frameReader *fr, unsigned features,
+                       unsigned *accepted) {
+    struct frameView view;
+    int status;
+
+    if ((status = _awaitFrame(sockfd, fr, &view)) == 0) {
+        fprintf(stderr, "chatclient: server %s during the handshake; try -1 "
+                        "for a legacy server\n", errno == ETIMEDOUT ?
+                        "did not answer" : "closed the connection");
+        return -1;
+    }
+    if (status == -1 || fr->version != FRAME_V2 ||
+        view.meta.type != FRAME_HELLO ||
+        frameDecodeHello(&view, accepted) != FRAME_V2) {
+        fprintf(stderr, "chatclient: server does not speak protocol "
+                        "version 2; try -1 for a legacy server\n");
+        return -1;
+    }
+    *accepted &= features;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _awaitAck()
+* Description: Awaits the server's answer to a SESSION frame, an ACK that
+*              reports the last message it received in the session.
+* Parameters: int sockfd - The socket file descriptor.
+*             struct frameReader *fr - The reader used for the handshake.
+*             uint32_t *lastSeq - Set to the sequence number acknowledged.
+* Preconditions: The SESSION frame has been sent. The socket is in blocking
+*                mode.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _awaitAck(int sockfd, struct frameReader *fr, uint32_t *lastSeq) {
+    struct frameView view;
+    int status;
+
+    if ((status = _awaitFrame(sockfd, fr, &view)) == 0) {
+        fprintf(stderr, "chatclient: server %s while resuming the "
+                        "session\n", errno == ETIMEDOUT ? "did not answer" :
+                        "closed the connection");
+        return -1;
+    }
+    if (status == -1 || view.meta.type != FRAME_ACK ||
+        frameDecodeAck(&view, lastSeq) == -1) {
+        fprintf(stderr, "chatclient: server did not accept the session\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: chatHandshake()
+* Description: Negotiates protocol version 2 on a freshly connected socket.
+*              The preamble and a HELLO frame offering the requested features
+*              are sent, then the server's HELLO is awaited. Any frames that
+*              arrive behind it are left in the reader.
+* Parameters: int sockfd - The connected socket file descriptor.
+*             struct frameReader *fr - A reader initialized with version 0.
+*             unsigned features - The features to request.
+*             unsigned *accepted - Set to the features the server accepted.
+* Preconditions: The socket is in blocking mode.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int chatHandshake(int sockfd, struct frameReader *fr, unsigned features,
+                  unsigned *accepted) {
+    char hello[FRAME_PREAMBLE_LEN + FRAME_V2_HEADER + FRAME_HELLO_LEN];
+    struct iovec iov;
+
+    iov.iov_base = hello;
+    iov.iov_len = _encodeHello(hello, features);
+    if (chatSendv(sockfd, &iov, 1, 0) == -1) {
+        perror("chatclient: handshake");
+        return -1;
+    }
+    return _awaitHello(sockfd, fr, features, accepted);
+}
+
+/*******************************************************************************
+* Function: chatHandshakeResume()
+* Description: Negotiates protocol version 2 and resumes a session in one
+*              round trip, for a client that already knows that the server
+*              keeps sessions: the SESSION frame is sent right behind the
+*              HELLO, then the server's HELLO and ACK are awaited. On a TLS
+*              socket resuming a TLS session, both frames travel as early
+*              data with the handshake. Any frames that arrive behind the ACK
+*              are left in the reader.
+* Parameters: int sockfd - The connected socket file descriptor.
+*             struct frameReader *fr - A reader initialized with version 0.
+*             unsigned features - The features to request, which include
+*                                 FEAT_RESUME.
+*             unsigned *accepted - Set to the features the server accepted.
+*             uint64_t id - The session id.
+*             char *handle - The validated handle.
+*             uint32_t *lastSeq - Set to the sequence number acknowledged.
+* Preconditions: The socket is in blocking mode.
+* Returns: 0 on success, -1 on failure, including if the server no longer
+*          keeps sessions.
+*******************************************************************************/
+
+int chatHandshakeResume(int sockfd, struct frameReader *fr,
+                        unsigned features, unsigned *accepted, uint64_t id,
+                        char *handle, uint32_t *lastSeq) {
+    char hello[FRAME_PREAMBLE_LEN + FRAME_V2_HEADER + FRAME_HELLO_LEN];
+    char session[FRAME_V2_HEADER + FRAME_SESSION_ID + MAX_HANDLE_LEN];
+    struct iovec iov[2];
+
+    iov[0].iov_base = hello;
+    iov[0].iov_len = _encodeHello(hello, features);
+    iov[1].iov_base = session;
+    iov[1].iov_len = frameEncodeSession(session, id, handle);
+    if (chatSendv(sockfd, iov, 2, 0) == -1) {
+        perror("chatclient: handshake");
+        return -1;
+    }
+    if (_awaitHello(sockfd, fr, features, accepted) == -1) {
+        return -1;
+    }
+    if (!(*accepted & FEAT_RESUME)) {
+        fprintf(stderr, "chatclient: server no longer resumes sessions\n");
+        return -1;
+    }
+    return _awaitAck(sockfd, fr, lastSeq);
+}
+
+/*******************************************************************************
+* Function: chatResume()
+* Description: Starts or resumes a session on a connection that negotiated
+*              FEAT_RESUME. The SESSION frame is sent, then the server's ACK,
+*              which reports the last message it received in the session, is
+*              awaited. Any frames that arrive behind it are left in the
+*              reader.
+* Parameters: int sockfd - The connected socket file descriptor.
+*             struct frameReader *fr - The reader used for the handshake.
+*             uint64_t id - The session id.
+*             char *handle - The validated handle.
+*             uint32_t *lastSeq - Set to the sequence number acknowledged.
+* Preconditions: chatHandshake() succeeded. The socket is in blocking mode.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int chatResume(int sockfd, struct frameReader *fr, uint64_t id, char *handle,
+               uint32_t *lastSeq) {
+    char frame[FRAME_V2_HEADER + FRAME_SESSION_ID + MAX_HANDLE_LEN];
+    struct iovec iov;
+
+    iov.iov_base = frame;
+    iov.iov_len = frameEncodeSession(frame, id, handle);
+    if (chatSendv(sockfd, &iov, 1, 0) == -1) {
+        perror("chatclient: session");
+        return -1;
+    }
+    return _awaitAck(sockfd, fr, lastSeq);
+}
+
+/*******************************************************************************
+* Function: replayQueueInit()
+* Description: Prepares an empty replay queue.
+* Parameters: struct replayQueue *rq - The replay queue.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void replayQueueInit(struct replayQueue *rq) {
+    memset(rq, 0, sizeof *rq);
+}
+
+/*******************************************************************************
+* Function: replayQueueFree()
+* Description: Releases the buffers of a replay queue.
+* Parameters: struct replayQueue *rq - The replay queue.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void replayQueueFree(struct replayQueue *rq) {
+    free(rq->data);
+    free(rq->recs);
+    replayQueueInit(rq);
+}
+
+/*******************************************************************************
+* Function: replayQueueAdd()
+* Description: Assigns a chat message the next sequence number in the session
+*              and appends it to the queue, encoded, to be sent by the next
+*              replayQueueFlush(). Unlike sendQueueAdd(), the message is
+*              copied, since it must outlive the caller's buffers.
+* Parameters: struct replayQueue *rq - The replay queue.
+*             const struct frameMeta *meta - The header fields, or NULL for
+*                                            a plain chat message.
+*             char *handle - The handle string, or NULL for a piece of a
+*                            streamed message other than the first.
+*             char *body - The message body.
+*             int bodyLen - The length of the body in bytes.
+* Preconditions: The handle and body have been validated.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+int replayQueueAdd(struct replayQueue *rq, const struct frameMeta *meta,
+                   char *handle, char *body, int bodyLen) {
+    struct frameMeta seqMeta = { FRAME_MSG, 0, 0, 0, 0, 0 };
+    struct iovec iov[SEND_MSG_IOV];
+    char header[FRAME_MAX_HEADER];
+    struct replayRec *recs;
+    size_t frameLen, newCap;
+    int iovcnt = 0, i;
+    char *data;
+
+    if (meta != NULL) {
+        seqMeta = *meta;
+    }
+    seqMeta.flags |= FRAME_F_SEQ;
+    seqMeta.seq = rq->lastSeq + 1;
+    frameLen = _fillMsgIov(iov, &iovcnt, header, FRAME_V2, &seqMeta, handle,
+                           body, bodyLen);
+
+    if (rq->len + frameLen > rq->cap) {
+        newCap = rq->cap ? rq->cap : LINE_BUF_SIZE;
+        while (newCap < rq->len + frameLen) {
+            newCap *= 2;
+        }
+        if ((data = realloc(rq->data, newCap)) == NULL) {
+            return -1;
+        }
+        rq->data = data;
+        rq->cap = newCap;
+    }
+    if (rq->recHead + rq->numRecs == rq->recCap) {
+        newCap = rq->recCap ? rq->recCap * 2 : 64;
+        if ((recs = realloc(rq->recs, newCap * sizeof *recs)) == NULL) {
+            return -1;
+        }
+        rq->recs = recs;
+        rq->recCap = newCap;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(rq->data + rq->len, iov[i].iov_base, iov[i].iov_len);
+        rq->len += iov[i].iov_len;
+    }
+    rq->recs[rq->recHead + rq->numRecs].seq = seqMeta.seq;
+    rq->recs[rq->recHead + rq->numRecs].len = frameLen;
+    rq->numRecs++;
+    rq->lastSeq = seqMeta.seq;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: replayQueueFlush()
+* Description: Sends every queued message that has not been sent yet.
+* Parameters: struct replayQueue *rq - The replay queue.
+*             int sockfd - The socket file descriptor.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure with errno set. On failure, the
+*          messages stay queued.
+*******************************************************************************/
+
+int replayQueueFlush(struct replayQueue *rq, int sockfd) {
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t status;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    while (rq->sent < rq->len) {
+        iov.iov_base = rq->data + rq->sent;
+        iov.iov_len = rq->len - rq->sent;
+        status = tlsSendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        rq->sent += status;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: replayQueueAck()
+* Description: Discards every message up to and including the given sequence
+*              number, which the server has acknowledged.
+* Parameters: struct replayQueue *rq - The replay queue.
+*             uint32_t seq - The acknowledged sequence number.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void replayQueueAck(struct replayQueue *rq, uint32_t seq) {
+    struct replayRec *rec;
+
+    while (rq->numRecs > 0) {
+        rec = &rq->recs[rq->recHead];
+        /* Compare through the difference so that wrapping is harmless. */
+        if ((int32_t)(rec->seq - seq) > 0) {
+            break;
+        }
+        rq->start += rec->len;
+        rq->recHead++;
+        rq->numRecs--;
+    }
+    if (rq->sent < rq->start) {
+        rq->sent = rq->start;
+    }
+    /* Move the remaining messages to the front once the acknowledged ones
+     * take up half of the buffer.
      */
-    int totalSent = 0;
-    int currSent;
-    /* While there are still bytes to be sent...*/
-    while (totalSent < msgLen) {
-        /* Send the remainder of the message to the server. If an error 
-         * occurs, exit with an error message.
-         */
-        if ((currSent = send(sockfd, &message[totalSent], msgLen-totalSent,
-                             0)) == -1){
-            perror("send");
-            exit(-1);
-        }; 
-        /* Increment the total amount of bytes sent. */
-        totalSent += currSent;
+    if (rq->start > 0 && (rq->start == rq->len || rq->start >= rq->cap / 2)) {
+        memmove(rq->data, rq->data + rq->start, rq->len - rq->start);
+        rq->sent -= rq->start;
+        rq->len -= rq->start;
+        rq->start = 0;
+        memmove(rq->recs, rq->recs + rq->recHead,
+                rq->numRecs * sizeof *rq->recs);
+        rq->recHead = 0;
     }
 }
 
+/*******************************************************************************
+* Function: replayQueueRewind()
+* Description: Marks every unacknowledged message as unsent, so that the next
+*              replayQueueFlush() sends them again on a new connection.
+* Parameters: struct replayQueue *rq - The replay queue.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void replayQueueRewind(struct replayQueue *rq) {
+    rq->sent = rq->start;
+}
+
 /*******************************************************************************
 * Function: _chatReceiveHelper()
-* Description: An ancillary function for chatReceive() that is used to first 
-*              obtain the number of bytes int the body of the message
-*              and then in a separate instance used to obtain the message body.
+* Description: An ancillary function for the receive functions that reads
+*              exactly msgLen bytes from the socket directly into the
+*              destination buffer. The destination is neither cleared nor
+*              scanned; the number of bytes received so far is the offset
+*              of the next read.
 * Parameters: int sockfd - The socket file descriptor.
-*             char *message - The message string buffer.
-*             int msgLen - The length of the message to be received.
-* Preconditions: The socket has been initialized. The message buffer is msgLen
-*                in size, and msgLen is accurate.
-* Returns: An error status on failure of recv(). Otherwise, the final error 
-*          status of the successful recv() is returned. The result is stored in
-*          the message buffer.
+*             char *message - The destination buffer.
+*             int msgLen - The number of bytes to receive.
+* Preconditions: The socket has been initialized. The destination buffer holds
+*                at least msgLen bytes.
+* Returns: 0 if the connection was closed, -1 on a recv() error, and the
+*          number of bytes received otherwise.
 *******************************************************************************/
 
 int _chatReceiveHelper(int sockfd, char *message, int msgLen) {
-    char buffer[MAX_BYTES];
     int bytesReceived = 0;
     int status;
 
-    /* While not all bytes in the current message section have been received,
-     * reset the local string buffer, call recv() to store new characters in
-     * the buffer, and concatenate the buffer to the message.
-     */
     while (bytesReceived < msgLen) {
-        memset(buffer, 0, sizeof buffer);
-
-        status = recv(sockfd, buffer, msgLen - bytesReceived, 0);
+        status = recv(sockfd, message + bytesReceived, msgLen - bytesReceived,
+                      0);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
         /* If no bytes are received print an error and return the error
          * status.
          */
@@ -157,10 +927,78 @@ int _chatReceiveHelper(int sockfd, char *message, int msgLen) {
             printf("Server ended connection.\n");
             return status;
         }
-        strcat(message, buffer);
+        if (status == -1) {
+            perror("recv");
+            return status;
+        }
         bytesReceived += status;
     }
 
+    return bytesReceived;
+}
+
+/*******************************************************************************
+* Function: _parseHeader()
+* Description: Converts the three digit byte count header to a number.
+* Parameters: const char *header - The PREFIX_OFFSET header characters.
+* Preconditions: None.
+* Returns: The byte count, or -1 if the header is not all digits.
+*******************************************************************************/
+
+static int _parseHeader(const char *header) {
+    int msgLen = 0;
+    int i;
+
+    for (i = 0; i < PREFIX_OFFSET; i++) {
+        if (!isdigit((unsigned char)header[i])) {
+            return -1;
+        }
+        msgLen = msgLen * 10 + (header[i] - '0');
+    }
+    return msgLen;
+}
+
+/*******************************************************************************
+* Function: chatReceiveView()
+* Description: Receives one chat message directly into the caller's buffer.
+*              The header is received at the start of the buffer and the body
+*              immediately after it, so the complete frame is left in the
+*              buffer without any intermediate copies, and the body is
+*              described by a length-aware view.
+* Parameters: int sockfd - The socket file descriptor.
+*             char *buffer - The frame buffer.
+*             int bufferLen - The length of the frame buffer.
+*             struct msgView *view - Set to the body, without its null
+*                                    terminator, on success.
+* Preconditions: The socket has been correctly initialized.
+* Returns: 0 if the connection was closed, -1 on error or a malformed header,
+*          and a positive value on success.
+*******************************************************************************/
+
+int chatReceiveView(int sockfd, char *buffer, int bufferLen,
+                    struct msgView *view) {
+    int status, msgLen;
+
+    /* Get the numeric message prefix. */
+    if ((status = _chatReceiveHelper(sockfd, buffer, PREFIX_OFFSET)) <= 0) {
+        return status;
+    }
+    msgLen = _parseHeader(buffer);
+    if (msgLen < 1 || msgLen > bufferLen - PREFIX_OFFSET) {
+        fprintf(stderr, "chatclient: malformed message header\n");
+        return -1;
+    }
+    /* Receive the body right behind the header. */
+    if ((status = _chatReceiveHelper(sockfd, buffer + PREFIX_OFFSET,
+                                     msgLen)) <= 0) {
+        return status;
+    }
+    /* The byte count includes the null terminator. Enforce it rather than
+     * trusting the peer.
+     */
+    buffer[PREFIX_OFFSET + msgLen - 1] = '\0';
+    view->data = buffer + PREFIX_OFFSET;
+    view->len = msgLen - 1;
     return status;
 }
 
@@ -168,7 +1006,7 @@ int _chatReceiveHelper(int sockfd, char *message, int msgLen) {
 * Function: chatReceive()
 * Description: Receives the chat header of three characters indicating the 
 *              length of the message body to follow, then receives the chat 
-*              message body.
+*              message body directly into the message buffer.
 * Parameters: int sockfd - The socket file descriptor.
 *             char *message - The message buffer.
 * Preconditions: The socket has been correctly initialized. The message buffer
@@ -178,25 +1016,26 @@ int _chatReceiveHelper(int sockfd, char *message, int msgLen) {
 *******************************************************************************/
 
 int chatReceive(int sockfd, char *message) {
-    char header[PREFIX_OFFSET+1];
-    char body[MAX_BYTES];
-    long msgLen; 
+    char header[PREFIX_OFFSET];
+    int msgLen;
     int status;
-    /* Initialize the local string buffers. */
-    memset(header, 0, sizeof header);
-    memset(body, 0, sizeof body);
-    /* Get the numeric message prefix. */ 
-    status = _chatReceiveHelper(sockfd, header, PREFIX_OFFSET);
-    /* If failure occurs, return immediately. */
-    if (status == 0) {
-        return status;
+
+    /* Get the numeric message prefix. If failure occurs, return
+     * immediately.
+     */
+    if ((status = _chatReceiveHelper(sockfd, header, PREFIX_OFFSET)) <= 0) {
+        return 0;
     }
     /* Convert the message length to a number. */
-    msgLen = strtol(header, NULL, 10);
+    msgLen = _parseHeader(header);
+    if (msgLen < 1 || msgLen > MAX_BYTES - PREFIX_OFFSET) {
+        fprintf(stderr, "chatclient: malformed message header\n");
+        return 0;
+    }
     /* Use this number to receive the message body. */
-    status = _chatReceiveHelper(sockfd, body, msgLen);
-    /* Copy the local buffer to the message buffer parameter. */
-    strcpy(message, body);
-    /* Return the status returned by the helper function. */
+    if ((status = _chatReceiveHelper(sockfd, message, msgLen)) <= 0) {
+        return 0;
+    }
+    message[msgLen - 1] = '\0';
     return status;
 }
@@ -1,7 +1,7 @@
 /*******************************************************************************
 *      Filename: network.h
 *        Author: Maxwell Goldberg
-* Last Modified: 02.12.17
+* Last Modified: 10.16.26
 *   Description: The header file for network.c. Please see network.c for more 
 *                details.
 *******************************************************************************/
@@ -10,16 +10,120 @@
 #define NETWORK_H
 
 #include <stdio.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
-int formConnection(char *, char *);
+#include "validate.h"
+#include "frame.h"
+#include "tls.h"
+
+#define CONNECT_TIMEOUT_MS       10000   /* Default time allowed to connect. */
+#define CONNECT_ATTEMPT_DELAY_MS 250     /* Head start given to each attempt
+                                          * before the next one begins. */
+#define CONNECT_MAX_ADDRS        16      /* Addresses tried per connection. */
+#define RECONNECT_BASE_MS        100     /* First delay before reconnecting. */
+#define RECONNECT_MAX_MS         10000   /* Longest delay between attempts. */
+#define RECONNECT_TRIES          12      /* Attempts before giving up. */
+#define KEEPALIVE_IDLE_MS        45000   /* Silence from the server after
+                                          * which it is pinged: longer than
+                                          * the server waits to ping an idle
+                                          * client, so that its PINGs keep a
+                                          * quiet connection alive. */
+#define KEEPALIVE_GRACE_MS       15000   /* Time allowed for the answer. */
+#define HANDSHAKE_TIMEOUT_MS     10000   /* Time allowed for each answer of
+                                          * the server during the
+                                          * handshake. */
+
+#define SEND_MSG_IOV    5       /* Buffers per message: header, handle,
+                                 * handle suffix, body and, for version 1,
+                                 * terminator. */
+#define SEND_QUEUE_MSGS 128     /* Messages coalesced into one sendmsg(). */
+#define REPLAY_LIMIT    (256 * 1024)    /* Unacknowledged bytes at which
+                                         * input stops being read. */
+#define SEND_WINDOW     1024            /* Unacknowledged messages at which
+                                         * input stops being read. */
+#define HISTORY_PAGE    20              /* Messages requested by \history
+                                         * unless told otherwise. */
+#define HISTORY_START   UINT64_MAX      /* A cursor past the oldest message. */
+
+/* Chat messages waiting to be sent together. The queue refers to the caller's
+ * handle and body buffers rather than copying them.
+ */
+struct sendQueue {
+    struct iovec iov[SEND_QUEUE_MSGS * SEND_MSG_IOV];
+    char         headers[SEND_QUEUE_MSGS][FRAME_MAX_HEADER];
+    int          version;
+    int          numMsgs;
+    int          iovcnt;
+    size_t       bytes;
+};
+
+/* A sent message that the server has not yet acknowledged. */
+struct replayRec {
+    uint32_t seq;
+    size_t   len;       /* The length of the encoded frame. */
+};
+
+/* Messages sent in a resumable session, kept encoded until the server
+ * acknowledges them so that they can be sent again after a reconnect. The
+ * bytes from start to sent have been sent; those from sent to len have not.
+ */
+struct replayQueue {
+    char             *data;
+    size_t            start;
+    size_t            sent;
+    size_t            len;
+    size_t            cap;
+    struct replayRec *recs;     /* One per frame from start to len. */
+    int               recHead;
+    int               numRecs;
+    int               recCap;
+    uint32_t          lastSeq;  /* The last sequence number assigned. */
+};
+
+/* A length-aware view of a received message body. The body is also null
+ * terminated, but len makes scanning for the terminator unnecessary.
+ */
+struct msgView {
+    char *data;
+    int   len;
+};
+
+long long clockMs(void);
+int formConnection(char *, char *, int);
+int chatSendv(int, struct iovec *, int, int);
 void chatSend(int, char *msg, int);
+int chatSendPing(int, int, uint64_t);
+void socketKeepalive(int, int, int);
+int chatSendMsg(int, int, char *, char *, int);
+void sendQueueInit(struct sendQueue *, int);
+int sendQueueAdd(struct sendQueue *, int, const struct frameMeta *, char *,
+                 char *, int);
+int sendQueueFlush(struct sendQueue *, int, int);
 int chatReceive(int, char *);
+int chatReceiveView(int, char *, int, struct msgView *);
+int chatHandshake(int, struct frameReader *, unsigned, unsigned *);
+int chatHandshakeResume(int, struct frameReader *, unsigned, unsigned *,
+                        uint64_t, char *, uint32_t *);
+int chatResume(int, struct frameReader *, uint64_t, char *, uint32_t *);
+void replayQueueInit(struct replayQueue *);
+void replayQueueFree(struct replayQueue *);
+int replayQueueAdd(struct replayQueue *, const struct frameMeta *, char *,
+                   char *, int);
+int replayQueueFlush(struct replayQueue *, int);
+void replayQueueAck(struct replayQueue *, uint32_t);
+void replayQueueRewind(struct replayQueue *);
 
 #endif
@@ -0,0 +1,686 @@
+/*******************************************************************************
+*      Filename: search.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides chatserver's full-text search of the message log.
+*                An indexer thread follows the end of the log, reading the
+*                messages appended since it last looked in batches, and adds
+*                the words of each to an inverted index held in memory. The
+*                operator's searches are answered on the same thread, so the
+*                index needs no lock, and neither indexing nor searching ever
+*                holds up a shard. Hits are ranked with BM25, without its
+*                length normalization, newest first among equals.
+*******************************************************************************/
+
+#include "search.h"
+
+/* A position in the postings of one word of a search. */
+struct searchCursor {
+    const unsigned char *pos;
+    const unsigned char *end;
+    uint64_t             id;    /* The current message, or UINT64_MAX once
+                                 * the postings are exhausted. */
+    uint32_t             tf;
+    double               idf;
+};
+
+/* A message that matches a search. */
+struct searchHit {
+    uint64_t id;
+    double   score;
+};
+
+/*******************************************************************************
+* Function: _hashWord()
+* Description: Hashes a word with FNV-1a.
+* Parameters: const char *word - The null terminated word.
+* Preconditions: None.
+* Returns: The hash.
+*******************************************************************************/
+
+static uint32_t _hashWord(const char *word) {
+    uint32_t hash = 2166136261u;
+
+    while (*word != '\0') {
+        hash = (hash ^ (unsigned char)*word++) * 16777619u;
+    }
+    return hash;
+}
+
+/*******************************************************************************
+* Function: _isWordByte()
+* Description: Decides whether a byte is part of a word. Letters and digits
+*              are, as are all bytes of multibyte UTF-8 characters, so that
+*              words in other scripts are indexed whole.
+* Parameters: unsigned char c - The byte.
+* Preconditions: None.
+* Returns: Nonzero if it is part of a word.
+*******************************************************************************/
+
+static int _isWordByte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/*******************************************************************************
+* Function: _nextWord()
+* Description: Finds the next word of a text, lowercased and cut short at
+*              SEARCH_WORD_MAX bytes.
+* Parameters: const char **pos - Where to start. Advanced past the word.
+*             const char *end - The end of the text.
+*             char *word - At least SEARCH_WORD_MAX + 1 bytes. Filled in
+*                          with the null terminated word.
+* Preconditions: None.
+* Returns: The length of the word, or 0 if the text has no more words.
+*******************************************************************************/
+
+static int _nextWord(const char **pos, const char *end, char *word) {
+    const char *p = *pos;
+    unsigned char c;
+    int len = 0;
+
+    while (p < end && !_isWordByte(*p)) {
+        p++;
+    }
+    while (p < end && _isWordByte(*p)) {
+        c = *p++;
+        if (len < SEARCH_WORD_MAX) {
+            word[len++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+    }
+    word[len] = '\0';
+    *pos = p;
+    return len;
+}
+
+/*******************************************************************************
+* Function: _termSlot()
+* Description: Finds the slot of a word in the word table, or the empty slot
+*              where it belongs.
+* Parameters: struct searchTerm **terms - The table.
+*             unsigned cap - Its size, a power of two.
+*             const char *word - The word.
+* Preconditions: The table has an empty slot.
+* Returns: The slot.
+*******************************************************************************/
+
+static unsigned _termSlot(struct searchTerm **terms, unsigned cap,
+                          const char *word) {
+    unsigned i;
+
+    for (i = _hashWord(word) & (cap - 1); terms[i] != NULL;
+         i = (i + 1) & (cap - 1)) {
+        if (strcmp(terms[i]->word, word) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*******************************************************************************
+* Function: _growTerms()
+* Description: Doubles the size of the word table.
+* Parameters: struct searchIndex *idx - The index.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _growTerms(struct searchIndex *idx) {
+    unsigned cap = idx->termCap * 2, i;
+    struct searchTerm **terms;
+
+    if ((terms = calloc(cap, sizeof *terms)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < idx->termCap; i++) {
+        if (idx->terms[i] != NULL) {
+            terms[_termSlot(terms, cap, idx->terms[i]->word)] = idx->terms[i];
+        }
+    }
+    free(idx->terms);
+    idx->terms = terms;
+    idx->termCap = cap;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _termAdd()
+* Description: Finds a word in the index, adding it if it is new.
+* Parameters: struct searchIndex *idx - The index.
+*             const char *word - The word.
+* Preconditions: None.
+* Returns: The word's entry, or NULL on failure.
+*******************************************************************************/
+
+static struct searchTerm *_termAdd(struct searchIndex *idx, const char *word) {
+    struct searchTerm *t;
+    unsigned i = _termSlot(idx->terms, idx->termCap, word);
+
+    if (idx->terms[i] != NULL) {
+        return idx->terms[i];
+    }
+    /* Keep the table at most half full. */
+    if ((idx->numTerms + 1) * 2 > idx->termCap) {
+        if (_growTerms(idx) == -1) {
+            return NULL;
+        }
+        i = _termSlot(idx->terms, idx->termCap, word);
+    }
+    if ((t = calloc(1, sizeof *t)) == NULL) {
+        return NULL;
+    }
+    strcpy(t->word, word);
+    idx->terms[i] = t;
+    idx->numTerms++;
+    return t;
+}
+
+/*******************************************************************************
+* Function: _putVarint()
+* Description: Appends a number to a word's postings as a varint, seven bits
+*              per byte, low bits first, with the top bit set on every byte
+*              but the last.
+* Parameters: struct searchTerm *t - The word.
+*             uint64_t v - The number.
+* Preconditions: The postings have room for 10 more bytes.
+* Returns: None.
+*******************************************************************************/
+
+static void _putVarint(struct searchTerm *t, uint64_t v) {
+    while (v >= 0x80) {
+        t->postings[t->len++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    t->postings[t->len++] = (unsigned char)v;
+}
+
+/*******************************************************************************
+* Function: _getVarint()
+* Description: Reads a varint written by _putVarint().
+* Parameters: const unsigned char **pos - Where it starts. Advanced past it.
+*             const unsigned char *end - The end of the postings.
+* Preconditions: None.
+* Returns: The number.
+*******************************************************************************/
+
+static uint64_t _getVarint(const unsigned char **pos,
+                           const unsigned char *end) {
+    const unsigned char *p = *pos;
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (p < end && *p & 0x80) {
+        v |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    if (p < end) {
+        v |= (uint64_t)*p++ << shift;
+    }
+    *pos = p;
+    return v;
+}
+
+/*******************************************************************************
+* Function: _termPost()
+* Description: Posts the message being indexed to a word that occurs in it.
+* Parameters: struct searchTerm *t - The word.
+*             uint64_t id - The message id, greater than any posted before.
+* Preconditions: t->tf counts the word's occurrences in the message.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _termPost(struct searchTerm *t, uint64_t id) {
+    unsigned char *postings;
+    size_t cap;
+
+    if (t->cap - t->len < 20) {
+        cap = t->cap == 0 ? 16 : t->cap * 2;
+        if ((postings = realloc(t->postings, cap)) == NULL) {
+            return -1;
+        }
+        t->postings = postings;
+        t->cap = cap;
+    }
+    _putVarint(t, id - t->last);
+    _putVarint(t, t->tf);
+    t->last = id;
+    t->df++;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _indexMessage()
+* Description: Adds the words of a message to the index. Only the body is
+*              indexed, not the sender's handle that precedes it.
+* Parameters: struct searchIndex *idx - The index.
+*             struct logRecord *rec - The message.
+* Preconditions: Messages are indexed in id order.
+* Returns: None.
+*******************************************************************************/
+
+static void _indexMessage(struct searchIndex *idx, struct logRecord *rec) {
+    char word[SEARCH_WORD_MAX + 1];
+    struct frameView view;
+    struct searchTerm *t;
+    const char *p, *end;
+    int textLen, n = 0, i, failed = 0;
+    uint64_t id;
+    int64_t when;
+    char *text;
+
+    view.body = rec->frame + rec->hdrLen;
+    view.bodyLen = rec->len - rec->hdrLen;
+    if (frameDecodeHistory(&view, &id, &when, &text, &textLen) != 0) {
+        return;
+    }
+    end = text + textLen;
+    for (p = text; p + 1 < end && (p[0] != '>' || p[1] != ' '); p++) {
+    }
+    p = p + 1 < end ? p + 2 : text;
+    while (_nextWord(&p, end, word) > 0) {
+        if ((t = _termAdd(idx, word)) == NULL) {
+            failed = 1;
+            break;
+        }
+        if (t->tf++ == 0) {
+            idx->touched[n++] = t;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (_termPost(idx->touched[i], rec->id) == -1) {
+            failed = 1;
+        }
+        idx->touched[i]->tf = 0;
+    }
+    if (failed) {
+        fprintf(stderr, "chatserver: out of memory indexing message %llu\n",
+                (unsigned long long)rec->id);
+    }
+    idx->numDocs++;
+}
+
+/*******************************************************************************
+* Function: _indexBatch()
+* Description: Indexes the messages appended since the index was last
+*              brought up to date, up to SEARCH_BATCH of them.
+* Parameters: struct searchIndex *idx - The index.
+*             uint64_t end - The id the next message appended will be given.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _indexBatch(struct searchIndex *idx, uint64_t end) {
+    struct logRecord rec;
+
+    if (end - idx->next > SEARCH_BATCH) {
+        end = idx->next + SEARCH_BATCH;
+    }
+    for (; idx->next < end; idx->next++) {
+        if (msgLogRead(idx->log, idx->next, &rec) == 0) {
+            _indexMessage(idx, &rec);
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _cursorNext()
+* Description: Moves a cursor to the next message in a word's postings.
+* Parameters: struct searchCursor *c - The cursor.
+* Preconditions: The cursor is not exhausted.
+* Returns: None.
+*******************************************************************************/
+
+static void _cursorNext(struct searchCursor *c) {
+    if (c->pos == c->end) {
+        c->id = UINT64_MAX;
+        return;
+    }
+    c->id += _getVarint(&c->pos, c->end);
+    c->tf = (uint32_t)_getVarint(&c->pos, c->end);
+}
+
+/*******************************************************************************
+* Function: _addHit()
+* Description: Adds a matching message to the best hits if it ranks among
+*              them. Hits are kept best first.
+* Parameters: struct searchHit *hits - SEARCH_HITS hits.
+*             int *numHits - The hits kept.
+*             uint64_t id - The message id, greater than any added before.
+*             double score - Its score.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _addHit(struct searchHit *hits, int *numHits, uint64_t id,
+                    double score) {
+    int i;
+
+    if (*numHits < SEARCH_HITS) {
+        i = (*numHits)++;
+    } else if (score >= hits[SEARCH_HITS - 1].score) {
+        i = SEARCH_HITS - 1;
+    } else {
+        return;
+    }
+    /* Ties go to the newer message, which is this one. */
+    while (i > 0 && score >= hits[i - 1].score) {
+        hits[i] = hits[i - 1];
+        i--;
+    }
+    hits[i].id = id;
+    hits[i].score = score;
+}
+
+/*******************************************************************************
+* Function: _showHit()
+* Description: Prints one hit of a search.
+* Parameters: struct searchIndex *idx - The index.
+*             uint64_t id - The message id.
+* Preconditions: The caller has locked stdout.
+* Returns: None.
+*******************************************************************************/
+
+static void _showHit(struct searchIndex *idx, uint64_t id) {
+    char name[FRAME_ROOM_NAME_MAX + 1], tag[FRAME_ROOM_NAME_MAX + 4] = "";
+    char stamp[32];
+    struct logRecord rec;
+    struct frameView view;
+    int textLen;
+    int64_t when;
+    time_t t;
+    struct tm tm;
+    char *text;
+
+    if (msgLogRead(idx->log, id, &rec) == -1) {
+        return;
+    }
+    view.body = rec.frame + rec.hdrLen;
+    view.bodyLen = rec.len - rec.hdrLen;
+    if (frameDecodeHistory(&view, &id, &when, &text, &textLen) != 0) {
+        return;
+    }
+    if (rec.room != 0 && msgLogRoomName(idx->log, rec.room, name) == 0) {
+        snprintf(tag, sizeof tag, "[%s] ", name);
+    }
+    t = (time_t)when;
+    if (localtime_r(&t, &tm) == NULL ||
+        strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M", &tm) == 0) {
+        strcpy(stamp, "?");
+    }
+    printf("  #%llu %s%s %.*s%s\n", (unsigned long long)id, tag, stamp,
+           textLen > SEARCH_SHOW ? SEARCH_SHOW : textLen, text,
+           textLen > SEARCH_SHOW ? "..." : "");
+}
+
+/*******************************************************************************
+* Function: _runSearch()
+* Description: Answers a search by merging the postings of its words, and
+*              prints the best hits. A message matches if it has any of the
+*              words, and ranks higher for having more of them, rarer ones,
+*              and more of each, with diminishing returns.
+* Parameters: struct searchIndex *idx - The index.
+*             const char *text - The words to search for.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _runSearch(struct searchIndex *idx, const char *text) {
+    char words[SEARCH_TERMS][SEARCH_WORD_MAX + 1];
+    struct searchCursor cursors[SEARCH_TERMS];
+    struct searchHit hits[SEARCH_HITS];
+    const char *p, *end;
+    int numWords = 0, numCursors = 0, numHits = 0, i, dup;
+    uint64_t matches = 0, id, logEnd;
+    struct searchTerm *t;
+    double score, df, n = (double)idx->numDocs;
+    unsigned slot;
+
+    text += strspn(text, " ");
+    p = text;
+    end = text + strlen(text);
+    while (numWords < SEARCH_TERMS &&
+           _nextWord(&p, end, words[numWords]) > 0) {
+        for (dup = i = 0; i < numWords; i++) {
+            dup |= strcmp(words[i], words[numWords]) == 0;
+        }
+        if (dup) {
+            continue;
+        }
+        slot = _termSlot(idx->terms, idx->termCap, words[numWords++]);
+        if ((t = idx->terms[slot]) == NULL || t->df == 0) {
+            continue;
+        }
+        df = t->df;
+        cursors[numCursors].pos = t->postings;
+        cursors[numCursors].end = t->postings + t->len;
+        cursors[numCursors].id = 0;
+        cursors[numCursors].idf = log(1.0 + (n - df + 0.5) / (df + 0.5));
+        _cursorNext(&cursors[numCursors++]);
+    }
+    if (numWords == 0) {
+        printf("usage: %s word...\n", SEARCH_COMMAND);
+        fflush(stdout);
+        return;
+    }
+    for (;;) {
+        for (id = UINT64_MAX, i = 0; i < numCursors; i++) {
+            if (cursors[i].id < id) {
+                id = cursors[i].id;
+            }
+        }
+        if (id == UINT64_MAX) {
+            break;
+        }
+        score = 0;
+        for (i = 0; i < numCursors; i++) {
+            if (cursors[i].id == id) {
+                score += cursors[i].idf * cursors[i].tf * (SEARCH_K1 + 1) /
+                         (cursors[i].tf + SEARCH_K1);
+                _cursorNext(&cursors[i]);
+            }
+        }
+        matches++;
+        _addHit(hits, &numHits, id, score);
+    }
+
+    flockfile(stdout);
+    printf("Search for \"%s\": %llu message%s matched.\n", text,
+           (unsigned long long)matches, matches == 1 ? "" : "s");
+    for (i = 0; i < numHits; i++) {
+        _showHit(idx, hits[i].id);
+    }
+    if ((logEnd = msgLogEnd(idx->log)) > idx->next) {
+        printf("  (%llu newer messages are not indexed yet.)\n",
+               (unsigned long long)(logEnd - idx->next));
+    }
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+/*******************************************************************************
+* Function: _searchThread()
+* Description: Runs the indexer. Searches are answered first, then whatever
+*              the log has gained is indexed, and once the index is up to
+*              date the thread waits to be woken by an append or a search.
+* Parameters: void *arg - The index.
+* Preconditions: None.
+* Returns: NULL.
+*******************************************************************************/
+
+static void *_searchThread(void *arg) {
+    struct searchIndex *idx = arg;
+    struct searchQuery *q;
+    uint64_t end;
+
+    pthread_mutex_lock(&idx->lock);
+    while (!idx->stop) {
+        if ((q = idx->queries) != NULL) {
+            if ((idx->queries = q->next) == NULL) {
+                idx->queriesTail = NULL;
+            }
+            pthread_mutex_unlock(&idx->lock);
+            _runSearch(idx, q->text);
+            free(q);
+            pthread_mutex_lock(&idx->lock);
+            continue;
+        }
+        if ((end = msgLogEnd(idx->log)) > idx->next) {
+            pthread_mutex_unlock(&idx->lock);
+            _indexBatch(idx, end);
+            pthread_mutex_lock(&idx->lock);
+            continue;
+        }
+        /* An append after idle is set finds it set, and so wakes the
+         * thread, unless the end is read again after the append. The
+         * log is read without a lock, so a fence here and another in
+         * searchNotify() keep either side from reading before the
+         * other's store.
+         */
+        atomic_store(&idx->idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (msgLogEnd(idx->log) == idx->next) {
+            pthread_cond_wait(&idx->wake, &idx->lock);
+        }
+        atomic_store(&idx->idle, 0);
+    }
+    pthread_mutex_unlock(&idx->lock);
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: searchStart()
+* Description: Creates an empty index of a message log and starts its
+*              indexer, which indexes the messages already logged before
+*              following new ones.
+* Parameters: struct searchIndex *idx - The index.
+*             struct msgLog *log - The open log.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int searchStart(struct searchIndex *idx, struct msgLog *log) {
+    sigset_t block, old;
+    int status;
+
+    memset(idx, 0, sizeof *idx);
+    idx->log = log;
+    idx->next = 1;
+    idx->termCap = SEARCH_TABLE_INIT;
+    idx->terms = calloc(idx->termCap, sizeof *idx->terms);
+    /* Words are separated, so no message has more than this many. */
+    idx->touched = malloc((FRAME_HISTORY_MAX / 2 + 1) * sizeof *idx->touched);
+    if (idx->terms == NULL || idx->touched == NULL) {
+        fprintf(stderr, "chatserver: out of memory\n");
+        free(idx->terms);
+        free(idx->touched);
+        return -1;
+    }
+    pthread_mutex_init(&idx->lock, NULL);
+    pthread_cond_init(&idx->wake, NULL);
+    atomic_init(&idx->idle, 0);
+
+    /* Leave SIGINT and SIGTERM to the thread that runs shard 0. */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    status = pthread_create(&idx->thread, NULL, _searchThread, idx);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        fprintf(stderr, "chatserver: cannot start the search indexer\n");
+        pthread_mutex_destroy(&idx->lock);
+        pthread_cond_destroy(&idx->wake);
+        free(idx->terms);
+        free(idx->touched);
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: searchStop()
+* Description: Stops the indexer, dropping any searches it has not answered,
+*              and frees the index.
+* Parameters: struct searchIndex *idx - The index.
+* Preconditions: The index was started.
+* Returns: None.
+*******************************************************************************/
+
+void searchStop(struct searchIndex *idx) {
+    struct searchQuery *q;
+    unsigned i;
+
+    pthread_mutex_lock(&idx->lock);
+    idx->stop = 1;
+    pthread_cond_signal(&idx->wake);
+    pthread_mutex_unlock(&idx->lock);
+    pthread_join(idx->thread, NULL);
+
+    while ((q = idx->queries) != NULL) {
+        idx->queries = q->next;
+        free(q);
+    }
+    for (i = 0; i < idx->termCap; i++) {
+        if (idx->terms[i] != NULL) {
+            free(idx->terms[i]->postings);
+            free(idx->terms[i]);
+        }
+    }
+    free(idx->terms);
+    free(idx->touched);
+    pthread_mutex_destroy(&idx->lock);
+    pthread_cond_destroy(&idx->wake);
+}
+
+/*******************************************************************************
+* Function: searchNotify()
+* Description: Tells the indexer that a message has been appended to the
+*              log. While the indexer is busy this costs only an atomic load,
+*              and it indexes every message appended meanwhile at once.
+* Parameters: struct searchIndex *idx - The index.
+* Preconditions: The message has been appended.
+* Returns: None.
+*******************************************************************************/
+
+void searchNotify(struct searchIndex *idx) {
+    /* Pairs with the fence in _searchThread(), so the message is seen
+     * committed or the indexer seen idle.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&idx->idle)) {
+        pthread_mutex_lock(&idx->lock);
+        pthread_cond_signal(&idx->wake);
+        pthread_mutex_unlock(&idx->lock);
+    }
+}
+
+/*******************************************************************************
+* Function: searchQuery()
+* Description: Queues a search for the indexer, which prints the best hits
+*              once it has answered any searches queued before.
+* Parameters: struct searchIndex *idx - The index.
+*             const char *text - The words to search for.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int searchQuery(struct searchIndex *idx, const char *text) {
+    struct searchQuery *q;
+    size_t len = strlen(text);
+
+    if ((q = malloc(sizeof *q + len + 1)) == NULL) {
+        return -1;
+    }
+    q->next = NULL;
+    memcpy(q->text, text, len + 1);
+    pthread_mutex_lock(&idx->lock);
+    if (idx->queriesTail != NULL) {
+        idx->queriesTail->next = q;
+    } else {
+        idx->queries = q;
+    }
+    idx->queriesTail = q;
+    pthread_cond_signal(&idx->wake);
+    pthread_mutex_unlock(&idx->lock);
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+*      Filename: search.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for search.c. Please see search.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "frame.h"
+#include "msglog.h"
+
+#define SEARCH_COMMAND      "\\search"  /* The operator's search command. */
+#define SEARCH_WORD_MAX     32          /* Longest word indexed. Longer
+                                         * words are cut short. */
+#define SEARCH_TERMS        8           /* Words of a query searched for. */
+#define SEARCH_HITS         10          /* Hits shown per search. */
+#define SEARCH_SHOW         160         /* Bytes of a hit's text shown. */
+#define SEARCH_TABLE_INIT   4096        /* Initial word table size, a power
+                                         * of two. */
+#define SEARCH_BATCH        4096        /* Messages indexed between looking
+                                         * for searches. */
+#define SEARCH_K1           1.2         /* How quickly repeating a word in a
+                                         * message stops raising its rank. */
+
+/* A word of the index, with the messages it occurs in. Postings are pairs of
+ * varints, the difference from the previous message id and the number of
+ * times the word occurs, in id order.
+ */
+struct searchTerm {
+    char           word[SEARCH_WORD_MAX + 1];
+    unsigned char *postings;
+    size_t         len;
+    size_t         cap;
+    uint64_t       last;        /* The id of the last message posted. */
+    uint32_t       df;          /* The messages posted. */
+    uint32_t       tf;          /* Occurrences in the message being indexed. */
+};
+
+/* A search waiting for the indexer. */
+struct searchQuery {
+    struct searchQuery *next;
+    char                text[];
+};
+
+/* An inverted index of the message log, built and searched by a thread of
+ * its own. Only the queue of searches is shared, so appending to the log
+ * costs a message's sender no more than, at most, waking the indexer.
+ */
+struct searchIndex {
+    struct msgLog       *log;
+    pthread_t            thread;
+    pthread_mutex_t      lock;          /* Guards the fields below it. */
+    pthread_cond_t       wake;
+    atomic_int           idle;          /* Set while the indexer may wait. */
+    int                  stop;
+    struct searchQuery  *queries;       /* Oldest first. */
+    struct searchQuery  *queriesTail;
+    /* Only the indexer uses the fields below. */
+    struct searchTerm  **terms;         /* Open addressed by word. */
+    unsigned             termCap;
+    unsigned             numTerms;
+    struct searchTerm  **touched;       /* Words of the message being
+                                         * indexed. */
+    uint64_t             next;          /* The id of the next message to
+                                         * index. */
+    uint64_t             numDocs;
+};
+
+int searchStart(struct searchIndex *, struct msgLog *);
+void searchStop(struct searchIndex *);
+void searchNotify(struct searchIndex *);
+int searchQuery(struct searchIndex *, const char *);
+
+#endif
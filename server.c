@@ -0,0 +1,4209 @@
+/*******************************************************************************
+*      Filename: server.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides the chatserver event loops. The server runs one
+*                or more shards, each an event loop on its own thread with
+*                its own listener, in which client sockets are made
+*                non-blocking and multiplexed on an epoll instance. Every
+*                complete chat message received from a client is broadcast
+*                to every other client of its shard and posted to the other
+*                shards, which broadcast it to theirs. Each client may speak
+*                either the three digit length-prefixed framing of chatserve
+*                or the binary framing negotiated by a HELLO frame, and
+*                receives messages in the framing it speaks. Clients that
+*                join a chat room send to its members alone. The loops may
+*                run on io_uring instead of epoll, in which case data is
+*                received into buffers provided to the kernel, sends are
+*                submitted in batches and completions take the place of
+*                readiness events. Each shard keeps the deadlines of its
+*                connections on a timing wheel, which pings clients that
+*                have gone quiet and closes those that stay silent.
+*******************************************************************************/
+
+#include "server.h"
+
+/* Cleared by the SIGINT handler to end serverLoop(). Every shard reads it. */
+static atomic_int running = 1;
+
+/* System calls made by the event loop of the calling thread. */
+static _Thread_local unsigned long sysCalls;
+
+/*******************************************************************************
+* Function: _statAdd()
+* Description: Adds to a counter that only the calling shard writes, without
+*              the cost of an atomic read-modify-write.
+* Parameters: atomic_long *stat - The counter.
+*             long n - The amount.
+* Preconditions: No other thread writes the counter.
+* Returns: None.
+*******************************************************************************/
+
+static void _statAdd(atomic_long *stat, long n) {
+    atomic_store_explicit(stat, atomic_load_explicit(stat,
+                          memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*******************************************************************************
+* Function: _clockTicks()
+* Description: Reads the monotonic clock in ticks of the timing wheels.
+* Parameters: None.
+* Preconditions: None.
+* Returns: The tick.
+*******************************************************************************/
+
+static uint64_t _clockTicks(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) /
+           TIMER_TICK_MS;
+}
+
+/* The header fields of a chat message sent whole. */
+static const struct frameMeta wholeMeta = { FRAME_MSG, 0, 0, 0, 0, 0 };
+
+/*******************************************************************************
+* Function: _setNonBlocking()
+* Description: Sets the O_NONBLOCK flag on a file descriptor.
+* Parameters: int fd - The file descriptor.
+* Preconditions: The file descriptor is open.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*******************************************************************************
+* Function: _formListener()
+* Description: Creates a non-blocking TCP socket bound to the wildcard address
+*              at the given port and sets it to listen. IPv6 is preferred so
+*              that both address families are served by a single socket.
+* Parameters: char *port - The validated port string.
+*             int shared - Nonzero if every shard binds its own listener to
+*                          the port.
+* Preconditions: The port has been validated.
+* Returns: The listening socket file descriptor, or -1 on failure.
+*******************************************************************************/
+
+static int _formListener(char *port, int shared) {
+    struct addrinfo hints, *res, *p;
+    int status, sockfd = -1, yes = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((status = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    /* Walk the candidates looking for one we can bind. AF_INET6 is returned
+     * after AF_INET on most systems, so try it in a first pass.
+     */
+    for (p = res; p != NULL; p = p->ai_next) {
+        if (p->ai_family == AF_INET6) {
+            break;
+        }
+    }
+    if (p == NULL) {
+        p = res;
+    }
+    for (; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype,
+                             p->ai_protocol)) == -1) {
+            perror("chatserver: socket");
+            continue;
+        }
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        /* The kernel spreads incoming connections over the listeners. */
+        if (shared) {
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes);
+        }
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            perror("chatserver: bind");
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(res);
+
+    if (sockfd == -1) {
+        return -1;
+    }
+    if (listen(sockfd, SOMAXCONN) == -1 || _setNonBlocking(sockfd) == -1) {
+        perror("chatserver: listen");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*******************************************************************************
+* Function: _msgBufNew()
+* Description: Encodes a chat message, or one piece of a streamed message, as
+*              a frame in the given protocol version. Messages too long for
+*              version 1 are truncated.
+* Parameters: int version - The protocol version.
+*             const struct frameMeta *meta - The version 2 header fields.
+*             const char *payload - The message, without a terminator.
+*             size_t len - The length of the message in bytes.
+* Preconditions: None.
+* Returns: The buffer, holding one reference, or NULL on allocation failure.
+*******************************************************************************/
+
+static struct msgBuf *_msgBufNew(int version, const struct frameMeta *meta,
+                                 const char *payload, size_t len) {
+    struct msgBuf *buf;
+
+    if (version == FRAME_V1 && len > FRAME_V1_MAX_BODY) {
+        len = FRAME_V1_MAX_BODY;
+    }
+    /* Version 1 bodies end with a null terminator. */
+    if ((buf = slabAlloc(sizeof *buf + FRAME_MAX_HEADER + len + 1)) == NULL) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->skipped = 0;
+    buf->version = version;
+    buf->meta = *meta;
+    buf->data = buf->storage;
+    buf->hdrLen = frameEncodeHeader(buf->data, version, meta, len);
+    memcpy(buf->data + buf->hdrLen, payload, len);
+    buf->len = buf->hdrLen + len;
+    if (version == FRAME_V1) {
+        buf->data[buf->len++] = '\0';
+    }
+    return buf;
+}
+
+/*******************************************************************************
+* Function: _msgBufCopy()
+* Description: Copies an encoded control frame into a buffer of its own.
+* Parameters: const char *data - The frame.
+*             size_t len - The length of the frame in bytes.
+* Preconditions: None.
+* Returns: The buffer, holding one reference, or NULL on allocation failure.
+*******************************************************************************/
+
+static struct msgBuf *_msgBufCopy(const char *data, size_t len) {
+    struct msgBuf *buf;
+
+    if ((buf = slabAlloc(sizeof *buf + len)) == NULL) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->skipped = 0;
+    buf->version = 0;
+    buf->hdrLen = 0;
+    buf->data = buf->storage;
+    buf->len = len;
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+/*******************************************************************************
+* Function: _msgBufDirect()
+* Description: Encodes a private message as a version 2 DIRECT frame naming
+*              its sender.
+* Parameters: const char *handle - The sender's handle.
+*             const char *text - The message.
+*             size_t len - The length of the message in bytes.
+* Preconditions: len is at most FRAME_DIRECT_MAX.
+* Returns: The buffer, holding one reference, or NULL on allocation failure.
+*******************************************************************************/
+
+static struct msgBuf *_msgBufDirect(const char *handle, const char *text,
+                                    size_t len) {
+    static const struct frameMeta meta = { FRAME_DIRECT, 0, 0, 0, 0, 0 };
+    size_t prefixLen = 1 + strlen(handle);
+    struct msgBuf *buf;
+
+    if ((buf = slabAlloc(sizeof *buf + FRAME_MAX_HEADER + prefixLen + len)) ==
+        NULL) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->skipped = 0;
+    buf->version = FRAME_V2;
+    buf->meta = meta;
+    buf->data = buf->storage;
+    buf->hdrLen = frameEncodeHeader(buf->data, FRAME_V2, &meta,
+                                    prefixLen + len);
+    frameEncodeDirect(buf->data + buf->hdrLen, handle);
+    memcpy(buf->data + buf->hdrLen + prefixLen, text, len);
+    buf->len = buf->hdrLen + prefixLen + len;
+    return buf;
+}
+
+/*******************************************************************************
+* Function: _msgBufRecord()
+* Description: Wraps a record of the message log, which is already a
+*              version 2 HISTORY frame, in a buffer that refers to it where
+*              it is mapped rather than copying it.
+* Parameters: const struct logRecord *rec - The record.
+* Preconditions: The log stays open for as long as the buffer is queued.
+* Returns: The buffer, holding one reference, or NULL on allocation failure.
+*******************************************************************************/
+
+static struct msgBuf *_msgBufRecord(const struct logRecord *rec) {
+    struct msgBuf *buf;
+
+    if ((buf = slabAlloc(sizeof *buf)) == NULL) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->skipped = 0;
+    buf->version = FRAME_V2;
+    memset(&buf->meta, 0, sizeof buf->meta);
+    buf->meta.type = FRAME_HISTORY;
+    if (rec->room != 0) {
+        buf->meta.flags = FRAME_F_ROOM;
+        buf->meta.room = rec->room;
+    }
+    buf->hdrLen = rec->hdrLen;
+    buf->len = rec->len;
+    buf->data = rec->frame;
+    return buf;
+}
+
+/*******************************************************************************
+* Function: _msgBufCompress()
+* Description: Compresses a version 2 frame as the next part of the stream
+*              of messages sent to one connection, into a buffer of its own.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             const struct msgBuf *buf - The frame.
+* Preconditions: The connection negotiated FEAT_COMPRESS, and the payload is
+*                at most COMPRESS_MAX bytes.
+* Returns: The buffer, holding one reference, or NULL on failure, after
+*          which nothing more can be sent to the connection.
+*******************************************************************************/
+
+static struct msgBuf *_msgBufCompress(struct chatShard *shard,
+                                      struct chatConn *conn,
+                                      const struct msgBuf *buf) {
+    struct msgBuf *zbuf;
+    int len;
+
+    if ((len = frameCompress(&conn->zip, buf->data + buf->hdrLen,
+                             buf->len - buf->hdrLen, shard->zipBuf)) == -1 ||
+        (zbuf = slabAlloc(sizeof *zbuf + FRAME_MAX_HEADER + len)) == NULL) {
+        return NULL;
+    }
+    atomic_init(&zbuf->refs, 1);
+    zbuf->skipped = 0;
+    zbuf->version = FRAME_V2;
+    zbuf->meta = buf->meta;
+    zbuf->meta.flags |= FRAME_F_COMPRESSED;
+    zbuf->data = zbuf->storage;
+    zbuf->hdrLen = frameEncodeHeader(zbuf->data, FRAME_V2, &zbuf->meta, len);
+    memcpy(zbuf->data + zbuf->hdrLen, shard->zipBuf, len);
+    zbuf->len = zbuf->hdrLen + len;
+    return zbuf;
+}
+
+/*******************************************************************************
+* Function: _msgBufHold()
+* Description: Takes references to a buffer for several recipients at once.
+* Parameters: struct msgBuf *buf - The buffer.
+*             int n - The number of references.
+* Preconditions: The caller holds a reference.
+* Returns: None.
+*******************************************************************************/
+
+static void _msgBufHold(struct msgBuf *buf, int n) {
+    if (n > 0) {
+        atomic_fetch_add(&buf->refs, n);
+    }
+}
+
+/*******************************************************************************
+* Function: _msgBufRelease()
+* Description: Drops a reference to a buffer, freeing it if it was the last.
+* Parameters: struct msgBuf *buf - The buffer.
+* Preconditions: The caller holds a reference.
+* Returns: None.
+*******************************************************************************/
+
+static void _msgBufRelease(struct msgBuf *buf) {
+    if (atomic_fetch_sub(&buf->refs, 1) == 1) {
+        slabFree(buf);
+    }
+}
+
+/*******************************************************************************
+* Function: _wakeShard()
+* Description: Makes a shard's event loop wake by signalling its eventfd.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _wakeShard(struct chatShard *shard) {
+    uint64_t one = 1;
+
+    sysCalls++;
+    if (write(shard->wakefd, &one, sizeof one) == -1 && errno != EAGAIN) {
+        perror("chatserver: eventfd");
+    }
+}
+
+/*******************************************************************************
+* Function: _wakeShards()
+* Description: Wakes every shard but one.
+* Parameters: struct chatServer *server - The server.
+*             struct chatShard *except - The shard not to wake, or NULL.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _wakeShards(struct chatServer *server, struct chatShard *except) {
+    int i;
+
+    for (i = 0; i < server->numShards; i++) {
+        if (&server->shards[i] != except) {
+            _wakeShard(&server->shards[i]);
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _shardPost()
+* Description: Pushes a message onto a shard's inbox without locking. The
+*              inbox is a stack that only its own shard empties, and always
+*              all at once, so a compare-and-swap loop suffices and the ABA
+*              problem cannot arise. The shard is only woken if its inbox
+*              was empty, since it empties the inbox whenever it wakes.
+*              A shard that falls behind, with more than OUT_BUF_HIGH bytes
+*              of messages in its inbox, counts as congested until it
+*              catches up, which pauses streaming senders on every shard.
+* Parameters: struct chatShard *to - The destination shard.
+*             struct shardLink *link - The link to the message. It must stay
+*                                      valid until the message is handled.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _shardPost(struct chatShard *to, struct shardLink *link) {
+    struct shardLink *head;
+    long len = link->msg->len, old;
+
+    /* Count the bytes before the shard can take the message, so that the
+     * count never drops below zero.
+     */
+    old = atomic_fetch_add(&to->inboxBytes, len);
+    if (old <= OUT_BUF_HIGH && old + len > OUT_BUF_HIGH) {
+        atomic_fetch_add(&to->server->numCongested, 1);
+    }
+    head = atomic_load(&to->inbox);
+    do {
+        link->next = head;
+    } while (!atomic_compare_exchange_weak(&to->inbox, &head, link));
+    if (head == NULL) {
+        _wakeShard(to);
+    }
+}
+
+/*******************************************************************************
+* Function: _outEntryLen()
+* Description: Returns the number of bytes that a queued message puts on the
+*              wire.
+* Parameters: const struct outEntry *e - The queued message.
+* Preconditions: None.
+* Returns: The length in bytes.
+*******************************************************************************/
+
+static size_t _outEntryLen(const struct outEntry *e) {
+    return e->hdrLen ? e->hdrLen + e->buf->len - e->buf->hdrLen : e->buf->len;
+}
+
+/*******************************************************************************
+* Function: _outQueueGrow()
+* Description: Doubles the capacity of an output queue.
+* Parameters: struct outQueue *q - The queue.
+* Preconditions: None.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _outQueueGrow(struct outQueue *q) {
+    unsigned newCap = q->cap ? q->cap * 2 : OUT_QUEUE_INIT, i;
+    struct outEntry *ring;
+
+    if ((ring = slabAlloc(newCap * sizeof *ring)) == NULL) {
+        return -1;
+    }
+    for (i = q->head; i != q->tail; i++) {
+        ring[i & (newCap - 1)] = q->ring[i & (q->cap - 1)];
+    }
+    slabFree(q->ring);
+    q->ring = ring;
+    q->cap = newCap;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _outQueueConsume()
+* Description: Drops the bytes that the kernel has accepted from the front of
+*              an output queue, releasing every message sent in full.
+* Parameters: struct chatShard *shard - The shard.
+*             struct outQueue *q - The queue.
+*             size_t sent - The number of bytes accepted.
+* Preconditions: sent is at most the bytes queued.
+* Returns: None.
+*******************************************************************************/
+
+static void _outQueueConsume(struct chatShard *shard, struct outQueue *q,
+                             size_t sent) {
+    struct outEntry *e;
+    size_t len;
+
+    q->bytes -= sent;
+    _statAdd(&shard->outQueued, -(long)sent);
+    sent += q->off;
+    while (q->head != q->tail) {
+        e = &q->ring[q->head & (q->cap - 1)];
+        if (sent < (len = _outEntryLen(e))) {
+            break;
+        }
+        sent -= len;
+        _msgBufRelease(e->buf);
+        q->head++;
+    }
+    q->off = sent;
+}
+
+/*******************************************************************************
+* Function: _outQueueFree()
+* Description: Releases every message in an output queue and frees it.
+* Parameters: struct outQueue *q - The queue.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _outQueueFree(struct outQueue *q) {
+    for (; q->head != q->tail; q->head++) {
+        _msgBufRelease(q->ring[q->head & (q->cap - 1)].buf);
+    }
+    slabFree(q->ring);
+}
+
+/*******************************************************************************
+* Function: _growTables()
+* Description: Ensures that the connection tables can hold one more live
+*              connection and that the descriptor table covers fd.
+* Parameters: struct chatShard *shard - The shard.
+*             int fd - The descriptor about to be added.
+* Preconditions: None.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _growTables(struct chatShard *shard, int fd) {
+    struct chatConn **p;
+    int newCap;
+
+    if (fd >= shard->byFdCap) {
+        newCap = shard->byFdCap ? shard->byFdCap : 64;
+        while (newCap <= fd) {
+            newCap *= 2;
+        }
+        if ((p = realloc(shard->byFd, newCap * sizeof *p)) == NULL) {
+            return -1;
+        }
+        memset(p + shard->byFdCap, 0, (newCap - shard->byFdCap) * sizeof *p);
+        shard->byFd = p;
+        shard->byFdCap = newCap;
+    }
+    if (shard->numActive == shard->activeCap) {
+        newCap = shard->activeCap ? shard->activeCap * 2 : 64;
+        /* The dirty and dead lists hold each connection at most once, so
+         * they share the capacity of the active list.
+         */
+        if ((p = realloc(shard->active, newCap * sizeof *p)) == NULL) {
+            return -1;
+        }
+        shard->active = p;
+        if ((p = realloc(shard->dirty, newCap * sizeof *p)) == NULL) {
+            return -1;
+        }
+        shard->dirty = p;
+        if ((p = realloc(shard->dead, newCap * sizeof *p)) == NULL) {
+            return -1;
+        }
+        shard->dead = p;
+        shard->activeCap = newCap;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _hashName()
+* Description: Hashes a room name or handle with FNV-1a.
+* Parameters: const char *name - The null terminated name.
+* Preconditions: None.
+* Returns: The hash.
+*******************************************************************************/
+
+static uint32_t _hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+/*******************************************************************************
+* Function: _roomSlot()
+* Description: Finds the slot of a room name in the server's room table.
+* Parameters: struct chatServer *server - The server.
+*             const char *name - The room name.
+* Preconditions: The caller holds roomLock.
+* Returns: The slot of the room, or the free slot where it would go.
+*******************************************************************************/
+
+static unsigned _roomSlot(struct chatServer *server, const char *name) {
+    unsigned i;
+
+    /* The table is twice as large as the rooms allowed, so a free slot is
+     * always found.
+     */
+    for (i = _hashName(name) & (ROOM_TABLE_SIZE - 1);
+         server->roomTable[i] != NULL &&
+         strcmp(server->roomTable[i]->name, name) != 0;
+         i = (i + 1) & (ROOM_TABLE_SIZE - 1)) {
+    }
+    return i;
+}
+
+/*******************************************************************************
+* Function: _roomFind()
+* Description: Looks a room up by name in the server's room table, creating
+*              it if it does not exist yet, and takes a reference to it. A
+*              new room is given a freed id if there is one. The table is
+*              shared by every shard, but only joining a room consults it.
+* Parameters: struct chatServer *server - The server.
+*             const char *name - The validated room name.
+* Preconditions: None.
+* Returns: The room, or NULL if MAX_ROOMS rooms exist or allocation failed.
+*******************************************************************************/
+
+static struct chatRoom *_roomFind(struct chatServer *server,
+                                  const char *name) {
+    struct chatRoom *room;
+    unsigned i;
+
+    pthread_mutex_lock(&server->roomLock);
+    i = _roomSlot(server, name);
+    if ((room = server->roomTable[i]) == NULL &&
+        (server->numFree > 0 || server->numRooms < MAX_ROOMS) &&
+        (room = calloc(1, sizeof *room)) != NULL) {
+        room->id = server->numFree > 0 ?
+                   server->freeRooms[--server->numFree] : ++server->numRooms;
+        strcpy(room->name, name);
+        server->roomTable[i] = room;
+    }
+    if (room != NULL) {
+        atomic_fetch_add(&room->refs, 1);
+    }
+    pthread_mutex_unlock(&server->roomLock);
+    return room;
+}
+
+/*******************************************************************************
+* Function: _roomRestore()
+* Description: Recreates a room that the message log holds messages for,
+*              with the id they name it by. Rooms are restored in id order,
+*              and the ids passed over are freed for new rooms.
+* Parameters: struct chatServer *server - The server.
+*             uint32_t id - The room id, above that of any room restored.
+*             const char *name - The room name.
+* Preconditions: Only serverInit() is running.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _roomRestore(struct chatServer *server, uint32_t id,
+                        const char *name) {
+    struct chatRoom *room;
+
+    if ((room = calloc(1, sizeof *room)) == NULL) {
+        return -1;
+    }
+    room->id = id;
+    strcpy(room->name, name);
+    atomic_init(&room->logged, 1);
+    server->roomTable[_roomSlot(server, name)] = room;
+    while (++server->numRooms < id) {
+        server->freeRooms[server->numFree++] = server->numRooms;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _roomUnlink()
+* Description: Removes a room from the server's room table, moving back the
+*              rooms after it that could not be placed in its slot, so that
+*              every room can still be found by probing from its hash.
+* Parameters: struct chatServer *server - The server.
+*             struct chatRoom *room - The room.
+* Preconditions: The caller holds roomLock, and the room is in the table.
+* Returns: None.
+*******************************************************************************/
+
+static void _roomUnlink(struct chatServer *server, struct chatRoom *room) {
+    unsigned hole = _roomSlot(server, room->name), i, home;
+    struct chatRoom *r;
+
+    server->roomTable[hole] = NULL;
+    for (i = (hole + 1) & (ROOM_TABLE_SIZE - 1);
+         (r = server->roomTable[i]) != NULL;
+         i = (i + 1) & (ROOM_TABLE_SIZE - 1)) {
+        /* A room whose home lies after the hole, up to its slot, stays. */
+        home = _hashName(r->name) & (ROOM_TABLE_SIZE - 1);
+        if (((i - home) & (ROOM_TABLE_SIZE - 1)) >=
+            ((i - hole) & (ROOM_TABLE_SIZE - 1))) {
+            server->roomTable[hole] = r;
+            server->roomTable[i] = NULL;
+            hole = i;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _roomRelease()
+* Description: Drops a reference to a room. A room that nothing refers to
+*              any more is freed and its id reused, unless it has been
+*              logged to. Since a first reference is only taken under
+*              roomLock, only the last is dropped under it.
+* Parameters: struct chatServer *server - The server.
+*             struct chatRoom *room - The room.
+* Preconditions: The caller holds the reference.
+* Returns: None.
+*******************************************************************************/
+
+static void _roomRelease(struct chatServer *server, struct chatRoom *room) {
+    int refs = atomic_load(&room->refs);
+
+    while (refs > 1) {
+        if (atomic_compare_exchange_weak(&room->refs, &refs, refs - 1)) {
+            return;
+        }
+    }
+    pthread_mutex_lock(&server->roomLock);
+    if (atomic_fetch_sub(&room->refs, 1) == 1 &&
+        !atomic_load(&room->logged)) {
+        _roomUnlink(server, room);
+        server->freeRooms[server->numFree++] = room->id;
+        free(room);
+    }
+    pthread_mutex_unlock(&server->roomLock);
+}
+
+/*******************************************************************************
+* Function: _shardMsgRelease()
+* Description: Records that one shard has handled a message, freeing it if
+*              it was the last.
+* Parameters: struct chatServer *server - The server.
+*             struct shardMsg *msg - The message.
+* Preconditions: The calling shard has not released the message before.
+* Returns: None.
+*******************************************************************************/
+
+static void _shardMsgRelease(struct chatServer *server,
+                             struct shardMsg *msg) {
+    if (atomic_fetch_sub(&msg->refs, 1) == 1) {
+        if (msg->buf != NULL) {
+            _msgBufRelease(msg->buf);
+        }
+        if (msg->room != NULL) {
+            _roomRelease(server, msg->room);
+        }
+        slabFree(msg);
+    }
+}
+
+/*******************************************************************************
+* Function: _roomAdd()
+* Description: Adds a connection to the members of a room on its shard. The
+*              first member on a shard marks the shard in the room, so that
+*              other shards post the room's messages to it. The membership
+*              takes over a reference to the room from the caller.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             struct chatRoom *room - The room.
+* Preconditions: The connection is in fewer than FRAME_MAX_JOINED rooms and
+*                not in this one.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _roomAdd(struct chatShard *shard, struct chatConn *conn,
+                    struct chatRoom *room) {
+    struct roomMembers *rm;
+    struct chatConn **conns;
+    uint32_t newCap;
+    void *p;
+
+    if (room->id >= shard->roomsCap) {
+        newCap = shard->roomsCap ? shard->roomsCap : 64;
+        while (newCap <= room->id) {
+            newCap *= 2;
+        }
+        if ((p = realloc(shard->rooms, newCap * sizeof *rm)) == NULL) {
+            return -1;
+        }
+        shard->rooms = p;
+        memset(shard->rooms + shard->roomsCap, 0,
+               (newCap - shard->roomsCap) * sizeof *rm);
+        shard->roomsCap = newCap;
+    }
+    rm = &shard->rooms[room->id];
+    if (rm->count == rm->cap) {
+        newCap = rm->cap ? rm->cap * 2 : ROOM_MEMBERS_INIT;
+        if ((conns = realloc(rm->conns, newCap * sizeof *conns)) == NULL) {
+            return -1;
+        }
+        rm->conns = conns;
+        if ((p = realloc(rm->refs, newCap * sizeof *rm->refs)) == NULL) {
+            return -1;
+        }
+        rm->refs = p;
+        rm->cap = newCap;
+    }
+    if (conn->rooms == NULL && (conn->rooms = slabAlloc(FRAME_MAX_JOINED *
+                                                sizeof *conn->rooms)) == NULL) {
+        return -1;
+    }
+    rm->room = room;
+    rm->conns[rm->count] = conn;
+    rm->refs[rm->count] = conn->numRooms;
+    conn->rooms[conn->numRooms].room = room->id;
+    conn->rooms[conn->numRooms++].slot = rm->count;
+    if (rm->count++ == 0) {
+        atomic_fetch_or(&room->shards[shard->index / 64],
+                        1UL << shard->index % 64);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _roomRemove()
+* Description: Removes a connection from one of the rooms it is in, keeping
+*              both the room's members and the connection's rooms dense, and
+*              drops the membership's reference to the room.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             int ref - The index of the room in conn->rooms.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _roomRemove(struct chatShard *shard, struct chatConn *conn,
+                        int ref) {
+    struct roomRef *r = &conn->rooms[ref];
+    struct roomMembers *rm = &shard->rooms[r->room];
+    struct chatRoom *room = rm->room;
+    int last = --rm->count;
+
+    /* Swap the last member into the vacated slot. */
+    rm->conns[r->slot] = rm->conns[last];
+    rm->refs[r->slot] = rm->refs[last];
+    rm->conns[r->slot]->rooms[rm->refs[r->slot]].slot = r->slot;
+    if (last == 0) {
+        atomic_fetch_and(&rm->room->shards[shard->index / 64],
+                         ~(1UL << shard->index % 64));
+    }
+    if (conn->room == r->room) {
+        conn->room = 0;
+    }
+    /* Swap the connection's last room into the vacated ref. */
+    *r = conn->rooms[--conn->numRooms];
+    if (ref < conn->numRooms) {
+        shard->rooms[r->room].refs[r->slot] = ref;
+    }
+    _roomRelease(shard->server, room);
+}
+
+/*******************************************************************************
+* Function: _connLeaveRooms()
+* Description: Removes a connection from every room it is in. If it has a
+*              session, the rooms are kept with the session, which holds a
+*              reference to each, to be joined again when the client resumes
+*              it.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _connLeaveRooms(struct chatShard *shard, struct chatConn *conn) {
+    struct clientSession *session = conn->session;
+    struct chatRoom **rooms;
+    int i;
+
+    if (session != NULL && conn->numRooms > 0 &&
+        (rooms = realloc(session->rooms,
+                         conn->numRooms * sizeof *rooms)) != NULL) {
+        for (i = 0; i < conn->numRooms; i++) {
+            rooms[i] = shard->rooms[conn->rooms[i].room].room;
+            atomic_fetch_add(&rooms[i]->refs, 1);
+        }
+        session->rooms = rooms;
+        session->numRooms = conn->numRooms;
+        session->room = conn->room;
+    }
+    while (conn->numRooms > 0) {
+        _roomRemove(shard, conn, conn->numRooms - 1);
+    }
+    slabFree(conn->rooms);
+    conn->rooms = NULL;
+}
+
+/*******************************************************************************
+* Function: _handleSlot()
+* Description: Finds the entry of a handle in the handle table.
+* Parameters: struct chatServer *server - The server.
+*             const char *handle - The handle.
+* Preconditions: The caller holds handleLock.
+* Returns: The index of the handle's entry, or of the unused entry at which
+*          it would be added.
+*******************************************************************************/
+
+static unsigned _handleSlot(struct chatServer *server, const char *handle) {
+    unsigned mask = server->handleCap - 1;
+    unsigned i = _hashName(handle) & mask;
+
+    while (server->handles[i].handle[0] != '\0' &&
+           strcmp(server->handles[i].handle, handle) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*******************************************************************************
+* Function: _handleGrow()
+* Description: Doubles the size of the handle table.
+* Parameters: struct chatServer *server - The server.
+* Preconditions: The caller holds handleLock for writing.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _handleGrow(struct chatServer *server) {
+    struct handleEntry *old = server->handles, *table;
+    unsigned oldCap = server->handleCap, i;
+
+    if ((table = calloc(2 * oldCap, sizeof *table)) == NULL) {
+        return -1;
+    }
+    server->handles = table;
+    server->handleCap = 2 * oldCap;
+    for (i = 0; i < oldCap; i++) {
+        if (old[i].handle[0] != '\0') {
+            table[_handleSlot(server, old[i].handle)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _handleRegister()
+* Description: Registers a connection's handle, so that private messages to
+*              the handle reach it. A handle registered by a connection of
+*              the same session, which the client is resuming, is taken
+*              over; one registered by another session's connection is
+*              refused, so that no client can receive or send private
+*              messages under a handle that a live client holds.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection's resumeHandle and resumeId are set.
+* Returns: 0 on success, -1 if the handle is refused or on allocation
+*          failure.
+*******************************************************************************/
+
+static int _handleRegister(struct chatShard *shard, struct chatConn *conn) {
+    struct chatServer *server = shard->server;
+    struct handleEntry *e;
+    int status = -1, taken = 0;
+
+    pthread_rwlock_wrlock(&server->handleLock);
+    /* Keep the table at most half full, so that probes stay short. */
+    if (2 * (server->numHandles + 1) <= server->handleCap ||
+        _handleGrow(server) == 0) {
+        e = &server->handles[_handleSlot(server, conn->resumeHandle)];
+        if (e->handle[0] == '\0') {
+            strcpy(e->handle, conn->resumeHandle);
+            server->numHandles++;
+        } else if (e->session != conn->resumeId) {
+            taken = 1;
+        }
+        if (!taken) {
+            e->session = conn->resumeId;
+            e->shard = shard->index;
+            e->conn = conn;
+            status = 0;
+        }
+    }
+    pthread_rwlock_unlock(&server->handleLock);
+    if (taken && !server->quiet) {
+        printf("Connection %d refused: handle %s is in use.\n", conn->fd,
+               conn->resumeHandle);
+    }
+    return status;
+}
+
+/*******************************************************************************
+* Function: _handleRemove()
+* Description: Removes a connection's handle from the handle table, unless
+*              another connection has registered it since.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _handleRemove(struct chatShard *shard, struct chatConn *conn) {
+    struct chatServer *server = shard->server;
+    struct handleEntry *handles;
+    unsigned mask, i, j, home;
+
+    pthread_rwlock_wrlock(&server->handleLock);
+    handles = server->handles;
+    mask = server->handleCap - 1;
+    i = _handleSlot(server, conn->resumeHandle);
+    if (handles[i].handle[0] == '\0' || handles[i].conn != conn ||
+        handles[i].shard != shard->index) {
+        pthread_rwlock_unlock(&server->handleLock);
+        return;
+    }
+    /* Rather than leave a tombstone, shift back each entry that follows in
+     * the same run unless that would move it before its home slot.
+     */
+    for (j = (i + 1) & mask; handles[j].handle[0] != '\0';
+         j = (j + 1) & mask) {
+        home = _hashName(handles[j].handle) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            handles[i] = handles[j];
+            i = j;
+        }
+    }
+    handles[i].handle[0] = '\0';
+    server->numHandles--;
+    pthread_rwlock_unlock(&server->handleLock);
+}
+
+/*******************************************************************************
+* Function: _handleLookup()
+* Description: Looks up the connection registered under a handle.
+* Parameters: struct chatServer *server - The server.
+*             const char *handle - The handle.
+*             int *shard - Set to the index of the shard serving the
+*                          connection.
+* Preconditions: None.
+* Returns: The connection, which only that shard may use, or NULL if no
+*          client has the handle.
+*******************************************************************************/
+
+static struct chatConn *_handleLookup(struct chatServer *server,
+                                      const char *handle, int *shard) {
+    struct handleEntry *e;
+    struct chatConn *conn;
+
+    pthread_rwlock_rdlock(&server->handleLock);
+    e = &server->handles[_handleSlot(server, handle)];
+    conn = e->handle[0] != '\0' ? e->conn : NULL;
+    *shard = e->shard;
+    pthread_rwlock_unlock(&server->handleLock);
+    return conn;
+}
+
+/*******************************************************************************
+* Function: _connClose()
+* Description: Queues a connection to be closed at the end of the current
+*              event loop iteration. Deferring the close keeps descriptors
+*              from being reused while events for them are still pending.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection to close.
+* Preconditions: The connection is live.
+* Returns: None.
+*******************************************************************************/
+
+static void _connClose(struct chatShard *shard, struct chatConn *conn) {
+    if (!conn->closing) {
+        conn->closing = 1;
+        shard->dead[shard->numDead++] = conn;
+    }
+}
+
+/*******************************************************************************
+* Function: _congestionEased()
+* Description: Counts one connection fewer as congested. Once none is, every
+*              shard is woken so that it resumes its paused clients, this one
+*              included, since it may have nothing else to wake it.
+* Parameters: struct chatShard *shard - The shard of the connection.
+* Preconditions: The connection was counted as congested.
+* Returns: None.
+*******************************************************************************/
+
+static void _congestionEased(struct chatShard *shard) {
+    if (atomic_fetch_sub(&shard->server->numCongested, 1) == 1) {
+        _wakeShards(shard->server, NULL);
+    }
+}
+
+/*******************************************************************************
+* Function: _connFree()
+* Description: Closes a connection that is in none of the shard's tables
+*              and frees it, keeping its session, its rooms and its place in
+*              any stream being sent, for the client to resume.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is not registered with epoll, nor has
+*                requests pending with io_uring.
+* Returns: None.
+*******************************************************************************/
+
+static void _connFree(struct chatShard *shard, struct chatConn *conn) {
+    struct historyReq *req;
+
+    tlsClose(conn->fd);
+    sysCalls++;
+    close(conn->fd);
+    if (conn->congested) {
+        _congestionEased(shard);
+    }
+    _connLeaveRooms(shard, conn);
+    if ((conn->features & FEAT_DIRECT) && conn->resumeHandle[0] != '\0') {
+        _handleRemove(shard, conn);
+    }
+    if (conn->session != NULL) {
+        conn->session->conn = NULL;
+        conn->session->streamId = conn->streamId;
+        conn->session->detachedAt = time(NULL);
+    }
+    if (!shard->server->quiet) {
+        printf("Connection %d closed.\n", conn->fd);
+    }
+    while ((req = conn->history) != NULL) {
+        conn->history = req->next;
+        slabFree(req);
+    }
+    frameReaderFree(&conn->in);
+    _statAdd(&shard->outQueued, -(long)conn->out.bytes);
+    _outQueueFree(&conn->out);
+    frameCompressorFree(&conn->zip);
+    slabFree(conn->logBuf);
+    free(conn->spill);
+    slabFree(conn);
+}
+
+/*******************************************************************************
+* Function: _uringData()
+* Description: Forms the user data of a request, by which its completion is
+*              told apart.
+* Parameters: struct chatConn *conn - The connection, or NULL.
+*             int tag - URING_RECV, URING_SEND, ...
+* Preconditions: None.
+* Returns: The user data.
+*******************************************************************************/
+
+static uint64_t _uringData(struct chatConn *conn, int tag) {
+    return (uint64_t)(uintptr_t)conn | tag;
+}
+
+/*******************************************************************************
+* Function: _connCancel()
+* Description: Cancels a request pending on a connection. The request still
+*              completes, with ECANCELED unless it completed first.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             int tag - The request: URING_RECV or URING_POLLOUT.
+* Preconditions: The shard runs on io_uring.
+* Returns: None.
+*******************************************************************************/
+
+static void _connCancel(struct chatShard *shard, struct chatConn *conn,
+                        int tag) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uringSqe(&shard->ring)) != NULL) {
+        uringPrepCancel(sqe, _uringData(conn, tag), URING_IGNORE);
+    }
+}
+
+/*******************************************************************************
+* Function: _connRetire()
+* Description: Frees a closed connection, or posts it to the shard that
+*              adopts it, once it has left the shard's tables and none of
+*              its requests is yet to complete.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is not live.
+* Returns: None.
+*******************************************************************************/
+
+static void _connRetire(struct chatShard *shard, struct chatConn *conn) {
+    struct chatServer *server = shard->server;
+
+    if (conn->draining) {
+        if (conn->drainPrev != NULL) {
+            conn->drainPrev->drainNext = conn->drainNext;
+        } else {
+            shard->draining = conn->drainNext;
+        }
+        if (conn->drainNext != NULL) {
+            conn->drainNext->drainPrev = conn->drainPrev;
+        }
+        conn->draining = 0;
+    }
+    if (conn->handoff != NULL) {
+        _shardPost(&server->shards[conn->resumeId % server->numShards],
+                   &conn->handoff->links[0]);
+    } else {
+        _connFree(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _reapConns()
+* Description: Closes and frees every connection queued by _connClose(), and
+*              posts those being handed off to the shards that adopt them.
+*              With io_uring, the requests pending on a connection are
+*              cancelled first, and it is kept on the shard's draining list
+*              until the last of them completes, since each completion
+*              refers to it.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _reapConns(struct chatShard *shard) {
+    struct chatConn *conn, *last;
+    int i, j;
+
+    for (i = 0; i < shard->numDead; i++) {
+        conn = shard->dead[i];
+        if (shard->server->engine == ENGINE_URING) {
+            if (conn->recvArmed) {
+                _connCancel(shard, conn, URING_RECV);
+            }
+            if (conn->pollArmed) {
+                _connCancel(shard, conn, URING_POLLOUT);
+            }
+        } else {
+            sysCalls++;
+            epoll_ctl(shard->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+        shard->byFd[conn->fd] = NULL;
+        timerCancel(&shard->wheel, &conn->timer);
+        /* With io_uring, it may still be queued for a flush. */
+        for (j = 0; conn->dirty && j < shard->numDirty; j++) {
+            if (shard->dirty[j] == conn) {
+                shard->dirty[j] = shard->dirty[--shard->numDirty];
+                conn->dirty = 0;
+            }
+        }
+        /* Swap the last live connection into the vacated slot. */
+        last = shard->active[--shard->numActive];
+        shard->active[conn->slot] = last;
+        last->slot = conn->slot;
+        shard->numPaused -= conn->paused;
+        if (conn->ioOps > 0) {
+            conn->draining = 1;
+            conn->drainPrev = NULL;
+            conn->drainNext = shard->draining;
+            if (shard->draining != NULL) {
+                shard->draining->drainPrev = conn;
+            }
+            shard->draining = conn;
+            continue;
+        }
+        _connRetire(shard, conn);
+    }
+    shard->numDead = 0;
+}
+
+/*******************************************************************************
+* Function: _connMarkDirty()
+* Description: Schedules a connection to be flushed once the current batch of
+*              events has been processed.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live.
+* Returns: None.
+*******************************************************************************/
+
+static void _connMarkDirty(struct chatShard *shard, struct chatConn *conn) {
+    if (!conn->dirty) {
+        conn->dirty = 1;
+        shard->dirty[shard->numDirty++] = conn;
+    }
+}
+
+/*******************************************************************************
+* Function: _outEntryDroppable()
+* Description: Tells whether a queued frame may be dropped from a slow
+*              client's queue: a whole chat or private message, or a notice
+*              of messages dropped before. Control frames, history, pieces
+*              of streamed messages and frames already compressed into the
+*              client's stream are kept, since the client could not make
+*              sense of what follows without them.
+* Parameters: const struct outEntry *e - The queued frame.
+* Preconditions: None.
+* Returns: Nonzero if it may be dropped.
+*******************************************************************************/
+
+static int _outEntryDroppable(const struct outEntry *e) {
+    const struct msgBuf *buf = e->buf;
+
+    if (buf->version == FRAME_V1) {
+        return 1;
+    }
+    return buf->version == FRAME_V2 &&
+           (buf->meta.type == FRAME_MSG || buf->meta.type == FRAME_DIRECT) &&
+           !(buf->meta.flags & (FRAME_F_STREAM | FRAME_F_COMPRESSED));
+}
+
+/*******************************************************************************
+* Function: _outQueueShed()
+* Description: Makes room in a slow client's output queue by dropping its
+*              oldest droppable messages, until its pending output and the
+*              frame to be queued come to at most OUT_BUF_SHED, so that it
+*              is not shed again with every message. Frames that have been
+*              sent in part, or that a send in flight holds, are kept. With
+*              SLOW_COALESCE, a notice of how many messages were dropped
+*              takes the place of the first, and counts those of any notice
+*              dropped with them. An acknowledgement that rode along on a
+*              dropped message is sent again.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             size_t len - The length of the frame to be queued.
+* Preconditions: The connection is live.
+* Returns: 0 if the frame now fits within OUT_BUF_LIMIT, -1 if not.
+*******************************************************************************/
+
+static int _outQueueShed(struct chatShard *shard, struct chatConn *conn,
+                         size_t len) {
+    struct outQueue *q = &conn->out;
+    size_t held = q->off + (conn->sending ? conn->sendWant : 0);
+    size_t target = len < OUT_BUF_SHED ? OUT_BUF_SHED - len : 0, n;
+    unsigned long messages = 0, skipped = 0;
+    char payload[MAX_BYTES];
+    struct msgBuf *notice;
+    struct outEntry *e;
+    unsigned i, dst, slot = 0;
+    int coalesce = shard->server->slowPolicy == SLOW_COALESCE &&
+                   conn->in.version != 0;
+
+    for (i = q->head; i != q->tail && held > 0; i++) {
+        n = _outEntryLen(&q->ring[i & (q->cap - 1)]);
+        held -= n < held ? n : held;
+    }
+    for (dst = i; i != q->tail; i++) {
+        e = &q->ring[i & (q->cap - 1)];
+        if (q->bytes > target && _outEntryDroppable(e)) {
+            if (coalesce && skipped == 0) {
+                slot = dst++;
+            }
+            skipped += e->buf->skipped ? e->buf->skipped : 1;
+            messages += e->buf->skipped == 0;
+            /* A header of the client's own carries an acknowledgement. */
+            if (e->hdrLen > 0) {
+                conn->ackPending = 1;
+            }
+            n = _outEntryLen(e);
+            q->bytes -= n;
+            _statAdd(&shard->outQueued, -(long)n);
+            _msgBufRelease(e->buf);
+            continue;
+        }
+        q->ring[dst++ & (q->cap - 1)] = *e;
+    }
+    q->tail = dst;
+    _statAdd(&shard->outDropped, messages);
+    if (coalesce && skipped > 0) {
+        n = snprintf(payload, sizeof payload, "%s> [%lu messages skipped]",
+                     SERVER_HANDLE, skipped);
+        if ((notice = _msgBufNew(conn->in.version, &wholeMeta, payload,
+                                 n)) == NULL) {
+            /* Close up the slot kept for it, so no entry is stale. */
+            for (i = slot; i + 1 != q->tail; i++) {
+                q->ring[i & (q->cap - 1)] = q->ring[(i + 1) & (q->cap - 1)];
+            }
+            q->tail--;
+            return -1;
+        }
+        notice->skipped = skipped;
+        e = &q->ring[slot & (q->cap - 1)];
+        e->buf = notice;
+        e->hdrLen = 0;
+        q->bytes += notice->len;
+        _statAdd(&shard->outQueued, notice->len);
+    }
+    return q->bytes + len <= OUT_BUF_LIMIT ? 0 : -1;
+}
+
+/*******************************************************************************
+* Function: _connQueueBuf()
+* Description: Queues an encoded frame for a connection and schedules the
+*              connection to be flushed once the current batch of events has
+*              been processed, so that several messages leave in one send. A
+*              pending acknowledgement of the connection's own messages rides
+*              along in a version 2 message, in a header of its own. A
+*              connection whose output passes OUT_BUF_HIGH is marked
+*              congested, unless the slow-client policy drops messages, in
+*              which case its queue is shed at OUT_BUF_LIMIT instead of the
+*              client being disconnected. The frame is queued as it is even
+*              for a connection that negotiated FEAT_COMPRESS, and only
+*              compressed once it is gathered for sending.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The destination connection.
+*             struct msgBuf *buf - The frame.
+* Preconditions: The frame is in the framing that the connection speaks.
+* Returns: 0 if the frame was queued, in which case the caller must give the
+*          queue a reference to it, or -1 if it was not.
+*******************************************************************************/
+
+static int _connQueueBuf(struct chatShard *shard, struct chatConn *conn,
+                         struct msgBuf *buf) {
+    struct outQueue *q = &conn->out;
+    struct frameMeta acked;
+    struct outEntry *e;
+
+    if (conn->closing) {
+        return -1;
+    }
+    /* A client that has stopped reading would otherwise grow its queue
+     * without bound, so drop it, or its oldest messages, instead.
+     */
+    if (q->bytes + buf->len > OUT_BUF_LIMIT &&
+        (shard->server->slowPolicy == SLOW_DISCONNECT ||
+         _outQueueShed(shard, conn, buf->len) == -1)) {
+        _statAdd(&shard->outSlow, 1);
+        if (!shard->server->quiet) {
+            printf("Connection %d is too slow.\n", conn->fd);
+        }
+        _connClose(shard, conn);
+        return -1;
+    }
+    if (q->tail - q->head == q->cap && _outQueueGrow(q) == -1) {
+        _connClose(shard, conn);
+        return -1;
+    }
+    e = &q->ring[q->tail++ & (q->cap - 1)];
+    e->buf = buf;
+    e->hdrLen = 0;
+    if (buf->version == FRAME_V2 && conn->ackPending &&
+        conn->session != NULL) {
+        acked = buf->meta;
+        acked.flags |= FRAME_F_ACK;
+        acked.ack = e->ack = conn->session->lastSeq;
+        e->hdrLen = frameEncodeHeader(e->hdr, FRAME_V2, &acked,
+                                      buf->len - buf->hdrLen);
+        conn->ackPending = 0;
+    }
+    q->bytes += _outEntryLen(e);
+    _statAdd(&shard->outQueued, _outEntryLen(e));
+    if ((long)q->bytes > atomic_load_explicit(&shard->outDeepest,
+                                              memory_order_relaxed)) {
+        atomic_store_explicit(&shard->outDeepest, q->bytes,
+                              memory_order_relaxed);
+    }
+    if (!conn->congested && q->bytes > OUT_BUF_HIGH &&
+        shard->server->slowPolicy == SLOW_DISCONNECT) {
+        conn->congested = 1;
+        atomic_fetch_add(&shard->server->numCongested, 1);
+    }
+    _connMarkDirty(shard, conn);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _connQueueFrame()
+* Description: Queues a control frame for one connection.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The destination connection.
+*             const char *data - The encoded frame.
+*             size_t len - The length of the frame in bytes.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _connQueueFrame(struct chatShard *shard, struct chatConn *conn,
+                            const char *data, size_t len) {
+    struct msgBuf *buf;
+
+    if ((buf = _msgBufCopy(data, len)) == NULL) {
+        _connClose(shard, conn);
+        return;
+    }
+    if (_connQueueBuf(shard, conn, buf) != 0) {
+        _msgBufRelease(buf);
+    }
+}
+
+/*******************************************************************************
+* Function: _historyPump()
+* Description: Queues the next messages of the history answers outstanding
+*              on a connection, oldest first, until its pending output
+*              reaches OUT_BUF_LOW, so that an answer of any length is
+*              streamed without holding more than that. The messages are
+*              queued in place in the log's mapping, so none is copied
+*              unless it is short enough to be gathered into the shard's
+*              send buffer anyway. An answer to a request ends with its
+*              cursor.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: Messages are logged.
+* Returns: The number of frames queued.
+*******************************************************************************/
+
+static int _historyPump(struct chatShard *shard, struct chatConn *conn) {
+    char frame[FRAME_MAX_HEADER + FRAME_HISTORY_END];
+    struct historyReq *req;
+    struct logRecord rec;
+    struct msgBuf *buf;
+    int n = 0;
+
+    while ((req = conn->history) != NULL && !conn->closing &&
+           conn->out.bytes < OUT_BUF_LOW) {
+        if (req->left > 0) {
+            /* A message that cannot be read is left out. */
+            if (msgLogRead(&shard->server->log, req->ids[--req->left],
+                           &rec) == -1) {
+                continue;
+            }
+            if ((buf = _msgBufRecord(&rec)) == NULL) {
+                _connClose(shard, conn);
+                break;
+            }
+            if (_connQueueBuf(shard, conn, buf) != 0) {
+                _msgBufRelease(buf);
+                break;
+            }
+            n++;
+            continue;
+        }
+        if (req->reply) {
+            _connQueueFrame(shard, conn, frame,
+                            frameEncodeHistoryEnd(frame, req->room,
+                                                  req->cursor));
+            n++;
+        }
+        conn->history = req->next;
+        conn->numHistory--;
+        slabFree(req);
+    }
+    return n;
+}
+
+/*******************************************************************************
+* Function: _historyQueue()
+* Description: Looks up a page of a room's messages in the log and queues it
+*              to be streamed to a client after any history already being
+*              streamed.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             uint32_t room - The room id, or 0 for every client.
+*             uint64_t before - As for msgLogChain().
+*             int max - The most messages to send.
+*             int reply - Nonzero to end with the cursor of the page before,
+*                         in answer to a request.
+* Preconditions: Messages are logged, the connection negotiated FEAT_HISTORY,
+*                and max is at most HISTORY_PAGE_MAX.
+* Returns: 0 on success, -1 if HISTORY_PENDING answers are outstanding.
+*******************************************************************************/
+
+static int _historyQueue(struct chatShard *shard, struct chatConn *conn,
+                         uint32_t room, uint64_t before, int max,
+                         int reply) {
+    struct historyReq *req;
+
+    if (conn->numHistory == HISTORY_PENDING) {
+        return -1;
+    }
+    if ((req = slabAlloc(sizeof *req + max * sizeof req->ids[0])) == NULL) {
+        _connClose(shard, conn);
+        return 0;
+    }
+    req->next = NULL;
+    req->room = room;
+    req->reply = reply;
+    req->left = msgLogChain(&shard->server->log, room, before, max, req->ids,
+                            &req->cursor);
+    if (conn->history == NULL) {
+        conn->historyTail = &conn->history;
+    }
+    *conn->historyTail = req;
+    conn->historyTail = &req->next;
+    conn->numHistory++;
+    _historyPump(shard, conn);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _roomIndex()
+* Description: Finds a room that a connection is in by name.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             const char *name - The room name.
+* Preconditions: None.
+* Returns: The index of the room in conn->rooms, or -1 if it is in none of
+*          that name.
+*******************************************************************************/
+
+static int _roomIndex(struct chatShard *shard, struct chatConn *conn,
+                      const char *name) {
+    int i;
+
+    for (i = 0; i < conn->numRooms; i++) {
+        if (strcmp(shard->rooms[conn->rooms[i].room].room->name,
+                   name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+* Function: _roomJoin()
+* Description: Joins a connection to a room, unless it is in it already, and
+*              makes it the room the connection's messages are sent to. The
+*              client is answered with a JOIN frame carrying the room id, or,
+*              if the room cannot be joined, with a PART frame, in which case
+*              its messages go to every client again. A client that was not
+*              in the room yet is then sent its latest logged messages.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             const char *name - The validated room name.
+* Preconditions: The connection negotiated FEAT_ROOMS.
+* Returns: None.
+*******************************************************************************/
+
+static void _roomJoin(struct chatShard *shard, struct chatConn *conn,
+                      const char *name) {
+    char frame[FRAME_MAX_HEADER + FRAME_ROOM_NAME_MAX];
+    struct chatRoom *room = NULL;
+    int i;
+
+    if ((i = _roomIndex(shard, conn, name)) != -1) {
+        room = shard->rooms[conn->rooms[i].room].room;
+    } else if (conn->numRooms == FRAME_MAX_JOINED ||
+               (room = _roomFind(shard->server, name)) == NULL ||
+               _roomAdd(shard, conn, room) == -1) {
+        if (room != NULL) {
+            _roomRelease(shard->server, room);
+        }
+        conn->room = 0;
+        _connQueueFrame(shard, conn, frame,
+                        frameEncodeRoom(frame, FRAME_PART, 0, name));
+        return;
+    }
+    conn->room = room->id;
+    _connQueueFrame(shard, conn, frame,
+                    frameEncodeRoom(frame, FRAME_JOIN, room->id, name));
+    /* If too much history is outstanding already, none is sent. */
+    if (i == -1 && (conn->features & FEAT_HISTORY)) {
+        _historyQueue(shard, conn, room->id, 0, JOIN_HISTORY, 0);
+    }
+}
+
+/*******************************************************************************
+* Function: _roomPart()
+* Description: Removes a connection from a room and answers the client with
+*              a PART frame, carrying the room id if it was in the room. If
+*              its messages were sent to the room, they go to every client
+*              again.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             const char *name - The validated room name.
+* Preconditions: The connection negotiated FEAT_ROOMS.
+* Returns: None.
+*******************************************************************************/
+
+static void _roomPart(struct chatShard *shard, struct chatConn *conn,
+                      const char *name) {
+    char frame[FRAME_MAX_HEADER + FRAME_ROOM_NAME_MAX];
+    uint32_t id = 0;
+    int i;
+
+    if ((i = _roomIndex(shard, conn, name)) != -1) {
+        id = conn->rooms[i].room;
+        _roomRemove(shard, conn, i);
+    }
+    _connQueueFrame(shard, conn, frame,
+                    frameEncodeRoom(frame, FRAME_PART, id, name));
+}
+
+/*******************************************************************************
+* Function: _broadcastLocal()
+* Description: Queues a chat message, or one piece of a streamed message, for
+*              every live connection of the shard other than the sender.
+*              Connections that have not yet sent anything are skipped, since
+*              the framing they expect is not known until they do. Clients
+*              that cannot take streamed messages receive the first piece of
+*              one as a whole message and nothing of the rest. Every
+*              recipient is queued the same buffer, and the buffers that
+*              other framings need are encoded once, on first use. A message
+*              for a room goes only to the room's members, whose dense array
+*              is walked in place of the shard's live connections.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *from - The sender, or NULL for the operator or
+*                                     another shard.
+*             struct msgBuf *buf - The version 2 frame.
+*             int whole - Nonzero if the message is whole rather than a piece.
+*             int first - Nonzero if the piece is the first of its message.
+* Preconditions: The caller holds a reference to the buffer.
+* Returns: None.
+*******************************************************************************/
+
+static void _broadcastLocal(struct chatShard *shard, struct chatConn *from,
+                            struct msgBuf *buf, int whole, int first) {
+    const char *payload = buf->data + buf->hdrLen;
+    struct msgBuf *v1 = NULL, *unchunked = NULL;
+    int i, numBuf = 0, numV1 = 0, numUnchunked = 0;
+    int count = shard->numActive;
+    size_t len = buf->len - buf->hdrLen;
+    struct chatConn **conns = shard->active, *conn;
+    struct frameMeta plain = wholeMeta;
+
+    if (buf->meta.flags & FRAME_F_ROOM) {
+        if (buf->meta.room >= shard->roomsCap) {
+            return;
+        }
+        conns = shard->rooms[buf->meta.room].conns;
+        count = shard->rooms[buf->meta.room].count;
+        plain.flags = FRAME_F_ROOM;
+        plain.room = buf->meta.room;
+    }
+    for (i = 0; i < count; i++) {
+        conn = conns[i];
+        if (conn == from || !conn->ready) {
+            continue;
+        }
+        if (conn->in.version == FRAME_V1) {
+            if ((whole || first) && (v1 != NULL || (v1 = _msgBufNew(FRAME_V1,
+                &wholeMeta, payload, len)) != NULL)) {
+                numV1 += _connQueueBuf(shard, conn, v1) == 0;
+            }
+        } else if (whole || (conn->features & FEAT_CHUNKED)) {
+            numBuf += _connQueueBuf(shard, conn, buf) == 0;
+        } else if (first && (unchunked != NULL ||
+                   (unchunked = _msgBufNew(FRAME_V2, &plain, payload,
+                                           len)) != NULL)) {
+            numUnchunked += _connQueueBuf(shard, conn, unchunked) == 0;
+        }
+    }
+    /* Take the references of all recipients at once. Nothing queued above
+     * is sent, and so released, before the batch of events is processed.
+     */
+    _msgBufHold(buf, numBuf);
+    if (v1 != NULL) {
+        _msgBufHold(v1, numV1);
+        _msgBufRelease(v1);
+    }
+    if (unchunked != NULL) {
+        _msgBufHold(unchunked, numUnchunked);
+        _msgBufRelease(unchunked);
+    }
+}
+
+/*******************************************************************************
+* Function: _shardBroadcast()
+* Description: Posts a chat message, or one piece of a streamed message, to
+*              every other shard, to be broadcast to its clients. The shards
+*              share the frame already encoded. A message for a room is
+*              posted only to the shards on which the room has members.
+* Parameters: struct chatShard *shard - The posting shard.
+*             struct msgBuf *buf - As for _broadcastLocal().
+*             int whole - As for _broadcastLocal().
+*             int first - As for _broadcastLocal().
+*             struct chatRoom *room - The room, or NULL for every client.
+* Preconditions: The server has more than one shard, and the caller holds a
+*                reference to the buffer.
+* Returns: None.
+*******************************************************************************/
+
+static void _shardBroadcast(struct chatShard *shard, struct msgBuf *buf,
+                            int whole, int first, struct chatRoom *room) {
+    struct chatServer *server = shard->server;
+    unsigned long mask[MAX_SHARDS / 64];
+    int others = 0, i, k = 0;
+    struct shardMsg *msg;
+
+    /* Work from a snapshot, since other shards' members come and go. */
+    for (i = 0; i < MAX_SHARDS / 64; i++) {
+        mask[i] = room != NULL ? atomic_load(&room->shards[i]) : ~0UL;
+    }
+    mask[shard->index / 64] &= ~(1UL << shard->index % 64);
+    for (i = 0; i < server->numShards; i++) {
+        others += mask[i / 64] >> i % 64 & 1;
+    }
+    if (others == 0) {
+        return;
+    }
+    if ((msg = slabAlloc(sizeof *msg + others * sizeof msg->links[0])) ==
+        NULL) {
+        fprintf(stderr, "chatserver: out of memory\n");
+        return;
+    }
+    msg->type = SHARD_BROADCAST;
+    atomic_init(&msg->refs, others);
+    _msgBufHold(buf, 1);
+    msg->buf = buf;
+    msg->whole = whole;
+    msg->first = first;
+    /* The room's id must not be reused while the message is in flight. */
+    if ((msg->room = room) != NULL) {
+        atomic_fetch_add(&room->refs, 1);
+    }
+    msg->len = buf->len;
+    for (i = 0; i < server->numShards; i++) {
+        if (mask[i / 64] >> i % 64 & 1) {
+            msg->links[k].msg = msg;
+            _shardPost(&server->shards[i], &msg->links[k++]);
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _logRoom()
+* Description: Records the name of a room in the message log, the first
+*              time a message for it is logged, which keeps the room and its
+*              id for good.
+* Parameters: struct chatShard *shard - The shard.
+*             uint32_t id - The room id, or 0 for every client.
+* Preconditions: Messages are logged, and the shard has members of the room.
+* Returns: 0 if messages for the room may be logged, -1 otherwise.
+*******************************************************************************/
+
+static int _logRoom(struct chatShard *shard, uint32_t id) {
+    struct chatRoom *room;
+
+    if (id == 0 || atomic_load(&(room = shard->rooms[id].room)->logged)) {
+        return 0;
+    }
+    if (msgLogAddRoom(&shard->server->log, id, room->name) == -1) {
+        return -1;
+    }
+    atomic_store(&room->logged, 1);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _logMessage()
+* Description: Appends a chat message to the message log, and tells the
+*              indexer if the log is searched. The pieces of a streamed
+*              message are gathered until the last arrives, and whatever
+*              exceeds FRAME_HISTORY_MAX is left out of the log.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *from - As for _broadcast().
+*             const struct frameMeta *meta - As for _broadcast().
+*             int first - As for _broadcast().
+*             const char *payload - As for _broadcast().
+*             size_t len - As for _broadcast().
+* Preconditions: Messages are logged, and only clients stream messages.
+* Returns: None.
+*******************************************************************************/
+
+static void _logMessage(struct chatShard *shard, struct chatConn *from,
+                        const struct frameMeta *meta, int first,
+                        const char *payload, size_t len) {
+    uint32_t room = meta->flags & FRAME_F_ROOM ? meta->room : 0;
+
+    if (!(meta->flags & FRAME_F_STREAM)) {
+        if (_logRoom(shard, room) == 0 &&
+            msgLogAppend(&shard->server->log, room, payload, len) != 0 &&
+            shard->server->searching) {
+            searchNotify(&shard->server->search);
+        }
+        return;
+    }
+    if (from->logBuf == NULL) {
+        if ((from->logBuf = slabAlloc(FRAME_HISTORY_MAX)) == NULL) {
+            return;
+        }
+        from->logLen = 0;
+    }
+    if (first) {
+        from->logLen = 0;
+    }
+    if (len > FRAME_HISTORY_MAX - from->logLen) {
+        len = FRAME_HISTORY_MAX - from->logLen;
+    }
+    memcpy(from->logBuf + from->logLen, payload, len);
+    from->logLen += len;
+    if (!(meta->flags & FRAME_F_MORE) && _logRoom(shard, room) == 0 &&
+        msgLogAppend(&shard->server->log, room, from->logBuf,
+                     from->logLen) != 0 && shard->server->searching) {
+        searchNotify(&shard->server->search);
+    }
+}
+
+/*******************************************************************************
+* Function: _broadcast()
+* Description: Encodes a chat message, or one piece of a streamed message,
+*              and broadcasts it to the clients of every shard, or to the
+*              members of its room, logging it if messages are logged.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *from - The sender, or NULL for the operator.
+*             const struct frameMeta *meta - The header fields, or NULL for a
+*                                            whole message to every client.
+*             int first - Nonzero if the piece is the first of its message.
+*             const char *payload - The message, without a terminator.
+*             size_t len - The length of the message in bytes.
+* Preconditions: A room named by meta is one the sender is in.
+* Returns: None.
+*******************************************************************************/
+
+static void _broadcast(struct chatShard *shard, struct chatConn *from,
+                       const struct frameMeta *meta, int first,
+                       const char *payload, size_t len) {
+    struct chatRoom *room = NULL;
+    struct msgBuf *buf;
+    int whole;
+
+    if (meta == NULL) {
+        meta = &wholeMeta;
+    }
+    if ((buf = _msgBufNew(FRAME_V2, meta, payload, len)) == NULL) {
+        fprintf(stderr, "chatserver: out of memory\n");
+        return;
+    }
+    if (meta->flags & FRAME_F_ROOM) {
+        room = shard->rooms[meta->room].room;
+    }
+    whole = !(meta->flags & FRAME_F_STREAM);
+    if (shard->server->logging) {
+        _logMessage(shard, from, meta, first, payload, len);
+    }
+    _broadcastLocal(shard, from, buf, whole, first);
+    if (shard->server->numShards > 1) {
+        _shardBroadcast(shard, buf, whole, first, room);
+    }
+    _msgBufRelease(buf);
+}
+
+/*******************************************************************************
+* Function: _sendDirect()
+* Description: Sends a private message to the client that registered a
+*              handle, on whichever shard serves it. If no client has the
+*              handle, the sender is answered with a DIRECT frame naming it
+*              and holding no message.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *from - The sender.
+*             const char *to - The recipient's handle.
+*             const char *text - The message.
+*             int len - The length of the message in bytes.
+* Preconditions: The sender has registered its handle, and len is at most
+*                FRAME_DIRECT_MAX.
+* Returns: None.
+*******************************************************************************/
+
+static void _sendDirect(struct chatShard *shard, struct chatConn *from,
+                        const char *to, const char *text, int len) {
+    static const struct frameMeta meta = { FRAME_DIRECT, 0, 0, 0, 0, 0 };
+    char frame[FRAME_V2_HEADER + 1 + MAX_HANDLE_LEN];
+    struct chatConn *conn;
+    struct shardMsg *msg;
+    struct msgBuf *buf;
+    int index, n;
+
+    if ((conn = _handleLookup(shard->server, to, &index)) == NULL) {
+        n = frameEncodeHeader(frame, FRAME_V2, &meta, 1 + strlen(to));
+        n += frameEncodeDirect(frame + n, to);
+        _connQueueFrame(shard, from, frame, n);
+        return;
+    }
+    if ((buf = _msgBufDirect(from->resumeHandle, text, len)) == NULL) {
+        fprintf(stderr, "chatserver: out of memory\n");
+        return;
+    }
+    if (index == shard->index) {
+        if (_connQueueBuf(shard, conn, buf) == 0) {
+            _msgBufHold(buf, 1);
+        }
+    } else if ((msg = slabAlloc(sizeof *msg + sizeof msg->links[0])) != NULL) {
+        /* The connection may be gone by the time the message arrives, so
+         * the other shard looks the handle up again.
+         */
+        msg->type = SHARD_DIRECT;
+        atomic_init(&msg->refs, 1);
+        _msgBufHold(buf, 1);
+        msg->buf = buf;
+        msg->room = NULL;
+        msg->len = buf->len;
+        strcpy(msg->handle, to);
+        msg->links[0].msg = msg;
+        _shardPost(&shard->server->shards[index], &msg->links[0]);
+    }
+    _msgBufRelease(buf);
+}
+
+/*******************************************************************************
+* Function: _connUpdateEvents()
+* Description: Registers interest in input unless the connection is paused
+*              and in EPOLLOUT while output is pending. With io_uring, the
+*              receive of a paused connection is cancelled instead; it is
+*              armed again by _connDrainSpill() when the connection
+*              resumes.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live.
+* Returns: None.
+*******************************************************************************/
+
+static void _connUpdateEvents(struct chatShard *shard, struct chatConn *conn) {
+    struct epoll_event ev;
+
+    if (shard->server->engine == ENGINE_URING) {
+        if (conn->paused && conn->recvArmed) {
+            _connCancel(shard, conn, URING_RECV);
+        }
+        return;
+    }
+    sysCalls++;
+    ev.events = (conn->paused ? 0 : EPOLLIN) |
+                (conn->wantWrite ? EPOLLOUT : 0);
+    ev.data.fd = conn->fd;
+    epoll_ctl(shard->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*******************************************************************************
+* Function: _outEntryCompress()
+* Description: Replaces a queued version 2 message with a compressed copy,
+*              as the next part of the stream of messages sent to a
+*              connection that negotiated FEAT_COMPRESS. Messages are only
+*              compressed as they are gathered for sending, so that one
+*              dropped from a slow client's queue never enters the stream.
+*              An acknowledgement that rides along is encoded again for the
+*              copy.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             struct outEntry *e - The queued message.
+* Preconditions: None of the message has been sent.
+* Returns: 0 on success, -1 on failure, after which nothing more can be sent
+*          to the connection.
+*******************************************************************************/
+
+static int _outEntryCompress(struct chatShard *shard, struct chatConn *conn,
+                             struct outEntry *e) {
+    size_t before = _outEntryLen(e);
+    struct frameMeta acked;
+    struct msgBuf *zbuf;
+
+    if (!(conn->features & FEAT_COMPRESS) || e->buf->version != FRAME_V2 ||
+        (e->buf->meta.flags & FRAME_F_COMPRESSED) ||
+        e->buf->len - e->buf->hdrLen > COMPRESS_MAX) {
+        return 0;
+    }
+    if ((zbuf = _msgBufCompress(shard, conn, e->buf)) == NULL) {
+        fprintf(stderr, "chatserver: cannot compress for connection %d\n",
+                conn->fd);
+        return -1;
+    }
+    _msgBufRelease(e->buf);
+    e->buf = zbuf;
+    if (e->hdrLen > 0) {
+        acked = zbuf->meta;
+        acked.flags |= FRAME_F_ACK;
+        acked.ack = e->ack;
+        e->hdrLen = frameEncodeHeader(e->hdr, FRAME_V2, &acked,
+                                      zbuf->len - zbuf->hdrLen);
+    }
+    conn->out.bytes = conn->out.bytes - before + _outEntryLen(e);
+    _statAdd(&shard->outQueued, (long)_outEntryLen(e) - (long)before);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _outQueueGather()
+* Description: Describes the unsent bytes at the front of an output queue as
+*              buffers for one send. Pieces of at most OUT_COPY_MAX bytes are
+*              copied side by side into a send buffer, since the kernel takes
+*              one long buffer much faster than many short ones; longer
+*              pieces, and those that the send buffer has no room left
+*              for, are sent from where they are. Gathering stops at a
+*              header of the recipient's own that there is no room for,
+*              since it is kept in the queue, which may move before a send
+*              with io_uring completes. Messages for a connection that
+*              negotiated FEAT_COMPRESS are compressed as they are reached.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             struct iovec *iov - Filled in with up to OUT_IOV buffers.
+*             char *space - The send buffer.
+*             size_t room - Its size.
+*             size_t *want - Set to the number of bytes the buffers hold.
+*             size_t *copied - Set to the number of bytes of space used.
+* Preconditions: The connection's queue is not empty.
+* Returns: The number of buffers, or -1 if a message could not be
+*          compressed.
+*******************************************************************************/
+
+static int _outQueueGather(struct chatShard *shard, struct chatConn *conn,
+                           struct iovec *iov, char *space, size_t room,
+                           size_t *want, size_t *copied) {
+    struct outQueue *q = &conn->out;
+    size_t skip = q->off, used = 0, len[2];
+    struct outEntry *e;
+    int n = 0, full = 0, parts, j;
+    char *base[2];
+    unsigned i;
+
+    *want = 0;
+    for (i = q->head; i != q->tail && n <= OUT_IOV - 2 && !full; i++) {
+        e = &q->ring[i & (q->cap - 1)];
+        if (_outEntryCompress(shard, conn, e) == -1) {
+            return -1;
+        }
+        if (e->hdrLen > 0) {
+            base[0] = e->hdr;
+            len[0] = e->hdrLen;
+            base[1] = e->buf->data + e->buf->hdrLen;
+            len[1] = e->buf->len - e->buf->hdrLen;
+            parts = 2;
+        } else {
+            base[0] = e->buf->data;
+            len[0] = e->buf->len;
+            parts = 1;
+        }
+        for (j = 0; j < parts; j++) {
+            /* Skip what has already been sent of the first message. */
+            if (skip >= len[j]) {
+                skip -= len[j];
+                continue;
+            }
+            base[j] += skip;
+            len[j] -= skip;
+            skip = 0;
+            if (len[j] > OUT_COPY_MAX || used + len[j] > room) {
+                if (j == 0 && parts == 2) {
+                    full = 1;
+                    break;
+                }
+                *want += len[j];
+                iov[n].iov_base = base[j];
+                iov[n++].iov_len = len[j];
+                continue;
+            }
+            *want += len[j];
+            memcpy(space + used, base[j], len[j]);
+            if (n > 0 && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len ==
+                         space + used) {
+                iov[n - 1].iov_len += len[j];
+            } else {
+                iov[n].iov_base = space + used;
+                iov[n++].iov_len = len[j];
+            }
+            used += len[j];
+        }
+    }
+    *copied = used;
+    return n;
+}
+
+/*******************************************************************************
+* Function: _uringSendsFull()
+* Description: Tells whether the sends in flight on a shard leave no slot
+*              for another.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: The shard runs on io_uring.
+* Returns: Nonzero if they do.
+*******************************************************************************/
+
+static int _uringSendsFull(struct chatShard *shard) {
+    return shard->numSends == URING_SENDS;
+}
+
+/*******************************************************************************
+* Function: _connSend()
+* Description: Queues a send of a connection's pending output with io_uring,
+*              to be submitted with every other request of the iteration in
+*              one system call. The send fails rather than waits if the
+*              socket is full, so it is done by the time the submission
+*              returns, and its completion either queues the next or arms
+*              a poll for POLLOUT. Only one send or poll is in flight per
+*              connection. History being streamed to the client is queued
+*              once everything before it has been sent.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live, and _uringSendsFull() is false.
+* Returns: None.
+*******************************************************************************/
+
+static void _connSend(struct chatShard *shard, struct chatConn *conn) {
+    struct outQueue *q = &conn->out;
+    struct io_uring_sqe *sqe;
+    struct uringSend *send;
+    size_t copied;
+    int n;
+
+    if (conn->sending || conn->pollArmed) {
+        return;
+    }
+    if (q->head == q->tail && conn->history != NULL) {
+        _historyPump(shard, conn);
+    }
+    if (q->head == q->tail) {
+        if (conn->congested && q->bytes < OUT_BUF_LOW) {
+            conn->congested = 0;
+            _congestionEased(shard);
+        }
+        return;
+    }
+    send = &shard->sends[shard->numSends];
+    if ((n = _outQueueGather(shard, conn, send->iov, send->buf,
+                             sizeof send->buf, &conn->sendWant,
+                             &copied)) == -1 ||
+        (sqe = uringSqe(&shard->ring)) == NULL) {
+        _connClose(shard, conn);
+        return;
+    }
+    shard->numSends++;
+    memset(&send->mh, 0, sizeof send->mh);
+    send->mh.msg_iov = send->iov;
+    send->mh.msg_iovlen = n;
+    uringPrepSendmsg(sqe, conn->fd, &send->mh, MSG_DONTWAIT | MSG_NOSIGNAL,
+                     _uringData(conn, URING_SEND));
+    conn->sending = 1;
+    conn->ioOps++;
+    shard->sendsInFlight++;
+}
+
+/*******************************************************************************
+* Function: _connFlush()
+* Description: Writes as much pending output as the socket accepts, gathering
+*              the queued messages into as few system calls as possible, and
+*              registers or removes interest in EPOLLOUT accordingly. The
+*              connection stops being congested once its output drains below
+*              OUT_BUF_LOW. History being streamed to the client is queued as
+*              the output drains.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live. With io_uring, as for _connSend(),
+*                which is called instead.
+* Returns: None.
+*******************************************************************************/
+
+static void _connFlush(struct chatShard *shard, struct chatConn *conn) {
+    struct outQueue *q = &conn->out;
+    struct iovec iov[OUT_IOV];
+    struct msghdr mh;
+    size_t want, copied;
+    ssize_t sent;
+    int n;
+
+    if (shard->server->engine == ENGINE_URING) {
+        _connSend(shard, conn);
+        return;
+    }
+    for (;;) {
+        while (q->head != q->tail) {
+            if ((n = _outQueueGather(shard, conn, iov, shard->sendBuf,
+                                     OUT_GATHER, &want, &copied)) == -1) {
+                _connClose(shard, conn);
+                return;
+            }
+            memset(&mh, 0, sizeof mh);
+            mh.msg_iov = iov;
+            mh.msg_iovlen = n;
+            sysCalls++;
+            if ((sent = tlsSendmsg(conn->fd, &mh, MSG_NOSIGNAL)) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                _connClose(shard, conn);
+                return;
+            }
+            _outQueueConsume(shard, q, sent);
+            if ((size_t)sent < want) {
+                break;
+            }
+        }
+        /* Once everything queued has been sent, go on streaming history. */
+        if (q->head != q->tail || conn->history == NULL ||
+            _historyPump(shard, conn) == 0) {
+            break;
+        }
+    }
+    if (conn->congested && q->bytes < OUT_BUF_LOW) {
+        conn->congested = 0;
+        _congestionEased(shard);
+    }
+
+    /* Only ask for EPOLLOUT while output is actually pending. */
+    if ((q->head != q->tail) != conn->wantWrite) {
+        conn->wantWrite = q->head != q->tail;
+        _connUpdateEvents(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _connAck()
+* Description: Acknowledges every message received on a resumable connection
+*              since the last acknowledgement, if any, with an ACK frame. It
+*              is called just before the connection is flushed, by which time
+*              the acknowledgement has usually ridden along on a message.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _connAck(struct chatShard *shard, struct chatConn *conn) {
+    char ack[FRAME_V2_HEADER + FRAME_ACK_LEN];
+
+    if (conn->ackPending && conn->session != NULL) {
+        _connQueueFrame(shard, conn, ack,
+                        frameEncodeAck(ack, conn->session->lastSeq));
+    }
+    conn->ackPending = 0;
+}
+
+/*******************************************************************************
+* Function: _flushDirty()
+* Description: Flushes every connection that had output queued, or messages
+*              to acknowledge, during the current event loop iteration. With
+*              io_uring, the connections left once the sends in flight fill
+*              the shard's slots stay queued for the next iteration, by
+*              which time those sends have completed.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _flushDirty(struct chatShard *shard) {
+    int uring = shard->server->engine == ENGINE_URING;
+    struct chatConn *conn;
+    int i;
+
+    for (i = 0; i < shard->numDirty; i++) {
+        conn = shard->dirty[i];
+        if (!conn->closing) {
+            if (uring && _uringSendsFull(shard)) {
+                break;
+            }
+            _connAck(shard, conn);
+            _connFlush(shard, conn);
+        }
+        conn->dirty = 0;
+    }
+    shard->numDirty -= i;
+    memmove(shard->dirty, shard->dirty + i,
+            shard->numDirty * sizeof *shard->dirty);
+}
+
+/*******************************************************************************
+* Function: _connArmRecv()
+* Description: Arms a multishot receive on a connection, which completes
+*              each time data arrives, in a buffer of the shard's buffer
+*              ring, until it fails or is cancelled.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The shard runs on io_uring.
+* Returns: 0 on success, -1 if no request can be queued.
+*******************************************************************************/
+
+static int _connArmRecv(struct chatShard *shard, struct chatConn *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->recvArmed) {
+        return 0;
+    }
+    if ((sqe = uringSqe(&shard->ring)) == NULL) {
+        return -1;
+    }
+    uringPrepRecv(sqe, conn->fd, URING_GROUP, _uringData(conn, URING_RECV));
+    conn->recvArmed = 1;
+    conn->ioOps++;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _connWatch()
+* Description: Starts watching a connection for input: registers it with
+*              epoll or, with io_uring, arms its receive, unless bytes
+*              already received wait in its spill.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is not paused.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _connWatch(struct chatShard *shard, struct chatConn *conn) {
+    struct epoll_event ev;
+
+    if (shard->server->engine == ENGINE_URING) {
+        return conn->spillLen > 0 ? 0 : _connArmRecv(shard, conn);
+    }
+    sysCalls++;
+    ev.events = EPOLLIN;
+    ev.data.fd = conn->fd;
+    return epoll_ctl(shard->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+}
+
+/*******************************************************************************
+* Function: _connArmTimer()
+* Description: Gives a connection HELLO_TIMEOUT to finish the handshake it
+*              is in, if any, or, once it is ready, the idle time before it
+*              is first checked for silence.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live.
+* Returns: None.
+*******************************************************************************/
+
+static void _connArmTimer(struct chatShard *shard, struct chatConn *conn) {
+    int secs = HELLO_TIMEOUT;
+
+    if (conn->ready && shard->server->idle != 0) {
+        secs = shard->server->idle;
+    }
+    timerSchedule(&shard->wheel, &conn->timer,
+                  shard->now + (uint64_t)secs * 1000 / TIMER_TICK_MS);
+}
+
+/*******************************************************************************
+* Function: _connTcpKeepalive()
+* Description: Has the kernel probe a client that cannot be pinged once it
+*              has been silent for the idle time, and fail the socket if
+*              the probe goes unanswered for as long again, or if data sent
+*              goes unacknowledged for as long as both.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: server->idle is not 0.
+* Returns: None.
+*******************************************************************************/
+
+static void _connTcpKeepalive(struct chatShard *shard, struct chatConn *conn) {
+    int idle = shard->server->idle, yes = 1, one = 1;
+    unsigned timeout = 2 * idle * 1000;
+
+    sysCalls += 5;
+    setsockopt(conn->fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof yes);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof idle);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPCNT, &one, sizeof one);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout,
+               sizeof timeout);
+}
+
+/*******************************************************************************
+* Function: _connExpired()
+* Description: Acts on the expiry of a connection's timer. A connection that
+*              started a TLS handshake or a HELLO and has not finished
+*              within HELLO_TIMEOUT is closed. One that has said nothing
+*              may be a version 1 client yet to send its first message, and
+*              is left to TCP keepalives, as is any client that did not
+*              negotiate FEAT_KEEPALIVE. Any other client that has been
+*              silent for the idle time is sent a PING, and closed if
+*              nothing has arrived by the same time later. Data arriving
+*              only notes the tick, so the timer is moved on here, once per
+*              idle time at most, rather than with every read.
+* Parameters: struct timerEntry *e - The connection's timer.
+*             void *arg - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _connExpired(struct timerEntry *e, void *arg) {
+    char ping[FRAME_V2_HEADER + FRAME_PING_LEN];
+    struct chatShard *shard = arg;
+    struct chatConn *conn = (struct chatConn *)
+                            ((char *)e - offsetof(struct chatConn, timer));
+    uint64_t idle = shard->server->idle * 1000 / TIMER_TICK_MS;
+    int quiet = shard->server->quiet;
+
+    if (conn->closing) {
+        return;
+    }
+    if (!conn->ready) {
+        if (conn->in.version == FRAME_V2 ||
+            conn->transport == CONN_HANDSHAKE) {
+            if (!quiet) {
+                printf("Connection %d timed out during its handshake.\n",
+                       conn->fd);
+            }
+            _connClose(shard, conn);
+        } else if (idle != 0) {
+            _connTcpKeepalive(shard, conn);
+        }
+        return;
+    }
+    if (idle == 0) {
+        return;
+    }
+    if (!(conn->features & FEAT_KEEPALIVE)) {
+        _connTcpKeepalive(shard, conn);
+        return;
+    }
+    /* A paused client is not being read, so its silence means nothing. */
+    if (conn->paused) {
+        conn->heard = shard->now;
+    }
+    if (conn->pingAt != 0 && conn->heard < conn->pingAt) {
+        if (!quiet) {
+            printf("Connection %d is not responding.\n", conn->fd);
+        }
+        _connClose(shard, conn);
+    } else if (shard->now - conn->heard < idle) {
+        conn->pingAt = 0;
+        timerSchedule(&shard->wheel, e, conn->heard + idle);
+    } else {
+        conn->pingAt = shard->now;
+        _connQueueFrame(shard, conn, ping,
+                        frameEncodePing(ping, FRAME_PING, shard->now));
+        timerSchedule(&shard->wheel, e, shard->now + idle);
+    }
+}
+
+/*******************************************************************************
+* Function: _expireTimers()
+* Description: Expires the timers of a shard's connections that are due by
+*              the tick at which the latest events arrived.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _expireTimers(struct chatShard *shard) {
+    timerWheelAdvance(&shard->wheel, shard->now, _connExpired, shard);
+}
+
+/*******************************************************************************
+* Function: _timerWait()
+* Description: Works out how long a shard's event loop may wait before its
+*              timing wheel is due to be advanced.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: The milliseconds, or -1 if no timer is pending.
+*******************************************************************************/
+
+static int _timerWait(struct chatShard *shard) {
+    uint64_t next = timerWheelNext(&shard->wheel), now = _clockTicks();
+
+    if (next == TIMER_NONE) {
+        return -1;
+    }
+    return next <= now ? 0 : (next - now) * TIMER_TICK_MS;
+}
+
+/*******************************************************************************
+* Function: _connAccepted()
+* Description: Sets up a connection for a client just accepted and starts
+*              watching it.
+* Parameters: struct chatShard *shard - The shard.
+*             int fd - The client's non-blocking socket.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _connAccepted(struct chatShard *shard, int fd) {
+    struct chatConn *conn;
+    int yes = 1;
+
+    if (_growTables(shard, fd) == -1 ||
+        (conn = slabCalloc(sizeof *conn)) == NULL) {
+        close(fd);
+        return;
+    }
+    if (frameReaderInit(&conn->in, 0) == -1) {
+        slabFree(conn);
+        close(fd);
+        return;
+    }
+    /* Chat messages are small and latency sensitive. */
+    sysCalls++;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    conn->fd = fd;
+    conn->transport = shard->server->tls != NULL ? CONN_SNIFF : CONN_PLAIN;
+    if (_connWatch(shard, conn) == -1) {
+        frameReaderFree(&conn->in);
+        slabFree(conn);
+        close(fd);
+        return;
+    }
+    conn->slot = shard->numActive;
+    shard->active[shard->numActive++] = conn;
+    shard->byFd[fd] = conn;
+    conn->heard = shard->now;
+    _connArmTimer(shard, conn);
+    if (!shard->server->quiet) {
+        printf("Connection %d accepted.\n", fd);
+    }
+}
+
+/*******************************************************************************
+* Function: _acceptConns()
+* Description: Accepts every pending connection on the listening socket and
+*              registers each with epoll.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: The listening socket is non-blocking.
+* Returns: None.
+*******************************************************************************/
+
+static void _acceptConns(struct chatShard *shard) {
+    int fd;
+
+    while ((fd = accept4(shard->listenfd, NULL, NULL, SOCK_NONBLOCK)) !=
+           -1) {
+        sysCalls++;
+        _connAccepted(shard, fd);
+    }
+    /* Count the call that found none left. */
+    sysCalls++;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("chatserver: accept");
+    }
+}
+
+/*******************************************************************************
+* Function: _startSession()
+* Description: Attaches a connection to the session that its client asked
+*              for, creating the session if the shard does not know it, and
+*              acknowledges the last message received in it. A connection
+*              still attached to the session is presumed dead and closed.
+*              Sessions in the same hash bucket that have been detached for
+*              longer than SESSION_TTL are freed along the way.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection negotiated FEAT_RESUME, its resumeId and
+*                resumeHandle are set, and the shard owns the session.
+*                The connection is in no room.
+* Returns: 0 on success, -1 if the session belongs to another handle, if
+*          its handle is refused for private messages, or if it cannot be
+*          created.
+*******************************************************************************/
+
+static int _startSession(struct chatShard *shard, struct chatConn *conn) {
+    char frame[FRAME_MAX_HEADER + FRAME_ROOM_NAME_MAX];
+    struct clientSession **bucket, **link, *cur, *session = NULL;
+    const char *handle = conn->resumeHandle;
+    uint64_t id = conn->resumeId;
+    time_t now = time(NULL);
+    struct chatRoom *room;
+    int i;
+
+    /* The low bits of the id that pick the shard would otherwise leave
+     * most buckets unused.
+     */
+    bucket = &shard->sessions[(id / shard->server->numShards) &
+                              (SESSION_BUCKETS - 1)];
+    link = bucket;
+    while ((cur = *link) != NULL) {
+        if (cur->id == id) {
+            session = cur;
+        } else if (cur->conn == NULL && now - cur->detachedAt > SESSION_TTL) {
+            *link = cur->next;
+            for (i = 0; i < cur->numRooms; i++) {
+                _roomRelease(shard->server, cur->rooms[i]);
+            }
+            free(cur->rooms);
+            free(cur);
+            continue;
+        }
+        link = &cur->next;
+    }
+    if (session != NULL && strcmp(session->handle, handle) != 0) {
+        return -1;
+    }
+    if ((conn->features & FEAT_DIRECT) && _handleRegister(shard, conn) == -1) {
+        return -1;
+    }
+    if (session == NULL) {
+        if ((session = calloc(1, sizeof *session)) == NULL) {
+            return -1;
+        }
+        session->id = id;
+        strcpy(session->handle, handle);
+        session->next = *bucket;
+        *bucket = session;
+    }
+    if (session->conn != NULL) {
+        _connLeaveRooms(shard, session->conn);
+        session->conn->session = NULL;
+        _connClose(shard, session->conn);
+    }
+    session->conn = conn;
+    conn->session = session;
+    conn->streamId = session->streamId;
+
+    _connQueueFrame(shard, conn, frame,
+                    frameEncodeAck(frame, session->lastSeq));
+    /* Rejoin the session's rooms, telling the client their ids again in
+     * case it missed the answers to its JOIN frames.
+     */
+    for (i = 0; i < session->numRooms; i++) {
+        room = session->rooms[i];
+        if (_roomAdd(shard, conn, room) == 0) {
+            if (room->id == session->room) {
+                conn->room = room->id;
+            }
+            _connQueueFrame(shard, conn, frame,
+                            frameEncodeRoom(frame, FRAME_JOIN, room->id,
+                                            room->name));
+        } else {
+            _roomRelease(shard->server, room);
+        }
+    }
+    free(session->rooms);
+    session->rooms = NULL;
+    session->numRooms = 0;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _connHandOff()
+* Description: Hands a connection to the shard that owns the session its
+*              client asked for. The connection leaves this shard at the end
+*              of the event loop iteration, like a closed one, and is then
+*              posted to the owner.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection's resumeId is set and names a session that
+*                another shard owns.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _connHandOff(struct chatShard *shard, struct chatConn *conn) {
+    struct shardMsg *msg;
+
+    if ((msg = slabAlloc(sizeof *msg + sizeof msg->links[0])) == NULL) {
+        return -1;
+    }
+    msg->type = SHARD_ADOPT;
+    atomic_init(&msg->refs, 1);
+    msg->buf = NULL;
+    msg->room = NULL;
+    msg->len = 0;
+    msg->conn = conn;
+    msg->links[0].msg = msg;
+    conn->handoff = msg;
+    _connClose(shard, conn);
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _handleFrame()
+* Description: Acts on one frame received from a client. A version 2 client
+*              must open with a HELLO frame, which is answered with the
+*              preamble and the server's HELLO, and, if it negotiated
+*              FEAT_RESUME, follow it with a SESSION frame, which hands the
+*              connection to the shard owning the session if that is another.
+*              Chat messages are broadcast; those carrying a sequence number
+*              are broadcast only the first time they arrive. The pieces of a
+*              streamed message are relayed as they arrive under a stream id
+*              assigned by the server, since the ids chosen by different
+*              clients may collide. A message goes to the room the client
+*              last joined, if it is still in it, and otherwise to every
+*              client. JOIN and PART frames join and leave rooms, DIRECT
+*              frames are private messages to the client with a handle, and
+*              HISTORY frames request a page of a room's logged messages.
+*              PING frames are answered with a PONG. Frame types the server
+*              does not know are ignored.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             struct frameView *view - The frame.
+* Preconditions: The connection is live.
+* Returns: 0 on success, -1 if the client violated the protocol.
+*******************************************************************************/
+
+static int _handleFrame(struct chatShard *shard, struct chatConn *conn,
+                        struct frameView *view) {
+    char hello[FRAME_PREAMBLE_LEN + FRAME_V2_HEADER + FRAME_HELLO_LEN];
+    char ping[FRAME_V2_HEADER + FRAME_PING_LEN];
+    char name[FRAME_ROOM_NAME_MAX + 1];
+    int first, numShards = shard->server->numShards;
+    int quiet = shard->server->quiet;
+    struct frameMeta meta = wholeMeta;
+    unsigned features;
+    uint64_t cursor;
+    uint32_t count;
+    char *text;
+    int len;
+
+    if (!conn->ready) {
+        if (conn->in.version == FRAME_V2 && !conn->greeted) {
+            if (view->meta.type != FRAME_HELLO ||
+                frameDecodeHello(view, &features) != FRAME_V2) {
+                return -1;
+            }
+            conn->features = features & SERVER_FEATURES;
+            if (!(conn->features & FEAT_RESUME)) {
+                conn->features &= ~FEAT_DIRECT;
+            }
+            if (!shard->server->logging) {
+                conn->features &= ~FEAT_HISTORY;
+            }
+            memcpy(hello, FRAME_PREAMBLE, FRAME_PREAMBLE_LEN);
+            len = frameEncodeHello(hello + FRAME_PREAMBLE_LEN,
+                                   conn->features);
+            _connQueueFrame(shard, conn, hello, FRAME_PREAMBLE_LEN + len);
+            conn->greeted = 1;
+            /* A resumable client receives nothing before its SESSION has
+             * been acknowledged.
+             */
+            conn->ready = !(conn->features & FEAT_RESUME);
+            _connArmTimer(shard, conn);
+            return 0;
+        }
+        if (conn->in.version == FRAME_V2) {
+            if (view->meta.type != FRAME_SESSION ||
+                frameDecodeSession(view, &conn->resumeId,
+                                   conn->resumeHandle) == -1) {
+                return -1;
+            }
+            if ((int)(conn->resumeId % numShards) != shard->index) {
+                return _connHandOff(shard, conn);
+            }
+            if (_startSession(shard, conn) == -1) {
+                return -1;
+            }
+            conn->ready = 1;
+            _connArmTimer(shard, conn);
+            return 0;
+        }
+        conn->ready = 1;
+    }
+
+    /* Only the server compresses. */
+    if (view->meta.flags & FRAME_F_COMPRESSED) {
+        return -1;
+    }
+    /* Messages already received before a reconnect are dropped, but still
+     * acknowledged.
+     */
+    if (view->meta.flags & FRAME_F_SEQ) {
+        if (conn->session == NULL) {
+            return -1;
+        }
+        conn->ackPending = 1;
+        if ((int32_t)(view->meta.seq - conn->session->lastSeq) <= 0) {
+            return 0;
+        }
+        conn->session->lastSeq = view->meta.seq;
+    }
+
+    switch (view->meta.type) {
+    case FRAME_MSG:
+        if (conn->room != 0) {
+            meta.flags = FRAME_F_ROOM;
+            meta.room = conn->room;
+        }
+        if (!quiet && conn->room != 0 && conn->streamId == 0) {
+            printf("[%s] ", shard->rooms[conn->room].room->name);
+        }
+        if (!(view->meta.flags & FRAME_F_STREAM)) {
+            if (!quiet) {
+                printf("%.*s\n", view->bodyLen, view->body);
+            }
+            _broadcast(shard, conn, &meta, 1, view->body, view->bodyLen);
+            return 0;
+        }
+        if (!(conn->features & FEAT_CHUNKED)) {
+            return -1;
+        }
+        /* Shard i of n assigns the ids i + 1, i + 1 + n, i + 1 + 2n, ...
+         * so that streams relayed from different shards never share one.
+         */
+        if ((first = conn->streamId == 0)) {
+            if (shard->nextStream == 0 ||
+                shard->nextStream > UINT32_MAX - numShards) {
+                shard->nextStream = shard->index + 1;
+            } else {
+                shard->nextStream += numShards;
+            }
+            conn->streamId = shard->nextStream;
+        }
+        meta.flags |= view->meta.flags & (FRAME_F_STREAM | FRAME_F_MORE);
+        meta.stream = conn->streamId;
+        if (!(meta.flags & FRAME_F_MORE)) {
+            conn->streamId = 0;
+        }
+        if (!quiet) {
+            fwrite(view->body, 1, view->bodyLen, stdout);
+            if (conn->streamId == 0) {
+                putchar('\n');
+            }
+        }
+        _broadcast(shard, conn, &meta, first, view->body, view->bodyLen);
+        return 0;
+    case FRAME_JOIN:
+    case FRAME_PART:
+        if (!(conn->features & FEAT_ROOMS) ||
+            frameDecodeRoom(view, name) == -1) {
+            return -1;
+        }
+        if (view->meta.type == FRAME_JOIN) {
+            _roomJoin(shard, conn, name);
+        } else {
+            _roomPart(shard, conn, name);
+        }
+        return 0;
+    case FRAME_DIRECT:
+        if (!(conn->features & FEAT_DIRECT) ||
+            frameDecodeDirect(view, name, &text, &len) == -1 || len == 0) {
+            return -1;
+        }
+        if (!quiet) {
+            printf("[to %s] %.*s\n", name, len, text);
+        }
+        _sendDirect(shard, conn, name, text, len);
+        return 0;
+    case FRAME_HISTORY:
+        if (!(conn->features & FEAT_HISTORY) ||
+            frameDecodeHistoryReq(view, &cursor, &count) == -1 ||
+            count == 0) {
+            return -1;
+        }
+        return _historyQueue(shard, conn, view->meta.flags & FRAME_F_ROOM ?
+                             view->meta.room : 0, cursor,
+                             count < HISTORY_PAGE_MAX ? count :
+                             HISTORY_PAGE_MAX, 1);
+    case FRAME_PING:
+        if (!(conn->features & FEAT_KEEPALIVE) ||
+            frameDecodePing(view, &cursor) == -1) {
+            return -1;
+        }
+        _connQueueFrame(shard, conn, ping,
+                        frameEncodePing(ping, FRAME_PONG, cursor));
+        return 0;
+    case FRAME_PONG:
+        /* Its arrival is all that matters. */
+        return conn->features & FEAT_KEEPALIVE ? 0 : -1;
+    case FRAME_HELLO:
+    case FRAME_SESSION:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+/*******************************************************************************
+* Function: _connProcess()
+* Description: Handles every complete frame held in a connection's frame
+*              reader, until the connection is closed or handed off. While
+*              any client of any shard is congested, a client streaming a
+*              message is paused after each piece: its input is left in the
+*              kernel, so that TCP slows it down instead of the server
+*              buffering its message for the slow clients. Closes the
+*              connection on a protocol violation.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live and not paused.
+* Returns: None.
+*******************************************************************************/
+
+static void _connProcess(struct chatShard *shard, struct chatConn *conn) {
+    struct frameView view;
+    int result;
+
+    while ((result = frameReaderNext(&conn->in, &view)) == 1) {
+        if ((result = _handleFrame(shard, conn, &view)) == -1 ||
+            conn->closing) {
+            break;
+        }
+        if (conn->streamId != 0 &&
+            atomic_load(&shard->server->numCongested) > 0) {
+            conn->paused = 1;
+            shard->numPaused++;
+            _connUpdateEvents(shard, conn);
+            break;
+        }
+    }
+    /* Make sure that the acknowledgement is sent even if no message is. */
+    if (conn->ackPending) {
+        _connMarkDirty(shard, conn);
+    }
+    if (result == -1) {
+        fprintf(stderr, "chatserver: protocol error on connection %d\n",
+                conn->fd);
+        _connClose(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _connSecured()
+* Description: Notes the end of a connection's TLS handshake, once it has
+*              completed, and reports how the session was set up.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection's handshake is in progress.
+* Returns: None.
+*******************************************************************************/
+
+static void _connSecured(struct chatShard *shard, struct chatConn *conn) {
+    int status;
+
+    if ((status = tlsStatus(conn->fd)) == -1) {
+        return;
+    }
+    conn->transport = CONN_SECURE;
+    if (!shard->server->quiet) {
+        printf("Connection %d secured (%s%s%s).\n", conn->fd,
+               status & TLS_RESUMED ? "resumed" : "full handshake",
+               status & TLS_EARLY ? ", early data" : "",
+               status & (TLS_KERNEL_SEND | TLS_KERNEL_RECV) ?
+               ", kernel TLS" : "");
+    }
+}
+
+/*******************************************************************************
+* Function: _connRead()
+* Description: Pulls everything a readable client socket has available into
+*              the connection's frame reader with a single system call, then
+*              handles the frames that it holds unless the connection is
+*              paused. On a server with TLS, the first read tells whether the
+*              client speaks TLS and, if so, starts the handshake, which
+*              completes in the reads that follow. Closes the connection on
+*              EOF or error.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is live.
+* Returns: None.
+*******************************************************************************/
+
+static void _connRead(struct chatShard *shard, struct chatConn *conn) {
+    ssize_t status;
+    int secure, again;
+
+    if (conn->transport == CONN_SNIFF) {
+        sysCalls++;
+        if ((secure = tlsSniff(conn->fd)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                _connClose(shard, conn);
+            }
+            return;
+        }
+        if (secure && tlsAccept(shard->server->tls, conn->fd) == -1) {
+            fprintf(stderr, "chatserver: TLS: %s\n", tlsError());
+            _connClose(shard, conn);
+            return;
+        }
+        conn->transport = secure ? CONN_HANDSHAKE : CONN_PLAIN;
+    }
+    /* Records already decrypted are invisible to epoll, so read until
+     * none are left or the connection can take no more.
+     */
+    do {
+        sysCalls++;
+        status = frameReaderFill(&conn->in, conn->fd);
+        again = status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        /* The handshake may complete in a read that yields no data. */
+        if (conn->transport == CONN_HANDSHAKE) {
+            _connSecured(shard, conn);
+        }
+        if (again) {
+            return;
+        }
+        if (status <= 0) {
+            _connClose(shard, conn);
+            return;
+        }
+        conn->heard = shard->now;
+        if (!conn->paused) {
+            _connProcess(shard, conn);
+        }
+    } while (!conn->paused && !conn->closing && tlsPending(conn->fd));
+}
+
+/*******************************************************************************
+* Function: _connFeed()
+* Description: Copies bytes received with io_uring into a connection's frame
+*              reader, as much at a time as it holds, and handles the frames
+*              completed, until the connection is paused or closed.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             const char *data - The bytes.
+*             size_t len - The number of bytes.
+* Preconditions: The connection is live.
+* Returns: The number of bytes taken.
+*******************************************************************************/
+
+static size_t _connFeed(struct chatShard *shard, struct chatConn *conn,
+                        const char *data, size_t len) {
+    size_t done = 0, n;
+
+    while (done < len && !conn->paused && !conn->closing) {
+        /* Handling the frames buffered always frees space, unless the
+         * frame reader holds a frame longer than it may grow.
+         */
+        if ((n = frameReaderFeed(&conn->in, data + done, len - done)) == 0) {
+            fprintf(stderr, "chatserver: protocol error on connection %d\n",
+                    conn->fd);
+            _connClose(shard, conn);
+            break;
+        }
+        done += n;
+        _connProcess(shard, conn);
+    }
+    return done;
+}
+
+/*******************************************************************************
+* Function: _connSpill()
+* Description: Keeps bytes received with io_uring that a connection cannot
+*              take yet, because it is paused or being handed off, after
+*              any already kept.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             const char *data - The bytes.
+*             size_t len - The number of bytes.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _connSpill(struct chatShard *shard, struct chatConn *conn,
+                       const char *data, size_t len) {
+    char *spill;
+
+    if ((spill = realloc(conn->spill, conn->spillLen + len)) == NULL) {
+        _connClose(shard, conn);
+        return;
+    }
+    memcpy(spill + conn->spillLen, data, len);
+    conn->spill = spill;
+    conn->spillLen += len;
+}
+
+/*******************************************************************************
+* Function: _connDrainSpill()
+* Description: Handles the frames buffered for a connection and then the
+*              bytes kept in its spill, and arms its receive once none is
+*              left, unless it is paused or closed first.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The shard runs on io_uring, and the connection is live and
+*                not paused.
+* Returns: None.
+*******************************************************************************/
+
+static void _connDrainSpill(struct chatShard *shard, struct chatConn *conn) {
+    size_t n;
+
+    _connProcess(shard, conn);
+    if (conn->spillLen > 0) {
+        n = _connFeed(shard, conn, conn->spill, conn->spillLen);
+        conn->spillLen -= n;
+        memmove(conn->spill, conn->spill + n, conn->spillLen);
+    }
+    if (!conn->paused && !conn->closing && conn->spillLen == 0 &&
+        _connArmRecv(shard, conn) == -1) {
+        _connClose(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _resumePaused()
+* Description: Once no client of any shard is congested, resumes reading
+*              from every paused client of this shard and handles the frames
+*              already buffered for it.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _resumePaused(struct chatShard *shard) {
+    struct chatConn *conn;
+    int i;
+
+    for (i = 0; i < shard->numActive &&
+                atomic_load(&shard->server->numCongested) == 0; i++) {
+        conn = shard->active[i];
+        if (!conn->paused || conn->closing) {
+            continue;
+        }
+        conn->paused = 0;
+        shard->numPaused--;
+        if (shard->server->engine == ENGINE_URING) {
+            _connDrainSpill(shard, conn);
+            continue;
+        }
+        _connUpdateEvents(shard, conn);
+        _connProcess(shard, conn);
+        if (!conn->paused && !conn->closing && tlsPending(conn->fd)) {
+            _connRead(shard, conn);
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: _operatorLine()
+* Description: Broadcasts one line typed by the server operator to every
+*              client with the chatserve handle prepended. Entering '\quit'
+*              stops the server, '\search' followed by words searches the
+*              message log, and '\queues' reports on the output queues.
+* Parameters: struct chatShard *shard - The shard.
+*             char *line - The null terminated line without its newline.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _operatorLine(struct chatShard *shard, char *line) {
+    struct chatServer *server = shard->server;
+    size_t cmdLen = strlen(SEARCH_COMMAND);
+    char payload[MAX_BYTES];
+    int status, len;
+
+    if (strncmp(line, SEARCH_COMMAND, cmdLen) == 0 &&
+        (line[cmdLen] == ' ' || line[cmdLen] == '\0')) {
+        if (!server->searching) {
+            printf("Searching needs a message log; start chatserver with "
+                   "-l.\n");
+        } else if (searchQuery(&server->search, line + cmdLen) == -1) {
+            fprintf(stderr, "chatserver: out of memory\n");
+        }
+        return;
+    }
+    if (strcmp(line, QUEUES_COMMAND) == 0) {
+        serverQueueReport(server);
+        return;
+    }
+    if ((status = validateMsgLine(line, MAX_MSG)) == 0) {
+        serverStop();
+        return;
+    }
+    if (status == 1) {
+        len = snprintf(payload, sizeof payload, "%s> %s", SERVER_HANDLE,
+                       line);
+        _broadcast(shard, NULL, NULL, 1, payload, len);
+    }
+}
+
+/*******************************************************************************
+* Function: _operatorInput()
+* Description: Reads whatever the operator has typed and hands each complete
+*              line to _operatorLine(). Closing stdin stops reading operator
+*              input.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: stdin is readable.
+* Returns: None.
+*******************************************************************************/
+
+static void _operatorInput(struct chatShard *shard) {
+    char *line;
+    int status;
+
+    sysCalls++;
+    status = lineBufferRead(&shard->opInput, STDIN_FILENO);
+    if (status == 0 || (status == -1 && errno != EAGAIN && errno != EINTR)) {
+        /* With io_uring, the poll is simply not armed again. */
+        if (shard->server->engine == ENGINE_EPOLL) {
+            epoll_ctl(shard->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        }
+        shard->stdinOpen = 0;
+        return;
+    }
+    while ((line = lineBufferNext(&shard->opInput)) != NULL) {
+        _operatorLine(shard, line);
+    }
+}
+
+/*******************************************************************************
+* Function: _adoptConn()
+* Description: Takes over a connection handed off by another shard, because
+*              this shard owns the session its client asked for, and starts
+*              the session. Frames that followed the SESSION frame are
+*              handled at once, including, with io_uring, those received
+*              while the handoff was under way.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+* Preconditions: The connection is registered with no shard.
+* Returns: None.
+*******************************************************************************/
+
+static void _adoptConn(struct chatShard *shard, struct chatConn *conn) {
+    conn->closing = conn->dirty = conn->wantWrite = conn->paused = 0;
+    conn->handoff = NULL;
+    if (_growTables(shard, conn->fd) == -1 ||
+        _connWatch(shard, conn) == -1) {
+        _connFree(shard, conn);
+        return;
+    }
+    conn->slot = shard->numActive;
+    shard->active[shard->numActive++] = conn;
+    shard->byFd[conn->fd] = conn;
+    conn->heard = shard->now;
+    conn->pingAt = 0;
+
+    if (_startSession(shard, conn) == -1) {
+        fprintf(stderr, "chatserver: protocol error on connection %d\n",
+                conn->fd);
+        _connClose(shard, conn);
+        return;
+    }
+    conn->ready = 1;
+    _connArmTimer(shard, conn);
+    if (shard->server->engine == ENGINE_URING) {
+        _connDrainSpill(shard, conn);
+        return;
+    }
+    _connProcess(shard, conn);
+    if (!conn->paused && !conn->closing && tlsPending(conn->fd)) {
+        _connRead(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _deliverDirect()
+* Description: Queues a private message posted by another shard for the
+*              client of this shard that has the handle, if it still does.
+* Parameters: struct chatShard *shard - The shard.
+*             const char *to - The recipient's handle.
+*             struct msgBuf *buf - The DIRECT frame.
+* Preconditions: The caller holds a reference to the buffer.
+* Returns: None.
+*******************************************************************************/
+
+static void _deliverDirect(struct chatShard *shard, const char *to,
+                           struct msgBuf *buf) {
+    struct chatConn *conn;
+    int index;
+
+    if ((conn = _handleLookup(shard->server, to, &index)) != NULL &&
+        index == shard->index && _connQueueBuf(shard, conn, buf) == 0) {
+        _msgBufHold(buf, 1);
+    }
+}
+
+/*******************************************************************************
+* Function: _takeInbox()
+* Description: Takes every message that other shards have posted to this
+*              one, to be handled by _drainInbox() after any taken before.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _takeInbox(struct chatShard *shard) {
+    struct shardLink *link, *next, *fifo = NULL, *last;
+    uint64_t count;
+
+    sysCalls++;
+    if (read(shard->wakefd, &count, sizeof count) == -1 && errno != EAGAIN) {
+        perror("chatserver: eventfd");
+    }
+    /* The inbox is a stack; reverse it to restore the posting order. */
+    link = last = atomic_exchange(&shard->inbox, NULL);
+    while (link != NULL) {
+        next = link->next;
+        link->next = fifo;
+        fifo = link;
+        link = next;
+    }
+    if (fifo == NULL) {
+        return;
+    }
+    if (shard->backlog == NULL) {
+        shard->backlog = fifo;
+    } else {
+        shard->backlogTail->next = fifo;
+    }
+    shard->backlogTail = last;
+}
+
+/*******************************************************************************
+* Function: _drainInbox()
+* Description: Acts on the messages taken from the inbox in the order in
+*              which they were posted, until the bytes handled reach a
+*              limit. The shard stops counting as congested once it has
+*              caught up.
+* Parameters: struct chatShard *shard - The shard.
+*             long limit - The bytes after which to stop.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _drainInbox(struct chatShard *shard, long limit) {
+    struct shardLink *link;
+    struct shardMsg *msg;
+    long handled = 0, old;
+
+    while ((link = shard->backlog) != NULL && handled < limit) {
+        /* The link lives in the message, which may be freed below. */
+        shard->backlog = link->next;
+        msg = link->msg;
+        if (msg->type == SHARD_ADOPT) {
+            _adoptConn(shard, msg->conn);
+        } else if (msg->type == SHARD_DIRECT) {
+            _deliverDirect(shard, msg->handle, msg->buf);
+        } else {
+            _broadcastLocal(shard, NULL, msg->buf, msg->whole, msg->first);
+        }
+        handled += msg->len;
+        _shardMsgRelease(shard->server, msg);
+    }
+    old = atomic_fetch_sub(&shard->inboxBytes, handled);
+    if (old > OUT_BUF_HIGH && old - handled <= OUT_BUF_HIGH) {
+        _congestionEased(shard);
+    }
+}
+
+/*******************************************************************************
+* Function: _shardInitUring()
+* Description: Sets up a shard's ring, disabled until its thread enables
+*              it, and the buffers that the ring receives into. Operator
+*              input is read only from a terminal or a pipe, as with epoll.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: The shard's listener and eventfd are open.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _shardInitUring(struct chatShard *shard) {
+    struct stat st;
+
+    if (uringInit(&shard->ring, URING_ENTRIES, URING_CQ_ENTRIES,
+                  IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                  IORING_SETUP_R_DISABLED) == -1) {
+        perror("chatserver: io_uring_setup");
+        return -1;
+    }
+    if (uringBufsInit(&shard->ring, &shard->bufs, URING_GROUP, URING_BUFS,
+                      URING_BUF_SIZE) == -1) {
+        perror("chatserver: io_uring_register");
+        uringFree(&shard->ring);
+        return -1;
+    }
+    if ((shard->sends = malloc(URING_SENDS * sizeof *shard->sends)) ==
+        NULL) {
+        uringFree(&shard->ring);
+        uringBufsFree(&shard->bufs);
+        return -1;
+    }
+    if (shard->index == 0 && !shard->server->quiet) {
+        shard->stdinOpen = fstat(STDIN_FILENO, &st) == 0 &&
+                           !S_ISREG(st.st_mode);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _shardInit()
+* Description: Forms a shard's listening socket, eventfd and epoll instance
+*              or ring, and registers the listener, the eventfd and, for
+*              shard 0 if requested, operator input with epoll.
+* Parameters: struct chatServer *server - The server.
+*             int index - The index of the shard.
+*             int cpu - The CPU to run the shard on, or -1.
+*             char *port - The validated port string.
+* Preconditions: server->numShards and server->engine are set.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+static int _shardInit(struct chatServer *server, int index, int cpu,
+                      char *port) {
+    struct chatShard *shard = &server->shards[index];
+    struct epoll_event ev;
+
+    shard->server = server;
+    shard->index = index;
+    shard->cpu = cpu;
+    shard->epfd = -1;
+    atomic_init(&shard->inbox, NULL);
+    atomic_init(&shard->inboxBytes, 0);
+    shard->now = _clockTicks();
+    timerWheelInit(&shard->wheel, shard->now);
+
+    if ((shard->listenfd = _formListener(port, server->numShards > 1)) == -1) {
+        return -1;
+    }
+    if ((shard->wakefd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        perror("chatserver: eventfd");
+        close(shard->listenfd);
+        return -1;
+    }
+    if (server->engine == ENGINE_URING) {
+        if (_shardInitUring(shard) == -1) {
+            close(shard->listenfd);
+            close(shard->wakefd);
+            return -1;
+        }
+        return 0;
+    }
+    if ((shard->epfd = epoll_create1(0)) == -1) {
+        perror("chatserver: epoll_create1");
+        close(shard->listenfd);
+        close(shard->wakefd);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = shard->listenfd;
+    epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->listenfd, &ev);
+    ev.data.fd = shard->wakefd;
+    epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->wakefd, &ev);
+
+    /* Operator input only makes sense in interactive mode. epoll rejects
+     * regular files, in which case operator input is simply disabled.
+     */
+    if (index == 0 && !server->quiet) {
+        ev.data.fd = STDIN_FILENO;
+        shard->stdinOpen = epoll_ctl(shard->epfd, EPOLL_CTL_ADD, STDIN_FILENO,
+                                     &ev) == 0;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _shardFree()
+* Description: Closes every connection of a shard, including any posted to
+*              it but not yet adopted, and its descriptors, and frees its
+*              tables and sessions.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: _shardInit() succeeded and no shard is running.
+* Returns: None.
+*******************************************************************************/
+
+static void _shardFree(struct chatShard *shard) {
+    struct clientSession *session;
+    struct shardLink *link, *next;
+    struct chatConn *conn;
+    struct shardMsg *msg;
+    int i;
+
+    /* Tearing the ring down first ends every request pending on it. */
+    if (shard->server->engine == ENGINE_URING) {
+        uringFree(&shard->ring);
+        uringBufsFree(&shard->bufs);
+        free(shard->sends);
+    }
+    while ((conn = shard->draining) != NULL) {
+        shard->draining = conn->drainNext;
+        close(conn->fd);
+        frameReaderFree(&conn->in);
+        _outQueueFree(&conn->out);
+        slabFree(conn->rooms);
+        free(conn->spill);
+        slabFree(conn->handoff);
+        slabFree(conn);
+    }
+    for (i = 0; i < shard->numActive; i++) {
+        tlsClose(shard->active[i]->fd);
+        close(shard->active[i]->fd);
+        frameReaderFree(&shard->active[i]->in);
+        _outQueueFree(&shard->active[i]->out);
+        slabFree(shard->active[i]->rooms);
+        free(shard->active[i]->spill);
+        slabFree(shard->active[i]);
+    }
+    /* The order in which they are freed does not matter. */
+    link = atomic_exchange(&shard->inbox, NULL);
+    if (shard->backlog != NULL) {
+        shard->backlogTail->next = link;
+        link = shard->backlog;
+    }
+    for (; link != NULL; link = next) {
+        next = link->next;
+        msg = link->msg;
+        if (msg->type == SHARD_ADOPT) {
+            tlsClose(msg->conn->fd);
+            close(msg->conn->fd);
+            frameReaderFree(&msg->conn->in);
+            _outQueueFree(&msg->conn->out);
+            slabFree(msg->conn->rooms);
+            free(msg->conn->spill);
+            slabFree(msg->conn);
+        }
+        _shardMsgRelease(shard->server, msg);
+    }
+    for (i = 0; i < SESSION_BUCKETS; i++) {
+        while ((session = shard->sessions[i]) != NULL) {
+            shard->sessions[i] = session->next;
+            free(session->rooms);
+            free(session);
+        }
+    }
+    for (i = 0; i < (int)shard->roomsCap; i++) {
+        free(shard->rooms[i].conns);
+        free(shard->rooms[i].refs);
+    }
+    free(shard->rooms);
+    close(shard->listenfd);
+    if (shard->epfd != -1) {
+        close(shard->epfd);
+    }
+    close(shard->wakefd);
+    free(shard->byFd);
+    free(shard->active);
+    free(shard->dirty);
+    free(shard->dead);
+}
+
+/*******************************************************************************
+* Function: _uringArm()
+* Description: Arms one of the requests of a shard that no connection owns:
+*              the multishot accept on its listener, the multishot poll of
+*              its eventfd, or a poll of operator input, which is armed
+*              afresh after each line is read, so that input left unread
+*              is not missed.
+* Parameters: struct chatShard *shard - The shard.
+*             int tag - URING_ACCEPT, URING_WAKE or URING_STDIN.
+* Preconditions: The shard runs on io_uring.
+* Returns: None.
+*******************************************************************************/
+
+static void _uringArm(struct chatShard *shard, int tag) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uringSqe(&shard->ring)) == NULL) {
+        perror("chatserver: io_uring_enter");
+        return;
+    }
+    if (tag == URING_ACCEPT) {
+        uringPrepAccept(sqe, shard->listenfd, _uringData(NULL, tag));
+    } else {
+        uringPrepPoll(sqe, tag == URING_WAKE ? shard->wakefd : STDIN_FILENO,
+                      POLLIN, tag == URING_WAKE, _uringData(NULL, tag));
+    }
+}
+
+/*******************************************************************************
+* Function: _uringRecv()
+* Description: Handles a completion of a connection's receive: hands the
+*              bytes received to the connection, or keeps them in its spill
+*              if it cannot take them yet, and gives the buffer back to the
+*              kernel. A receive that ends without the connection being
+*              paused or closed, because the kernel ran out of buffers, is
+*              armed again; one that ends with end of file or an error
+*              closes the connection.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             int res - The result: the bytes received, or a negated errno.
+*             unsigned flags - The completion flags.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _uringRecv(struct chatShard *shard, struct chatConn *conn,
+                       int res, unsigned flags) {
+    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+    size_t n = 0;
+    char *data;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recvArmed = 0;
+        conn->ioOps--;
+    }
+    if (res > 0) {
+        conn->heard = shard->now;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+        data = uringBuf(&shard->bufs, id);
+        if (res > 0 && conn->spillLen == 0) {
+            n = _connFeed(shard, conn, data, res);
+        }
+        /* What a connection being handed off receives goes with it. */
+        if (res > 0 && (size_t)res > n &&
+            (!conn->closing || conn->handoff != NULL)) {
+            _connSpill(shard, conn, data + n, res - n);
+        }
+        uringBufRecycle(&shard->bufs, id);
+    }
+    if (conn->closing) {
+        return;
+    }
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        _connClose(shard, conn);
+        return;
+    }
+    if (!conn->recvArmed && !conn->paused && conn->spillLen == 0 &&
+        _connArmRecv(shard, conn) == -1) {
+        _connClose(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _uringSent()
+* Description: Handles the completion of a connection's send: drops what was
+*              sent from its output queue and, if the socket took less than
+*              all of it, arms a poll for POLLOUT, or else flushes it again
+*              if more is pending. Once no send is in flight on the shard,
+*              its slots and send buffer are free again.
+* Parameters: struct chatShard *shard - The shard.
+*             struct chatConn *conn - The connection.
+*             int res - The result: the bytes sent, or a negated errno.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _uringSent(struct chatShard *shard, struct chatConn *conn,
+                       int res) {
+    struct outQueue *q = &conn->out;
+    struct io_uring_sqe *sqe;
+
+    conn->sending = 0;
+    conn->ioOps--;
+    if (--shard->sendsInFlight == 0) {
+        shard->numSends = 0;
+    }
+    if (res > 0) {
+        _outQueueConsume(shard, q, res);
+    }
+    if (conn->closing) {
+        return;
+    }
+    if (res < 0 && res != -EAGAIN) {
+        _connClose(shard, conn);
+        return;
+    }
+    if (res < 0 || (size_t)res < conn->sendWant) {
+        if ((sqe = uringSqe(&shard->ring)) == NULL) {
+            _connClose(shard, conn);
+            return;
+        }
+        uringPrepPoll(sqe, conn->fd, POLLOUT, 0,
+                      _uringData(conn, URING_POLLOUT));
+        conn->pollArmed = 1;
+        conn->ioOps++;
+    } else if (q->head != q->tail || conn->history != NULL) {
+        _connMarkDirty(shard, conn);
+    }
+    if (conn->congested && q->bytes < OUT_BUF_LOW) {
+        conn->congested = 0;
+        _congestionEased(shard);
+    }
+}
+
+/*******************************************************************************
+* Function: _uringComplete()
+* Description: Acts on one completion, told apart by its user data. A
+*              closed connection is retired once its last request has
+*              completed.
+* Parameters: struct chatShard *shard - The shard.
+*             uint64_t data - The user data.
+*             int res - The result.
+*             unsigned flags - The completion flags.
+* Preconditions: The shard runs on io_uring.
+* Returns: None.
+*******************************************************************************/
+
+static void _uringComplete(struct chatShard *shard, uint64_t data, int res,
+                           unsigned flags) {
+    struct chatConn *conn = (struct chatConn *)(uintptr_t)
+                            (data & ~(uint64_t)URING_TAG_MASK);
+
+    switch (data & URING_TAG_MASK) {
+    case URING_RECV:
+        _uringRecv(shard, conn, res, flags);
+        break;
+    case URING_SEND:
+        _uringSent(shard, conn, res);
+        break;
+    case URING_POLLOUT:
+        conn->pollArmed = 0;
+        conn->ioOps--;
+        if (!conn->closing) {
+            _connMarkDirty(shard, conn);
+        }
+        break;
+    case URING_ACCEPT:
+        if (res >= 0) {
+            _connAccepted(shard, res);
+        } else if (res != -ECANCELED) {
+            fprintf(stderr, "chatserver: accept: %s\n", strerror(-res));
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            _uringArm(shard, URING_ACCEPT);
+        }
+        return;
+    case URING_WAKE:
+        _takeInbox(shard);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            _uringArm(shard, URING_WAKE);
+        }
+        return;
+    case URING_STDIN:
+        if (shard->stdinOpen) {
+            _operatorInput(shard);
+        }
+        if (shard->stdinOpen) {
+            _uringArm(shard, URING_STDIN);
+        }
+        return;
+    default:
+        return;
+    }
+    if (conn->draining && conn->ioOps == 0) {
+        _connRetire(shard, conn);
+    }
+}
+
+/*******************************************************************************
+* Function: _uringReap()
+* Description: Acts on the completions posted, as _shardLoop() does on
+*              events, at most MAX_EVENTS of them as with epoll.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: The shard runs on io_uring.
+* Returns: The number acted on.
+*******************************************************************************/
+
+static int _uringReap(struct chatShard *shard) {
+    struct io_uring_cqe *cqe;
+    unsigned flags;
+    uint64_t data;
+    int res, n;
+
+    /* Completions are consumed before they are acted on, since acting on
+     * one may submit more.
+     */
+    for (n = 0; n < MAX_EVENTS && (cqe = uringPeek(&shard->ring)) != NULL;
+         n++) {
+        data = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        uringSeen(&shard->ring);
+        _uringComplete(shard, data, res, flags);
+    }
+    return n;
+}
+
+/*******************************************************************************
+* Function: _uringFlush()
+* Description: Flushes the connections with output pending, and goes on
+*              sending as long as the sockets take all that is sent, the
+*              way _connFlush() does with epoll. Each round submits the
+*              sends of every such connection in one system call that does
+*              not wait, in which they complete, and that takes in nothing
+*              more, so the output queues drain before the next messages
+*              are received.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: The shard runs on io_uring.
+* Returns: None.
+*******************************************************************************/
+
+static void _uringFlush(struct chatShard *shard) {
+    _flushDirty(shard);
+    while (shard->sendsInFlight > 0) {
+        if (uringSubmit(&shard->ring, 0, -1) == -1 ||
+            _uringReap(shard) == 0) {
+            break;
+        }
+        _flushDirty(shard);
+    }
+}
+
+/*******************************************************************************
+* Function: _shardLoopUring()
+* Description: The event loop of one shard on io_uring. Each iteration
+*              submits every request queued by the one before, including a
+*              send for each connection flushed, and waits for completions
+*              in the same system call, until the next timer is due at
+*              most, then acts on them as _shardLoop() does on events.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: _shardInit() succeeded.
+* Returns: None.
+*******************************************************************************/
+
+static void _shardLoopUring(struct chatShard *shard) {
+
+    /* Enabled here, the ring takes submissions from this thread alone. */
+    if (uringEnable(&shard->ring) == -1) {
+        perror("chatserver: io_uring_register");
+        serverStop();
+        _wakeShards(shard->server, shard);
+        return;
+    }
+    _uringArm(shard, URING_ACCEPT);
+    _uringArm(shard, URING_WAKE);
+    if (shard->stdinOpen) {
+        _uringArm(shard, URING_STDIN);
+    }
+    while (running) {
+        /* While messages from other shards are left to handle, nothing
+         * more is taken in, so that the sockets hold what is not yet read,
+         * as with epoll, instead of the output queues it would fill.
+         */
+        if (uringSubmit(&shard->ring, shard->backlog == NULL,
+                        _timerWait(shard)) == -1 &&
+            errno != EINTR && errno != EBUSY && errno != ETIME) {
+            perror("chatserver: io_uring_enter");
+            break;
+        }
+        shard->now = _clockTicks();
+        _uringReap(shard);
+        _expireTimers(shard);
+        if (shard->backlog != NULL) {
+            _drainInbox(shard, OUT_BUF_HIGH);
+        }
+        _uringFlush(shard);
+        if (shard->numPaused > 0 &&
+            atomic_load(&shard->server->numCongested) == 0) {
+            _resumePaused(shard);
+            _uringFlush(shard);
+        }
+        _reapConns(shard);
+    }
+}
+
+/*******************************************************************************
+* Function: _shardLoop()
+* Description: The event loop of one shard. Waits for socket events, or
+*              until the next timer is due, accepts new clients, reads and
+*              broadcasts messages, handles messages posted by other
+*              shards, expires timers and flushes output until serverStop()
+*              is called. The system calls that the loop makes are counted
+*              in the shard's syscalls once it returns.
+* Parameters: struct chatShard *shard - The shard.
+* Preconditions: _shardInit() succeeded.
+* Returns: None.
+*******************************************************************************/
+
+static void _shardLoop(struct chatShard *shard) {
+    struct epoll_event events[MAX_EVENTS];
+    struct chatConn *conn;
+    int n, i, fd;
+
+    if (shard->server->engine == ENGINE_URING) {
+        _shardLoopUring(shard);
+        shard->syscalls = sysCalls + shard->ring.enters;
+        return;
+    }
+    while (running) {
+        sysCalls++;
+        if ((n = epoll_wait(shard->epfd, events, MAX_EVENTS,
+                            _timerWait(shard))) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("chatserver: epoll_wait");
+            break;
+        }
+        shard->now = _clockTicks();
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            if (fd == shard->listenfd) {
+                _acceptConns(shard);
+                continue;
+            }
+            if (fd == shard->wakefd) {
+                _takeInbox(shard);
+                _drainInbox(shard, LONG_MAX);
+                continue;
+            }
+            if (fd == STDIN_FILENO && shard->stdinOpen) {
+                _operatorInput(shard);
+                continue;
+            }
+            if ((conn = shard->byFd[fd]) == NULL || conn->closing) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                _connRead(shard, conn);
+            }
+            if ((events[i].events & EPOLLOUT) && !conn->closing) {
+                _connFlush(shard, conn);
+            }
+        }
+        _expireTimers(shard);
+        _flushDirty(shard);
+        /* Resumed clients may queue more output, which is flushed at once. */
+        if (shard->numPaused > 0 &&
+            atomic_load(&shard->server->numCongested) == 0) {
+            _resumePaused(shard);
+            _flushDirty(shard);
+        }
+        _reapConns(shard);
+    }
+    shard->syscalls = sysCalls;
+}
+
+/*******************************************************************************
+* Function: _pinShard()
+* Description: Restricts the calling thread to the CPU of its shard, if the
+*              shard has one.
+* Parameters: struct chatShard *shard - The shard run by the calling thread.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _pinShard(struct chatShard *shard) {
+    cpu_set_t set;
+    int status;
+
+    if (shard->cpu == -1) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(shard->cpu, &set);
+    if ((status = pthread_setaffinity_np(pthread_self(), sizeof set,
+                                         &set)) != 0) {
+        fprintf(stderr, "chatserver: pthread_setaffinity_np: %s\n",
+                strerror(status));
+    }
+}
+
+/*******************************************************************************
+* Function: _shardThread()
+* Description: The body of the thread running a shard other than shard 0,
+*              which gives the memory it has cached back to the pools on
+*              exit.
+* Parameters: void *arg - The shard.
+* Preconditions: _shardInit() succeeded.
+* Returns: NULL.
+*******************************************************************************/
+
+static void *_shardThread(void *arg) {
+    _pinShard(arg);
+    _shardLoop(arg);
+    slabThreadFlush();
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: serverInit()
+* Description: Initializes the shards of the server, each with its own
+*              listener bound to the port, and opens the message log, if
+*              any, recreating the rooms that it names so that they keep
+*              their ids.
+* Parameters: struct chatServer *server - The server to initialize.
+*             char *port - The validated port string.
+*             int quiet - Nonzero to suppress per-message output and operator
+*                         input.
+*             int threads - The number of shards, each run by a thread, or 0
+*                           for one pinned to each CPU available.
+*             int engine - ENGINE_EPOLL or ENGINE_URING.
+*             int slowPolicy - SLOW_DISCONNECT, SLOW_DROP or SLOW_COALESCE.
+*             int idle - The seconds of silence after which a client is
+*                        pinged, or 0 to ping none.
+*             const char *logDir - The directory of the message log, or NULL
+*                                  to log nothing.
+*             SSL_CTX *tls - The context of TLS clients, which the server
+*                            frees at shutdown if it starts, or NULL to take
+*                            only plain clients.
+* Preconditions: The port has been validated.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int serverInit(struct chatServer *server, char *port, int quiet,
+               int threads, int engine, int slowPolicy, int idle,
+               const char *logDir, SSL_CTX *tls) {
+    cpu_set_t allowed;
+    int i, cpu = -1, pin = threads == 0;
+    uint32_t r;
+
+    memset(server, 0, sizeof *server);
+    server->quiet = quiet;
+    server->engine = engine;
+    server->slowPolicy = slowPolicy;
+    server->idle = idle;
+    server->tls = tls;
+    atomic_init(&server->numCongested, 0);
+
+    if (pin) {
+        if (sched_getaffinity(0, sizeof allowed, &allowed) == -1) {
+            perror("chatserver: sched_getaffinity");
+            return -1;
+        }
+        threads = CPU_COUNT(&allowed);
+    }
+    server->numShards = threads < MAX_SHARDS ? threads : MAX_SHARDS;
+    server->shards = calloc(server->numShards, sizeof *server->shards);
+    server->threads = calloc(server->numShards, sizeof *server->threads);
+    server->roomTable = calloc(ROOM_TABLE_SIZE, sizeof *server->roomTable);
+    server->freeRooms = malloc(MAX_ROOMS * sizeof *server->freeRooms);
+    server->handles = calloc(HANDLE_TABLE_INIT, sizeof *server->handles);
+    server->handleCap = HANDLE_TABLE_INIT;
+    pthread_mutex_init(&server->roomLock, NULL);
+    pthread_rwlock_init(&server->handleLock, NULL);
+    if (server->shards == NULL || server->threads == NULL ||
+        server->roomTable == NULL || server->freeRooms == NULL ||
+        server->handles == NULL) {
+        goto fail;
+    }
+    if (logDir != NULL) {
+        if (msgLogOpen(&server->log, logDir) == -1) {
+            goto fail;
+        }
+        server->logging = 1;
+        /* Only the rooms with messages logged are restored; the ids of
+         * any others are free.
+         */
+        for (r = 1; r <= server->log.numRooms && r <= MAX_ROOMS; r++) {
+            if (server->log.roomNames[r - 1][0] != '\0' &&
+                server->log.tails[r] != 0 &&
+                _roomRestore(server, r, server->log.roomNames[r - 1]) == -1) {
+                goto fail;
+            }
+        }
+        /* Only the operator searches, so a quiet server has no use for an
+         * index.
+         */
+        if (!quiet) {
+            if (searchStart(&server->search, &server->log) == -1) {
+                goto fail;
+            }
+            server->searching = 1;
+        }
+    }
+    for (i = 0; i < server->numShards; i++) {
+        if (pin) {
+            do {
+                cpu++;
+            } while (!CPU_ISSET(cpu, &allowed));
+        }
+        if (_shardInit(server, i, pin ? cpu : -1, port) == -1) {
+            while (--i >= 0) {
+                _shardFree(&server->shards[i]);
+            }
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    if (server->roomTable != NULL) {
+        for (i = 0; i < ROOM_TABLE_SIZE; i++) {
+            free(server->roomTable[i]);
+        }
+    }
+    if (server->searching) {
+        searchStop(&server->search);
+    }
+    if (server->logging) {
+        msgLogClose(&server->log);
+    }
+    free(server->shards);
+    free(server->threads);
+    free(server->roomTable);
+    free(server->freeRooms);
+    free(server->handles);
+    pthread_mutex_destroy(&server->roomLock);
+    pthread_rwlock_destroy(&server->handleLock);
+    return -1;
+}
+
+/*******************************************************************************
+* Function: serverLoop()
+* Description: Runs the server until serverStop() is called: shard 0 on the
+*              calling thread and every other shard on a thread of its own.
+*              The system calls that the shards made are then counted in
+*              the server's syscalls.
+* Parameters: struct chatServer *server - The initialized server.
+* Preconditions: serverInit() succeeded.
+* Returns: None.
+*******************************************************************************/
+
+void serverLoop(struct chatServer *server) {
+    sigset_t block, old;
+    int i, started;
+
+    /* Only the calling thread takes SIGINT and SIGTERM, so that they
+     * interrupt the wait of shard 0.
+     */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (started = 1; started < server->numShards; started++) {
+        if (pthread_create(&server->threads[started], NULL, _shardThread,
+                           &server->shards[started]) != 0) {
+            fprintf(stderr, "chatserver: cannot start shard %d\n", started);
+            serverStop();
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    _pinShard(&server->shards[0]);
+    _shardLoop(&server->shards[0]);
+
+    /* Once shard 0 returns, wake the others to notice that they should. */
+    serverStop();
+    _wakeShards(server, &server->shards[0]);
+    for (i = 1; i < started; i++) {
+        pthread_join(server->threads[i], NULL);
+    }
+    for (i = 0; i < started; i++) {
+        server->syscalls += server->shards[i].syscalls;
+    }
+}
+
+/*******************************************************************************
+* Function: serverStop()
+* Description: Requests that serverLoop() return. Safe to call from a signal
+*              handler.
+* Parameters: None.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void serverStop(void) {
+    running = 0;
+}
+
+/*******************************************************************************
+* Function: serverQueueReport()
+* Description: Prints the output pending on every shard, the most pending on
+*              one connection so far, the congested connections and shards,
+*              the messages dropped from slow clients' queues and the slow
+*              clients disconnected. May be called from any shard, and once
+*              serverLoop() has returned.
+* Parameters: struct chatServer *server - The server.
+* Preconditions: serverInit() succeeded.
+* Returns: None.
+*******************************************************************************/
+
+void serverQueueReport(struct chatServer *server) {
+    static const char *policies[] = { "disconnect", "drop", "coalesce" };
+    long queued = 0, deepest = 0, dropped = 0, slow = 0, d;
+    int i;
+
+    for (i = 0; i < server->numShards; i++) {
+        queued += atomic_load(&server->shards[i].outQueued);
+        d = atomic_load(&server->shards[i].outDeepest);
+        deepest = d > deepest ? d : deepest;
+        dropped += atomic_load(&server->shards[i].outDropped);
+        slow += atomic_load(&server->shards[i].outSlow);
+    }
+    printf("Output queues (%s): %ld bytes pending, deepest %ld bytes, "
+           "%d congested, %ld messages dropped, %ld slow clients "
+           "disconnected.\n", policies[server->slowPolicy], queued, deepest,
+           atomic_load(&server->numCongested), dropped, slow);
+}
+
+/*******************************************************************************
+* Function: serverShutdown()
+* Description: Closes every connection, listener, epoll instance and eventfd,
+*              frees the connection, session, room and handle tables and the
+*              TLS context, and closes the message log.
+* Parameters: struct chatServer *server - The server.
+* Preconditions: serverLoop() has returned.
+* Returns: None.
+*******************************************************************************/
+
+void serverShutdown(struct chatServer *server) {
+    int i;
+
+    for (i = 0; i < server->numShards; i++) {
+        _shardFree(&server->shards[i]);
+    }
+    for (i = 0; i < ROOM_TABLE_SIZE; i++) {
+        free(server->roomTable[i]);
+    }
+    free(server->shards);
+    free(server->threads);
+    free(server->roomTable);
+    free(server->freeRooms);
+    free(server->handles);
+    pthread_mutex_destroy(&server->roomLock);
+    pthread_rwlock_destroy(&server->handleLock);
+    /* Nothing queued refers to the log's records any more. */
+    if (server->searching) {
+        searchStop(&server->search);
+    }
+    if (server->logging) {
+        msgLogClose(&server->log);
+    }
+    SSL_CTX_free(server->tls);
+}
@@ -0,0 +1,463 @@
+/*******************************************************************************
+*      Filename: server.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for server.c. Please see server.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#define _GNU_SOURCE     /* For CPU affinity. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "validate.h"
+#include "frame.h"
+#include "msglog.h"
+#include "search.h"
+#include "compress.h"
+#include "tls.h"
+#include "uring.h"
+#include "slab.h"
+#include "timer.h"
+
+#define SERVER_USAGE    "usage: chatserver [-q] [-j threads] [-e engine] " \
+                        "[-P policy] [-i idle] [-l logdir] " \
+                        "[-C certfile -K keyfile] port\n"
+#define SERVER_HANDLE   "chatserve"
+#define MAX_EVENTS      256
+#define SERVER_FEATURES (FEAT_CHUNKED | FEAT_RESUME | FEAT_ROOMS | \
+                         FEAT_DIRECT | FEAT_HISTORY | FEAT_COMPRESS | \
+                         FEAT_KEEPALIVE)  /*
+                                         * HELLO features the server
+                                         * supports. */
+#define OUT_QUEUE_INIT  16              /* Initial output queue size, a
+                                         * power of two. */
+#define OUT_IOV         256             /* Buffers gathered per send. */
+#define OUT_COPY_MAX    1024            /* Longest piece of a frame copied
+                                         * rather than referenced when
+                                         * gathered for sending. */
+#define OUT_GATHER      (64 * 1024)     /* Bytes copied per send. */
+#define OUT_BUF_HIGH    (256 * 1024)    /* Pending output at which a client
+                                         * is congested. */
+#define OUT_BUF_LOW     (64 * 1024)     /* Pending output at which it no
+                                         * longer is. */
+#define OUT_BUF_LIMIT   (1 << 20)       /* Pending output at which a client
+                                         * is considered unresponsive. */
+#define OUT_BUF_SHED    OUT_BUF_HIGH    /* Pending output that dropping a
+                                         * slow client's oldest messages
+                                         * brings it down to. */
+#define QUEUES_COMMAND  "\\queues"      /* The operator's command to report
+                                         * on the output queues. */
+#define SESSION_BUCKETS 1024            /* Session table size, a power of
+                                         * two. */
+#define SESSION_TTL     300             /* Seconds a session outlives its
+                                         * connection. */
+#define MAX_SHARDS      256
+#define MAX_ROOMS       (64 * 1024)     /* Rooms that may exist at once. */
+#define ROOM_TABLE_SIZE (2 * MAX_ROOMS) /* Room name table size, a power of
+                                         * two. */
+#define ROOM_MEMBERS_INIT 8             /* Initial members array size. */
+#define HANDLE_TABLE_INIT 1024          /* Initial handle table size, a power
+                                         * of two. */
+#define JOIN_HISTORY    20              /* Logged messages sent to a client
+                                         * joining a room. */
+#define HISTORY_PAGE_MAX 256            /* Most messages sent in answer to
+                                         * one HISTORY request. */
+#define HISTORY_PENDING 8               /* Most history answers that may be
+                                         * outstanding on a connection. */
+#define TIMER_TICK_MS   100             /* The tick of each shard's timing
+                                         * wheel. */
+#define KEEPALIVE_IDLE  30              /* Default seconds of silence after
+                                         * which a client is pinged, and
+                                         * after which one that has not
+                                         * answered is closed. */
+#define HELLO_TIMEOUT   10              /* Seconds allowed for a TLS
+                                         * handshake, and for HELLO and
+                                         * SESSION once one is started. */
+
+/* The I/O engines that the event loops may run on. */
+#define ENGINE_EPOLL    0               /* Readiness events from epoll. */
+#define ENGINE_URING    1               /* Completions from io_uring. */
+
+#define URING_ENTRIES   1024            /* Submission queue size. */
+#define URING_CQ_ENTRIES 8192           /* Completion queue size. */
+#define URING_BUFS      32              /* Receive buffers provided to the
+                                         * kernel per shard, a power of
+                                         * two. */
+#define URING_BUF_SIZE  4096            /* The size of each. */
+#define URING_GROUP     0               /* Their buffer group id. */
+#define URING_SENDS     32              /* Sends in flight per shard. */
+#define URING_SEND_COPY OUT_GATHER      /* Bytes copied per send. */
+
+/* What a completion is for. The tag is kept in the low bits of the user
+ * data, above which is the connection, if any.
+ */
+#define URING_IGNORE    0               /* A cancellation. */
+#define URING_RECV      1               /* A connection's multishot receive. */
+#define URING_SEND      2               /* A connection's send. */
+#define URING_POLLOUT   3               /* A connection becoming writable. */
+#define URING_ACCEPT    4               /* The multishot accept. */
+#define URING_WAKE      5               /* The eventfd becoming readable. */
+#define URING_STDIN     6               /* Operator input. */
+#define URING_TAG_MASK  7
+
+/* What is done with a client whose pending output would pass
+ * OUT_BUF_LIMIT.
+ */
+#define SLOW_DISCONNECT 0               /* Disconnect it. */
+#define SLOW_DROP       1               /* Drop its oldest chat messages. */
+#define SLOW_COALESCE   2               /* Drop them, and queue one notice of
+                                         * how many in their place. */
+
+/* The transport of a connection. */
+#define CONN_PLAIN      0               /* Plain TCP. */
+#define CONN_SNIFF      1               /* Not yet known: the first byte
+                                         * received tells. */
+#define CONN_HANDSHAKE  2               /* TLS, handshake in progress. */
+#define CONN_SECURE     3               /* TLS, handshake complete. */
+
+/* The kinds of message that one shard posts to another. */
+#define SHARD_BROADCAST 1               /* Queue a chat message for every
+                                         * client of the shard. */
+#define SHARD_ADOPT     2               /* Take over a connection whose
+                                         * session the shard owns. */
+#define SHARD_DIRECT    3               /* Queue a private message for the
+                                         * client of the shard that has a
+                                         * handle. */
+
+/* An encoded frame. A message is encoded once per framing and the buffer
+ * queued for every recipient that takes that framing, so it is immutable
+ * once queued and freed when the last recipient, on any shard, is done.
+ */
+struct msgBuf {
+    atomic_int       refs;
+    int              version;   /* The framing, or 0 for a control frame. */
+    struct frameMeta meta;      /* The header fields of a version 2 frame. */
+    size_t           hdrLen;    /* The bytes of data holding the header. */
+    size_t           len;       /* The bytes of data. */
+    char            *data;      /* The frame: either storage, or a record
+                                 * mapped from the message log. */
+    unsigned long    skipped;   /* For a notice of messages dropped from
+                                 * a slow client's queue, how many. */
+    char             storage[];
+};
+
+/* A message queued for one recipient. A version 2 message may be sent with
+ * a header of the recipient's own in place of the shared one, so that an
+ * acknowledgement can ride along without copying the message.
+ */
+struct outEntry {
+    struct msgBuf *buf;
+    uint32_t       ack;         /* The acknowledgement that hdr carries. */
+    unsigned char  hdrLen;      /* The length of hdr, or 0 if unused. */
+    char           hdr[FRAME_MAX_HEADER];
+};
+
+/* A ring of messages that the kernel has not yet accepted in full. head and
+ * tail count entries dequeued and queued; off is the number of bytes of the
+ * entry at head that have already been sent.
+ */
+struct outQueue {
+    struct outEntry *ring;
+    unsigned         cap;
+    unsigned         head;
+    unsigned         tail;
+    size_t           off;
+    size_t           bytes;     /* The bytes not yet sent. */
+};
+
+/* A chat room. A room is created when first joined, and every shard indexes
+ * it by id. It is counted referenced by each connection in it, each session
+ * that will rejoin it and each message for it posted to other shards, and
+ * freed, and its id reused, once nothing refers to it, unless a message for
+ * it has been logged. A logged room keeps its id for good.
+ */
+struct chatRoom {
+    uint32_t         id;
+    char             name[FRAME_ROOM_NAME_MAX + 1];
+    atomic_int       refs;
+    atomic_int       logged;        /* Set once its name is in the log. */
+    atomic_ulong     shards[MAX_SHARDS / 64];   /* Bit i is set while shard i
+                                                 * has members. */
+};
+
+/* The members of one room on one shard. The connections are kept dense so
+ * that a message is fanned out by walking a single array; refs[i] is the
+ * index of the room in conns[i]->rooms.
+ */
+struct roomMembers {
+    struct chatRoom  *room;
+    struct chatConn **conns;
+    int              *refs;
+    int               count;
+    int               cap;
+};
+
+/* A room that a connection is in, and its index in the room's members. */
+struct roomRef {
+    uint32_t room;
+    int      slot;
+};
+
+/* A handle registered by a client for private messages, the session it
+ * belongs to, and the client's connection, which only the shard serving it
+ * may use.
+ */
+struct handleEntry {
+    char             handle[MAX_HANDLE_LEN + 1];   /* Empty if unused. */
+    uint64_t         session;
+    int              shard;
+    struct chatConn *conn;
+};
+
+/* An answer to a HISTORY request, or the history sent to a client joining a
+ * room, being streamed to the client. The ids of the messages are looked up
+ * in the log's index when it is requested, but the messages are only
+ * queued a few at a time, as the client's output drains.
+ */
+struct historyReq {
+    struct historyReq *next;        /* The next answer to stream. */
+    uint32_t           room;
+    int                reply;       /* Set to end with the cursor. */
+    uint64_t           cursor;      /* The cursor of the page before. */
+    int                left;        /* The messages yet to be queued. */
+    uint64_t           ids[];       /* The messages, newest first. */
+};
+
+/* A resumable client session. It outlives its connection, so that a client
+ * reconnecting with the same id and handle continues where it left off.
+ */
+struct clientSession {
+    uint64_t              id;
+    char                  handle[MAX_HANDLE_LEN + 1];
+    uint32_t              lastSeq;      /* Last message received. */
+    uint32_t              streamId;     /* The stream being sent, or 0. */
+    struct chatConn      *conn;         /* The connection, or NULL. */
+    time_t                detachedAt;   /* When conn became NULL. */
+    struct chatRoom     **rooms;        /* The rooms conn was in, */
+    int                   numRooms;
+    uint32_t              room;         /* and the one it sent to. */
+    struct clientSession *next;         /* The next in the hash bucket. */
+};
+
+/* Links a shard message into the inbox of one shard. */
+struct shardLink {
+    struct shardLink *next;
+    struct shardMsg  *msg;
+};
+
+/* A message posted by one shard to others. A broadcast is linked into the
+ * inbox of every other shard; the last shard to handle it frees it.
+ */
+struct shardMsg {
+    int               type;
+    atomic_int        refs;         /* Shards yet to handle the message. */
+    struct msgBuf    *buf;          /* SHARD_BROADCAST: the version 2 frame, */
+    int               whole;        /* whether the message is whole, */
+    int               first;        /* and whether it starts a stream. */
+    struct chatRoom  *room;         /* The room it is for, or NULL. */
+    size_t            len;          /* The bytes that the message holds. */
+    struct chatConn  *conn;         /* SHARD_ADOPT: the connection. */
+    char              handle[MAX_HANDLE_LEN + 1];  /* SHARD_DIRECT: the
+                                     * recipient of buf. */
+    struct shardLink  links[];      /* One per destination shard. */
+};
+
+/* The per-client connection state. */
+struct chatConn {
+    int              fd;
+    int              slot;          /* Index in chatServer.active. */
+    int              dirty;         /* Set while queued for a flush. */
+    int              closing;       /* Set while queued for closing. */
+    int              wantWrite;     /* Set while EPOLLOUT is registered. */
+    int              greeted;       /* Set once HELLO has been exchanged. */
+    int              ready;         /* Set once the protocol version is known
+                                     * and, for version 2, HELLO exchanged
+                                     * and any session started. */
+    int              transport;     /* CONN_PLAIN, CONN_SNIFF, ... */
+    int              ackPending;    /* Set when received messages are yet to
+                                     * be acknowledged. */
+    struct clientSession *session;  /* The session, if resumable. */
+    uint64_t         resumeId;      /* The session requested by the client, */
+    char             resumeHandle[MAX_HANDLE_LEN + 1];  /* and its handle. */
+    struct shardMsg *handoff;       /* Set while the connection is handed
+                                     * to the shard owning that session. */
+    unsigned         features;      /* Features negotiated by HELLO. */
+    uint32_t         streamId;      /* Server stream id of the message being
+                                     * streamed by this client, or 0. */
+    int              congested;     /* Set while output is above
+                                     * OUT_BUF_HIGH, until below OUT_BUF_LOW,
+                                     * unless the slow-client policy drops
+                                     * messages. */
+    int              paused;        /* Set while input is not being read
+                                     * because other clients are congested. */
+    uint32_t         room;          /* The room messages are sent to, or 0
+                                     * to send them to every client. */
+    struct roomRef  *rooms;         /* The rooms joined. */
+    int              numRooms;
+    char            *logBuf;        /* The message being streamed by this
+                                     * client, gathered to be logged, */
+    size_t           logLen;        /* and its length. */
+    struct historyReq *history;     /* History answers yet to be sent, */
+    struct historyReq **historyTail;    /* where the next is linked, */
+    int              numHistory;    /* and how many there are. */
+    struct frameCompressor zip;     /* The messages sent, compressed if
+                                     * FEAT_COMPRESS was negotiated. */
+    struct frameReader in;
+    struct outQueue  out;
+    /* With io_uring only: */
+    int              ioOps;         /* Requests yet to complete. */
+    int              recvArmed;     /* Set while a receive is armed, */
+    int              pollArmed;     /* a poll for POLLOUT is armed, */
+    int              sending;       /* or a send is in flight. */
+    size_t           sendWant;      /* The bytes that the send holds. */
+    char            *spill;         /* Bytes received that the frame reader */
+    size_t           spillLen;      /* could not take yet. */
+    int              draining;      /* Set once closed while requests are
+                                     * yet to complete. */
+    struct chatConn *drainPrev;     /* Links into chatShard.draining. */
+    struct chatConn *drainNext;
+    struct timerEntry timer;        /* Expires at the handshake deadline,
+                                     * then whenever the client may have
+                                     * been silent for too long. */
+    uint64_t         heard;         /* The tick at which data last arrived, */
+    uint64_t         pingAt;        /* and at which a PING was sent that
+                                     * nothing has arrived since, or 0. */
+};
+
+/* A send in flight with io_uring, which must stay in place until it
+ * completes.
+ */
+struct uringSend {
+    struct msghdr mh;
+    struct iovec  iov[OUT_IOV];
+    char          buf[URING_SEND_COPY];     /* Short frames gathered. */
+};
+
+/* The state of one event loop. Each shard runs on its own thread, accepts
+ * connections on its own SO_REUSEPORT listener and serves them alone. The
+ * only state that shards share is their inboxes, the congestion count, the
+ * registered handles, the message log and the rooms, whose members each
+ * shard keeps for itself.
+ */
+struct chatShard {
+    struct chatServer *server;
+    int               index;
+    int               cpu;          /* The CPU it runs on, or -1. */
+    int               listenfd;
+    int               epfd;         /* The epoll instance, or -1. */
+    struct uring      ring;         /* With io_uring, the ring, */
+    struct uringBufs  bufs;         /* the buffers it receives into, */
+    struct uringSend *sends;        /* and the sends in flight, which */
+    int               numSends;     /* take slots in order until none is */
+    int               sendsInFlight;    /* in flight. */
+    struct chatConn  *draining;     /* Closed connections with requests yet
+                                     * to complete. */
+    unsigned long     syscalls;     /* System calls made by the loop. */
+    int               wakefd;       /* An eventfd signalled when the inbox
+                                     * becomes non-empty. */
+    _Atomic(struct shardLink *) inbox;  /* Posted messages, newest first. */
+    atomic_long       inboxBytes;   /* Bytes of the messages posted and not
+                                     * yet handled. Above OUT_BUF_HIGH, the
+                                     * shard counts as congested. */
+    struct shardLink *backlog;      /* Messages taken from the inbox and */
+    struct shardLink *backlogTail;  /* not yet handled, oldest first. */
+    atomic_long       outQueued;    /* Bytes of output pending, */
+    atomic_long       outDeepest;   /* the most pending on one connection, */
+    atomic_long       outDropped;   /* messages dropped from slow clients' */
+    atomic_long       outSlow;      /* queues, and slow clients
+                                     * disconnected. Written by the shard
+                                     * alone and read by any. A connection
+                                     * handed to another shard takes its
+                                     * output along, so only the sum of
+                                     * outQueued over the shards counts. */
+    char              sendBuf[OUT_GATHER];  /* Short frames are gathered
+                                     * here for sending. */
+    char              zipBuf[COMPRESS_OUT_SIZE];  /* Payloads are
+                                     * compressed here. */
+    int               stdinOpen;    /* Operator input is read by shard 0. */
+    struct lineBuffer opInput;      /* Partial operator input. */
+    struct chatConn **byFd;         /* Connections indexed by descriptor. */
+    int               byFdCap;
+    struct chatConn **active;       /* Dense array of live connections. */
+    int               numActive;
+    int               activeCap;
+    struct chatConn **dirty;        /* Connections with output to flush. */
+    int               numDirty;
+    struct chatConn **dead;         /* Connections awaiting close. */
+    int               numDead;
+    uint32_t          nextStream;   /* Last server stream id assigned. */
+    int               numPaused;    /* Connections with paused set. */
+    struct clientSession *sessions[SESSION_BUCKETS];  /* The sessions whose
+                                     * id modulo the shard count is index. */
+    struct roomMembers *rooms;      /* Members of each room, by room id. */
+    uint32_t          roomsCap;
+    uint64_t          now;          /* The tick at which the latest events
+                                     * arrived. */
+    struct timerWheel wheel;        /* The timers of its connections. */
+};
+
+/* The server: one shard per thread. */
+struct chatServer {
+    int               quiet;
+    int               engine;       /* ENGINE_EPOLL or ENGINE_URING. */
+    int               slowPolicy;   /* SLOW_DISCONNECT, SLOW_DROP, ... */
+    int               idle;         /* Seconds of silence after which a
+                                     * client is pinged, or 0 for none. */
+    SSL_CTX          *tls;          /* Set if clients may connect with TLS. */
+    int               numShards;
+    struct chatShard *shards;
+    pthread_t        *threads;
+    atomic_int        numCongested; /* Connections with congested set, on
+                                     * any shard, and congested shards. */
+    pthread_mutex_t   roomLock;     /* Guards the room name table, the free
+                                     * room ids and the last reference to
+                                     * each room. */
+    struct chatRoom **roomTable;    /* Rooms, open addressed by name. */
+    uint32_t          numRooms;     /* The highest room id given out. */
+    uint32_t         *freeRooms;    /* Room ids below it not in use, */
+    uint32_t          numFree;      /* and how many there are. */
+    pthread_rwlock_t  handleLock;   /* Guards the handle table. */
+    struct handleEntry *handles;    /* Registered handles, open addressed
+                                     * with linear probing. */
+    unsigned          handleCap;
+    unsigned          numHandles;
+    int               logging;      /* Set if messages are logged. */
+    struct msgLog     log;
+    int               searching;    /* Set if the log is indexed for the
+                                     * operator to search. */
+    struct searchIndex search;
+    unsigned long     syscalls;     /* System calls made by every loop. */
+};
+
+int serverInit(struct chatServer *, char *, int, int, int, int, int,
+               const char *, SSL_CTX *);
+void serverLoop(struct chatServer *);
+void serverQueueReport(struct chatServer *);
+void serverStop(void);
+void serverShutdown(struct chatServer *);
+
+#endif
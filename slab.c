@@ -0,0 +1,305 @@
+/*******************************************************************************
+*      Filename: slab.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides pools of memory for the objects that the server
+*                makes and frees with every message and connection: frames,
+*                messages posted between shards, connections and their
+*                buffers. Sizes are rounded up to a power of two, and each
+*                size class is a free list of slots cut from aligned chunks
+*                taken from the system. Every thread keeps its own free list per
+*                class, which it takes from and returns to without locking;
+*                only when it runs dry or holds too many does it move a
+*                whole batch of slots to or from a depot shared by all
+*                threads. A frame freed by another shard than the one that
+*                made it is simply cached by that shard. Once the caches
+*                have warmed up, handling a message allocates nothing from
+*                the system. Chunks of slots are kept for the life of the
+*                process.
+*******************************************************************************/
+
+#include "slab.h"
+
+/* The free slots of one class held by one thread. */
+struct slabCache {
+    struct slabSlot *head;
+    unsigned         count;
+};
+
+static _Thread_local struct slabCache caches[SLAB_CLASSES];
+
+/* Batches of free slots of each class, shared by every thread. */
+static struct slabSlot *depot[SLAB_CLASSES];
+static pthread_mutex_t depotLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Chunks taken from the system, for slots and for large objects. */
+static atomic_ulong chunks;
+
+/*******************************************************************************
+* Function: _slabSize()
+* Description: Returns the size of the slots of a class.
+* Parameters: unsigned cls - The class.
+* Preconditions: cls is below SLAB_CLASSES.
+* Returns: The size in bytes.
+*******************************************************************************/
+
+static size_t _slabSize(unsigned cls) {
+    return (size_t)1 << (cls + SLAB_MIN_SHIFT);
+}
+
+/*******************************************************************************
+* Function: _slabBatch()
+* Description: Returns the number of slots of a class moved at once between
+*              a thread's cache and the depot.
+* Parameters: unsigned cls - The class.
+* Preconditions: cls is below SLAB_CLASSES.
+* Returns: The number of slots, at least 1.
+*******************************************************************************/
+
+static unsigned _slabBatch(unsigned cls) {
+    size_t n = SLAB_BATCH / _slabSize(cls);
+
+    return n > 0 ? n : 1;
+}
+
+/*******************************************************************************
+* Function: _slabClass()
+* Description: Finds the smallest class whose slots hold an object.
+* Parameters: size_t len - The size of the object.
+* Preconditions: None.
+* Returns: The class, or SLAB_LARGE if no slot is large enough.
+*******************************************************************************/
+
+static unsigned _slabClass(size_t len) {
+    unsigned cls = 0;
+
+    while (cls < SLAB_CLASSES && _slabSize(cls) < len) {
+        cls++;
+    }
+    return cls < SLAB_CLASSES ? cls : SLAB_LARGE;
+}
+
+/*******************************************************************************
+* Function: _slabCarve()
+* Description: Cuts a new chunk into slots of a class. The first batch goes
+*              to the calling thread's cache and the rest to the depot.
+* Parameters: unsigned cls - The class.
+* Preconditions: The thread's cache of the class is empty, and so was the
+*                depot.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _slabCarve(unsigned cls) {
+    size_t size = _slabSize(cls), n = SLAB_CHUNK / size, i;
+    unsigned batch = _slabBatch(cls), len = 0;
+    struct slabSlot *slot, *first = NULL, *batches = NULL, *last = NULL;
+    struct slabChunk *chunk;
+
+    if (posix_memalign((void **)&chunk, SLAB_CHUNK, SLAB_CHUNK) != 0) {
+        return -1;
+    }
+    atomic_fetch_add(&chunks, 1);
+    chunk->cls = cls;
+    /* Link the slots from the last, so that each batch is in address
+     * order and the first batch ends up in the cache. Slot 0 holds the
+     * header.
+     */
+    for (i = n; i-- > 1; ) {
+        slot = (struct slabSlot *)((char *)chunk + i * size);
+        slot->next = first;
+        first = slot;
+        len++;
+        if ((i - 1) % batch == 0 && i > 1) {
+            first->nextBatch = batches;
+            first->batchLen = len;
+            if (batches == NULL) {
+                last = first;
+            }
+            batches = first;
+            first = NULL;
+            len = 0;
+        }
+    }
+    caches[cls].head = first;
+    caches[cls].count = len;
+    if (batches != NULL) {
+        pthread_mutex_lock(&depotLock);
+        last->nextBatch = depot[cls];
+        depot[cls] = batches;
+        pthread_mutex_unlock(&depotLock);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _slabRefill()
+* Description: Fills the calling thread's empty cache of a class with a
+*              batch from the depot, or from a new chunk if it has none.
+* Parameters: unsigned cls - The class.
+* Preconditions: The thread's cache of the class is empty.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _slabRefill(unsigned cls) {
+    struct slabSlot *batch;
+
+    pthread_mutex_lock(&depotLock);
+    if ((batch = depot[cls]) != NULL) {
+        depot[cls] = batch->nextBatch;
+    }
+    pthread_mutex_unlock(&depotLock);
+    if (batch == NULL) {
+        return _slabCarve(cls);
+    }
+    caches[cls].head = batch;
+    caches[cls].count = batch->batchLen;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _slabSpill()
+* Description: Moves one batch of a thread's cache of a class to the depot.
+* Parameters: unsigned cls - The class.
+* Preconditions: The cache holds at least one batch.
+* Returns: None.
+*******************************************************************************/
+
+static void _slabSpill(unsigned cls) {
+    struct slabCache *c = &caches[cls];
+    struct slabSlot *batch = c->head, *last = batch;
+    unsigned i, n = _slabBatch(cls);
+
+    for (i = 1; i < n; i++) {
+        last = last->next;
+    }
+    c->head = last->next;
+    c->count -= n;
+    last->next = NULL;
+    batch->batchLen = n;
+    pthread_mutex_lock(&depotLock);
+    batch->nextBatch = depot[cls];
+    depot[cls] = batch;
+    pthread_mutex_unlock(&depotLock);
+}
+
+/*******************************************************************************
+* Function: slabAlloc()
+* Description: Allocates an object from the pool of its size class, or as a
+*              chunk of its own if it is too large for any.
+* Parameters: size_t len - The size of the object.
+* Preconditions: None.
+* Returns: The object, aligned to its size up to SLAB_ALIGN, or NULL on
+*          allocation failure.
+*******************************************************************************/
+
+void *slabAlloc(size_t len) {
+    unsigned cls = _slabClass(len);
+    struct slabChunk *chunk;
+    struct slabCache *c;
+    struct slabSlot *slot;
+
+    if (cls == SLAB_LARGE) {
+        if (posix_memalign((void **)&chunk, SLAB_CHUNK,
+                           SLAB_ALIGN + len) != 0) {
+            return NULL;
+        }
+        atomic_fetch_add(&chunks, 1);
+        chunk->cls = SLAB_LARGE;
+        return (char *)chunk + SLAB_ALIGN;
+    }
+    c = &caches[cls];
+    if (c->head == NULL && _slabRefill(cls) == -1) {
+        return NULL;
+    }
+    slot = c->head;
+    c->head = slot->next;
+    c->count--;
+    return slot;
+}
+
+/*******************************************************************************
+* Function: slabCalloc()
+* Description: Allocates a zeroed object, as slabAlloc() does.
+* Parameters: size_t len - The size of the object.
+* Preconditions: None.
+* Returns: The object, or NULL on allocation failure.
+*******************************************************************************/
+
+void *slabCalloc(size_t len) {
+    void *p;
+
+    if ((p = slabAlloc(len)) != NULL) {
+        memset(p, 0, len);
+    }
+    return p;
+}
+
+/*******************************************************************************
+* Function: slabFree()
+* Description: Returns an object to the calling thread's cache of its
+*              class, which need not be that of the thread that allocated
+*              it. A cache that grows to two batches gives one to the depot.
+* Parameters: void *p - The object, or NULL.
+* Preconditions: p came from slabAlloc() or slabCalloc().
+* Returns: None.
+*******************************************************************************/
+
+void slabFree(void *p) {
+    struct slabChunk *chunk;
+    struct slabSlot *slot = p;
+    struct slabCache *c;
+
+    if (p == NULL) {
+        return;
+    }
+    chunk = (struct slabChunk *)((uintptr_t)p & ~(uintptr_t)(SLAB_CHUNK - 1));
+    if (chunk->cls == SLAB_LARGE) {
+        free(chunk);
+        return;
+    }
+    c = &caches[chunk->cls];
+    slot->next = c->head;
+    c->head = slot;
+    if (++c->count >= 2 * _slabBatch(chunk->cls)) {
+        _slabSpill(chunk->cls);
+    }
+}
+
+/*******************************************************************************
+* Function: slabThreadFlush()
+* Description: Gives every slot cached by the calling thread to the depot,
+*              for other threads to use once it exits. Each class goes as
+*              one batch, which may be shorter or longer than usual.
+* Parameters: None.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void slabThreadFlush(void) {
+    unsigned cls;
+
+    pthread_mutex_lock(&depotLock);
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        if (caches[cls].head != NULL) {
+            caches[cls].head->batchLen = caches[cls].count;
+            caches[cls].head->nextBatch = depot[cls];
+            depot[cls] = caches[cls].head;
+        }
+        caches[cls].head = NULL;
+        caches[cls].count = 0;
+    }
+    pthread_mutex_unlock(&depotLock);
+}
+
+/*******************************************************************************
+* Function: slabChunks()
+* Description: Returns the number of chunks that the pools have taken from
+*              the system, for slots and for objects too large for one.
+* Parameters: None.
+* Preconditions: None.
+* Returns: The number of chunks.
+*******************************************************************************/
+
+unsigned long slabChunks(void) {
+    return atomic_load(&chunks);
+}
@@ -0,0 +1,61 @@
+/*******************************************************************************
+*      Filename: slab.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for slab.c. Please see slab.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define SLAB_MIN_SHIFT  6               /* The smallest slot: 64 bytes. */
+#define SLAB_CLASSES    12              /* Slots of 64 bytes to 128 KiB, each
+                                         * twice the size of the last, so a
+                                         * frame of the longest payload
+                                         * still fits. */
+#define SLAB_LARGE      0xffff          /* The class of an object too large
+                                         * for a slot. */
+#define SLAB_CHUNK      (1024 * 1024)   /* Memory taken from the system at
+                                         * once, aligned to its size, and
+                                         * cut into slots. */
+#define SLAB_ALIGN      64              /* Where a large object starts in
+                                         * its chunk. */
+#define SLAB_BATCH      (32 * 1024)     /* The bytes of slots moved at once
+                                         * between a thread's cache and the
+                                         * shared depot. A thread caches at
+                                         * most twice this per class. */
+
+/* The start of a chunk, which names the class of its slots. Objects carry
+ * no header of their own, so that a buffer of a power of two bytes takes a
+ * slot of that size: the chunk is found by rounding the address of an
+ * object down to SLAB_CHUNK. The first slot of a chunk holds this header;
+ * a large object is a chunk of its own, starting SLAB_ALIGN bytes in.
+ */
+struct slabChunk {
+    uint16_t cls;
+};
+
+/* A free slot. Its first words link it into a free list, and the first slot
+ * of a batch in the depot links the batch to the next and counts its slots.
+ */
+struct slabSlot {
+    struct slabSlot *next;
+    struct slabSlot *nextBatch;
+    unsigned         batchLen;
+};
+
+void *slabAlloc(size_t);
+void *slabCalloc(size_t);
+void slabFree(void *);
+void slabThreadFlush(void);
+unsigned long slabChunks(void);
+
+#endif
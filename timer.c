@@ -0,0 +1,244 @@
+/*******************************************************************************
+*      Filename: timer.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides a hierarchical timing wheel, which keeps any number
+*                of timers for the server's connections. Scheduling,
+*                rescheduling and cancelling a timer each unlink and link one
+*                list entry, whatever the number of timers pending. Time is
+*                counted in ticks of the caller's choosing, and a timer
+*                expires in the first advance of the wheel past its tick.
+*                Timers due far ahead are kept in coarse slots and moved to
+*                finer ones as their tick approaches, each at most once per
+*                level, so expiring a timer costs little more than
+*                scheduling it.
+*******************************************************************************/
+
+#include "timer.h"
+
+/*******************************************************************************
+* Function: _timerUnlink()
+* Description: Takes a pending timer out of its slot.
+* Parameters: struct timerEntry *e - The timer.
+* Preconditions: The timer is pending.
+* Returns: None.
+*******************************************************************************/
+
+static void _timerUnlink(struct timerEntry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->next = e->prev = NULL;
+}
+
+/*******************************************************************************
+* Function: _timerLink()
+* Description: Links a timer into the slot of the wheel that its tick falls
+*              in: the slot of level 0 for that tick if it is due within 64
+*              ticks, else the slot of the lowest level that reaches it. A
+*              timer already due goes in the slot of the next tick to expire,
+*              and one due beyond the reach of the wheel in the last slot it
+*              reaches.
+* Parameters: struct timerWheel *w - The wheel.
+*             struct timerEntry *e - The timer, with its tick set.
+* Preconditions: The timer is not pending.
+* Returns: None.
+*******************************************************************************/
+
+static void _timerLink(struct timerWheel *w, struct timerEntry *e) {
+    struct timerEntry *head;
+    uint64_t delta;
+    int level = 0;
+
+    if (e->expires < w->tick) {
+        e->expires = w->tick;
+    } else if (e->expires - w->tick >= TIMER_SPAN) {
+        e->expires = w->tick + TIMER_SPAN - 1;
+    }
+    delta = e->expires - w->tick;
+    while (delta >= (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))) {
+        level++;
+    }
+    head = &w->slots[level][(e->expires >> (TIMER_SLOT_BITS * level)) &
+                            (TIMER_SLOTS - 1)];
+    e->next = head;
+    e->prev = head->prev;
+    head->prev->next = e;
+    head->prev = e;
+}
+
+/*******************************************************************************
+* Function: _timerCascade()
+* Description: Moves every timer in one slot of a level down to the levels
+*              below, now that the level below has come round to it.
+* Parameters: struct timerWheel *w - The wheel.
+*             int level - The level, at least 1.
+*             unsigned index - The slot.
+* Preconditions: The wheel's tick is the first that the slot covers.
+* Returns: None.
+*******************************************************************************/
+
+static void _timerCascade(struct timerWheel *w, int level, unsigned index) {
+    struct timerEntry *head = &w->slots[level][index], *e;
+
+    while ((e = head->next) != head) {
+        _timerUnlink(e);
+        _timerLink(w, e);
+    }
+}
+
+/*******************************************************************************
+* Function: timerWheelInit()
+* Description: Sets up an empty wheel.
+* Parameters: struct timerWheel *w - The wheel.
+*             uint64_t now - The current tick.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void timerWheelInit(struct timerWheel *w, uint64_t now) {
+    int level, i;
+
+    w->tick = now;
+    w->count = 0;
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        for (i = 0; i < TIMER_SLOTS; i++) {
+            w->slots[level][i].next = w->slots[level][i].prev =
+                &w->slots[level][i];
+        }
+    }
+}
+
+/*******************************************************************************
+* Function: timerSchedule()
+* Description: Sets a timer to expire at a tick, in place of any tick for
+*              which it was pending.
+* Parameters: struct timerWheel *w - The wheel.
+*             struct timerEntry *e - The timer, zeroed before its first use.
+*             uint64_t expires - The tick.
+* Preconditions: If the timer is pending, it is on this wheel.
+* Returns: None.
+*******************************************************************************/
+
+void timerSchedule(struct timerWheel *w, struct timerEntry *e,
+                   uint64_t expires) {
+    if (e->next != NULL) {
+        _timerUnlink(e);
+    } else {
+        w->count++;
+    }
+    e->expires = expires;
+    _timerLink(w, e);
+}
+
+/*******************************************************************************
+* Function: timerCancel()
+* Description: Stops a timer from expiring, if it is pending.
+* Parameters: struct timerWheel *w - The wheel.
+*             struct timerEntry *e - The timer.
+* Preconditions: If the timer is pending, it is on this wheel.
+* Returns: None.
+*******************************************************************************/
+
+void timerCancel(struct timerWheel *w, struct timerEntry *e) {
+    if (e->next != NULL) {
+        _timerUnlink(e);
+        w->count--;
+    }
+}
+
+/*******************************************************************************
+* Function: timerPending()
+* Description: Tells whether a timer is set to expire.
+* Parameters: const struct timerEntry *e - The timer.
+* Preconditions: None.
+* Returns: 1 if it is, 0 otherwise.
+*******************************************************************************/
+
+int timerPending(const struct timerEntry *e) {
+    return e->next != NULL;
+}
+
+/*******************************************************************************
+* Function: timerWheelNext()
+* Description: Finds the tick by which the wheel must next be advanced: that
+*              of the first timers due within 64 ticks, or, if none are, the
+*              tick at which timers due later are moved down a level, which
+*              may bring them within 64 ticks. Scans at most the 64 slots of
+*              level 0.
+* Parameters: const struct timerWheel *w - The wheel.
+* Preconditions: None.
+* Returns: The tick, or TIMER_NONE if no timer is pending.
+*******************************************************************************/
+
+uint64_t timerWheelNext(const struct timerWheel *w) {
+    const struct timerEntry *head;
+    uint64_t t;
+
+    if (w->count == 0) {
+        return TIMER_NONE;
+    }
+    for (t = w->tick; t < w->tick + TIMER_SLOTS; t++) {
+        /* The slots above cascade as level 0 comes round. */
+        if ((t & (TIMER_SLOTS - 1)) == 0) {
+            return t;
+        }
+        head = &w->slots[0][t & (TIMER_SLOTS - 1)];
+        if (head->next != head) {
+            return t;
+        }
+    }
+    return t;
+}
+
+/*******************************************************************************
+* Function: timerWheelAdvance()
+* Description: Expires every timer due at or before a tick, in the order of
+*              their ticks, and calls a function for each. A timer is no
+*              longer pending when the function is called, which may
+*              schedule it again, or schedule or cancel any other timer.
+* Parameters: struct timerWheel *w - The wheel.
+*             uint64_t now - The tick.
+*             void (*expire)(struct timerEntry *, void *) - The function.
+*             void *arg - Passed to the function.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void timerWheelAdvance(struct timerWheel *w, uint64_t now,
+                       void (*expire)(struct timerEntry *, void *),
+                       void *arg) {
+    struct timerEntry due, *head, *e;
+    unsigned index;
+    int level;
+
+    while (w->tick <= now) {
+        /* With nothing pending, the ticks between need not be walked. */
+        if (w->count == 0) {
+            w->tick = now + 1;
+            return;
+        }
+        index = w->tick & (TIMER_SLOTS - 1);
+        for (level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+            index = (w->tick >> (TIMER_SLOT_BITS * level)) &
+                    (TIMER_SLOTS - 1);
+            _timerCascade(w, level, index);
+        }
+        /* Move the slot's timers aside, so that those scheduled by the
+         * function for this tick wait for the next.
+         */
+        head = &w->slots[0][w->tick & (TIMER_SLOTS - 1)];
+        w->tick++;
+        if (head->next == head) {
+            continue;
+        }
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = due.prev->next = &due;
+        head->next = head->prev = head;
+        while ((e = due.next) != &due) {
+            _timerUnlink(e);
+            w->count--;
+            expire(e, arg);
+        }
+    }
+}
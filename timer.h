@@ -0,0 +1,51 @@
+/*******************************************************************************
+*      Filename: timer.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for timer.c. Please see timer.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS     (1 << TIMER_SLOT_BITS)  /* Slots per level. */
+#define TIMER_LEVELS    4                       /* Levels of the wheel: the
+                                                 * last covers 64^4 ticks. */
+#define TIMER_SPAN      ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+#define TIMER_NONE      UINT64_MAX              /* No timer is pending. */
+
+/* A timer, kept in whatever it times. While pending it is linked into a slot
+ * of the wheel, a circular list whose head is an entry of its own; next is
+ * NULL while it is not.
+ */
+struct timerEntry {
+    struct timerEntry *prev;
+    struct timerEntry *next;
+    uint64_t           expires;     /* The tick at which it expires. */
+};
+
+/* A hierarchical timing wheel. Level 0 holds the timers due within 64 ticks
+ * of tick, one slot per tick; each level above holds those due within 64
+ * times as long, one slot per 64 slots of the level below, and moves them
+ * down a level each time the level below comes round.
+ */
+struct timerWheel {
+    uint64_t          tick;         /* The next tick to expire. */
+    unsigned long     count;        /* The timers pending. */
+    struct timerEntry slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timerWheelInit(struct timerWheel *, uint64_t);
+void timerSchedule(struct timerWheel *, struct timerEntry *, uint64_t);
+void timerCancel(struct timerWheel *, struct timerEntry *);
+int timerPending(const struct timerEntry *);
+uint64_t timerWheelNext(const struct timerWheel *);
+void timerWheelAdvance(struct timerWheel *, uint64_t,
+                       void (*)(struct timerEntry *, void *), void *);
+
+#endif
@@ -0,0 +1,655 @@
+/*******************************************************************************
+*      Filename: tls.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides the optional TLS 1.3 transport of chatclient and
+*                chatserver. A socket's TLS session is kept in a table by
+*                descriptor, and tlsReadv() and tlsSendmsg() stand in for
+*                readv() and sendmsg() everywhere, passing plain sockets
+*                straight through. Where the kernel supports TLS, OpenSSL
+*                hands it the record encryption once the handshake is done,
+*                and tlsSendmsg() then calls sendmsg() itself, so that
+*                gathered buffers are sent as they are. Otherwise records
+*                are encrypted by OpenSSL, with short buffers gathered into
+*                one record. A server issues a session ticket with every
+*                handshake, and a client that presents one on reconnecting
+*                skips the certificate exchange and may send its opening
+*                frames as early data, before the handshake has finished.
+*******************************************************************************/
+
+#include "tls.h"
+
+static struct tlsConn **tlsConns;       /* Indexed by descriptor. */
+static int tlsCap;
+static _Thread_local char tlsErrorBuf[256];
+static _Thread_local char tlsGatherBuf[TLS_GATHER];
+
+/*******************************************************************************
+* Function: _tlsTableInit()
+* Description: Allocates the table of sessions, with room for every
+*              descriptor the process may open, up to TLS_FD_MAX. Pages of
+*              it that are never used are never touched.
+* Parameters: None.
+* Preconditions: No other thread uses the table.
+* Returns: 0 on success, -1 on allocation failure.
+*******************************************************************************/
+
+static int _tlsTableInit(void) {
+    struct rlimit rl;
+
+    if (tlsConns != NULL) {
+        return 0;
+    }
+    tlsCap = TLS_FD_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < TLS_FD_MAX) {
+        tlsCap = rl.rlim_cur;
+    }
+    if ((tlsConns = calloc(tlsCap, sizeof *tlsConns)) == NULL) {
+        tlsCap = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _tlsGet()
+* Description: Looks up the TLS session of a descriptor.
+* Parameters: int fd - The descriptor.
+* Preconditions: None.
+* Returns: The session, or NULL for a plain socket.
+*******************************************************************************/
+
+static struct tlsConn *_tlsGet(int fd) {
+    return fd >= 0 && fd < tlsCap ? tlsConns[fd] : NULL;
+}
+
+/*******************************************************************************
+* Function: tlsError()
+* Description: Describes the error that made the calling thread's last TLS
+*              call fail, and clears it.
+* Parameters: None.
+* Preconditions: None.
+* Returns: A description, valid until the thread's next call.
+*******************************************************************************/
+
+const char *tlsError(void) {
+    unsigned long err = ERR_get_error();
+
+    if (err == 0) {
+        snprintf(tlsErrorBuf, sizeof tlsErrorBuf, "%s", strerror(errno));
+    } else {
+        ERR_error_string_n(err, tlsErrorBuf, sizeof tlsErrorBuf);
+    }
+    ERR_clear_error();
+    return tlsErrorBuf;
+}
+
+/*******************************************************************************
+* Function: _tlsContext()
+* Description: Creates a context with the settings common to both ends: TLS
+*              1.3 only, the ciphers of TLS_CIPHERS, and kernel TLS wherever
+*              the kernel offers it.
+* Parameters: const SSL_METHOD *method - The client or server method.
+* Preconditions: None.
+* Returns: The context, or NULL on failure.
+*******************************************************************************/
+
+static SSL_CTX *_tlsContext(const SSL_METHOD *method) {
+    SSL_CTX *ctx;
+
+    if (_tlsTableInit() == -1 || (ctx = SSL_CTX_new(method)) == NULL) {
+        return NULL;
+    }
+    if (SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) != 1 ||
+        SSL_CTX_set_ciphersuites(ctx, TLS_CIPHERS) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    /* A peer that vanishes without a close_notify is at end of file, as
+     * it would be without TLS.
+     */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    /* The buffers written may move between retries, since they are
+     * gathered afresh each time. Reading ahead takes in every record
+     * available with one read() rather than two per record.
+     */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_read_ahead(ctx, 1);
+    return ctx;
+}
+
+/*******************************************************************************
+* Function: tlsServerContext()
+* Description: Creates the context of a server. Sessions are resumed from
+*              stateless tickets, one issued per handshake, which any shard
+*              can accept since the ticket key belongs to the context.
+*              Clients resuming a session may send early data; OpenSSL
+*              accepts each ticket's early data only once, so that it cannot
+*              be replayed. Idle connections release their record buffers.
+* Parameters: const char *certFile - The PEM certificate chain.
+*             const char *keyFile - The PEM private key.
+* Preconditions: No other thread uses TLS yet.
+* Returns: The context, or NULL on failure; see tlsError().
+*******************************************************************************/
+
+SSL_CTX *tlsServerContext(const char *certFile, const char *keyFile) {
+    SSL_CTX *ctx;
+
+    if ((ctx = _tlsContext(TLS_server_method())) == NULL) {
+        return NULL;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_max_early_data(ctx, TLS_EARLY_MAX);
+    SSL_CTX_set_recv_max_early_data(ctx, TLS_EARLY_MAX);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_RELEASE_BUFFERS);
+    return ctx;
+}
+
+/*******************************************************************************
+* Function: _tlsNewTicket()
+* Description: Keeps the latest ticket a server has issued on a connection,
+*              in the place given to tlsConnect(), for the next connection.
+* Parameters: SSL *ssl - The connection.
+*             SSL_SESSION *ticket - The session the ticket resumes.
+* Preconditions: None.
+* Returns: 1, to take ownership of the session.
+*******************************************************************************/
+
+static int _tlsNewTicket(SSL *ssl, SSL_SESSION *ticket) {
+    SSL_SESSION **slot = SSL_get_app_data(ssl);
+
+    if (*slot != NULL) {
+        SSL_SESSION_free(*slot);
+    }
+    *slot = ticket;
+    return 1;
+}
+
+/*******************************************************************************
+* Function: tlsClientContext()
+* Description: Creates the context of a client, which verifies the server's
+*              certificate against the given file or the system's trusted
+*              certificates, and keeps the tickets servers issue.
+* Parameters: const char *caFile - The PEM certificates to trust, or NULL
+*                                  for the system's.
+* Preconditions: No other thread uses TLS yet.
+* Returns: The context, or NULL on failure; see tlsError().
+*******************************************************************************/
+
+SSL_CTX *tlsClientContext(const char *caFile) {
+    SSL_CTX *ctx;
+
+    if ((ctx = _tlsContext(TLS_client_method())) == NULL) {
+        return NULL;
+    }
+    if ((caFile != NULL ? SSL_CTX_load_verify_locations(ctx, caFile, NULL)
+                        : SSL_CTX_set_default_verify_paths(ctx)) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, _tlsNewTicket);
+    /* Return from a blocking read once a ticket has been taken in, rather
+     * than waiting there for a message.
+     */
+    SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+    return ctx;
+}
+
+/*******************************************************************************
+* Function: _tlsAttach()
+* Description: Creates the TLS session of a socket and enters it in the
+*              table.
+* Parameters: SSL_CTX *ctx - The context.
+*             int fd - The socket.
+* Preconditions: The socket has no session.
+* Returns: The session, or NULL on failure.
+*******************************************************************************/
+
+static struct tlsConn *_tlsAttach(SSL_CTX *ctx, int fd) {
+    struct tlsConn *t;
+
+    if (fd < 0 || fd >= tlsCap) {
+        errno = EMFILE;
+        return NULL;
+    }
+    if ((t = calloc(1, sizeof *t)) == NULL) {
+        return NULL;
+    }
+    if ((t->ssl = SSL_new(ctx)) == NULL || SSL_set_fd(t->ssl, fd) != 1) {
+        SSL_free(t->ssl);
+        free(t);
+        return NULL;
+    }
+    t->status = -1;
+    tlsConns[fd] = t;
+    return t;
+}
+
+/*******************************************************************************
+* Function: tlsSniff()
+* Description: Tells, without consuming it, whether what a client has sent
+*              starts with a TLS handshake record, so that a server can take
+*              TLS and plain clients on the same port.
+* Parameters: int fd - The socket.
+* Preconditions: The socket is non-blocking.
+* Returns: 1 for TLS, 0 for anything else, or -1 if nothing has arrived yet
+*          (errno EAGAIN), the client has gone or the socket failed.
+*******************************************************************************/
+
+int tlsSniff(int fd) {
+    unsigned char first;
+    ssize_t n;
+
+    do {
+        n = recv(fd, &first, 1, MSG_PEEK);
+    } while (n == -1 && errno == EINTR);
+    if (n == 0) {
+        errno = ECONNRESET;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    return first == 0x16;
+}
+
+/*******************************************************************************
+* Function: tlsAccept()
+* Description: Starts the server's side of TLS on a socket. The handshake
+*              is carried out by the reads that follow.
+* Parameters: SSL_CTX *ctx - A server context.
+*             int fd - The socket.
+* Preconditions: The socket is non-blocking and has no session.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int tlsAccept(SSL_CTX *ctx, int fd) {
+    struct tlsConn *t;
+
+    if ((t = _tlsAttach(ctx, fd)) == NULL) {
+        return -1;
+    }
+    SSL_set_accept_state(t->ssl);
+    t->early = 1;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: tlsConnect()
+* Description: Starts the client's side of TLS on a socket, verifying that
+*              the server's certificate names the host. If a ticket from an
+*              earlier connection is given, the session is resumed, and if
+*              the ticket allows early data, the handshake is left to be
+*              finished by the first read, so that what is sent until then
+*              travels with the handshake's first flight. Tickets the server
+*              issues replace the one given.
+* Parameters: SSL_CTX *ctx - A client context.
+*             int fd - The socket.
+*             const char *host - The host name or address connected to.
+*             SSL_SESSION **ticket - The ticket to resume, or a place
+*                                    holding NULL. It must stay valid until
+*                                    the socket is closed.
+* Preconditions: The socket is blocking and has no session.
+* Returns: 0 on success, -1 on failure; see tlsError().
+*******************************************************************************/
+
+int tlsConnect(SSL_CTX *ctx, int fd, const char *host,
+               SSL_SESSION **ticket) {
+    unsigned char addr[sizeof(struct in6_addr)];
+    struct tlsConn *t;
+    int ok;
+
+    if ((t = _tlsAttach(ctx, fd)) == NULL) {
+        return -1;
+    }
+    SSL_set_connect_state(t->ssl);
+    SSL_set_app_data(t->ssl, ticket);
+    if (inet_pton(AF_INET, host, addr) == 1 ||
+        inet_pton(AF_INET6, host, addr) == 1) {
+        ok = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(t->ssl), host);
+    } else {
+        ok = SSL_set_tlsext_host_name(t->ssl, host) == 1 &&
+             SSL_set1_host(t->ssl, host) == 1;
+    }
+    if (!ok || (*ticket != NULL && SSL_set_session(t->ssl, *ticket) != 1)) {
+        tlsClose(fd);
+        return -1;
+    }
+    if (*ticket != NULL && SSL_SESSION_get_max_early_data(*ticket) > 0) {
+        t->early = 1;
+        return 0;
+    }
+    if (SSL_connect(t->ssl) != 1) {
+        tlsClose(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: _tlsEstablished()
+* Description: Records how a session was set up once its handshake is
+*              complete.
+* Parameters: struct tlsConn *t - The session.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+static void _tlsEstablished(struct tlsConn *t) {
+    if (t->status != -1 || !SSL_is_init_finished(t->ssl)) {
+        return;
+    }
+    t->status = (SSL_session_reused(t->ssl) ? TLS_RESUMED : 0) |
+                (SSL_get_early_data_status(t->ssl) == SSL_EARLY_DATA_ACCEPTED
+                 ? TLS_EARLY : 0) |
+                (BIO_get_ktls_send(SSL_get_wbio(t->ssl)) ? TLS_KERNEL_SEND
+                                                         : 0) |
+                (BIO_get_ktls_recv(SSL_get_rbio(t->ssl)) ? TLS_KERNEL_RECV
+                                                         : 0);
+}
+
+/*******************************************************************************
+* Function: _tlsFail()
+* Description: Converts the failure of an OpenSSL read or write into the
+*              errno a system call would have set.
+* Parameters: struct tlsConn *t - The session.
+*             int ret - What the call returned.
+* Preconditions: The call failed.
+* Returns: 0 at end of file, or -1 with errno set.
+*******************************************************************************/
+
+static int _tlsFail(struct tlsConn *t, int ret) {
+    switch (SSL_get_error(t->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        ERR_clear_error();
+        return errno == 0 ? 0 : -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/*******************************************************************************
+* Function: _tlsFinishEarly()
+* Description: Finishes the handshake of a client that has been sending early
+*              data, and sends the data again as usual if the server
+*              rejected it.
+* Parameters: struct tlsConn *t - The session.
+* Preconditions: The socket is blocking.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+static int _tlsFinishEarly(struct tlsConn *t) {
+    size_t written;
+    int ret;
+
+    t->early = 0;
+    if ((ret = SSL_do_handshake(t->ssl)) != 1 ||
+        (SSL_get_early_data_status(t->ssl) != SSL_EARLY_DATA_ACCEPTED &&
+         t->sentLen > 0 &&
+         (ret = SSL_write_ex(t->ssl, t->sent, t->sentLen, &written)) != 1)) {
+        if (_tlsFail(t, ret) == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    free(t->sent);
+    t->sent = NULL;
+    t->sentLen = 0;
+    return 0;
+}
+
+/*******************************************************************************
+* Function: tlsReadv()
+* Description: Reads like readv(). On a TLS socket, a client's handshake is
+*              finished first if early data has been sent, and a server's
+*              goes on as the client's records arrive, with early data read
+*              as it comes. Records are decrypted into the buffers until
+*              they are full or OpenSSL holds nothing more, so that a
+*              blocking socket only waits for the first.
+* Parameters: int fd - The socket.
+*             const struct iovec *iov - The buffers.
+*             int iovcnt - The number of buffers.
+* Preconditions: None.
+* Returns: The byte count, 0 at end of file, or -1 with errno set. On a TLS
+*          socket, EAGAIN may be returned even for a blocking socket, once
+*          a record other than data, such as a ticket, has been taken in.
+*******************************************************************************/
+
+ssize_t tlsReadv(int fd, const struct iovec *iov, int iovcnt) {
+    struct tlsConn *t = _tlsGet(fd);
+    size_t total = 0, n;
+    int i, ret;
+    char *base;
+
+    if (t == NULL) {
+        return readv(fd, iov, iovcnt);
+    }
+    if (t->early && !SSL_is_server(t->ssl) && _tlsFinishEarly(t) == -1) {
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        base = iov[i].iov_base;
+        while (base < (char *)iov[i].iov_base + iov[i].iov_len) {
+            n = (char *)iov[i].iov_base + iov[i].iov_len - base;
+            if (t->early) {
+                ret = SSL_read_early_data(t->ssl, base, n, &n);
+                if (ret == SSL_READ_EARLY_DATA_FINISH) {
+                    t->early = 0;
+                    continue;
+                }
+                ret = ret == SSL_READ_EARLY_DATA_SUCCESS;
+            } else {
+                ret = SSL_read_ex(t->ssl, base, n, &n);
+            }
+            _tlsEstablished(t);
+            if (ret != 1) {
+                ret = _tlsFail(t, ret);
+                return total > 0 ? (ssize_t)total : ret;
+            }
+            base += n;
+            total += n;
+            if (!SSL_has_pending(t->ssl)) {
+                return total;
+            }
+        }
+    }
+    return total;
+}
+
+/*******************************************************************************
+* Function: _tlsWrite()
+* Description: Writes one buffer as TLS records: as early data while the
+*              handshake is in progress, and otherwise as usual. A client's
+*              early data is kept in case the server rejects it, up to what
+*              the ticket allows; beyond that, the handshake is finished
+*              first.
+* Parameters: struct tlsConn *t - The session.
+*             const char *buf - The buffer.
+*             size_t len - Its length.
+* Preconditions: None.
+* Returns: The number of bytes written, or -1 with errno set, or 0 if the
+*          peer has gone.
+*******************************************************************************/
+
+static ssize_t _tlsWrite(struct tlsConn *t, const char *buf, size_t len) {
+    SSL_SESSION *session = SSL_get_session(t->ssl);
+    size_t written;
+    char *sent;
+    int ret;
+
+    if (t->early && !SSL_is_server(t->ssl)) {
+        if (t->sentLen + len > SSL_SESSION_get_max_early_data(session)) {
+            if (_tlsFinishEarly(t) == -1) {
+                return -1;
+            }
+        } else {
+            if ((sent = realloc(t->sent, t->sentLen + len)) == NULL) {
+                return -1;
+            }
+            memcpy(sent + t->sentLen, buf, len);
+            t->sent = sent;
+            t->sentLen += len;
+        }
+    }
+    if (!SSL_is_init_finished(t->ssl)) {
+        ret = SSL_write_early_data(t->ssl, buf, len, &written);
+    } else {
+        ret = SSL_write_ex(t->ssl, buf, len, &written);
+    }
+    _tlsEstablished(t);
+    return ret == 1 ? (ssize_t)written : _tlsFail(t, ret);
+}
+
+/*******************************************************************************
+* Function: tlsSendmsg()
+* Description: Sends like sendmsg(). On a TLS socket whose records the
+*              kernel encrypts, sendmsg() is called as it is. Otherwise
+*              buffers shorter than TLS_DIRECT_MIN are gathered, up to
+*              TLS_GATHER bytes, and written as one record, and longer ones
+*              are written from where they are. A server writes records as
+*              soon as it has read the client's first flight, before the
+*              handshake has finished. A write that OpenSSL could not finish
+*              must be retried with the same bytes first, as the callers do
+*              by sending what is still unsent.
+* Parameters: int fd - The socket.
+*             const struct msghdr *msg - The buffers. Only msg_iov and
+*                                        msg_iovlen are used on a TLS socket.
+*             int flags - Flags for sendmsg().
+* Preconditions: None.
+* Returns: The number of bytes sent, or -1 with errno set.
+*******************************************************************************/
+
+ssize_t tlsSendmsg(int fd, const struct msghdr *msg, int flags) {
+    struct tlsConn *t = _tlsGet(fd);
+    size_t i, used = 0, total = 0, len;
+    ssize_t n = 0;
+    char *base;
+
+    if (t == NULL || (t->status != -1 && (t->status & TLS_KERNEL_SEND))) {
+        return sendmsg(fd, msg, flags);
+    }
+    if (msg->msg_iovlen == 1) {
+        n = _tlsWrite(t, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+        goto done;
+    }
+    for (i = 0; i <= msg->msg_iovlen; i++) {
+        base = i < msg->msg_iovlen ? msg->msg_iov[i].iov_base : NULL;
+        len = i < msg->msg_iovlen ? msg->msg_iov[i].iov_len : 0;
+        /* Write what has been gathered before a buffer that does not join
+         * it, and at the end.
+         */
+        if (used > 0 && (base == NULL || len >= TLS_DIRECT_MIN ||
+                         used + len > TLS_GATHER)) {
+            if ((n = _tlsWrite(t, tlsGatherBuf, used)) > 0) {
+                total += n;
+            }
+            if (n < (ssize_t)used) {
+                goto done;
+            }
+            used = 0;
+        }
+        if (len >= TLS_DIRECT_MIN) {
+            if ((n = _tlsWrite(t, base, len)) > 0) {
+                total += n;
+            }
+            if (n < (ssize_t)len) {
+                goto done;
+            }
+        } else if (len > 0) {
+            memcpy(tlsGatherBuf + used, base, len);
+            used += len;
+        }
+    }
+    return total;
+
+done:
+    if (total > 0) {
+        return total;
+    }
+    if (n == 0) {
+        errno = EPIPE;
+        return -1;
+    }
+    return n;
+}
+
+/*******************************************************************************
+* Function: tlsPending()
+* Description: Tells whether OpenSSL holds received bytes that have not been
+*              read, which polling the socket would not show.
+* Parameters: int fd - The socket.
+* Preconditions: None.
+* Returns: 1 if it does, 0 otherwise or for a plain socket.
+*******************************************************************************/
+
+int tlsPending(int fd) {
+    struct tlsConn *t = _tlsGet(fd);
+
+    return t != NULL && SSL_has_pending(t->ssl);
+}
+
+/*******************************************************************************
+* Function: tlsStatus()
+* Description: Reports how a socket's TLS session was set up.
+* Parameters: int fd - The socket.
+* Preconditions: None.
+* Returns: TLS_* flags, or -1 for a plain socket or until the handshake is
+*          complete.
+*******************************************************************************/
+
+int tlsStatus(int fd) {
+    struct tlsConn *t = _tlsGet(fd);
+
+    if (t == NULL) {
+        return -1;
+    }
+    _tlsEstablished(t);
+    return t->status;
+}
+
+/*******************************************************************************
+* Function: tlsClose()
+* Description: Ends a socket's TLS session, if it has one, sending the peer
+*              a close_notify if the handshake was completed. Ending the
+*              session this way also keeps its ticket valid for the client
+*              to resume. The socket itself is left open.
+* Parameters: int fd - The socket.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void tlsClose(int fd) {
+    struct tlsConn *t = _tlsGet(fd);
+
+    if (t == NULL) {
+        return;
+    }
+    /* A failed shutdown is of no interest, unlike the error that made a
+     * handshake fail, which is left for tlsError().
+     */
+    if (SSL_is_init_finished(t->ssl)) {
+        SSL_shutdown(t->ssl);
+        ERR_clear_error();
+    }
+    SSL_free(t->ssl);
+    free(t->sent);
+    free(t);
+    tlsConns[fd] = NULL;
+}
@@ -0,0 +1,72 @@
+/*******************************************************************************
+*      Filename: tls.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for tls.c. Please see tls.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#define TLS_CIPHERS     "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:" \
+                        "TLS_CHACHA20_POLY1305_SHA256"  /* In order of
+                                         * preference. AES-GCM is the
+                                         * cheapest with AES instructions,
+                                         * and every kernel with TLS
+                                         * offload takes it. */
+#define TLS_EARLY_MAX   16384           /* Early data a resumed client may
+                                         * send. */
+#define TLS_GATHER      16384           /* Short buffers written as one
+                                         * record, the largest there is. */
+#define TLS_DIRECT_MIN  1024            /* Buffers at least this long are
+                                         * written from where they are. */
+#define TLS_FD_MAX      (1 << 20)       /* Descriptors the table below can
+                                         * hold at most. */
+
+/* Flags returned by tlsStatus(). */
+#define TLS_RESUMED     0x01    /* The session was resumed from a ticket. */
+#define TLS_EARLY       0x02    /* Early data was sent and accepted. */
+#define TLS_KERNEL_SEND 0x04    /* The kernel encrypts what is sent. */
+#define TLS_KERNEL_RECV 0x08    /* The kernel decrypts what is received. */
+
+/* The TLS session of a socket. Sessions are looked up by descriptor, so the
+ * functions that send and receive on a descriptor need no other argument.
+ */
+struct tlsConn {
+    SSL    *ssl;
+    int     early;      /* Set while early data may be read, for a server,
+                         * or is being written, for a client. */
+    int     status;     /* TLS_* flags, or -1 until the handshake is
+                         * complete. */
+    char   *sent;       /* The early data written by a client, to send */
+    size_t  sentLen;    /* again if the server rejects it. */
+};
+
+SSL_CTX *tlsServerContext(const char *, const char *);
+SSL_CTX *tlsClientContext(const char *);
+const char *tlsError(void);
+int tlsSniff(int);
+int tlsAccept(SSL_CTX *, int);
+int tlsConnect(SSL_CTX *, int, const char *, SSL_SESSION **);
+ssize_t tlsReadv(int, const struct iovec *, int);
+ssize_t tlsSendmsg(int, const struct msghdr *, int);
+int tlsPending(int);
+int tlsStatus(int);
+void tlsClose(int);
+
+#endif
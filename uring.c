@@ -0,0 +1,484 @@
+/*******************************************************************************
+*      Filename: uring.c
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: Provides a minimal interface to io_uring, made directly with
+*                the system calls rather than a library: setting up and
+*                mapping a ring, queueing requests and submitting them in
+*                batches, reaping completions, and rings of buffers that the
+*                kernel fills with what it receives. The submission and
+*                completion queues are shared with the kernel, so their
+*                indexes are read with acquire and written with release
+*                ordering.
+*******************************************************************************/
+
+#include "uring.h"
+
+/*******************************************************************************
+* Function: _uringSetup()
+* Description: Calls io_uring_setup(), which glibc does not wrap.
+* Parameters: unsigned entries - The submission queue size.
+*             struct io_uring_params *p - The parameters, filled in with the
+*                                         offsets of the queues.
+* Preconditions: None.
+* Returns: The ring's descriptor, or -1 on failure.
+*******************************************************************************/
+
+static int _uringSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+/*******************************************************************************
+* Function: _uringEnter()
+* Description: Calls io_uring_enter(), which glibc does not wrap, and counts
+*              the call.
+* Parameters: struct uring *ring - The ring.
+*             unsigned submit - The entries to submit.
+*             unsigned wait - The completions to wait for.
+*             unsigned flags - IORING_ENTER_* flags.
+*             const void *arg - The argument that flags call for, or NULL.
+*             size_t argLen - Its size.
+* Preconditions: None.
+* Returns: The number of entries submitted, or -1 on failure.
+*******************************************************************************/
+
+static int _uringEnter(struct uring *ring, unsigned submit, unsigned wait,
+                       unsigned flags, const void *arg, size_t argLen) {
+    ring->enters++;
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, arg,
+                   argLen);
+}
+
+/*******************************************************************************
+* Function: uringInit()
+* Description: Sets up a ring and maps its queues. If the kernel is too old
+*              for IORING_SETUP_SINGLE_ISSUER or IORING_SETUP_DEFER_TASKRUN,
+*              the ring is set up without them.
+* Parameters: struct uring *ring - The ring to set up.
+*             unsigned entries - The submission queue size.
+*             unsigned cqEntries - The completion queue size, at least
+*                                  entries.
+*             unsigned flags - IORING_SETUP_* flags.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+int uringInit(struct uring *ring, unsigned entries, unsigned cqEntries,
+              unsigned flags) {
+    struct io_uring_params p;
+    unsigned optional = IORING_SETUP_SINGLE_ISSUER |
+                        IORING_SETUP_DEFER_TASKRUN;
+    char *sq, *cq;
+    unsigned i;
+
+    memset(ring, 0, sizeof *ring);
+    for (;;) {
+        memset(&p, 0, sizeof p);
+        p.flags = flags | IORING_SETUP_CQSIZE;
+        p.cq_entries = cqEntries;
+        if ((ring->fd = _uringSetup(entries, &p)) != -1) {
+            break;
+        }
+        if (errno != EINVAL || !(flags & optional)) {
+            return -1;
+        }
+        flags &= ~optional;
+    }
+
+    ring->sqRingLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqRingLen = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingLen > ring->sqRingLen) {
+            ring->sqRingLen = ring->cqRingLen;
+        }
+    }
+    sq = mmap(NULL, ring->sqRingLen, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqRing = sq;
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, ring->cqRingLen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            munmap(sq, ring->sqRingLen);
+            close(ring->fd);
+            return -1;
+        }
+        ring->cqRing = cq;
+    }
+    ring->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != NULL) {
+            munmap(ring->cqRing, ring->cqRingLen);
+        }
+        munmap(sq, ring->sqRingLen);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqHead = (unsigned *)(sq + p.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sqArray = (unsigned *)(sq + p.sq_off.array);
+    ring->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sqEntries = p.sq_entries;
+    ring->sqLocal = *ring->sqTail;
+    ring->cqHead = (unsigned *)(cq + p.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    /* Entries are always used in order, so the array that maps queue
+     * slots to entries never changes.
+     */
+    for (i = 0; i < p.sq_entries; i++) {
+        ring->sqArray[i] = i;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: uringEnable()
+* Description: Enables a ring set up with IORING_SETUP_R_DISABLED. With
+*              IORING_SETUP_SINGLE_ISSUER, the calling thread becomes the
+*              only one that may submit to it.
+* Parameters: struct uring *ring - The ring.
+* Preconditions: The ring is disabled.
+* Returns: 0 on success, -1 on failure.
+*******************************************************************************/
+
+int uringEnable(struct uring *ring) {
+    return syscall(__NR_io_uring_register, ring->fd,
+                   IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1 ? -1 : 0;
+}
+
+/*******************************************************************************
+* Function: uringFree()
+* Description: Tears down a ring, cancelling every request still pending.
+* Parameters: struct uring *ring - The ring.
+* Preconditions: uringInit() succeeded.
+* Returns: None.
+*******************************************************************************/
+
+void uringFree(struct uring *ring) {
+    munmap(ring->sqes, ring->sqesLen);
+    if (ring->cqRing != NULL) {
+        munmap(ring->cqRing, ring->cqRingLen);
+    }
+    munmap(ring->sqRing, ring->sqRingLen);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/*******************************************************************************
+* Function: uringSqe()
+* Description: Takes the next submission queue entry, cleared, for the
+*              caller to fill in. It is submitted by the next uringSubmit().
+*              If the queue is full, what it holds is submitted first.
+* Parameters: struct uring *ring - The ring.
+* Preconditions: None.
+* Returns: The entry, or NULL if the queue stays full.
+*******************************************************************************/
+
+struct io_uring_sqe *uringSqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+        ring->sqEntries && (uringSubmit(ring, 0, -1) == -1 ||
+        ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+        ring->sqEntries)) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqLocal++ & ring->sqMask];
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+/*******************************************************************************
+* Function: uringSubmit()
+* Description: Submits every entry taken since the last submission and, in
+*              the same system call, waits for completions. Requests that
+*              complete as they are submitted post their completions either
+*              way, but with IORING_SETUP_DEFER_TASKRUN the others do so only
+*              when the call waits.
+* Parameters: struct uring *ring - The ring.
+*             unsigned wait - The completions to wait for, or 0 to only
+*                             submit.
+*             int timeout - The milliseconds to wait at most, or -1 to wait
+*                           until they complete.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure with errno set. EINTR means that a
+*          signal arrived while waiting, ETIME that the timeout passed
+*          first, and EBUSY that completions must be reaped before more
+*          can be submitted.
+*******************************************************************************/
+
+int uringSubmit(struct uring *ring, unsigned wait, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit;
+
+    __atomic_store_n(ring->sqTail, ring->sqLocal, __ATOMIC_RELEASE);
+    submit = ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (wait == 0) {
+        return submit == 0 || _uringEnter(ring, submit, 0, 0, NULL, 0) != -1 ?
+               0 : -1;
+    }
+    if (timeout < 0) {
+        return _uringEnter(ring, submit, wait, IORING_ENTER_GETEVENTS, NULL,
+                           0) == -1 ? -1 : 0;
+    }
+    memset(&arg, 0, sizeof arg);
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = timeout % 1000 * 1000000L;
+    arg.ts = (uintptr_t)&ts;
+    return _uringEnter(ring, submit, wait,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                       sizeof arg) == -1 ? -1 : 0;
+}
+
+/*******************************************************************************
+* Function: uringPeek()
+* Description: Looks at the oldest completion not yet seen.
+* Parameters: struct uring *ring - The ring.
+* Preconditions: None.
+* Returns: The completion, or NULL if there is none.
+*******************************************************************************/
+
+struct io_uring_cqe *uringPeek(struct uring *ring) {
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+/*******************************************************************************
+* Function: uringSeen()
+* Description: Hands the completion returned by uringPeek() back to the
+*              kernel.
+* Parameters: struct uring *ring - The ring.
+* Preconditions: uringPeek() returned a completion.
+* Returns: None.
+*******************************************************************************/
+
+void uringSeen(struct uring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+* Function: uringBufsInit()
+* Description: Allocates a ring of buffers, registers it with a ring as a
+*              buffer group and provides every buffer to the kernel.
+* Parameters: struct uring *ring - The ring.
+*             struct uringBufs *bufs - The buffer ring to set up.
+*             uint16_t group - The buffer group id.
+*             unsigned count - The number of buffers, a power of two of at
+*                              most 32768.
+*             unsigned size - The size of each buffer.
+* Preconditions: None.
+* Returns: 0 on success, -1 on failure with errno set.
+*******************************************************************************/
+
+int uringBufsInit(struct uring *ring, struct uringBufs *bufs, uint16_t group,
+                  unsigned count, unsigned size) {
+    struct io_uring_buf_reg reg;
+    size_t ringLen = count * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    memset(bufs, 0, sizeof *bufs);
+    bufs->ring = mmap(NULL, ringLen, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->ring == MAP_FAILED) {
+        bufs->ring = NULL;
+        return -1;
+    }
+    if ((bufs->data = malloc((size_t)count * size)) == NULL) {
+        munmap(bufs->ring, ringLen);
+        bufs->ring = NULL;
+        return -1;
+    }
+    bufs->count = count;
+    bufs->size = size;
+    bufs->group = group;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uintptr_t)bufs->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1) {
+        uringBufsFree(bufs);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        uringBufRecycle(bufs, i);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function: uringBuf()
+* Description: Locates a buffer of a buffer ring by its id.
+* Parameters: struct uringBufs *bufs - The buffer ring.
+*             unsigned id - The buffer id, from a completion's flags.
+* Preconditions: None.
+* Returns: The buffer.
+*******************************************************************************/
+
+char *uringBuf(struct uringBufs *bufs, unsigned id) {
+    return bufs->data + (size_t)id * bufs->size;
+}
+
+/*******************************************************************************
+* Function: uringBufRecycle()
+* Description: Provides a buffer to the kernel again once its contents have
+*              been used.
+* Parameters: struct uringBufs *bufs - The buffer ring.
+*             unsigned id - The buffer id.
+* Preconditions: The kernel does not hold the buffer.
+* Returns: None.
+*******************************************************************************/
+
+void uringBufRecycle(struct uringBufs *bufs, unsigned id) {
+    struct io_uring_buf *b = &bufs->ring->bufs[bufs->tail &
+                                                (bufs->count - 1)];
+
+    b->addr = (uintptr_t)uringBuf(bufs, id);
+    b->len = bufs->size;
+    b->bid = id;
+    bufs->tail++;
+    __atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+* Function: uringBufsFree()
+* Description: Frees a ring of buffers.
+* Parameters: struct uringBufs *bufs - The buffer ring.
+* Preconditions: The ring it was registered with has been torn down.
+* Returns: None.
+*******************************************************************************/
+
+void uringBufsFree(struct uringBufs *bufs) {
+    if (bufs->ring != NULL) {
+        munmap(bufs->ring, bufs->count * sizeof(struct io_uring_buf));
+    }
+    free(bufs->data);
+    bufs->ring = NULL;
+    bufs->data = NULL;
+}
+
+/*******************************************************************************
+* Function: uringPrepRecv()
+* Description: Prepares a multishot receive, which completes each time data
+*              arrives, in a buffer the kernel picks from a buffer group,
+*              until it fails, the peer closes the connection or it is
+*              cancelled.
+* Parameters: struct io_uring_sqe *sqe - The entry.
+*             int fd - The socket.
+*             uint16_t group - The buffer group.
+*             uint64_t data - Returned in every completion.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void uringPrepRecv(struct io_uring_sqe *sqe, int fd, uint16_t group,
+                   uint64_t data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = data;
+}
+
+/*******************************************************************************
+* Function: uringPrepAccept()
+* Description: Prepares a multishot accept, which completes with the
+*              descriptor of each connection accepted, made non-blocking.
+* Parameters: struct io_uring_sqe *sqe - The entry.
+*             int fd - The listening socket.
+*             uint64_t data - Returned in every completion.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void uringPrepAccept(struct io_uring_sqe *sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = data;
+}
+
+/*******************************************************************************
+* Function: uringPrepPoll()
+* Description: Prepares a poll for events on a descriptor.
+* Parameters: struct io_uring_sqe *sqe - The entry.
+*             int fd - The descriptor.
+*             unsigned events - The poll(2) events.
+*             int multishot - Nonzero to complete each time the events
+*                             occur rather than once.
+*             uint64_t data - Returned in every completion.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void uringPrepPoll(struct io_uring_sqe *sqe, int fd, unsigned events,
+                   int multishot, uint64_t data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = data;
+}
+
+/*******************************************************************************
+* Function: uringPrepSendmsg()
+* Description: Prepares a sendmsg(). The message and the buffers it names
+*              must stay in place until the request completes.
+* Parameters: struct io_uring_sqe *sqe - The entry.
+*             int fd - The socket.
+*             const struct msghdr *msg - The message.
+*             int flags - The sendmsg() flags. With MSG_DONTWAIT, a full
+*                         socket fails the request with EAGAIN rather than
+*                         leaving it pending.
+*             uint64_t data - Returned in the completion.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void uringPrepSendmsg(struct io_uring_sqe *sqe, int fd,
+                      const struct msghdr *msg, int flags, uint64_t data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = data;
+}
+
+/*******************************************************************************
+* Function: uringPrepCancel()
+* Description: Prepares the cancellation of a pending request, which then
+*              completes with ECANCELED.
+* Parameters: struct io_uring_sqe *sqe - The entry.
+*             uint64_t target - The data of the request to cancel.
+*             uint64_t data - Returned in the completion of the
+*                             cancellation itself.
+* Preconditions: None.
+* Returns: None.
+*******************************************************************************/
+
+void uringPrepCancel(struct io_uring_sqe *sqe, uint64_t target,
+                     uint64_t data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+}
@@ -0,0 +1,78 @@
+/*******************************************************************************
+*      Filename: uring.h
+*        Author: Maxwell Goldberg
+* Last Modified: 10.16.26
+*   Description: The header file for uring.c. Please see uring.c for more
+*                details.
+*******************************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* An io_uring instance, mapped into the process. */
+struct uring {
+    int                  fd;
+    unsigned            *sqHead;
+    unsigned            *sqTail;
+    unsigned            *sqArray;
+    unsigned             sqMask;
+    unsigned             sqEntries;
+    unsigned             sqLocal;   /* The tail, including entries not yet
+                                     * made visible to the kernel. */
+    struct io_uring_sqe *sqes;
+    unsigned            *cqHead;
+    unsigned            *cqTail;
+    unsigned             cqMask;
+    struct io_uring_cqe *cqes;
+    void                *sqRing;    /* The mappings, */
+    size_t               sqRingLen;
+    void                *cqRing;    /* NULL if shared with sqRing, */
+    size_t               cqRingLen;
+    size_t               sqesLen;   /* and the length of sqes. */
+    unsigned long        enters;    /* Calls made to io_uring_enter(). */
+};
+
+/* A ring of equal buffers provided to the kernel, which picks one for each
+ * completion of a receive that selects from the group.
+ */
+struct uringBufs {
+    struct io_uring_buf_ring *ring;
+    char                     *data;
+    unsigned                  count;    /* A power of two. */
+    unsigned                  size;
+    uint16_t                  group;
+    uint16_t                  tail;
+};
+
+int uringInit(struct uring *, unsigned, unsigned, unsigned);
+int uringEnable(struct uring *);
+void uringFree(struct uring *);
+struct io_uring_sqe *uringSqe(struct uring *);
+int uringSubmit(struct uring *, unsigned, int);
+struct io_uring_cqe *uringPeek(struct uring *);
+void uringSeen(struct uring *);
+int uringBufsInit(struct uring *, struct uringBufs *, uint16_t, unsigned,
+                  unsigned);
+char *uringBuf(struct uringBufs *, unsigned);
+void uringBufRecycle(struct uringBufs *, unsigned);
+void uringBufsFree(struct uringBufs *);
+void uringPrepRecv(struct io_uring_sqe *, int, uint16_t, uint64_t);
+void uringPrepAccept(struct io_uring_sqe *, int, uint64_t);
+void uringPrepPoll(struct io_uring_sqe *, int, unsigned, int, uint64_t);
+void uringPrepSendmsg(struct io_uring_sqe *, int, const struct msghdr *,
+                      int, uint64_t);
+void uringPrepCancel(struct io_uring_sqe *, uint64_t, uint64_t);
+
+#endif
@@ -1,10 +1,11 @@
 /*******************************************************************************
 *      Filename: validate.c
 *        Author: Maxwell Goldberg
-* Last Modified: 02.12.17
+* Last Modified: 10.16.26
 *   Description: A file containing a variety of validation functions, including
 *                command line argument validate, hostname and port validation, 
-*                client handle validation, and message validation.
+*                client handle validation, message validation, and a line
+*                buffer for reading input without blocking.
 *******************************************************************************/
 
 #include "validate.h"
@@ -24,12 +25,99 @@ int validateArgs(char *hostname, char *port, int numArgs) {
      * return with an error.
      */
     if (numArgs != 3) {
-        fprintf(stderr, "usage: chatclient hostname port\n");
+        fprintf(stderr, "%s", CLIENT_USAGE);
         exit(1);
     }
     return (validateHostname(hostname) && validatePort(port));
 }
 
+/*******************************************************************************
+* Function: parseClientArgs()
+* Description: Parses the chatclient command line options, then validates the
+*              hostname and port that follow them. A handle given with -H is
+*              validated here; batch mode requires one, since it never
+*              prompts.
+* Parameters: int argc - The command line argument count.
+*             char *argv[] - The string array of command line arguments.
+*             struct clientOptions *opts - Filled in with the parsed options.
+* Preconditions: None.
+* Returns: None. Exits with a usage message on invalid arguments.
+*******************************************************************************/
+
+void parseClientArgs(int argc, char *argv[], struct clientOptions *opts) {
+    static const struct option longOpts[] = {
+        { "batch", no_argument, NULL, 'b' },
+        { NULL, 0, NULL, 0 }
+    };
+    long timeout;
+    char *end;
+    int opt;
+
+    memset(opts, 0, sizeof *opts);
+    opts->version = 2;
+    opts->timeout = -1;
+
+    while ((opt = getopt_long(argc, argv, "1A:H:f:st:z", longOpts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case '1':
+            /* Speak the legacy framing, e.g. to chatserve. */
+            opts->version = 1;
+            break;
+        case 'b':
+            opts->batch = 1;
+            break;
+        case 'H':
+            if (strlen(optarg) >= MAX_BYTES || !validateHandle(optarg)) {
+                exit(1);
+            }
+            opts->handle = optarg;
+            break;
+        case 'f':
+            opts->file = optarg;
+            break;
+        case 't':
+            /* Whole seconds, which must still fit in an int once counted
+             * in milliseconds.
+             */
+            timeout = strtol(optarg, &end, 10);
+            if (!isdigit(*optarg) || *end != '\0' ||
+                timeout > INT_MAX / 1000) {
+                fprintf(stderr, "%s", CLIENT_USAGE);
+                exit(1);
+            }
+            opts->timeout = timeout;
+            break;
+        case 'z':
+            opts->compress = 1;
+            break;
+        case 's':
+            opts->tls = 1;
+            break;
+        case 'A':
+            /* Naming the certificates to trust implies TLS. */
+            opts->caFile = optarg;
+            opts->tls = 1;
+            break;
+        default:
+            fprintf(stderr, "%s", CLIENT_USAGE);
+            exit(1);
+        }
+    }
+    if (opts->batch && opts->handle == NULL) {
+        fprintf(stderr, "chatclient: --batch requires -H handle\n");
+        exit(1);
+    }
+    /* Only the hostname and port may follow the options. */
+    if (argc - optind != 2) {
+        fprintf(stderr, "%s", CLIENT_USAGE);
+        exit(1);
+    }
+    validateArgs(argv[optind], argv[optind+1], argc - optind + 1);
+    opts->hostname = argv[optind];
+    opts->port = argv[optind+1];
+}
+
 /*******************************************************************************
 * Function: validateHostname()
 * Description: Validates the hostname string passed on the command line
@@ -158,6 +246,34 @@ int validateHandle(char *handle) {
 
 }
 
+/*******************************************************************************
+* Function: validateRoomName()
+* Description: Validates a user-specified chat room name.
+* Parameters: char *name - The null terminated room name.
+*             int maxLen - The longest name allowed.
+* Preconditions: None.
+* Returns: 1 if the name is valid, 0 otherwise.
+*******************************************************************************/
+
+int validateRoomName(char *name, int maxLen) {
+    char *str;
+
+    /* Room names may also contain hyphens. */
+    for (str = name; *str != '\0'; str++) {
+        if (!isalnum((unsigned char)*str) && *str != '_' && *str != '-') {
+            fprintf(stderr, "chatclient: room name must contain only "
+                            "alphanumerics, '_' or '-'\n");
+            return 0;
+        }
+    }
+    if (str == name || str - name > maxLen) {
+        fprintf(stderr, "chatclient: room name must contain 1 to %d chars\n",
+                maxLen);
+        return 0;
+    }
+    return 1;
+}
+
 /*******************************************************************************
 * Function: createValidatedHandle()
 * Description: Takes in user input on the handle while the handle is invalid.
@@ -270,3 +386,162 @@ int createValidatedMsg(char *handle, char *msg, int msgBufferLen) {
     _prependByteCountMsg(msg, strlen(buffer));
     return 1;
 }
+
+/*******************************************************************************
+* Function: validateMsgLine()
+* Description: Validates a line of user input as a chat message body. Unlike
+*              createValidatedMsg(), it never reads from stdin, so it can be
+*              driven by an event loop.
+* Parameters: char *line - The null terminated input line without its newline.
+*             int maxLen - The longest body allowed, normally MAX_MSG.
+* Preconditions: None.
+* Returns: 0 if the line is '\quit', -1 if the line is invalid, and 1
+*          otherwise.
+*******************************************************************************/
+
+int validateMsgLine(char *line, int maxLen) {
+    if (strcmp(line, "\\quit") == 0) {
+        return 0;
+    }
+    if ((int)strlen(line) > maxLen) {
+        fprintf(stderr, "chatclient: Invalid message length\n");
+        return -1;
+    }
+    return 1;
+}
+
+/*******************************************************************************
+* Function: buildValidatedMsg()
+* Description: Validates a line of user input and formats it as a chat message
+*              with the handle and byte count header prepended.
+* Parameters: char *handle - The handle string.
+*             char *line - The null terminated input line without its newline.
+*             char *msg - The message string buffer.
+*             int msgBufferLen - The length of the message buffer.
+* Preconditions: The handle has been validated, and the length accurately
+*                reflects the message buffer length.
+* Returns: 0 if the line is '\quit', -1 if the line is invalid, and the
+*          length of the formatted message otherwise.
+*******************************************************************************/
+
+int buildValidatedMsg(char *handle, char *line, char *msg, int msgBufferLen) {
+    int bodyLen, status;
+
+    if ((status = validateMsgLine(line, MAX_MSG)) <= 0) {
+        return status;
+    }
+    /* Format the body behind the header, then fill the header in. The byte
+     * count includes the null terminator.
+     */
+    bodyLen = snprintf(msg + PREFIX_OFFSET, msgBufferLen - PREFIX_OFFSET,
+                       "%s> %s", handle, line) + 1;
+    msg[0] = '0' + bodyLen / 100;
+    msg[1] = '0' + bodyLen / 10 % 10;
+    msg[2] = '0' + bodyLen % 10;
+
+    return PREFIX_OFFSET + bodyLen;
+}
+
+/*******************************************************************************
+* Function: lineBufferRead()
+* Description: Reads whatever input is available on a file descriptor into a
+*              line buffer. stdio is bypassed so that no input is left
+*              buffered where poll() or epoll cannot see it. Lines returned
+*              by lineBufferNext() before this call are discarded.
+* Parameters: struct lineBuffer *lb - The line buffer.
+*             int fd - The file descriptor to read from.
+* Preconditions: The line buffer has been zeroed.
+* Returns: The result of read(): the byte count, 0 on end of file, or -1.
+*******************************************************************************/
+
+int lineBufferRead(struct lineBuffer *lb, int fd) {
+    int status;
+
+    /* Move the unconsumed input to the front of the buffer. */
+    if (lb->start > 0) {
+        lb->len -= lb->start;
+        memmove(lb->data, lb->data + lb->start, lb->len);
+        lb->start = 0;
+    }
+    /* A full buffer without a newline cannot hold a valid line. */
+    if (lb->len == (int)sizeof lb->data - 1) {
+        if (!lb->discard) {
+            fprintf(stderr, "chatclient: Invalid message length\n");
+        }
+        lb->len = 0;
+        lb->discard = 1;
+    }
+    status = read(fd, lb->data + lb->len, sizeof lb->data - lb->len - 1);
+    if (status > 0) {
+        lb->len += status;
+    }
+    return status;
+}
+
+/*******************************************************************************
+* Function: lineBufferNext()
+* Description: Removes the next complete line from a line buffer. The tail of
+*              a line that did not fit in the buffer is skipped.
+* Parameters: struct lineBuffer *lb - The line buffer.
+* Preconditions: None.
+* Returns: A pointer to the null terminated line without its newline, or NULL
+*          if no complete line is buffered. Every line returned remains valid
+*          until the next call to lineBufferRead(), so a batch of lines can be
+*          queued for sending without copying them.
+*******************************************************************************/
+
+char *lineBufferNext(struct lineBuffer *lb) {
+    char *line, *nl;
+
+    while (1) {
+        line = lb->data + lb->start;
+        if ((nl = memchr(line, '\n', lb->len - lb->start)) == NULL) {
+            return NULL;
+        }
+        *nl = '\0';
+        lb->start = nl - lb->data + 1;
+        if (!lb->discard) {
+            return line;
+        }
+        /* Skip the tail of an overlong line. */
+        lb->discard = 0;
+    }
+}
+
+/*******************************************************************************
+* Function: lineBufferNextPart()
+* Description: Removes the next line from a line buffer like lineBufferNext(),
+*              except that a line too long for the buffer is passed on in
+*              pieces instead of being discarded, so that it can be streamed
+*              without ever being held in memory as a whole.
+* Parameters: struct lineBuffer *lb - The line buffer.
+*             struct linePart *part - Set to the line or piece.
+* Preconditions: lineBufferNext() is not used on the same buffer.
+* Returns: 1 if a line or piece was removed, 0 otherwise. As with
+*          lineBufferNext(), the data remains valid until the next call to
+*          lineBufferRead(). Pieces are not null terminated.
+*******************************************************************************/
+
+int lineBufferNextPart(struct lineBuffer *lb, struct linePart *part) {
+    char *nl;
+
+    part->data = lb->data + lb->start;
+    part->first = !lb->partial;
+    if ((nl = memchr(part->data, '\n', lb->len - lb->start)) != NULL) {
+        *nl = '\0';
+        part->len = nl - part->data;
+        part->last = 1;
+        lb->partial = 0;
+        lb->start += part->len + 1;
+        return 1;
+    }
+    /* Pass on a full buffer holding no newline as a piece. */
+    if (lb->start == 0 && lb->len == (int)sizeof lb->data - 1) {
+        part->len = lb->len;
+        part->last = 0;
+        lb->partial = 1;
+        lb->start = lb->len;
+        return 1;
+    }
+    return 0;
+}
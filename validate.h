@@ -1,7 +1,7 @@
 /*******************************************************************************
 *      Filename: validate.h
 *        Author: Maxwell Goldberg
-* Last Modified: 02.12.17
+* Last Modified: 10.16.26
 *   Description: The header file for validate.c. Please see validate.c for more
 *                details on each function.
 *******************************************************************************/
@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #define MIN_PORT       1
 #define MAX_PORT       65535
@@ -23,12 +25,59 @@
 #define MAX_BYTES      516
 #define MAX_MSG        500
 #define PREFIX_OFFSET  3
+#define LINE_BUF_SIZE  4096     /* Input buffered before an overlong line is
+                                 * passed on in pieces. */
+
+#define CLIENT_USAGE   "usage: chatclient [-1] [--batch] [-H handle] " \
+                       "[-f file] [-t seconds] [-z] [-s] [-A cafile] " \
+                       "hostname port\n"
+
+/* The settings given on the chatclient command line. */
+struct clientOptions {
+    char *hostname;
+    char *port;
+    int   version;      /* The protocol version to speak. */
+    int   batch;        /* Nonzero to run without prompts or decoration. */
+    char *handle;       /* The handle given with -H, or NULL to prompt. */
+    char *file;         /* The file to read messages from, or NULL for
+                         * stdin. */
+    int   timeout;      /* Seconds allowed for connecting, 0 for no limit,
+                         * or -1 for the default. */
+    int   compress;     /* Nonzero to ask the server to compress. */
+    int   tls;          /* Nonzero to connect with TLS. */
+    char *caFile;       /* The certificates to trust, or NULL for the
+                         * system's. */
+};
+
+/* Input read from a descriptor that has not yet been consumed as lines. */
+struct lineBuffer {
+    char data[LINE_BUF_SIZE];
+    int  len;
+    int  start;         /* Offset of the first unconsumed byte. */
+    int  discard;       /* Set while skipping the rest of an overlong line. */
+    int  partial;       /* Set while passing on an overlong line in pieces. */
+};
+
+/* A line, or a piece of a line too long for the buffer. */
+struct linePart {
+    char *data;
+    int   len;
+    int   first;        /* Set on the first piece of a line. */
+    int   last;         /* Set on the last piece of a line. */
+};
 
 int validateArgs(char *, char *, int);
+void parseClientArgs(int, char *[], struct clientOptions *);
 int validateHandle(char *);
+int validateRoomName(char *, int);
 int validateHostname(char *);
 int validatePort(char *);
 void createValidatedHandle(char *);
-int createValidatedMessage(char *, char *, int);
+int createValidatedMsg(char *, char *, int);
+int validateMsgLine(char *, int);
+int buildValidatedMsg(char *, char *, char *, int);
+int lineBufferRead(struct lineBuffer *, int);
+char *lineBufferNext(struct lineBuffer *);
+int lineBufferNextPart(struct lineBuffer *, struct linePart *);
 
 #endif